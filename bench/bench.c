@@ -0,0 +1,344 @@
+#include "sqlite3.h"
+#include "sqlite-tg.h"
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+// Microbenchmarks for sqlite-tg, run with `make bench`. Every measurement is
+// written to stdout as one JSON document, so results from two builds can be
+// diffed or charted, and a short summary goes to stderr.
+//
+//   dist/bench [micro_size] [tg0_size,tg0_size,...]
+//
+// micro_size rows (default 10000) are used for the parse, predicate, and
+// aggregate suites, and the tg0 suite builds and queries a table of each of
+// the given sizes (default 1000,10000,100000), next to the equivalent plain
+// rtree table joined with tg_intersects(). Datasets come from a fixed seed,
+// so runs are comparable. Each measurement is the best of REPEAT runs.
+
+#define REPEAT 3
+#define QUERIES 200
+#define SEED 0x5eed5eedULL
+
+static sqlite3_int64 now_ns(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (sqlite3_int64)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+static sqlite3_uint64 rngState = SEED;
+
+// xorshift64*, uniform in [0, 1)
+static double rng(void) {
+  rngState ^= rngState >> 12;
+  rngState ^= rngState << 25;
+  rngState ^= rngState >> 27;
+  return (double)((rngState * 0x2545F4914F6CDD1DULL) >> 11) / 9007199254740992.0;
+}
+
+static void die(sqlite3 *db, const char *sql) {
+  fprintf(stderr, "bench: [%s] failed: %s\n", sql, sqlite3_errmsg(db));
+  exit(1);
+}
+
+static void exec(sqlite3 *db, const char *sql) {
+  if (sqlite3_exec(db, sql, NULL, NULL, NULL) != SQLITE_OK) {
+    die(db, sql);
+  }
+}
+
+static sqlite3_stmt *prepare(sqlite3 *db, const char *sql) {
+  sqlite3_stmt *stmt;
+  if (sqlite3_prepare_v2(db, sql, -1, &stmt, NULL) != SQLITE_OK) {
+    die(db, sql);
+  }
+  return stmt;
+}
+
+// Steps stmt to completion, returning the first column of the last row.
+static sqlite3_int64 run(sqlite3 *db, sqlite3_stmt *stmt) {
+  sqlite3_int64 value = 0;
+  int rc;
+  while ((rc = sqlite3_step(stmt)) == SQLITE_ROW) {
+    value = sqlite3_column_int64(stmt, 0);
+  }
+  if (rc != SQLITE_DONE) {
+    die(db, sqlite3_sql(stmt));
+  }
+  sqlite3_reset(stmt);
+  return value;
+}
+
+// Best of REPEAT runs of sql, in nanoseconds.
+static sqlite3_int64 time_sql(sqlite3 *db, const char *sql) {
+  sqlite3_stmt *stmt = prepare(db, sql);
+  sqlite3_int64 best = -1;
+  for (int i = 0; i < REPEAT; i++) {
+    sqlite3_int64 start = now_ns();
+    run(db, stmt);
+    sqlite3_int64 ns = now_ns() - start;
+    if (best < 0 || ns < best) {
+      best = ns;
+    }
+  }
+  sqlite3_finalize(stmt);
+  return best;
+}
+
+static int nResults = 0;
+
+// One measurement: ops operations (parses, predicate calls, rows, queries)
+// over size rows took ns nanoseconds. bytes is the input size, if relevant.
+static void emit(const char *suite, const char *name, int size,
+                 sqlite3_int64 ops, sqlite3_int64 ns, sqlite3_int64 bytes) {
+  double nsPerOp = ops ? (double)ns / (double)ops : 0;
+  printf("%s\n    {\"suite\":\"%s\",\"name\":\"%s\",\"size\":%d,\"ops\":%lld,"
+         "\"ns\":%lld,\"ns_per_op\":%.1f",
+         nResults++ ? "," : "", suite, name, size, ops, ns, nsPerOp);
+  if (bytes) {
+    printf(",\"bytes\":%lld,\"mb_per_sec\":%.1f", bytes,
+           ns ? (double)bytes / 1e6 / ((double)ns / 1e9) : 0);
+  }
+  printf("}");
+  fprintf(stderr, "%-10s %-32s %8d %12.1f ns/op\n", suite, name, size,
+          nsPerOp);
+}
+
+// Fills the shapes table with n clusters of a point, a 3-vertex line, and two
+// overlapping 8-gons around the same random center, at a constant density.
+// Returns the side of the square they're spread over.
+static double generate(sqlite3 *db, int n) {
+  double extent = sqrt((double)n) * 10;
+  exec(db, "drop table if exists shapes");
+  exec(db, "create table shapes(id integer primary key, point, line, poly, "
+           "poly2, wkt, geojson, minX, maxX, minY, maxY)");
+  exec(db, "begin");
+  sqlite3_stmt *stmt =
+      prepare(db, "insert into shapes(id, point, line, poly, poly2, wkt, "
+                  "minX, maxX, minY, maxY) values (?1, tg_to_wkb(?2), "
+                  "tg_to_wkb(?3), tg_to_wkb(?4), tg_to_wkb(?5), ?4, ?6, ?7, "
+                  "?8, ?9)");
+  char point[128], line[256], poly[1024], poly2[1024];
+  for (int id = 1; id <= n; id++) {
+    double cx = rng() * extent, cy = rng() * extent;
+    double r = 0.5 + rng() * 2;
+    snprintf(point, sizeof(point), "POINT(%.6f %.6f)", cx + r * (rng() - .5),
+             cy + r * (rng() - .5));
+    snprintf(line, sizeof(line), "LINESTRING(%.6f %.6f,%.6f %.6f,%.6f %.6f)",
+             cx - r, cy - r * rng(), cx, cy + r * rng(), cx + r,
+             cy - r * rng());
+    double minX = cx, maxX = cx, minY = cy, maxY = cy;
+    for (int k = 0; k < 2; k++) {
+      char *out = k ? poly2 : poly;
+      double ox = k ? r * .5 : 0;
+      int len = snprintf(out, 1024, "POLYGON((");
+      for (int v = 0; v <= 8; v++) {
+        double a = 2 * M_PI * (v % 8) / 8;
+        double x = cx + ox + r * cos(a), y = cy + r * sin(a);
+        len += snprintf(out + len, 1024 - len, "%s%.6f %.6f", v ? "," : "", x,
+                        y);
+        if (!k) {
+          minX = fmin(minX, x), maxX = fmax(maxX, x);
+          minY = fmin(minY, y), maxY = fmax(maxY, y);
+        }
+      }
+      snprintf(out + len, 1024 - len, "))");
+    }
+    sqlite3_bind_int(stmt, 1, id);
+    sqlite3_bind_text(stmt, 2, point, -1, SQLITE_STATIC);
+    sqlite3_bind_text(stmt, 3, line, -1, SQLITE_STATIC);
+    sqlite3_bind_text(stmt, 4, poly, -1, SQLITE_STATIC);
+    sqlite3_bind_text(stmt, 5, poly2, -1, SQLITE_STATIC);
+    sqlite3_bind_double(stmt, 6, minX);
+    sqlite3_bind_double(stmt, 7, maxX);
+    sqlite3_bind_double(stmt, 8, minY);
+    sqlite3_bind_double(stmt, 9, maxY);
+    run(db, stmt);
+  }
+  sqlite3_finalize(stmt);
+  exec(db, "update shapes set geojson = tg_to_geojson(wkt)");
+  exec(db, "commit");
+  return extent;
+}
+
+static sqlite3_int64 scalar(sqlite3 *db, const char *sql) {
+  sqlite3_stmt *stmt = prepare(db, sql);
+  sqlite3_int64 value = run(db, stmt);
+  sqlite3_finalize(stmt);
+  return value;
+}
+
+static void bench_parse(sqlite3 *db, int n) {
+  static const char *formats[][2] = {
+      {"wkt", "wkt"}, {"wkb", "poly"}, {"geojson", "geojson"}};
+  for (int i = 0; i < 3; i++) {
+    char *sql = sqlite3_mprintf("select count(tg_type(%s)) from shapes",
+                                formats[i][1]);
+    char *sqlBytes =
+        sqlite3_mprintf("select sum(length(%s)) from shapes", formats[i][1]);
+    emit("parse", formats[i][0], n, n, time_sql(db, sql),
+         scalar(db, sqlBytes));
+    sqlite3_free(sql);
+    sqlite3_free(sqlBytes);
+  }
+}
+
+static void bench_predicates(sqlite3 *db, int n) {
+  static const char *predicates[] = {"intersects", "contains", "within",
+                                     "covers",     "coveredby", "touches",
+                                     "disjoint"};
+  static const char *pairs[][3] = {
+      {"point", "poly", "point_polygon"},
+      {"line", "poly", "line_polygon"},
+      {"poly", "poly2", "polygon_polygon"},
+      {"poly", "line", "polygon_line"},
+  };
+  for (int p = 0; p < 7; p++) {
+    for (int i = 0; i < 4; i++) {
+      char *sql = sqlite3_mprintf("select sum(tg_%s(%s, %s)) from shapes",
+                                  predicates[p], pairs[i][0], pairs[i][1]);
+      char *name = sqlite3_mprintf("%s/%s", predicates[p], pairs[i][2]);
+      emit("predicate", name, n, n, time_sql(db, sql), 0);
+      sqlite3_free(sql);
+      sqlite3_free(name);
+    }
+  }
+}
+
+static void bench_aggregates(sqlite3 *db, int n) {
+  static const char *aggregates[][2] = {
+      {"group_multipoint", "tg_to_wkb(tg_group_multipoint(point))"},
+      {"group_multipolygon", "tg_to_wkb(tg_group_multipolygon(poly))"},
+      {"group_geometry_collection",
+       "tg_to_wkb(tg_group_geometry_collection(poly))"},
+      {"group_bbox", "tg_to_wkb(tg_group_bbox(poly))"},
+      {"group_feature_collection",
+       "tg_group_feature_collection_geojson(poly)"},
+  };
+  for (int i = 0; i < 5; i++) {
+    char *sql =
+        sqlite3_mprintf("select length(%s) from shapes", aggregates[i][1]);
+    emit("aggregate", aggregates[i][0], n, n, time_sql(db, sql), 0);
+    sqlite3_free(sql);
+  }
+}
+
+// Times QUERIES window queries on stmt, which takes the window's bounding box
+// as ?1-?4 (minX, maxX, minY, maxY) and its WKT as ?5. Windows are squares
+// covering about 0.1% of the extent, from the same seed every time.
+static sqlite3_int64 time_queries(sqlite3 *db, sqlite3_stmt *stmt,
+                                  double extent, sqlite3_int64 *pRows) {
+  sqlite3_int64 best = -1;
+  double side = extent * 0.03;
+  for (int r = 0; r < REPEAT; r++) {
+    sqlite3_uint64 saved = rngState;
+    rngState = SEED ^ 0xabcdef;
+    sqlite3_int64 rows = 0;
+    sqlite3_int64 ns = 0;
+    char wkt[256];
+    for (int q = 0; q < QUERIES; q++) {
+      double x = rng() * (extent - side), y = rng() * (extent - side);
+      snprintf(wkt, sizeof(wkt),
+               "POLYGON((%.6f %.6f,%.6f %.6f,%.6f %.6f,%.6f %.6f,%.6f %.6f))",
+               x, y, x + side, y, x + side, y + side, x, y + side, x, y);
+      sqlite3_bind_double(stmt, 1, x);
+      sqlite3_bind_double(stmt, 2, x + side);
+      sqlite3_bind_double(stmt, 3, y);
+      sqlite3_bind_double(stmt, 4, y + side);
+      sqlite3_bind_text(stmt, 5, wkt, -1, SQLITE_TRANSIENT);
+      sqlite3_int64 start = now_ns();
+      rows += run(db, stmt);
+      ns += now_ns() - start;
+    }
+    rngState = saved;
+    *pRows = rows;
+    if (best < 0 || ns < best) {
+      best = ns;
+    }
+  }
+  return best;
+}
+
+static void bench_tg0(sqlite3 *db, int n) {
+  double extent = generate(db, n);
+  sqlite3_int64 rowsTg0, rowsRtree;
+
+  exec(db, "drop table if exists temp.bench_tg0");
+  sqlite3_int64 start = now_ns();
+  exec(db, "create virtual table temp.bench_tg0 using tg0()");
+  exec(db, "insert into temp.bench_tg0(rowid, _shape) "
+           "select id, poly from shapes");
+  emit("tg0", "build", n, n, now_ns() - start, 0);
+
+  sqlite3_stmt *stmt =
+      prepare(db, "select count(*) from temp.bench_tg0 "
+                  "where tg_intersects(_shape, ?5)");
+  emit("tg0", "query", n, QUERIES, time_queries(db, stmt, extent, &rowsTg0),
+       0);
+  sqlite3_finalize(stmt);
+
+  // the same data and queries as a plain rtree of bounding boxes, joined back
+  // to the shapes for an exact tg_intersects() check
+  exec(db, "drop table if exists temp.bench_rtree");
+  start = now_ns();
+  exec(db, "create virtual table temp.bench_rtree "
+           "using rtree(id, minX, maxX, minY, maxY)");
+  exec(db, "insert into temp.bench_rtree "
+           "select id, minX, maxX, minY, maxY from shapes");
+  emit("rtree", "build", n, n, now_ns() - start, 0);
+
+  stmt = prepare(db, "select count(*) from temp.bench_rtree as r "
+                     "join shapes as s on s.id = r.id "
+                     "where r.maxX >= ?1 and r.minX <= ?2 "
+                     "and r.maxY >= ?3 and r.minY <= ?4 "
+                     "and tg_intersects(s.poly, ?5)");
+  emit("rtree", "query", n, QUERIES,
+       time_queries(db, stmt, extent, &rowsRtree), 0);
+  sqlite3_finalize(stmt);
+
+  if (rowsTg0 != rowsRtree) {
+    fprintf(stderr, "bench: tg0 matched %lld rows, rtree %lld\n", rowsTg0,
+            rowsRtree);
+    exit(1);
+  }
+  exec(db, "drop table temp.bench_tg0");
+  exec(db, "drop table temp.bench_rtree");
+}
+
+int main(int argc, char *argv[]) {
+  int microSize = argc > 1 ? atoi(argv[1]) : 10000;
+  const char *sizes = argc > 2 ? argv[2] : "1000,10000,100000";
+  sqlite3 *db;
+
+  sqlite3_auto_extension((void (*)())sqlite3_tg_init);
+  if (microSize <= 0 || sqlite3_open(":memory:", &db) != SQLITE_OK) {
+    fprintf(stderr, "usage: %s [micro_size] [tg0_size,...]\n", argv[0]);
+    return 1;
+  }
+
+  sqlite3_stmt *stmt = prepare(db, "select tg_version()");
+  sqlite3_step(stmt);
+  printf("{\"sqlite_version\":\"%s\",\"tg_version\":\"%s\",\"results\":[",
+         sqlite3_libversion(), sqlite3_column_text(stmt, 0));
+  sqlite3_finalize(stmt);
+
+  generate(db, microSize);
+  bench_parse(db, microSize);
+  bench_predicates(db, microSize);
+  bench_aggregates(db, microSize);
+
+  for (const char *z = sizes; *z;) {
+    int n = atoi(z);
+    if (n > 0) {
+      bench_tg0(db, n);
+    }
+    z += strcspn(z, ",");
+    z += *z == ',';
+  }
+
+  printf("\n]}\n");
+  sqlite3_close(db);
+  return 0;
+}
@@ -0,0 +1,263 @@
+#include "sqlite3.h"
+#include "sqlite-tg.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/resource.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+
+// tg0 scaling suite, run with `make bench-scale`. For each size, builds an
+// on-disk tg0 table of generated polygons, then runs viewport, point-lookup,
+// and join query mixes with a cold and then a warm page cache. Results are
+// written to stdout as one JSON document like dist/bench, with a summary on
+// stderr.
+//
+//   dist/bench-scale [size,size,...] [directory]
+//
+// Sizes default to 10000,100000,1000000, and databases are written to
+// directory (default dist) and deleted once measured. Builds slow down as the
+// R-Tree grows, so larger sizes like 100000000 (hours) are opt-in. Rows come
+// from tg_random_polygons() with a fixed seed, clustered like buildings in
+// cities.
+//
+// "cold" reopens the connection, so SQLite's page cache starts empty, but the
+// operating system's file cache is left as is. Pages read per query are
+// SQLite page cache misses, from sqlite3_db_status(). Peak memory is SQLite's
+// heap high-water mark for the size, and the process's peak RSS so far, which
+// only grows, so sizes are best listed smallest first.
+
+#define SEED 42
+#define CLUSTERS 1000
+#define VERTICES 8
+#define QUERIES 200
+// side of the viewport windows, in degrees
+#define VIEWPORT 0.5
+// probe points per join query
+#define JOIN_PROBES 100
+
+static sqlite3_int64 now_ns(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (sqlite3_int64)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+static void die(sqlite3 *db, const char *sql) {
+  fprintf(stderr, "bench-scale: [%s] failed: %s\n", sql, sqlite3_errmsg(db));
+  exit(1);
+}
+
+static void exec(sqlite3 *db, const char *sql) {
+  if (sqlite3_exec(db, sql, NULL, NULL, NULL) != SQLITE_OK) {
+    die(db, sql);
+  }
+}
+
+static sqlite3_stmt *prepare(sqlite3 *db, const char *sql) {
+  sqlite3_stmt *stmt;
+  if (sqlite3_prepare_v2(db, sql, -1, &stmt, NULL) != SQLITE_OK) {
+    die(db, sql);
+  }
+  return stmt;
+}
+
+static sqlite3 *open_db(const char *path) {
+  sqlite3 *db;
+  if (sqlite3_open(path, &db) != SQLITE_OK) {
+    die(db, path);
+  }
+  return db;
+}
+
+static int nResults = 0;
+
+static void emit_begin(const char *name, int size) {
+  printf("%s\n    {\"suite\":\"scale\",\"name\":\"%s\",\"size\":%d",
+         nResults++ ? "," : "", name, size);
+}
+
+static void emit_field(const char *field, sqlite3_int64 value) {
+  printf(",\"%s\":%lld", field, value);
+}
+
+static void emit_end(void) { printf("}"); }
+
+static int compare_int64(const void *a, const void *b) {
+  sqlite3_int64 x = *(const sqlite3_int64 *)a, y = *(const sqlite3_int64 *)b;
+  return x < y ? -1 : x > y;
+}
+
+static void remove_db(const char *path) {
+  char *journal = sqlite3_mprintf("%s-journal", path);
+  unlink(path);
+  unlink(journal);
+  sqlite3_free(journal);
+}
+
+static void build(const char *path, int n) {
+  remove_db(path);
+  sqlite3 *db = open_db(path);
+  exec(db, "pragma cache_size = -262144");
+  sqlite3_int64 start = now_ns();
+  exec(db, "begin");
+  exec(db, "create virtual table shapes using tg0()");
+  char *sql = sqlite3_mprintf(
+      "insert into shapes(rowid, _shape) select rowid, geometry "
+      "from tg_random_polygons(%d, %d, null, %d, %d)",
+      n, VERTICES, SEED, CLUSTERS);
+  exec(db, sql);
+  sqlite3_free(sql);
+  exec(db, "commit");
+  sqlite3_close(db);
+  sqlite3_int64 ns = now_ns() - start;
+
+  struct stat st;
+  sqlite3_int64 fileBytes =
+      stat(path, &st) == 0 ? (sqlite3_int64)st.st_size : 0;
+  emit_begin("build", n);
+  emit_field("ns", ns);
+  emit_field("rows_per_sec", ns ? (sqlite3_int64)(n / (ns / 1e9)) : 0);
+  emit_field("file_bytes", fileBytes);
+  emit_end();
+  fprintf(stderr, "%-22s %10d %10.1f s %10.1f MB\n", "build", n, ns / 1e9,
+          fileBytes / 1e6);
+}
+
+// The query mixes, each taking the query's index as ?1. Viewports and point
+// lookups are centered on the first QUERIES generated rows, so they land in
+// the data's clusters and every point lookup matches at least its own row.
+static const char *MIXES[][2] = {
+    {"viewport", "select count(*) from temp.centers as c join shapes as s "
+                 "on tg_intersects(s._shape, c.window) where c.q = ?1"},
+    {"point", "select count(*) from temp.centers as c join shapes as s "
+              "on tg_intersects(s._shape, c.point) where c.q = ?1"},
+    {"join", "select count(*) from temp.probes as p join shapes as s "
+             "on tg_intersects(s._shape, p.geometry) where p.batch = ?1"},
+};
+
+// Fills temp.centers and temp.probes with the mixes' query geometries.
+static void create_queries(sqlite3 *db) {
+  exec(db, "create temp table centers(q integer primary key, point, window)");
+  char *sql = sqlite3_mprintf(
+      "insert into temp.centers select c.rowid - 1, c.geometry, "
+      "printf('POLYGON((%%f %%f,%%f %%f,%%f %%f,%%f %%f,%%f %%f))', "
+      "b.minX - %f, b.minY - %f, b.minX + %f, b.minY - %f, "
+      "b.minX + %f, b.minY + %f, b.minX - %f, b.minY + %f, "
+      "b.minX - %f, b.minY - %f) "
+      "from tg_random_points(%d, null, %d, %d) as c "
+      "join tg_bbox(c.geometry) as b",
+      VIEWPORT / 2, VIEWPORT / 2, VIEWPORT / 2, VIEWPORT / 2, VIEWPORT / 2,
+      VIEWPORT / 2, VIEWPORT / 2, VIEWPORT / 2, VIEWPORT / 2, VIEWPORT / 2,
+      QUERIES, SEED, CLUSTERS);
+  exec(db, sql);
+  sqlite3_free(sql);
+
+  exec(db, "create temp table probes(batch, geometry)");
+  sql = sqlite3_mprintf(
+      "insert into temp.probes select (rowid - 1) / %d, geometry "
+      "from tg_random_points(%d, null, %d, %d)",
+      JOIN_PROBES, QUERIES * JOIN_PROBES, SEED + 1, CLUSTERS);
+  exec(db, sql);
+  sqlite3_free(sql);
+  exec(db, "create index temp.probes_batch on probes(batch)");
+}
+
+static void run_mix(sqlite3 *db, const char *name, const char *sql, int n,
+                    const char *cache) {
+  sqlite3_stmt *stmt = prepare(db, sql);
+  sqlite3_int64 latencies[QUERIES];
+  sqlite3_int64 rows = 0, misses = 0, hits = 0;
+  for (int q = 0; q < QUERIES; q++) {
+    int cur, hiwtr;
+    sqlite3_db_status(db, SQLITE_DBSTATUS_CACHE_MISS, &cur, &hiwtr, 1);
+    sqlite3_db_status(db, SQLITE_DBSTATUS_CACHE_HIT, &cur, &hiwtr, 1);
+    sqlite3_bind_int(stmt, 1, q);
+    sqlite3_int64 start = now_ns();
+    if (sqlite3_step(stmt) != SQLITE_ROW) {
+      die(db, sql);
+    }
+    rows += sqlite3_column_int64(stmt, 0);
+    sqlite3_reset(stmt);
+    latencies[q] = now_ns() - start;
+    sqlite3_db_status(db, SQLITE_DBSTATUS_CACHE_MISS, &cur, &hiwtr, 0);
+    misses += cur;
+    sqlite3_db_status(db, SQLITE_DBSTATUS_CACHE_HIT, &cur, &hiwtr, 0);
+    hits += cur;
+  }
+  sqlite3_finalize(stmt);
+  qsort(latencies, QUERIES, sizeof(latencies[0]), compare_int64);
+
+  char *label = sqlite3_mprintf("%s/%s", name, cache);
+  emit_begin(label, n);
+  emit_field("queries", QUERIES);
+  emit_field("rows", rows);
+  emit_field("pages_read", misses);
+  emit_field("pages_cached", hits);
+  emit_field("p50_ns", latencies[QUERIES / 2]);
+  emit_field("p90_ns", latencies[QUERIES * 9 / 10]);
+  emit_field("p99_ns", latencies[QUERIES * 99 / 100]);
+  emit_field("max_ns", latencies[QUERIES - 1]);
+  emit_end();
+  fprintf(stderr, "%-22s %10d %10.1f us p50 %10.1f us p99 %8.1f pages/q\n",
+          label, n, latencies[QUERIES / 2] / 1e3,
+          latencies[QUERIES * 99 / 100] / 1e3, (double)misses / QUERIES);
+  sqlite3_free(label);
+}
+
+static void bench_size(const char *dir, int n) {
+  char *path = sqlite3_mprintf("%s/bench-scale-%d.db", dir, n);
+  sqlite3_memory_highwater(1);
+
+  build(path, n);
+
+  for (size_t m = 0; m < sizeof(MIXES) / sizeof(MIXES[0]); m++) {
+    sqlite3 *db = open_db(path);
+    create_queries(db);
+    run_mix(db, MIXES[m][0], MIXES[m][1], n, "cold");
+    run_mix(db, MIXES[m][0], MIXES[m][1], n, "warm");
+    sqlite3_close(db);
+  }
+
+  struct rusage usage;
+  getrusage(RUSAGE_SELF, &usage);
+  emit_begin("memory", n);
+  emit_field("sqlite_highwater_bytes", sqlite3_memory_highwater(0));
+  emit_field("peak_rss_kb", usage.ru_maxrss);
+  emit_end();
+  fprintf(stderr, "%-22s %10d %10.1f MB sqlite %10.1f MB rss\n", "memory", n,
+          sqlite3_memory_highwater(0) / 1e6, usage.ru_maxrss / 1e3);
+
+  remove_db(path);
+  sqlite3_free(path);
+}
+
+int main(int argc, char *argv[]) {
+  const char *sizes = argc > 1 ? argv[1] : "10000,100000,1000000";
+  const char *dir = argc > 2 ? argv[2] : "dist";
+  sqlite3 *db;
+
+  sqlite3_auto_extension((void (*)())sqlite3_tg_init);
+  if (sqlite3_open(":memory:", &db) != SQLITE_OK) {
+    fprintf(stderr, "usage: %s [size,...] [directory]\n", argv[0]);
+    return 1;
+  }
+  sqlite3_stmt *stmt = prepare(db, "select tg_version()");
+  sqlite3_step(stmt);
+  printf("{\"sqlite_version\":\"%s\",\"tg_version\":\"%s\",\"results\":[",
+         sqlite3_libversion(), sqlite3_column_text(stmt, 0));
+  sqlite3_finalize(stmt);
+  sqlite3_close(db);
+
+  for (const char *z = sizes; *z;) {
+    int n = atoi(z);
+    if (n > 0) {
+      bench_size(dir, n);
+    }
+    z += strcspn(z, ",");
+    z += *z == ',';
+  }
+
+  printf("\n]}\n");
+  return 0;
+}
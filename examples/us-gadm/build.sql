@@ -5,10 +5,10 @@
 
 create table us_counties as
 select
-  tg_extra_json(geometry) ->> '$.properties.NAME_1' as state_name,
-  tg_extra_json(geometry) ->> '$.properties.NAME_2' as country_name,
+  properties ->> 'NAME_1' as state_name,
+  properties ->> 'NAME_2' as country_name,
   tg_to_wkb(geometry) as geometry
-from tg_geometries_each(cast(readfile('gadm41_USA_2.json') as text));
+from tg_read_geojson('gadm41_USA_2.json');
 
 
 create virtual table rtree_us_counties using rtree(id, minX, maxX, minY, maxY,/* +boundary*/);
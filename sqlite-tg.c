@@ -6,13 +6,1038 @@ SQLITE_EXTENSION_INIT1
 #include "sqlite-tg.h"
 #include <ctype.h>
 #include <errno.h>
+#include <math.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <time.h>
+
+#ifdef _WIN32
+#include <windows.h>
+#else
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+#if defined(_WIN32) || defined(__EMSCRIPTEN__)
+#ifndef SQLITE_TG_OMIT_THREADS
+#define SQLITE_TG_OMIT_THREADS
+#endif
+#endif
+#ifndef SQLITE_TG_OMIT_THREADS
+#include <pthread.h>
+#endif
+
+#if defined(_MSC_VER)
+#define TG_THREAD_LOCAL __declspec(thread)
+#elif defined(__STDC_VERSION__) && __STDC_VERSION__ >= 201112L
+#define TG_THREAD_LOCAL _Thread_local
+#else
+#define TG_THREAD_LOCAL __thread
+#endif
 
 // https://github.com/sqlite/sqlite/blob/2d3c5385bf168c85875c010bbaa79c6712eab214/src/json.c#L125-L126
 #define JSON_SUBTYPE 74
 
+#pragma region stats
+
+// Counters behind the tg_stats table. Every connection has its own set, kept
+// in a process-wide list. The SQL functions and virtual tables of a
+// connection make its set current on their thread with tg_stats_enter(), and
+// the counting helpers below (and tg's allocator) add to whatever set is
+// current. A set is reference-counted by the modules and functions that
+// hold it, and freed when the last of them goes with the connection, which
+// bumps tgStatsGeneration so that other threads stop using it as current.
+
+enum tg_stat {
+  TG_STAT_PARSE_WKT,
+  TG_STAT_PARSE_WKB,
+  TG_STAT_PARSE_TWKB,
+  TG_STAT_PARSE_GEOJSON,
+  TG_STAT_PARSE_BYTES,
+  TG_STAT_POINTER_VALUES,
+  TG_STAT_PREDICATE_CONTAINS,
+  TG_STAT_PREDICATE_COVEREDBY,
+  TG_STAT_PREDICATE_COVERS,
+  TG_STAT_PREDICATE_DISJOINT,
+  TG_STAT_PREDICATE_INTERSECTS,
+  TG_STAT_PREDICATE_TOUCHES,
+  TG_STAT_PREDICATE_WITHIN,
+  TG_STAT_TG0_CANDIDATES,
+  TG_STAT_TG0_ACCEPTED,
+  TG_STAT_ALLOCATIONS,
+  TG_STAT_ALLOCATED_BYTES,
+  TG_STAT_PARSE_NS,
+  TG_STAT_RTREE_NS,
+  TG_STAT_PREDICATE_NS,
+  // 1 when the *_ns timers run, the only counter that can be updated
+  TG_STAT_TIMING,
+  TG_STAT_COUNT
+};
+
+static const char *const tgStatNames[TG_STAT_COUNT] = {
+    "parse_wkt",
+    "parse_wkb",
+    "parse_twkb",
+    "parse_geojson",
+    "parse_bytes",
+    "pointer_values",
+    "predicate_contains",
+    "predicate_coveredby",
+    "predicate_covers",
+    "predicate_disjoint",
+    "predicate_intersects",
+    "predicate_touches",
+    "predicate_within",
+    "tg0_candidates",
+    "tg0_accepted",
+    "allocations",
+    "allocated_bytes",
+    "parse_ns",
+    "rtree_ns",
+    "predicate_ns",
+    "timing",
+};
+
+struct tg_stats {
+  sqlite3 *db;
+  struct tg_stats *next;
+  int nRef;
+  // the connection's open tg0 tables, for tg0_last_query_stats()
+  struct tg0_vtab *tables;
+  sqlite3_int64 a[TG_STAT_COUNT];
+};
+
+// Guarded by SQLITE_MUTEX_STATIC_APP1.
+static struct tg_stats *tgStatsList;
+// Read without the mutex: a torn or stale read only costs a list lookup.
+static volatile unsigned int tgStatsGeneration;
+
+static TG_THREAD_LOCAL struct tg_stats *tgStatsCurrent;
+static TG_THREAD_LOCAL sqlite3 *tgStatsCurrentDb;
+static TG_THREAD_LOCAL unsigned int tgStatsCurrentGeneration;
+
+static struct tg_stats *tg_stats_current(void) {
+  return tgStatsCurrentGeneration == tgStatsGeneration ? tgStatsCurrent
+                                                       : NULL;
+}
+
+static void tg_stats_enter(sqlite3 *db) {
+  if (tgStatsCurrentDb == db &&
+      tgStatsCurrentGeneration == tgStatsGeneration) {
+    return;
+  }
+  sqlite3_mutex *mutex = sqlite3_mutex_alloc(SQLITE_MUTEX_STATIC_APP1);
+  sqlite3_mutex_enter(mutex);
+  struct tg_stats *stats = tgStatsList;
+  while (stats && stats->db != db) {
+    stats = stats->next;
+  }
+  tgStatsCurrent = stats;
+  tgStatsCurrentDb = db;
+  tgStatsCurrentGeneration = tgStatsGeneration;
+  sqlite3_mutex_leave(mutex);
+}
+
+// Adds a set for db to the list, with no references yet.
+static struct tg_stats *tg_stats_register(sqlite3 *db) {
+  struct tg_stats *stats = sqlite3_malloc(sizeof(*stats));
+  if (!stats) {
+    return NULL;
+  }
+  memset(stats, 0, sizeof(*stats));
+  stats->db = db;
+  sqlite3_mutex *mutex = sqlite3_mutex_alloc(SQLITE_MUTEX_STATIC_APP1);
+  sqlite3_mutex_enter(mutex);
+  stats->next = tgStatsList;
+  tgStatsList = stats;
+  // a set registered earlier for the same db (the extension loaded twice)
+  // would otherwise shadow this one in cached lookups
+  tgStatsGeneration++;
+  sqlite3_mutex_leave(mutex);
+  return stats;
+}
+
+static struct tg_stats *tg_stats_ref(struct tg_stats *stats) {
+  stats->nRef++;
+  return stats;
+}
+
+// Destructor of the modules and functions holding a reference.
+static void tg_stats_unref(void *p) {
+  struct tg_stats *stats = p;
+  if (--stats->nRef > 0) {
+    return;
+  }
+  sqlite3_mutex *mutex = sqlite3_mutex_alloc(SQLITE_MUTEX_STATIC_APP1);
+  sqlite3_mutex_enter(mutex);
+  struct tg_stats **pp = &tgStatsList;
+  while (*pp && *pp != stats) {
+    pp = &(*pp)->next;
+  }
+  if (*pp) {
+    *pp = stats->next;
+  }
+  tgStatsGeneration++;
+  sqlite3_mutex_leave(mutex);
+  sqlite3_free(stats);
+}
+
+static sqlite3_int64 tg_now_ns(void) {
+#ifdef _WIN32
+  LARGE_INTEGER frequency, counter;
+  QueryPerformanceFrequency(&frequency);
+  QueryPerformanceCounter(&counter);
+  return (sqlite3_int64)((double)counter.QuadPart * 1e9 /
+                         (double)frequency.QuadPart);
+#else
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (sqlite3_int64)ts.tv_sec * 1000000000 + ts.tv_nsec;
+#endif
+}
+
+static void tg_stats_add(enum tg_stat stat, sqlite3_int64 n) {
+  struct tg_stats *stats = tg_stats_current();
+  if (stats) {
+    stats->a[stat] += n;
+  }
+}
+
+// Start of a timed phase, or 0 when timing is off.
+static sqlite3_int64 tg_stats_clock(void) {
+  struct tg_stats *stats = tg_stats_current();
+  return stats && stats->a[TG_STAT_TIMING] ? tg_now_ns() : 0;
+}
+
+// Ends a timed phase, returning its nanoseconds (0 when timing is off).
+static sqlite3_int64 tg_stats_time(enum tg_stat stat, sqlite3_int64 start) {
+  if (!start) {
+    return 0;
+  }
+  sqlite3_int64 ns = tg_now_ns() - start;
+  tg_stats_add(stat, ns);
+  return ns;
+}
+
+#pragma endregion
+
+#pragma region allocator
+
+// tg allocates through sqlite3_malloc(), so geometries are counted by
+// sqlite3_memory_used() and bounded by sqlite3_hard_heap_limit64() like the
+// rest of SQLite's memory. Applications that statically link tg and use it
+// before loading this extension should build with SQLITE_TG_SYSTEM_MALLOC,
+// which leaves tg on the C library's malloc().
+//
+// On top of that, a tg_arena can be made current on the calling thread for
+// work whose tg objects all die within one row, like the geometries parsed by
+// predicates and the tg0 refine loop. While it is current, tg allocations are
+// bumped out of the arena's chunks, tg_free() of them is (nearly) free, and
+// tg_arena_end() gives everything back at once without touching the global
+// allocator. Every tg object allocated inside an arena must be freed or
+// abandoned before tg_arena_end(): freeing it afterwards is a double free.
+
+// Every tg allocation, from an arena or from the heap, is prefixed with its
+// size (for realloc) and the arena it came from (NULL for the heap), padded so
+// that doubles and pointers stay aligned. That way tg_free() knows where a
+// pointer belongs without searching the arenas' chunks.
+struct tg_arena;
+struct tg_alloc_header {
+  size_t size;
+  struct tg_arena *arena;
+};
+#define TG_ARENA_ALIGN 8
+#define TG_ARENA_HEADER                                                        \
+  ((sizeof(struct tg_alloc_header) + TG_ARENA_ALIGN - 1) &                     \
+   ~(size_t)(TG_ARENA_ALIGN - 1))
+#define TG_ALLOC_HEADER(ptr)                                                   \
+  ((struct tg_alloc_header *)((char *)(ptr)-TG_ARENA_HEADER))
+// Size of a regular chunk. Allocations bigger than a quarter of this get a
+// chunk of their own, so one large ring doesn't waste the rest of a chunk.
+#define TG_ARENA_CHUNK 16384
+
+struct tg_arena_chunk {
+  struct tg_arena_chunk *next;
+  size_t size;
+};
+#define TG_ARENA_CHUNK_HEADER                                                  \
+  ((sizeof(struct tg_arena_chunk) + TG_ARENA_ALIGN - 1) &                      \
+   ~(size_t)(TG_ARENA_ALIGN - 1))
+#define TG_ARENA_CHUNK_DATA(chunk) ((char *)(chunk) + TG_ARENA_CHUNK_HEADER)
+
+struct tg_arena {
+  // the region allocations are bumped from: the caller's buffer, or the
+  // storage of the most recent regular chunk
+  char *base;
+  size_t size;
+  size_t used;
+  // offset in base of the most recent allocation's header, which is the only
+  // one that can grow in place or be given back by tg_free()
+  size_t last;
+  // optional caller-provided buffer (usually on the stack), used first
+  char *buffer;
+  size_t nBuffer;
+  // heap chunks, most recent first
+  struct tg_arena_chunk *chunks;
+  // the arena that was current before tg_arena_begin()
+  struct tg_arena *prev;
+};
+
+static TG_THREAD_LOCAL struct tg_arena *tgArenaCurrent;
+
+static void tg_arena_init(struct tg_arena *arena, void *buffer, size_t n) {
+  memset(arena, 0, sizeof(*arena));
+  if (buffer) {
+    arena->buffer = arena->base = buffer;
+    arena->nBuffer = arena->size = n;
+  }
+}
+
+// Makes arena the current one for tg allocations on this thread.
+static void tg_arena_begin(struct tg_arena *arena) {
+  arena->prev = tgArenaCurrent;
+  tgArenaCurrent = arena;
+}
+
+// Restores the previously current arena and releases everything allocated
+// from this one, so it can be begun again.
+static void tg_arena_end(struct tg_arena *arena) {
+  tgArenaCurrent = arena->prev;
+  struct tg_arena_chunk *chunk = arena->chunks;
+  while (chunk) {
+    struct tg_arena_chunk *next = chunk->next;
+    sqlite3_free(chunk);
+    chunk = next;
+  }
+  tg_arena_init(arena, arena->buffer, arena->nBuffer);
+}
+
+#ifndef SQLITE_TG_SYSTEM_MALLOC
+
+static void *tg_arena_alloc(struct tg_arena *arena, size_t n) {
+  size_t need = TG_ARENA_HEADER +
+                ((n + TG_ARENA_ALIGN - 1) & ~(size_t)(TG_ARENA_ALIGN - 1));
+  if (need < n) {
+    return NULL;
+  }
+  char *header;
+  if (arena->size - arena->used >= need) {
+    header = arena->base + arena->used;
+    arena->last = arena->used;
+    arena->used += need;
+  } else {
+    int own = need > TG_ARENA_CHUNK / 4;
+    size_t size = own ? need : TG_ARENA_CHUNK;
+    struct tg_arena_chunk *chunk =
+        sqlite3_malloc64(TG_ARENA_CHUNK_HEADER + (sqlite3_uint64)size);
+    if (!chunk) {
+      return NULL;
+    }
+    chunk->size = size;
+    chunk->next = arena->chunks;
+    arena->chunks = chunk;
+    header = TG_ARENA_CHUNK_DATA(chunk);
+    if (!own) {
+      arena->base = header;
+      arena->size = size;
+      arena->last = 0;
+      arena->used = need;
+    }
+  }
+  struct tg_alloc_header *h = (struct tg_alloc_header *)header;
+  h->size = n;
+  h->arena = arena;
+  return header + TG_ARENA_HEADER;
+}
+
+static void *tg_arena_realloc(struct tg_arena *arena, void *ptr, size_t n) {
+  struct tg_alloc_header *h = TG_ALLOC_HEADER(ptr);
+  size_t old = h->size;
+  if ((char *)h == arena->base + arena->last) {
+    size_t need = TG_ARENA_HEADER +
+                  ((n + TG_ARENA_ALIGN - 1) & ~(size_t)(TG_ARENA_ALIGN - 1));
+    if (need >= n && arena->size - arena->last >= need) {
+      h->size = n;
+      arena->used = arena->last + need;
+      return ptr;
+    }
+  }
+  void *p = tg_arena_alloc(arena, n);
+  if (p) {
+    memcpy(p, ptr, old < n ? old : n);
+  }
+  return p;
+}
+
+static void tg_arena_free(struct tg_arena *arena, void *ptr) {
+  if ((char *)TG_ALLOC_HEADER(ptr) == arena->base + arena->last) {
+    arena->used = arena->last;
+  }
+}
+
+// tg treats a NULL result as out-of-memory even for zero bytes (like the
+// arrays of an empty multi geometry); the header keeps heap requests nonzero.
+static void *tg_allocator_malloc(size_t n) {
+  struct tg_stats *stats = tg_stats_current();
+  if (stats) {
+    stats->a[TG_STAT_ALLOCATIONS]++;
+    stats->a[TG_STAT_ALLOCATED_BYTES] += n;
+  }
+  struct tg_arena *arena = tgArenaCurrent;
+  if (arena) {
+    return tg_arena_alloc(arena, n);
+  }
+  if (TG_ARENA_HEADER + n < n) {
+    return NULL;
+  }
+  struct tg_alloc_header *h = sqlite3_malloc64(TG_ARENA_HEADER + n);
+  if (!h) {
+    return NULL;
+  }
+  h->size = n;
+  h->arena = NULL;
+  return (char *)h + TG_ARENA_HEADER;
+}
+
+static void *tg_allocator_realloc(void *ptr, size_t n) {
+  if (!ptr) {
+    return tg_allocator_malloc(n);
+  }
+  struct tg_stats *stats = tg_stats_current();
+  if (stats) {
+    stats->a[TG_STAT_ALLOCATIONS]++;
+    stats->a[TG_STAT_ALLOCATED_BYTES] += n;
+  }
+  struct tg_alloc_header *h = TG_ALLOC_HEADER(ptr);
+  if (h->arena) {
+    return tg_arena_realloc(h->arena, ptr, n);
+  }
+  if (TG_ARENA_HEADER + n < n) {
+    return NULL;
+  }
+  h = sqlite3_realloc64(h, TG_ARENA_HEADER + n);
+  if (!h) {
+    return NULL;
+  }
+  h->size = n;
+  return (char *)h + TG_ARENA_HEADER;
+}
+
+static void tg_allocator_free(void *ptr) {
+  if (!ptr) {
+    return;
+  }
+  struct tg_alloc_header *h = TG_ALLOC_HEADER(ptr);
+  if (h->arena) {
+    tg_arena_free(h->arena, ptr);
+  } else {
+    sqlite3_free(h);
+  }
+}
+
+#endif
+
+// tg's allocator is process-wide and must not change once anything has been
+// allocated, so it is installed by the first sqlite3_tg_init() only.
+static void tg_allocator_install(void) {
+#ifndef SQLITE_TG_SYSTEM_MALLOC
+  static int installed = 0;
+  if (!installed) {
+    tg_env_set_allocator(tg_allocator_malloc, tg_allocator_realloc,
+                         tg_allocator_free);
+    installed = 1;
+  }
+#endif
+}
+
+#pragma endregion
+
+#pragma region twkb
+
+// TWKB (https://github.com/TWKB/Specification) is a compact form of WKB:
+// coordinates are scaled by 10^precision, rounded to integers, and written as
+// zig-zag varints of their difference from the previous vertex of the same
+// geometry. Readers skip the optional bounding boxes, sizes, and id lists,
+// and writers never emit them.
+
+#define TWKB_MIN_PRECISION -8
+#define TWKB_MAX_PRECISION 7
+
+// metadata header bits
+#define TWKB_HAS_BBOX 0x01
+#define TWKB_HAS_SIZE 0x02
+#define TWKB_HAS_IDLIST 0x04
+#define TWKB_HAS_EXTENDED_DIMS 0x08
+#define TWKB_IS_EMPTY 0x10
+
+#define TWKB_MAX_DEPTH 64
+
+// scaled coordinates must stay below 2^62, so deltas between them fit too
+#define TWKB_MAX_SCALED 4.6e18
+
+static const double twkbPowers[] = {1e0, 1e1, 1e2, 1e3, 1e4,
+                                    1e5, 1e6, 1e7, 1e8};
+
+// How the coordinates of one TWKB geometry are scaled, and the previous
+// vertex they are deltas of.
+struct twkb_coords {
+  // 2 to 4, x and y then z and/or m
+  int dims;
+  int hasZ;
+  int hasM;
+  // per dimension: 10^|precision|, and whether precision is negative
+  double power[4];
+  int negative[4];
+  sqlite3_int64 last[4];
+};
+
+static void twkbCoordsInit(struct twkb_coords *c, int precision, int hasZ,
+                           int hasM, int precisionZ, int precisionM) {
+  int aPrecision[4] = {precision, precision, hasZ ? precisionZ : precisionM,
+                       precisionM};
+  c->dims = 2 + hasZ + hasM;
+  c->hasZ = hasZ;
+  c->hasM = hasM;
+  for (int d = 0; d < 4; d++) {
+    c->power[d] = twkbPowers[abs(aPrecision[d])];
+    c->negative[d] = aPrecision[d] < 0;
+    c->last[d] = 0;
+  }
+}
+
+static int twkbVarint(const unsigned char *b, size_t n, size_t *pi,
+                      sqlite3_uint64 *pValue) {
+  sqlite3_uint64 value = 0;
+  size_t i = *pi;
+  for (int shift = 0; shift < 64; shift += 7) {
+    if (i >= n) {
+      return 0;
+    }
+    unsigned char c = b[i++];
+    value |= (sqlite3_uint64)(c & 0x7f) << shift;
+    if (!(c & 0x80)) {
+      *pi = i;
+      *pValue = value;
+      return 1;
+    }
+  }
+  return 0;
+}
+
+// A TWKB blob being parsed into tg geometries.
+struct twkb_reader {
+  const unsigned char *b;
+  size_t n;
+  size_t i;
+  enum tg_index ix;
+  // scratch vertices of the line or ring being read
+  struct tg_point *aPoint;
+  int nPointAlloc;
+  // z and m values of the current geometry, see twkbReadGeom()
+  double *aExtra;
+  size_t nExtra;
+  size_t nExtraAlloc;
+};
+
+// Reads a count of items that each take at least min bytes, rejecting counts
+// the rest of the blob can't hold before anything is allocated for them.
+static int twkbReadCount(struct twkb_reader *r, int min, int *pCount) {
+  sqlite3_uint64 count;
+  if (!twkbVarint(r->b, r->n, &r->i, &count) ||
+      count > (r->n - r->i) / min) {
+    return 0;
+  }
+  *pCount = (int)count;
+  return 1;
+}
+
+// Reads n vertices into r->aPoint, and their z and m values onto r->aExtra.
+static int twkbReadPoints(struct twkb_reader *r, struct twkb_coords *c,
+                          int n) {
+  if (n > r->nPointAlloc) {
+    struct tg_point *a =
+        sqlite3_realloc64(r->aPoint, (sqlite3_uint64)n * sizeof(*a));
+    if (!a) {
+      return 0;
+    }
+    r->aPoint = a;
+    r->nPointAlloc = n;
+  }
+  size_t nExtra = r->nExtra + (size_t)n * (c->dims - 2);
+  if (nExtra > r->nExtraAlloc) {
+    double *a = sqlite3_realloc64(r->aExtra, nExtra * 2 * sizeof(*a));
+    if (!a) {
+      return 0;
+    }
+    r->aExtra = a;
+    r->nExtraAlloc = nExtra * 2;
+  }
+  for (int i = 0; i < n; i++) {
+    double v[4] = {0, 0, 0, 0};
+    for (int d = 0; d < c->dims; d++) {
+      sqlite3_uint64 zz;
+      if (!twkbVarint(r->b, r->n, &r->i, &zz)) {
+        return 0;
+      }
+      c->last[d] = (sqlite3_int64)((sqlite3_uint64)c->last[d] +
+                                   ((zz >> 1) ^ (~(zz & 1) + 1)));
+      v[d] = c->negative[d] ? (double)c->last[d] * c->power[d]
+                            : (double)c->last[d] / c->power[d];
+    }
+    r->aPoint[i].x = v[0];
+    r->aPoint[i].y = v[1];
+    for (int d = 2; d < c->dims; d++) {
+      r->aExtra[r->nExtra++] = v[d];
+    }
+  }
+  return 1;
+}
+
+static struct tg_ring *twkbReadRing(struct twkb_reader *r,
+                                    struct twkb_coords *c) {
+  int n;
+  if (!twkbReadCount(r, c->dims, &n) || !twkbReadPoints(r, c, n)) {
+    return NULL;
+  }
+  return tg_ring_new_ix(r->aPoint, n, r->ix);
+}
+
+static struct tg_poly *twkbReadPoly(struct twkb_reader *r,
+                                    struct twkb_coords *c) {
+  int nRings;
+  if (!twkbReadCount(r, 1, &nRings) || nRings == 0) {
+    return NULL;
+  }
+  struct tg_ring *stack[8];
+  struct tg_ring **aRing =
+      nRings <= 8 ? stack
+                  : sqlite3_malloc64((sqlite3_uint64)nRings * sizeof(*aRing));
+  struct tg_poly *poly = NULL;
+  int n = 0;
+  if (aRing) {
+    while (n < nRings && (aRing[n] = twkbReadRing(r, c))) {
+      n++;
+    }
+    if (n == nRings) {
+      poly = tg_poly_new(aRing[0], (const struct tg_ring *const *)aRing + 1,
+                         nRings - 1);
+    }
+  }
+  for (int i = 0; i < n; i++) {
+    tg_ring_free(aRing[i]);
+  }
+  if (aRing != stack) {
+    sqlite3_free(aRing);
+  }
+  return poly;
+}
+
+static struct tg_geom *twkbEmpty(int type) {
+  switch (type) {
+  case TG_POINT:
+    return tg_geom_new_point_empty();
+  case TG_LINESTRING:
+    return tg_geom_new_linestring_empty();
+  case TG_POLYGON:
+    return tg_geom_new_polygon_empty();
+  case TG_MULTIPOINT:
+    return tg_geom_new_multipoint_empty();
+  case TG_MULTILINESTRING:
+    return tg_geom_new_multilinestring_empty();
+  case TG_MULTIPOLYGON:
+    return tg_geom_new_multipolygon_empty();
+  default:
+    return tg_geom_new_geometrycollection_empty();
+  }
+}
+
+// Picks the tg_geom_new_<kind>() constructor for c's dimensions. The extra
+// coordinates are r's.
+#define TWKB_NEW(kind, ...)                                                    \
+  (c.dims == 2 ? tg_geom_new_##kind(__VA_ARGS__)                               \
+   : c.hasZ && c.hasM                                                          \
+       ? tg_geom_new_##kind##_zm(__VA_ARGS__, r->aExtra, (int)r->nExtra)       \
+   : c.hasZ ? tg_geom_new_##kind##_z(__VA_ARGS__, r->aExtra, (int)r->nExtra)   \
+            : tg_geom_new_##kind##_m(__VA_ARGS__, r->aExtra, (int)r->nExtra))
+
+// Reads one TWKB geometry, header included. Returns NULL when the input is
+// malformed or memory runs out.
+static struct tg_geom *twkbReadGeom(struct twkb_reader *r, int depth) {
+  if (depth > TWKB_MAX_DEPTH || r->n - r->i < 2) {
+    return NULL;
+  }
+  unsigned char header = r->b[r->i++];
+  unsigned char meta = r->b[r->i++];
+  int type = header & 0x0f;
+  int precision = (header >> 5) ^ -((header >> 4) & 1);
+  int hasZ = 0, hasM = 0, precisionZ = 0, precisionM = 0;
+  if (type < TG_POINT || type > TG_GEOMETRYCOLLECTION) {
+    return NULL;
+  }
+  if (meta & TWKB_HAS_EXTENDED_DIMS) {
+    if (r->i >= r->n) {
+      return NULL;
+    }
+    unsigned char ext = r->b[r->i++];
+    hasZ = ext & 1;
+    hasM = (ext >> 1) & 1;
+    precisionZ = (ext >> 2) & 7;
+    precisionM = (ext >> 5) & 7;
+  }
+  struct twkb_coords c;
+  twkbCoordsInit(&c, precision, hasZ, hasM, precisionZ, precisionM);
+  sqlite3_uint64 skipped;
+  if ((meta & TWKB_HAS_SIZE) && !twkbVarint(r->b, r->n, &r->i, &skipped)) {
+    return NULL;
+  }
+  for (int i = 0; (meta & TWKB_HAS_BBOX) && i < 2 * c.dims; i++) {
+    if (!twkbVarint(r->b, r->n, &r->i, &skipped)) {
+      return NULL;
+    }
+  }
+  if (meta & TWKB_IS_EMPTY) {
+    return twkbEmpty(type);
+  }
+
+  // the extra coordinates belong to this geometry, so a collection's children
+  // start over with their own
+  size_t nOuterExtra = r->nExtra;
+  r->nExtra = 0;
+  struct tg_geom *geom = NULL;
+  int n = 0;
+  if (type == TG_POINT) {
+    if (twkbReadPoints(r, &c, 1)) {
+      struct tg_point point = r->aPoint[0];
+      geom = c.dims == 2         ? tg_geom_new_point(point)
+             : c.hasZ && c.hasM ? tg_geom_new_point_zm(point, r->aExtra[0],
+                                                        r->aExtra[1])
+             : c.hasZ           ? tg_geom_new_point_z(point, r->aExtra[0])
+                                : tg_geom_new_point_m(point, r->aExtra[0]);
+    }
+  } else if (type == TG_LINESTRING) {
+    struct tg_line *line = NULL;
+    if (twkbReadCount(r, c.dims, &n) && twkbReadPoints(r, &c, n) &&
+        (line = tg_line_new_ix(r->aPoint, n, r->ix))) {
+      geom = TWKB_NEW(linestring, line);
+    }
+    tg_line_free(line);
+  } else if (type == TG_POLYGON) {
+    struct tg_poly *poly = twkbReadPoly(r, &c);
+    if (poly) {
+      geom = TWKB_NEW(polygon, poly);
+    }
+    tg_poly_free(poly);
+  } else if (twkbReadCount(r, type == TG_MULTIPOINT ? c.dims : 1, &n)) {
+    int ok = 1;
+    for (int i = 0; ok && (meta & TWKB_HAS_IDLIST) && i < n; i++) {
+      ok = twkbVarint(r->b, r->n, &r->i, &skipped);
+    }
+    void **aPart =
+        type == TG_MULTIPOINT || !ok
+            ? NULL
+            : sqlite3_malloc64((sqlite3_uint64)(n ? n : 1) * sizeof(void *));
+    int nPart = 0;
+    if (type == TG_MULTIPOINT) {
+      if (ok && twkbReadPoints(r, &c, n)) {
+        geom = TWKB_NEW(multipoint, r->aPoint, n);
+      }
+    } else if (aPart) {
+      for (; nPart < n; nPart++) {
+        if (type == TG_MULTILINESTRING) {
+          int nPoints;
+          aPart[nPart] = twkbReadCount(r, c.dims, &nPoints) &&
+                                 twkbReadPoints(r, &c, nPoints)
+                             ? tg_line_new_ix(r->aPoint, nPoints, r->ix)
+                             : NULL;
+        } else if (type == TG_MULTIPOLYGON) {
+          aPart[nPart] = twkbReadPoly(r, &c);
+        } else {
+          aPart[nPart] = twkbReadGeom(r, depth + 1);
+        }
+        if (!aPart[nPart]) {
+          break;
+        }
+      }
+      if (nPart == n) {
+        geom = type == TG_MULTILINESTRING
+                   ? TWKB_NEW(multilinestring,
+                              (const struct tg_line *const *)aPart, n)
+               : type == TG_MULTIPOLYGON
+                   ? TWKB_NEW(multipolygon,
+                              (const struct tg_poly *const *)aPart, n)
+                   : tg_geom_new_geometrycollection(
+                         (const struct tg_geom *const *)aPart, n);
+      }
+    }
+    for (int i = 0; i < nPart; i++) {
+      if (type == TG_MULTILINESTRING) {
+        tg_line_free(aPart[i]);
+      } else if (type == TG_MULTIPOLYGON) {
+        tg_poly_free(aPart[i]);
+      } else {
+        tg_geom_free(aPart[i]);
+      }
+    }
+    sqlite3_free(aPart);
+  }
+  r->nExtra = nOuterExtra;
+  return geom;
+}
+
+#undef TWKB_NEW
+
+// Parses a whole TWKB blob, or returns NULL if it's malformed, has trailing
+// bytes, or memory runs out.
+static struct tg_geom *twkbParse(const unsigned char *b, size_t n,
+                                 enum tg_index ix) {
+  struct twkb_reader r;
+  memset(&r, 0, sizeof(r));
+  r.b = b;
+  r.n = n;
+  r.ix = ix;
+  struct tg_geom *geom = twkbReadGeom(&r, 0);
+  if (geom && r.i != n) {
+    tg_geom_free(geom);
+    geom = NULL;
+  }
+  sqlite3_free(r.aPoint);
+  sqlite3_free(r.aExtra);
+  return geom;
+}
+
+// Reads the coordinates of a TWKB point without parsing it, like
+// wkbPointXY(). Returns 0 for any other shape, or a point with z or m.
+static int twkbPointXY(const unsigned char *b, int n, double *x, double *y) {
+  if (n < 4 || (b[0] & 0x0f) != TG_POINT || b[1] != 0) {
+    return 0;
+  }
+  size_t i = 2;
+  sqlite3_uint64 zx, zy;
+  if (!twkbVarint(b, n, &i, &zx) || !twkbVarint(b, n, &i, &zy) ||
+      i != (size_t)n) {
+    return 0;
+  }
+  int precision = (b[0] >> 5) ^ -((b[0] >> 4) & 1);
+  double power = twkbPowers[abs(precision)];
+  sqlite3_int64 qx = (sqlite3_int64)((zx >> 1) ^ (~(zx & 1) + 1));
+  sqlite3_int64 qy = (sqlite3_int64)((zy >> 1) ^ (~(zy & 1) + 1));
+  *x = precision < 0 ? (double)qx * power : (double)qx / power;
+  *y = precision < 0 ? (double)qy * power : (double)qy / power;
+  return 1;
+}
+
+// Parses a WKB or TWKB blob. WKB starts with a byte order of 0 or 1, which
+// TWKB headers never have, except for points of precision 0: blobs starting
+// with 1 are read as WKB, and only as TWKB when that fails. Errors are WKB's.
+// *pTwkb is set to whether the blob was TWKB.
+static struct tg_geom *parseBlob(const unsigned char *b, size_t n,
+                                 enum tg_index ix, int *pTwkb) {
+  struct tg_geom *geom;
+  *pTwkb = 0;
+  if (n > 0 && b[0] > 1 && (geom = twkbParse(b, n, ix))) {
+    *pTwkb = 1;
+    return geom;
+  }
+  geom = tg_parse_wkb_ix(b, n, ix);
+  if (n > 0 && b[0] == 1 && (!geom || tg_geom_error(geom))) {
+    struct tg_geom *twkb = twkbParse(b, n, ix);
+    if (twkb) {
+      tg_geom_free(geom);
+      *pTwkb = 1;
+      return twkb;
+    }
+  }
+  return geom;
+}
+
+// A TWKB blob being written.
+struct twkb_writer {
+  unsigned char *a;
+  size_t n;
+  size_t nAlloc;
+  // set when memory runs out
+  int oom;
+  // set on coordinates that can't be written, a static message
+  const char *zErr;
+};
+
+static int twkbReserve(struct twkb_writer *w, size_t n) {
+  if (w->oom || w->zErr) {
+    return 0;
+  }
+  if (w->n + n > w->nAlloc) {
+    size_t nAlloc = w->nAlloc * 2 + n + 64;
+    unsigned char *a = sqlite3_realloc64(w->a, nAlloc);
+    if (!a) {
+      w->oom = 1;
+      return 0;
+    }
+    w->a = a;
+    w->nAlloc = nAlloc;
+  }
+  return 1;
+}
+
+// Appends a varint, room for which must have been reserved.
+static void twkbPutVarint(struct twkb_writer *w, sqlite3_uint64 v) {
+  while (v >= 0x80) {
+    w->a[w->n++] = (unsigned char)(v | 0x80);
+    v >>= 7;
+  }
+  w->a[w->n++] = (unsigned char)v;
+}
+
+static void twkbWriteCount(struct twkb_writer *w, int n) {
+  if (twkbReserve(w, 5)) {
+    twkbPutVarint(w, (sqlite3_uint64)n);
+  }
+}
+
+// Writes n vertices, taking their z and m values from extra at *piExtra.
+static void twkbWritePoints(struct twkb_writer *w, struct twkb_coords *c,
+                            const struct tg_point *points, int n,
+                            const double *extra, int nExtra, int *piExtra) {
+  if (!twkbReserve(w, (size_t)n * c->dims * 10)) {
+    return;
+  }
+  for (int i = 0; i < n; i++) {
+    double v[4] = {points[i].x, points[i].y, 0, 0};
+    for (int d = 2; d < c->dims; d++) {
+      v[d] = *piExtra < nExtra ? extra[(*piExtra)++] : 0;
+    }
+    for (int d = 0; d < c->dims; d++) {
+      double scaled = c->negative[d] ? v[d] / c->power[d] : v[d] * c->power[d];
+      // also catches NaN
+      if (!(fabs(scaled) < TWKB_MAX_SCALED)) {
+        w->zErr = "coordinate out of range for TWKB precision";
+        return;
+      }
+      sqlite3_int64 q = llround(scaled);
+      sqlite3_uint64 delta = (sqlite3_uint64)q - (sqlite3_uint64)c->last[d];
+      c->last[d] = q;
+      twkbPutVarint(w, (delta << 1) ^ (~(delta >> 63) + 1));
+    }
+  }
+}
+
+static void twkbWriteRings(struct twkb_writer *w, struct twkb_coords *c,
+                           const struct tg_poly *poly, const double *extra,
+                           int nExtra, int *piExtra) {
+  int nHoles = tg_poly_num_holes(poly);
+  twkbWriteCount(w, 1 + nHoles);
+  for (int i = -1; i < nHoles; i++) {
+    const struct tg_ring *ring =
+        i < 0 ? tg_poly_exterior(poly) : tg_poly_hole_at(poly, i);
+    twkbWriteCount(w, tg_ring_num_points(ring));
+    twkbWritePoints(w, c, tg_ring_points(ring), tg_ring_num_points(ring),
+                    extra, nExtra, piExtra);
+  }
+}
+
+static void twkbWriteGeom(struct twkb_writer *w, const struct tg_geom *geom,
+                          int precision) {
+  int type = tg_geom_typeof(geom);
+  int hasZ = tg_geom_has_z(geom), hasM = tg_geom_has_m(geom);
+  // z and m are written with the same precision as x and y, as far as the
+  // extended dimensions byte can hold
+  int precisionZM = precision < 0 ? 0 : precision;
+  int nParts = type == TG_MULTIPOINT        ? tg_geom_num_points(geom)
+               : type == TG_MULTILINESTRING ? tg_geom_num_lines(geom)
+               : type == TG_MULTIPOLYGON    ? tg_geom_num_polys(geom)
+               : type == TG_GEOMETRYCOLLECTION
+                   ? tg_geom_num_geometries(geom)
+                   : 0;
+  int empty = type <= TG_POLYGON ? tg_geom_is_empty(geom) : nParts == 0;
+  if (!twkbReserve(w, 3)) {
+    return;
+  }
+  unsigned zigzag = precision < 0 ? -2 * precision - 1 : 2 * precision;
+  w->a[w->n++] = (unsigned char)(type | (zigzag << 4));
+  w->a[w->n++] = (hasZ || hasM ? TWKB_HAS_EXTENDED_DIMS : 0) |
+                 (empty ? TWKB_IS_EMPTY : 0);
+  if (hasZ || hasM) {
+    w->a[w->n++] = (unsigned char)(hasZ | (hasM << 1) |
+                                   (hasZ ? precisionZM << 2 : 0) |
+                                   (hasM ? precisionZM << 5 : 0));
+  }
+  if (empty) {
+    return;
+  }
+
+  struct twkb_coords c;
+  twkbCoordsInit(&c, precision, hasZ, hasM, precisionZM, precisionZM);
+  const double *extra = tg_geom_extra_coords(geom);
+  int nExtra = tg_geom_num_extra_coords(geom);
+  int iExtra = 0;
+  switch (type) {
+  case TG_POINT: {
+    struct tg_point point = tg_geom_point(geom);
+    double zm[2] = {hasZ ? tg_geom_z(geom) : tg_geom_m(geom), tg_geom_m(geom)};
+    twkbWritePoints(w, &c, &point, 1, zm, 2, &iExtra);
+    break;
+  }
+  case TG_LINESTRING: {
+    const struct tg_line *line = tg_geom_line(geom);
+    twkbWriteCount(w, tg_line_num_points(line));
+    twkbWritePoints(w, &c, tg_line_points(line), tg_line_num_points(line),
+                    extra, nExtra, &iExtra);
+    break;
+  }
+  case TG_POLYGON:
+    twkbWriteRings(w, &c, tg_geom_poly(geom), extra, nExtra, &iExtra);
+    break;
+  case TG_MULTIPOINT:
+    twkbWriteCount(w, nParts);
+    for (int i = 0; i < nParts; i++) {
+      struct tg_point point = tg_geom_point_at(geom, i);
+      twkbWritePoints(w, &c, &point, 1, extra, nExtra, &iExtra);
+    }
+    break;
+  case TG_MULTILINESTRING:
+    twkbWriteCount(w, nParts);
+    for (int i = 0; i < nParts; i++) {
+      const struct tg_line *line = tg_geom_line_at(geom, i);
+      twkbWriteCount(w, tg_line_num_points(line));
+      twkbWritePoints(w, &c, tg_line_points(line), tg_line_num_points(line),
+                      extra, nExtra, &iExtra);
+    }
+    break;
+  case TG_MULTIPOLYGON:
+    twkbWriteCount(w, nParts);
+    for (int i = 0; i < nParts; i++) {
+      twkbWriteRings(w, &c, tg_geom_poly_at(geom, i), extra, nExtra, &iExtra);
+    }
+    break;
+  default:
+    twkbWriteCount(w, nParts);
+    for (int i = 0; i < nParts; i++) {
+      twkbWriteGeom(w, tg_geom_geometry_at(geom, i), precision);
+    }
+  }
+}
+
+// Encodes geom as TWKB with precision decimal digits. Returns a buffer to
+// sqlite3_free(), or NULL with *pzErr set to a static message, or left NULL
+// when memory ran out.
+static unsigned char *twkbEncode(const struct tg_geom *geom, int precision,
+                                 size_t *pSize, const char **pzErr) {
+  struct twkb_writer w;
+  memset(&w, 0, sizeof(w));
+  twkbWriteGeom(&w, geom, precision);
+  *pzErr = w.zErr;
+  if (w.oom || w.zErr) {
+    sqlite3_free(w.a);
+    return NULL;
+  }
+  *pSize = w.n;
+  return w.a;
+}
+
+#pragma endregion
+
 #pragma region value
 
 static const char *TG_GEOM_POINTER_NAME = "tg0-tg_geom";
@@ -32,6 +1057,7 @@ static const char *TG_GEOM_POINTER_NAME = "tg0-tg_geom";
 // must NOT also be freed by the caller — hold your own clone if you need one.
 int geomValue(sqlite3_value *value, struct tg_geom ** out_geom, char ** errmsg) {
   struct tg_geom * g;
+  sqlite3_int64 start = tg_stats_clock();
 
   if(
     (sqlite3_value_subtype(value) == JSON_SUBTYPE)
@@ -40,24 +1066,32 @@ int geomValue(sqlite3_value *value, struct tg_geom ** out_geom, char ** errmsg)
     const char *text = (const char *)sqlite3_value_text(value);
     int n = sqlite3_value_bytes(value);
     g =  tg_parse_geojsonn_ix(text, n, TG_NONE);
+    tg_stats_add(TG_STAT_PARSE_GEOJSON, 1);
+    tg_stats_add(TG_STAT_PARSE_BYTES, n);
   }else {
   switch (sqlite3_value_type(value)) {
     case SQLITE_BLOB: {
       const void * b = sqlite3_value_blob(value);
       int n = sqlite3_value_bytes(value);
-      g = tg_parse_wkb_ix(b, n, TG_NONE);
+      int twkb;
+      g = parseBlob(b, n, TG_NONE, &twkb);
+      tg_stats_add(twkb ? TG_STAT_PARSE_TWKB : TG_STAT_PARSE_WKB, 1);
+      tg_stats_add(TG_STAT_PARSE_BYTES, n);
       break;
     }
     case SQLITE_TEXT: {
       const char *text = (const char *)sqlite3_value_text(value);
       int n = sqlite3_value_bytes(value);
       g = tg_parse_wktn_ix(text, n, TG_NONE);
+      tg_stats_add(TG_STAT_PARSE_WKT, 1);
+      tg_stats_add(TG_STAT_PARSE_BYTES, n);
       break;
     }
     case SQLITE_NULL: {
       void *p = sqlite3_value_pointer(value, TG_GEOM_POINTER_NAME);
       if (p) {
         g = tg_geom_clone((struct tg_geom *) p);
+        tg_stats_add(TG_STAT_POINTER_VALUES, 1);
         break;
       }
       *errmsg = sqlite3_mprintf("%s", INVALID_GEO_INPUT);
@@ -69,6 +1103,7 @@ int geomValue(sqlite3_value *value, struct tg_geom ** out_geom, char ** errmsg)
     }
   }
 
+  tg_stats_time(TG_STAT_PARSE_NS, start);
   if(tg_geom_error(g)) {
     *errmsg = sqlite3_mprintf("%s", tg_geom_error(g));
     tg_geom_free(g);
@@ -78,6 +1113,27 @@ int geomValue(sqlite3_value *value, struct tg_geom ** out_geom, char ** errmsg)
   return SQLITE_OK;
 }
 
+// Reads the coordinates of a little-endian 2D WKB point without parsing it,
+// for hot loops over point layers. Returns 0 for any other shape or encoding.
+static int wkbPointXY(const unsigned char *b, int n, double *x, double *y) {
+  if (n != 21 || b[0] != 1 || b[1] != 1 || b[2] != 0 || b[3] != 0 ||
+      b[4] != 0) {
+    return 0;
+  }
+  memcpy(x, b + 5, 8);
+  memcpy(y, b + 13, 8);
+  return 1;
+}
+
+// Writes the 21 bytes of a little-endian 2D WKB point, the inverse of
+// wkbPointXY().
+static void wkbPointWrite(unsigned char *b, double x, double y) {
+  static const unsigned char header[5] = {1, 1, 0, 0, 0};
+  memcpy(b, header, 5);
+  memcpy(b + 5, &x, 8);
+  memcpy(b + 13, &y, 8);
+}
+
 #pragma endregion
 
 #pragma region resulting
@@ -90,37 +1146,73 @@ static void resultGeomPointer(sqlite3_context *context, struct tg_geom *geom) {
   sqlite3_result_pointer(context, geom, TG_GEOM_POINTER_NAME, destroy_geom);
 }
 
-static void resultGeomWkt(sqlite3_context *context, struct tg_geom *geom) {
-  size_t size = tg_geom_wkt(geom, 0, 0);
-  void *buffer = sqlite3_malloc(size + 1);
+// Serializes geom with a tg_geom_wkt()-style writer in a single pass, into a
+// buffer sized from hint (usually the size of the input value). The writer is
+// only run a second time when the guess was too small. The result is
+// NUL-terminated, and *pSize gets its length without the terminator.
+static char *serializeGeom(const struct tg_geom *geom,
+                           size_t (*xWrite)(const struct tg_geom *, char *,
+                                            size_t),
+                           size_t hint, size_t *pSize) {
+  size_t capacity = hint + hint / 2 + 64;
+  if (capacity < 128)
+    capacity = 128;
+  char *buffer = sqlite3_malloc64(capacity);
+  if (!buffer)
+    return NULL;
+  size_t size = xWrite(geom, buffer, capacity);
+  if (size >= capacity) {
+    capacity = size + 1;
+    char *grown = sqlite3_realloc64(buffer, capacity);
+    if (!grown) {
+      sqlite3_free(buffer);
+      return NULL;
+    }
+    buffer = grown;
+    xWrite(geom, buffer, capacity);
+  } else if (capacity - size > 4096) {
+    // don't hand SQLite a result much larger than it needs to keep around
+    char *shrunk = sqlite3_realloc64(buffer, size + 1);
+    if (shrunk)
+      buffer = shrunk;
+  }
+  buffer[size] = 0;
+  *pSize = size;
+  return buffer;
+}
+
+static size_t writeGeomWkb(const struct tg_geom *geom, char *dst, size_t n) {
+  return tg_geom_wkb(geom, (uint8_t *)dst, n);
+}
+
+static void resultGeomWkt(sqlite3_context *context, struct tg_geom *geom,
+                          size_t hint) {
+  size_t size;
+  char *buffer = serializeGeom(geom, tg_geom_wkt, hint, &size);
   if (buffer == 0) {
     sqlite3_result_error_nomem(context);
     return;
   }
-  // TODO assert enough space?
-  tg_geom_wkt(geom, buffer, size + 1);
   sqlite3_result_text(context, buffer, size, sqlite3_free);
 }
-static void resultGeomWkb(sqlite3_context *context, struct tg_geom *geom) {
-  size_t size = tg_geom_wkb(geom, 0, 0);
-  void *buffer = sqlite3_malloc(size + 1);
+static void resultGeomWkb(sqlite3_context *context, struct tg_geom *geom,
+                          size_t hint) {
+  size_t size;
+  char *buffer = serializeGeom(geom, writeGeomWkb, hint, &size);
   if (buffer == 0) {
     sqlite3_result_error_nomem(context);
     return;
   }
-  // TODO assert enough space?
-  tg_geom_wkb(geom, buffer, size + 1);
   sqlite3_result_blob(context, buffer, size, sqlite3_free);
 }
-static void resultGeomGeojson(sqlite3_context *context, struct tg_geom *geom) {
-  size_t size = tg_geom_geojson(geom, 0, 0);
-  void *buffer = sqlite3_malloc(size + 1);
+static void resultGeomGeojson(sqlite3_context *context, struct tg_geom *geom,
+                              size_t hint) {
+  size_t size;
+  char *buffer = serializeGeom(geom, tg_geom_geojson, hint, &size);
   if (buffer == 0) {
     sqlite3_result_error_nomem(context);
     return;
   }
-  // TODO assert enough space?
-  tg_geom_geojson(geom, buffer, size + 1);
   sqlite3_result_text(context, buffer, size, sqlite3_free);
   sqlite3_result_subtype(context, JSON_SUBTYPE);
 }
@@ -141,8 +1233,103 @@ static void tg_debug(sqlite3_context *context, int argc, sqlite3_value **arg) {
 
 #pragma region conversions
 
+static int wkbCanonicalGeom(const unsigned char *b, size_t n, size_t *pi,
+                            int parentDims, int depth) {
+  size_t i = *pi;
+  if (depth > 64 || n - i < 5 || b[i] != 1)
+    return 0;
+  uint32_t type = (uint32_t)b[i + 1] | ((uint32_t)b[i + 2] << 8) |
+                  ((uint32_t)b[i + 3] << 16) | ((uint32_t)b[i + 4] << 24);
+  i += 5;
+  // EWKB flags and SRIDs are all above 4000
+  if (type >= 4000)
+    return 0;
+  int dims = 2 + (type / 1000 == 1 || type / 1000 == 2) + 2 * (type / 1000 == 3);
+  if (parentDims && dims != parentDims)
+    return 0;
+  sqlite3_uint64 point = 8 * (sqlite3_uint64)dims;
+  sqlite3_uint64 count;
+#define WKB_READ_COUNT()                                                       \
+  do {                                                                         \
+    if (n - i < 4)                                                             \
+      return 0;                                                                \
+    count = (sqlite3_uint64)b[i] | ((sqlite3_uint64)b[i + 1] << 8) |           \
+            ((sqlite3_uint64)b[i + 2] << 16) |                                 \
+            ((sqlite3_uint64)b[i + 3] << 24);                                  \
+    i += 4;                                                                    \
+  } while (0)
+  switch (type % 1000) {
+  case 1:
+    if (n - i < point)
+      return 0;
+    i += point;
+    break;
+  case 2:
+    WKB_READ_COUNT();
+    if ((n - i) / point < count)
+      return 0;
+    i += count * point;
+    break;
+  case 3: {
+    WKB_READ_COUNT();
+    sqlite3_uint64 nRings = count;
+    for (sqlite3_uint64 r = 0; r < nRings; r++) {
+      WKB_READ_COUNT();
+      if ((n - i) / point < count)
+        return 0;
+      i += count * point;
+    }
+    break;
+  }
+  case 4:
+  case 5:
+  case 6:
+  case 7: {
+    WKB_READ_COUNT();
+    sqlite3_uint64 nGeoms = count;
+    for (sqlite3_uint64 g = 0; g < nGeoms; g++) {
+      if (!wkbCanonicalGeom(b, n, &i, dims, depth + 1))
+        return 0;
+    }
+    break;
+  }
+  default:
+    return 0;
+  }
+#undef WKB_READ_COUNT
+  *pi = i;
+  return 1;
+}
+
+// Whether a parsed WKB blob is already in the form tg_geom_wkb() writes:
+// little-endian with ISO type codes all the way down, and nothing trailing.
+static int wkbIsCanonical(const unsigned char *b, size_t n) {
+  size_t i = 0;
+  return wkbCanonicalGeom(b, n, &i, 0, 0) && i == n;
+}
+
+// Whether GeoJSON text has no whitespace outside of strings.
+static int geojsonIsCompact(const char *z, int n) {
+  int inString = 0;
+  for (int i = 0; i < n; i++) {
+    char c = z[i];
+    if (inString) {
+      if (c == '\\')
+        i++;
+      else if (c == '"')
+        inString = 0;
+    } else if (c == '"') {
+      inString = 1;
+    } else if (c == ' ' || c == '\t' || c == '\n' || c == '\r') {
+      return 0;
+    }
+  }
+  return 1;
+}
+
 static void tg_to_wkt(sqlite3_context *context, int argc,
                       sqlite3_value **argv) {
+  tg_stats_enter(sqlite3_context_db_handle(context));
   struct tg_geom *geom;
   char * errmsg;
   int rc = geomValue(argv[0], &geom, &errmsg);
@@ -151,12 +1338,13 @@ static void tg_to_wkt(sqlite3_context *context, int argc,
     sqlite3_free(errmsg);
     return;
   }
-  resultGeomWkt(context, geom);
+  resultGeomWkt(context, geom, sqlite3_value_bytes(argv[0]));
   tg_geom_free(geom);
 }
 
 static void tg_to_wkb(sqlite3_context *context, int argc,
                       sqlite3_value **argv) {
+  tg_stats_enter(sqlite3_context_db_handle(context));
   struct tg_geom *geom;
   char * errmsg;
   int rc = geomValue(argv[0], &geom, &errmsg);
@@ -166,12 +1354,58 @@ static void tg_to_wkb(sqlite3_context *context, int argc,
     return;
   }
 
-  resultGeomWkb(context, geom);
+  // valid WKB that tg would write byte-for-byte is returned as-is
+  if (sqlite3_value_type(argv[0]) == SQLITE_BLOB &&
+      wkbIsCanonical(sqlite3_value_blob(argv[0]),
+                     sqlite3_value_bytes(argv[0]))) {
+    sqlite3_result_value(context, argv[0]);
+  } else {
+    resultGeomWkb(context, geom, sqlite3_value_bytes(argv[0]));
+  }
+  tg_geom_free(geom);
+}
+
+static void tg_to_twkb(sqlite3_context *context, int argc,
+                       sqlite3_value **argv) {
+  tg_stats_enter(sqlite3_context_db_handle(context));
+  int precision = TWKB_MAX_PRECISION;
+  if (argc > 1) {
+    if (sqlite3_value_numeric_type(argv[1]) != SQLITE_INTEGER ||
+        sqlite3_value_int64(argv[1]) < TWKB_MIN_PRECISION ||
+        sqlite3_value_int64(argv[1]) > TWKB_MAX_PRECISION) {
+      char *zErr = sqlite3_mprintf("precision must be an integer between %d "
+                                   "and %d",
+                                   TWKB_MIN_PRECISION, TWKB_MAX_PRECISION);
+      sqlite3_result_error(context, zErr, -1);
+      sqlite3_free(zErr);
+      return;
+    }
+    precision = sqlite3_value_int(argv[1]);
+  }
+  struct tg_geom *geom;
+  char *errmsg;
+  int rc = geomValue(argv[0], &geom, &errmsg);
+  if (rc != SQLITE_OK) {
+    sqlite3_result_error(context, errmsg, -1);
+    sqlite3_free(errmsg);
+    return;
+  }
+  size_t size;
+  const char *zErr;
+  unsigned char *buffer = twkbEncode(geom, precision, &size, &zErr);
   tg_geom_free(geom);
+  if (buffer) {
+    sqlite3_result_blob64(context, buffer, size, sqlite3_free);
+  } else if (zErr) {
+    sqlite3_result_error(context, zErr, -1);
+  } else {
+    sqlite3_result_error_nomem(context);
+  }
 }
 
 static void tg_to_geojson(sqlite3_context *context, int argc,
                           sqlite3_value **argv) {
+  tg_stats_enter(sqlite3_context_db_handle(context));
   struct tg_geom *geom;
   char * errmsg;
   int rc = geomValue(argv[0], &geom, &errmsg);
@@ -181,7 +1415,18 @@ static void tg_to_geojson(sqlite3_context *context, int argc,
     return;
   }
 
-  resultGeomGeojson(context, geom);
+  // valid GeoJSON that is already compact is returned as-is, rather than
+  // re-serialized with tg's own number formatting and member order
+  if (sqlite3_value_type(argv[0]) == SQLITE_TEXT &&
+      sqlite3_value_bytes(argv[0]) > 0 &&
+      ((const char *)sqlite3_value_text(argv[0]))[0] == '{' &&
+      geojsonIsCompact((const char *)sqlite3_value_text(argv[0]),
+                       sqlite3_value_bytes(argv[0]))) {
+    sqlite3_result_value(context, argv[0]);
+    sqlite3_result_subtype(context, JSON_SUBTYPE);
+  } else {
+    resultGeomGeojson(context, geom, sqlite3_value_bytes(argv[0]));
+  }
   tg_geom_free(geom);
 }
 
@@ -192,12 +1437,39 @@ static void tg_to_geojson(sqlite3_context *context, int argc,
 typedef bool (*GeomPredicateFunc)(const struct tg_geom *a,
                                   const struct tg_geom *b);
 
+// user data of the predicate functions
+struct predicate {
+  GeomPredicateFunc func;
+  enum tg_stat stat;
+};
+
+static const struct predicate predicateContains = {
+    tg_geom_contains, TG_STAT_PREDICATE_CONTAINS};
+static const struct predicate predicateCoveredBy = {
+    tg_geom_coveredby, TG_STAT_PREDICATE_COVEREDBY};
+static const struct predicate predicateCovers = {tg_geom_covers,
+                                                 TG_STAT_PREDICATE_COVERS};
+static const struct predicate predicateDisjoint = {
+    tg_geom_disjoint, TG_STAT_PREDICATE_DISJOINT};
+static const struct predicate predicateIntersects = {
+    tg_geom_intersects, TG_STAT_PREDICATE_INTERSECTS};
+static const struct predicate predicateTouches = {tg_geom_touches,
+                                                  TG_STAT_PREDICATE_TOUCHES};
+static const struct predicate predicateWithin = {tg_geom_within,
+                                                 TG_STAT_PREDICATE_WITHIN};
+
 static void tg_predicate_impl(sqlite3_context *context, int argc,
                               sqlite3_value **argv) {
   struct tg_geom *a = NULL;
   struct tg_geom *b = NULL;
   char * errmsg;
   int rc;
+  // both shapes only live for this call, so parse them into a stack arena
+  sqlite3_uint64 buffer[512];
+  struct tg_arena arena;
+  tg_stats_enter(sqlite3_context_db_handle(context));
+  tg_arena_init(&arena, buffer, sizeof(buffer));
+  tg_arena_begin(&arena);
 
   rc = geomValue(argv[0], &a, &errmsg);
   if (rc != SQLITE_OK) {
@@ -213,885 +1485,7653 @@ static void tg_predicate_impl(sqlite3_context *context, int argc,
     goto cleanup;
   }
 
-  GeomPredicateFunc func = sqlite3_user_data(context);
-  sqlite3_result_int(context, func(a, b));
+  const struct predicate *predicate = sqlite3_user_data(context);
+  sqlite3_int64 start = tg_stats_clock();
+  sqlite3_result_int(context, predicate->func(a, b));
+  tg_stats_time(TG_STAT_PREDICATE_NS, start);
+  tg_stats_add(predicate->stat, 1);
 
   cleanup:
   tg_geom_free(a);
   tg_geom_free(b);
+  tg_arena_end(&arena);
 }
 
 #pragma endregion
 
-#pragma region validators
+#pragma region tg_hilbert() and tg_zorder()
+
+// Space-filling curve keys for clustering ordinary tables by location: rows
+// that are close on the curve are close in space, so a table sorted by its
+// key keeps neighbors on the same pages. A geometry is keyed by the center of
+// its bounding box, placed on a grid of 2^order by 2^order cells over bbox.
+
+#define TG_CURVE_DEFAULT_ORDER 16
+// keys of 2 * 31 bits still fit a positive 64-bit integer
+#define TG_CURVE_MAX_ORDER 31
+
+// Spreads the low 32 bits of x out to the even bits of the result.
+static sqlite3_uint64 tg_curve_spread(sqlite3_uint64 x) {
+  x &= 0xFFFFFFFF;
+  x = (x | (x << 16)) & 0x0000FFFF0000FFFF;
+  x = (x | (x << 8)) & 0x00FF00FF00FF00FF;
+  x = (x | (x << 4)) & 0x0F0F0F0F0F0F0F0F;
+  x = (x | (x << 2)) & 0x3333333333333333;
+  x = (x | (x << 1)) & 0x5555555555555555;
+  return x;
+}
 
-static void tg_valid_geojson(sqlite3_context *context, int argc,
-                             sqlite3_value **argv) {
-  // TODO it's text/blob?
-  const char *s = (const char *)sqlite3_value_text(argv[0]);
-  int n = sqlite3_value_bytes(argv[0]);
-  struct tg_geom *geom = tg_parse_geojsonn_ix(s, n, TG_NONE);
-  if (tg_geom_error(geom)) {
-    sqlite3_result_int(context, 0);
-  } else {
-    sqlite3_result_int(context, 1);
+static sqlite3_uint64 tg_zorder_key(uint32_t x, uint32_t y, int order) {
+  (void)order;
+  return tg_curve_spread(x) | (tg_curve_spread(y) << 1);
+}
+
+// The Hilbert curve index of cell (x, y), computed for all levels at once
+// with a parallel prefix scan over the bits of x and y, rather than one level
+// at a time with branches.
+static sqlite3_uint64 tg_hilbert_key(uint32_t x, uint32_t y, int order) {
+  x <<= 32 - order;
+  y <<= 32 - order;
+
+  uint32_t A, B, C, D;
+  {
+    uint32_t a = x ^ y;
+    uint32_t b = 0xFFFFFFFF ^ a;
+    uint32_t c = 0xFFFFFFFF ^ (x | y);
+    uint32_t d = x & (y ^ 0xFFFFFFFF);
+    A = a | (b >> 1);
+    B = (a >> 1) ^ a;
+    C = ((c >> 1) ^ (b & (d >> 1))) ^ c;
+    D = ((a & (c >> 1)) ^ (d >> 1)) ^ d;
   }
-  tg_geom_free(geom);
+  for (int shift = 2; shift <= 16; shift <<= 1) {
+    uint32_t a = A, b = B, c = C, d = D;
+    if (shift < 16) {
+      A = (a & (a >> shift)) ^ (b & (b >> shift));
+      B = (a & (b >> shift)) ^ (b & ((a ^ b) >> shift));
+    }
+    C ^= (a & (c >> shift)) ^ (b & (d >> shift));
+    D ^= (b & (c >> shift)) ^ ((a ^ b) & (d >> shift));
+  }
+
+  uint32_t a = C ^ (C >> 1);
+  uint32_t b = D ^ (D >> 1);
+  uint32_t i0 = x ^ y;
+  uint32_t i1 = b | (0xFFFFFFFF ^ (i0 | a));
+  return ((tg_curve_spread(i1) << 1) | tg_curve_spread(i0)) >>
+         (64 - 2 * order);
 }
-static void tg_valid_wkt(sqlite3_context *context, int argc,
-                         sqlite3_value **argv) {
-  // TODO it's text/blob?
-  const char *s = (const char *)sqlite3_value_text(argv[0]);
-  int n = sqlite3_value_bytes(argv[0]);
-  struct tg_geom *geom = tg_parse_wktn_ix(s, n, TG_NONE);
-  if (tg_geom_error(geom)) {
-    sqlite3_result_int(context, 0);
-  } else {
-    sqlite3_result_int(context, 1);
+
+// user data of tg_hilbert(), tg_zorder(), and their _xy variants
+struct tg_curve {
+  sqlite3_uint64 (*xKey)(uint32_t x, uint32_t y, int order);
+  // whether the position is given as x, y rather than a geometry
+  int xy;
+};
+
+static const struct tg_curve curveHilbert = {tg_hilbert_key, 0};
+static const struct tg_curve curveHilbertXY = {tg_hilbert_key, 1};
+static const struct tg_curve curveZorder = {tg_zorder_key, 0};
+static const struct tg_curve curveZorderXY = {tg_zorder_key, 1};
+
+// The column of a 2^order grid over [min, max] that v falls in, clamped to
+// the grid.
+static uint32_t tg_curve_cell(double v, double min, double max, int order) {
+  double n = (double)((sqlite3_uint64)1 << order);
+  double t = max > min ? (v - min) / (max - min) * n : 0;
+  if (!(t > 0)) {
+    return 0;
   }
-  tg_geom_free(geom);
+  if (t >= n) {
+    return (uint32_t)(n - 1);
+  }
+  return (uint32_t)t;
 }
-static void tg_valid_wkb(sqlite3_context *context, int argc,
-                         sqlite3_value **argv) {
-  // TODO ensure blob?
-  const void *b = sqlite3_value_blob(argv[0]);
-  int n = sqlite3_value_bytes(argv[0]);
-  struct tg_geom *geom = tg_parse_wkb_ix(b, n, TG_NONE);
-  if (tg_geom_error(geom)) {
-    sqlite3_result_int(context, 0);
+
+// tg_hilbert(geom, bbox, order), tg_zorder(geom, bbox, order), and
+// tg_hilbert_xy(x, y, bbox, order), tg_zorder_xy(x, y, bbox, order). order
+// is optional, and a NULL bbox is the whole world in longitude/latitude.
+static void tg_curve_impl(sqlite3_context *context, int argc,
+                          sqlite3_value **argv) {
+  const struct tg_curve *curve = sqlite3_user_data(context);
+  int iBbox = curve->xy ? 2 : 1;
+  char *errmsg;
+  tg_stats_enter(sqlite3_context_db_handle(context));
+
+  int order = TG_CURVE_DEFAULT_ORDER;
+  if (argc > iBbox + 1) {
+    if (sqlite3_value_type(argv[iBbox + 1]) != SQLITE_INTEGER ||
+        sqlite3_value_int64(argv[iBbox + 1]) < 1 ||
+        sqlite3_value_int64(argv[iBbox + 1]) > TG_CURVE_MAX_ORDER) {
+      sqlite3_result_error(context, "order must be an integer between 1 and 31",
+                           -1);
+      return;
+    }
+    order = sqlite3_value_int(argv[iBbox + 1]);
+  }
+
+  // the extent rarely changes between rows, so keep it parsed
+  struct tg_rect world = {{-180, -90}, {180, 90}};
+  const struct tg_rect *extent = &world;
+  if (sqlite3_value_type(argv[iBbox]) != SQLITE_NULL ||
+      sqlite3_value_pointer(argv[iBbox], TG_GEOM_POINTER_NAME)) {
+    extent = sqlite3_get_auxdata(context, iBbox);
+    if (!extent) {
+      struct tg_geom *bbox;
+      if (geomValue(argv[iBbox], &bbox, &errmsg) != SQLITE_OK) {
+        sqlite3_result_error(context, errmsg, -1);
+        sqlite3_free(errmsg);
+        return;
+      }
+      int empty = tg_geom_is_empty(bbox);
+      struct tg_rect *rect = sqlite3_malloc(sizeof(*rect));
+      if (rect) {
+        *rect = tg_geom_rect(bbox);
+      }
+      tg_geom_free(bbox);
+      if (empty) {
+        sqlite3_free(rect);
+        sqlite3_result_error(context, "bbox must not be empty", -1);
+        return;
+      }
+      if (!rect) {
+        sqlite3_result_error_nomem(context);
+        return;
+      }
+      sqlite3_set_auxdata(context, iBbox, rect, sqlite3_free);
+      extent = sqlite3_get_auxdata(context, iBbox);
+      if (!extent) {
+        sqlite3_result_error_nomem(context);
+        return;
+      }
+    }
+  }
+
+  double x, y;
+  if (curve->xy) {
+    if (sqlite3_value_type(argv[0]) == SQLITE_NULL ||
+        sqlite3_value_type(argv[1]) == SQLITE_NULL) {
+      return;
+    }
+    x = sqlite3_value_double(argv[0]);
+    y = sqlite3_value_double(argv[1]);
+  } else if (sqlite3_value_type(argv[0]) == SQLITE_BLOB &&
+             (wkbPointXY(sqlite3_value_blob(argv[0]),
+                         sqlite3_value_bytes(argv[0]), &x, &y) ||
+              twkbPointXY(sqlite3_value_blob(argv[0]),
+                          sqlite3_value_bytes(argv[0]), &x, &y))) {
+    // POINT EMPTY, which has no position
+    if (isnan(x)) {
+      return;
+    }
   } else {
-    sqlite3_result_int(context, 1);
+    if (sqlite3_value_type(argv[0]) == SQLITE_NULL &&
+        !sqlite3_value_pointer(argv[0], TG_GEOM_POINTER_NAME)) {
+      return;
+    }
+    // the geometry only lives for this call, so parse it into a stack arena
+    sqlite3_uint64 buffer[512];
+    struct tg_arena arena;
+    struct tg_geom *geom = NULL;
+    tg_arena_init(&arena, buffer, sizeof(buffer));
+    tg_arena_begin(&arena);
+    int rc = geomValue(argv[0], &geom, &errmsg);
+    int empty = rc == SQLITE_OK && tg_geom_is_empty(geom);
+    if (rc == SQLITE_OK && !empty) {
+      struct tg_rect rect = tg_geom_rect(geom);
+      x = (rect.min.x + rect.max.x) / 2;
+      y = (rect.min.y + rect.max.y) / 2;
+    }
+    tg_geom_free(geom);
+    tg_arena_end(&arena);
+    if (rc != SQLITE_OK) {
+      sqlite3_result_error(context, errmsg, -1);
+      sqlite3_free(errmsg);
+      return;
+    }
+    // empty geometries have no position
+    if (empty) {
+      return;
+    }
   }
-  tg_geom_free(geom);
+
+  sqlite3_result_int64(
+      context,
+      (sqlite3_int64)curve->xKey(
+          tg_curve_cell(x, extent->min.x, extent->max.x, order),
+          tg_curve_cell(y, extent->min.y, extent->max.y, order), order));
 }
 
 #pragma endregion
 
-#pragma region tg_geom()
+#pragma region validators
 
-static void tg_geom(sqlite3_context *context, int argc, sqlite3_value **argv) {
-  int n = sqlite3_value_bytes(argv[0]);
-  enum tg_index index = TG_NONE;
-  struct tg_geom *geom = NULL;
-  if (argc > 1) {
-    const char *value = (const char *)sqlite3_value_text(argv[1]);
-    if (sqlite3_stricmp("none", value) == 0)
-      index = TG_NONE;
-    else if (sqlite3_stricmp("natural", value) == 0)
-      index = TG_NATURAL;
-    else if (sqlite3_stricmp("ystripes", value) == 0)
-      index = TG_YSTRIPES;
-    else {
-      sqlite3_result_error(
-          context,
-          "unrecognized index option. Should be one of none/natural/ystripes",
-          -1);
-      return;
+// Minimal JSON scanning, just enough to find the boundaries of values without
+// parsing them. Each returns a pointer just past what it skipped, or NULL on
+// malformed or truncated input.
+static const char *tg_json_skip_ws(const char *p, const char *end) {
+  while (p < end && (*p == ' ' || *p == '\t' || *p == '\n' || *p == '\r'))
+    p++;
+  return p;
+}
+
+static const char *tg_json_skip_string(const char *p, const char *end) {
+  if (p >= end || *p != '"')
+    return NULL;
+  for (p++; p < end; p++) {
+    if (*p == '\\') {
+      p++;
+    } else if (*p == '"') {
+      return p + 1;
     }
   }
-  switch (sqlite3_value_type(argv[0])) {
-  case SQLITE_BLOB: {
-    geom = tg_parse_wkb_ix(sqlite3_value_blob(argv[0]), n, index);
-    break;
+  return NULL;
+}
+
+static const char *tg_json_skip_value(const char *p, const char *end) {
+  if (p >= end)
+    return NULL;
+  if (*p == '"')
+    return tg_json_skip_string(p, end);
+  if (*p == '{' || *p == '[') {
+    int depth = 0;
+    while (p < end) {
+      switch (*p) {
+      case '"':
+        p = tg_json_skip_string(p, end);
+        if (!p)
+          return NULL;
+        continue;
+      case '{':
+      case '[':
+        depth++;
+        break;
+      case '}':
+      case ']':
+        if (--depth == 0)
+          return p + 1;
+        break;
+      }
+      p++;
+    }
+    return NULL;
   }
-  case SQLITE_TEXT: {
-    const char *text = (const char *)sqlite3_value_text(argv[0]);
-    if (sqlite3_value_subtype(argv[0]) == JSON_SUBTYPE ||
-        // JSON is many SQL queries don't have a subtype,
-        // so to distinguish between WKT/geojson, see if it
-        // starts with "{", which almost always is geojson
-        (n > 0 && text[0] == '{')) {
-      geom = tg_parse_geojsonn_ix(text, n, index);
+  // numbers, true, false, null
+  const char *start = p;
+  while (p < end && *p != ',' && *p != '}' && *p != ']' && *p != ' ' &&
+         *p != '\t' && *p != '\n' && *p != '\r')
+    p++;
+  return p > start ? p : NULL;
+}
+
+// Finds the member named zKey in the JSON object starting at p. On success
+// *pValue and *pValueEnd bound its value and 1 is returned, 0 if the object
+// has no such member, and -1 if the object is malformed. With a NULL
+// pValueEnd the matched value is not scanned, only where it starts is found,
+// for values such as a FeatureCollection's features that are read piecemeal.
+static int tg_json_object_member(const char *p, const char *end,
+                                 const char *zKey, const char **pValue,
+                                 const char **pValueEnd) {
+  size_t nKey = strlen(zKey);
+  p = tg_json_skip_ws(p, end);
+  if (p >= end || *p != '{')
+    return -1;
+  p = tg_json_skip_ws(p + 1, end);
+  if (p < end && *p == '}')
+    return 0;
+  while (p < end) {
+    const char *key = p;
+    p = tg_json_skip_string(p, end);
+    if (!p)
+      return -1;
+    int match = (size_t)(p - key) == nKey + 2 && memcmp(key + 1, zKey, nKey) == 0;
+    p = tg_json_skip_ws(p, end);
+    if (p >= end || *p != ':')
+      return -1;
+    const char *value = tg_json_skip_ws(p + 1, end);
+    if (match && !pValueEnd) {
+      if (value >= end)
+        return -1;
+      *pValue = value;
+      return 1;
+    }
+    p = tg_json_skip_value(value, end);
+    if (!p)
+      return -1;
+    if (match) {
+      *pValue = value;
+      *pValueEnd = p;
+      return 1;
+    }
+    p = tg_json_skip_ws(p, end);
+    if (p < end && *p == ',') {
+      p = tg_json_skip_ws(p + 1, end);
+    } else if (p < end && *p == '}') {
+      return 0;
     } else {
-      geom = tg_parse_wktn_ix(text, n, index);
+      return -1;
     }
-    break;
-  }
-  default:
-    sqlite3_result_error(context,
-                         "tg_geom() input must be WKT, WKB, or GeoJSON", -1);
-    return;
-  }
-  if (tg_geom_error(geom)) {
-    sqlite3_result_error(context, tg_geom_error(geom), -1);
-    tg_geom_free(geom);
-    return;
   }
-  sqlite3_result_pointer(context, geom, TG_GEOM_POINTER_NAME,
-                         (void (*)(void *))tg_geom_free);
+  return -1;
 }
-static void tg_type(sqlite3_context *context, int argc, sqlite3_value **argv) {
-  struct tg_geom *geom;
-  char * errmsg;
-  int rc = geomValue(argv[0], &geom, &errmsg);
-  if (rc != SQLITE_OK) {
-    sqlite3_result_error(context, errmsg, -1);
-    sqlite3_free(errmsg);
-    return;
-  }
 
-    sqlite3_result_text(context, tg_geom_type_string(tg_geom_typeof(geom)), -1,
-                        SQLITE_STATIC);
+// Validation-only scanners. Each one accepts exactly what the matching tg
+// parser accepts, but walks the input in place: no rings, indexes, coordinate
+// vectors or extra-member copies are built. The first problem found is
+// recorded as a static reason and its byte offset into the input.
+struct validation {
+  const char *input;
+  const char *reason;
+  sqlite3_int64 offset;
+  // set when a GeoJSON scan has to let tg decide, with tg's reason copied
+  int defer;
+  char zFallback[128];
+};
 
-  tg_geom_free(geom);
+static int validationFail(struct validation *v, const char *reason,
+                          const void *at) {
+  v->reason = reason;
+  v->offset = at ? (const char *)at - v->input : -1;
+  return 0;
 }
 
-static void tg_extra_json(sqlite3_context *context, int argc,
-                          sqlite3_value **argv) {
-  struct tg_geom *geom;
-  char * errmsg;
-  int rc = geomValue(argv[0], &geom, &errmsg);
-  if (rc != SQLITE_OK) {
-    sqlite3_result_error(context, errmsg, -1);
-    sqlite3_free(errmsg);
-    return;
-  }
+// The same, for scanners that return dimensions or positions.
+static int validationFailDims(struct validation *v, const char *reason,
+                              const void *at) {
+  validationFail(v, reason, at);
+  return -1;
+}
 
-  const char *result = tg_geom_extra_json(geom);
-  if (result) {
-    // TODO what if null character in json?
-    sqlite3_result_text(context, result, -1, SQLITE_TRANSIENT);
-    sqlite3_result_subtype(context, JSON_SUBTYPE);
-  } else {
-    sqlite3_result_null(context);
-  }
+static const unsigned char *jsonValidationFail(struct validation *v,
+                                               const void *at) {
+  validationFail(v, "invalid json", at);
+  return NULL;
+}
 
-  tg_geom_free(geom);
+// tg's MAXDEPTH, for nesting of geometries and JSON values
+#define VALIDATE_MAXDEPTH 1024
+
+#define VALIDATE_BASE_POINT 0
+#define VALIDATE_BASE_LINE 1
+#define VALIDATE_BASE_RING 2
+
+static uint32_t wkbReadU32(const unsigned char *b, int le) {
+  return le ? (uint32_t)b[0] | ((uint32_t)b[1] << 8) | ((uint32_t)b[2] << 16) |
+                  ((uint32_t)b[3] << 24)
+            : (uint32_t)b[3] | ((uint32_t)b[2] << 8) | ((uint32_t)b[1] << 16) |
+                  ((uint32_t)b[0] << 24);
 }
-#pragma endregion
 
-#pragma region constructors
+static double wkbReadDouble(const unsigned char *b, int le) {
+  uint64_t x = 0;
+  for (int k = 0; k < 8; k++)
+    x |= (uint64_t)b[le ? k : 7 - k] << (8 * k);
+  double d;
+  memcpy(&d, &x, sizeof(d));
+  return d;
+}
 
-static void tg_point(sqlite3_context *context, int argc, sqlite3_value **argv) {
-  int typeX = sqlite3_value_type(argv[0]);
-  int typeY = sqlite3_value_type(argv[1]);
-  if (typeX != SQLITE_INTEGER && typeX != SQLITE_FLOAT) {
-    sqlite3_result_error(context, "point X value must be an integer or float",
-                         -1);
-    return;
-  }
-  if (typeY != SQLITE_INTEGER && typeY != SQLITE_FLOAT) {
-    sqlite3_result_error(context, "point Y value must be an integer or float",
-                         -1);
-    return;
+// A run of positions: a line, a ring, or nothing at all when the count is 0.
+static int wkbValidatePosns(const unsigned char *b, size_t n, size_t *pi,
+                            int le, int dims, int base, uint32_t *pCount,
+                            struct validation *v) {
+  size_t i = *pi;
+  if (n - i < 4)
+    return validationFail(v, "invalid binary", b + i);
+  uint32_t count = wkbReadU32(b + i, le);
+  i += 4;
+  *pCount = count;
+  if (count == 0) {
+    *pi = i;
+    return 1;
   }
-  double x = sqlite3_value_double(argv[0]);
-  double y = sqlite3_value_double(argv[1]);
-  struct tg_point point = {x, y};
-  struct tg_geom *geom = tg_geom_new_point(point);
-  if (tg_geom_error(geom)) {
-    sqlite3_result_error(context, tg_geom_error(geom), -1);
-    tg_geom_free(geom);
-    return;
+  size_t point = 8 * (size_t)dims;
+  if ((n - i) / point < count)
+    return validationFail(v, "invalid binary", b + n);
+  const unsigned char *first = b + i;
+  const unsigned char *last = b + i + (count - 1) * point;
+  if (base == VALIDATE_BASE_LINE && count < 2)
+    return validationFail(v, "lines must have two or more positions", first);
+  if (base == VALIDATE_BASE_RING) {
+    if (count < 3)
+      return validationFail(v, "rings must have three or more positions",
+                            first);
+    if (!(wkbReadDouble(first, le) == wkbReadDouble(last, le) &&
+          wkbReadDouble(first + 8, le) == wkbReadDouble(last + 8, le)))
+      return validationFail(
+          v, "rings must have matching first and last positions", last);
   }
-  resultGeomPointer(context, geom);
+  *pi = i + count * point;
+  return 1;
 }
 
-static void tg_poly_exterior_(sqlite3_context *context, int argc,
-                          sqlite3_value **argv) {
-  struct tg_geom *geom;
-  char * errmsg;
-  int rc = geomValue(argv[0], &geom, &errmsg);
-  if (rc != SQLITE_OK) {
-    sqlite3_result_error(context, errmsg, -1);
-    sqlite3_free(errmsg);
-    return;
+// Mirrors tg's parse_wkb(). *pType, *pZ and *pM describe the geometry the way
+// tg would flag it, which matters for the child checks of Multi* types: an
+// empty point, line or polygon never carries Z or M.
+static int wkbValidateGeom(const unsigned char *b, size_t n, size_t *pi,
+                           int depth, int *pType, int *pZ, int *pM,
+                           struct validation *v) {
+  size_t i = *pi;
+  const unsigned char *start = b + i;
+  if (i == n || (b[i] >> 1) || depth > VALIDATE_MAXDEPTH)
+    return validationFail(v, "invalid binary", start);
+  int le = b[i] == 1;
+  i++;
+  if (n - i < 4)
+    return validationFail(v, "invalid binary", b + i);
+  uint32_t type = wkbReadU32(b + i, le);
+  i += 4;
+  if (type & 0x20000000) {
+    // skip the EWKB SRID
+    if (n - i < 4)
+      return validationFail(v, "invalid binary", b + i);
+    i += 4;
   }
-  const struct tg_poly * p = tg_geom_poly(geom);
-  if(!p) {
-    sqlite3_result_error(context, "argument to tg_poly_exterior() is not a polygon", -1);
-    tg_geom_free(geom);
-    return;
+  type &= 0xFFFF;
+  if (type >= 4000 || type % 1000 == 0 || type % 1000 > 7)
+    return validationFail(v, "invalid type", start);
+  int z = type / 1000 == 1 || type / 1000 == 3;
+  int m = type / 1000 >= 2;
+  int dims = 2 + z + m;
+  type %= 1000;
+  uint32_t count;
+  switch (type) {
+  case TG_POINT: {
+    size_t point = 8 * (size_t)dims;
+    if (n - i < point)
+      return validationFail(v, "invalid binary", b + n);
+    int empty = 1;
+    for (int k = 0; k < dims; k++) {
+      double d = wkbReadDouble(b + i + 8 * k, le);
+      if (d == d) {
+        empty = 0;
+        break;
+      }
+    }
+    if (empty)
+      z = m = 0;
+    i += point;
+    break;
   }
-  const struct tg_ring *ring = tg_poly_exterior(p);
-  // "A tg_ring can always be safely upcasted to a tg_poly or tg_geom"
-  // clone (rc increment) so the ring outlives its parent geom
-  resultGeomPointer(context, (struct tg_geom*) tg_ring_clone(ring));
-  tg_geom_free(geom);
-}
-
-static void tg_multipoint(sqlite3_context *context, int argc,
-                          sqlite3_value **argv) {
-  if (argc == 0) {
-    struct tg_geom *geom = tg_geom_new_multipoint_empty();
-    if (!geom) {
-      sqlite3_result_error_nomem(context);
-    } else {
-      resultGeomPointer(context, geom);
+  case TG_LINESTRING:
+    if (!wkbValidatePosns(b, n, &i, le, dims, VALIDATE_BASE_LINE, &count, v))
+      return 0;
+    if (count == 0)
+      z = m = 0;
+    break;
+  case TG_POLYGON: {
+    if (n - i < 4)
+      return validationFail(v, "invalid binary", b + i);
+    uint32_t nRings = wkbReadU32(b + i, le);
+    i += 4;
+    for (uint32_t r = 0; r < nRings; r++) {
+      if (!wkbValidatePosns(b, n, &i, le, dims, VALIDATE_BASE_RING, &count,
+                            v))
+        return 0;
     }
-    return;
-  }
-
-  struct tg_point *points = sqlite3_malloc(argc * sizeof(struct tg_point));
-  if (!points) {
-    sqlite3_result_error_nomem(context);
-    return;
+    if (nRings == 0)
+      z = m = 0;
+    break;
   }
-  memset(points, 0, argc * sizeof(struct tg_point));
-
-  for (int i = 0; i < argc; i++) {
-    struct tg_geom *geom;
-    char * errmsg;
-    int rc = geomValue(argv[i], &geom, &errmsg);
-    if (rc != SQLITE_OK) {
-      const char *zErr = sqlite3_mprintf(
-          "argument to tg_multipoint() at index %i is an invalid geometry: %z",
-          i, errmsg);
-      sqlite3_result_error(context, zErr, -1);
-      sqlite3_free((void *)zErr);
-      sqlite3_free(points);
-      return;
-    }
-
-    if (tg_geom_typeof(geom) != TG_POINT) {
-      const char *zErr = sqlite3_mprintf(
-          "argument to tg_multipoint() at index %i expected a point, found %s",
-          i, tg_geom_type_string(tg_geom_typeof(geom)));
-      sqlite3_result_error(context, zErr, -1);
-      sqlite3_free((void *)zErr);
-      tg_geom_free(geom);
-      sqlite3_free(points);
-      return;
+  default: {
+    if (n - i < 4)
+      return validationFail(v, "invalid binary", b + i);
+    uint32_t nGeoms = wkbReadU32(b + i, le);
+    i += 4;
+    for (uint32_t g = 0; g < nGeoms; g++) {
+      const unsigned char *child = b + i;
+      int childType, childZ, childM;
+      if (!wkbValidateGeom(b, n, &i, depth + 1, &childType, &childZ, &childM,
+                           v))
+        return 0;
+      // MultiPoint, MultiLineString and MultiPolygon hold only their own base
+      // type, with the same dimensions
+      if (type != TG_GEOMETRYCOLLECTION &&
+          (childType != (int)type - 3 || childZ != z || childM != m))
+        return validationFail(v, "invalid child type", child);
     }
-    struct tg_point src = tg_geom_point(geom);
-    struct tg_point *dest = &points[i];
-    dest->x = src.x;
-    dest->y = src.y;
-    tg_geom_free(geom);
+    break;
   }
-  struct tg_geom *geom = tg_geom_new_multipoint(points, argc);
-  if (!geom) {
-    sqlite3_result_error_nomem(context);
-  } else {
-    resultGeomPointer(context, geom);
   }
-  sqlite3_free(points);
+  *pType = type;
+  *pZ = z;
+  *pM = m;
+  *pi = i;
+  return 1;
 }
 
-static void tg_line(sqlite3_context *context, int argc,
-                          sqlite3_value **argv) {
-  if (argc == 0) {
-    struct tg_geom *geom = tg_geom_new_linestring_empty();
-    if (!geom) {
-      sqlite3_result_error_nomem(context);
-    } else {
-      resultGeomPointer(context, geom);
-    }
-    return;
+// Trailing bytes after the geometry are allowed, like tg_parse_wkb().
+static int wkbValidate(const void *wkb, size_t n, struct validation *v) {
+  size_t i = 0;
+  int type, z, m;
+  v->input = wkb;
+  return wkbValidateGeom(wkb, n, &i, 0, &type, &z, &m, v);
+}
+
+// Reads a varint like twkbVarint(), failing at its first byte.
+static int twkbValidateVarint(const unsigned char *b, size_t n, size_t *pi,
+                              sqlite3_uint64 *pValue, struct validation *v) {
+  if (!twkbVarint(b, n, pi, pValue))
+    return validationFail(v, "invalid varint", b + *pi);
+  return 1;
+}
+
+// A count of items that each take at least min bytes, like twkbReadCount().
+static int twkbValidateCount(const unsigned char *b, size_t n, size_t *pi,
+                             int min, sqlite3_uint64 *pCount,
+                             struct validation *v) {
+  const unsigned char *at = b + *pi;
+  if (!twkbValidateVarint(b, n, pi, pCount, v))
+    return 0;
+  if (*pCount > (n - *pi) / min)
+    return validationFail(v, "count exceeds the input", at);
+  return 1;
+}
+
+// count vertices of dims varints each.
+static int twkbValidatePoints(const unsigned char *b, size_t n, size_t *pi,
+                              sqlite3_uint64 count, int dims,
+                              struct validation *v) {
+  sqlite3_uint64 zz;
+  for (sqlite3_uint64 k = 0; k < count * dims; k++) {
+    if (!twkbValidateVarint(b, n, pi, &zz, v))
+      return 0;
   }
+  return 1;
+}
 
-  struct tg_point *points = sqlite3_malloc(argc * sizeof(struct tg_point));
-  if (!points) {
-    sqlite3_result_error_nomem(context);
-    return;
+static int twkbValidateRings(const unsigned char *b, size_t n, size_t *pi,
+                             int dims, struct validation *v) {
+  const unsigned char *at = b + *pi;
+  sqlite3_uint64 nRings, nPoints;
+  if (!twkbValidateCount(b, n, pi, 1, &nRings, v))
+    return 0;
+  if (nRings == 0)
+    return validationFail(v, "polygon has no rings", at);
+  for (sqlite3_uint64 k = 0; k < nRings; k++) {
+    if (!twkbValidateCount(b, n, pi, dims, &nPoints, v) ||
+        !twkbValidatePoints(b, n, pi, nPoints, dims, v))
+      return 0;
   }
-  memset(points, 0, argc * sizeof(struct tg_point));
+  return 1;
+}
 
-  for (int i = 0; i < argc; i++) {
-    struct tg_geom *geom;
-    char * errmsg;
-    int rc = geomValue(argv[i], &geom, &errmsg);
-    if (rc != SQLITE_OK) {
-      const char *zErr = sqlite3_mprintf(
-          "argument to tg_line() at index %i is an invalid geometry: %z",
-          i, errmsg);
-      sqlite3_result_error(context, zErr, -1);
-      sqlite3_free((void *)zErr);
-      sqlite3_free(points);
-      return;
-    }
+// Mirrors twkbReadGeom().
+static int twkbValidateGeom(const unsigned char *b, size_t n, size_t *pi,
+                            int depth, struct validation *v) {
+  const unsigned char *at = b + *pi;
+  if (depth > TWKB_MAX_DEPTH)
+    return validationFail(v, "nesting too deep", at);
+  if (n - *pi < 2)
+    return validationFail(v, "truncated header", at);
+  unsigned char header = b[(*pi)++];
+  unsigned char meta = b[(*pi)++];
+  int type = header & 0x0f;
+  if (type < TG_POINT || type > TG_GEOMETRYCOLLECTION)
+    return validationFail(v, "invalid geometry type", at);
+  int dims = 2;
+  if (meta & TWKB_HAS_EXTENDED_DIMS) {
+    if (*pi >= n)
+      return validationFail(v, "truncated header", at);
+    unsigned char ext = b[(*pi)++];
+    dims += (ext & 1) + ((ext >> 1) & 1);
+  }
+  sqlite3_uint64 skipped, count;
+  if ((meta & TWKB_HAS_SIZE) && !twkbValidateVarint(b, n, pi, &skipped, v))
+    return 0;
+  for (int k = 0; (meta & TWKB_HAS_BBOX) && k < 2 * dims; k++) {
+    if (!twkbValidateVarint(b, n, pi, &skipped, v))
+      return 0;
+  }
+  if (meta & TWKB_IS_EMPTY)
+    return 1;
 
-    if (tg_geom_typeof(geom) != TG_POINT) {
-      const char *zErr = sqlite3_mprintf(
-          "argument to tg_line() at index %i expected a point, found %s",
-          i, tg_geom_type_string(tg_geom_typeof(geom)));
-      sqlite3_result_error(context, zErr, -1);
-      sqlite3_free((void *)zErr);
-      tg_geom_free(geom);
-      sqlite3_free(points);
-      return;
-    }
-    struct tg_point src = tg_geom_point(geom);
-    struct tg_point *dest = &points[i];
-    dest->x = src.x;
-    dest->y = src.y;
-    tg_geom_free(geom);
+  switch (type) {
+  case TG_POINT:
+    return twkbValidatePoints(b, n, pi, 1, dims, v);
+  case TG_LINESTRING:
+    return twkbValidateCount(b, n, pi, dims, &count, v) &&
+           twkbValidatePoints(b, n, pi, count, dims, v);
+  case TG_POLYGON:
+    return twkbValidateRings(b, n, pi, dims, v);
   }
-  struct tg_geom *geom = (struct tg_geom *) tg_line_new(points, argc);
-  if (!geom) {
-    sqlite3_result_error_nomem(context);
-  } else {
-    resultGeomPointer(context, geom);
+  if (!twkbValidateCount(b, n, pi, type == TG_MULTIPOINT ? dims : 1, &count,
+                         v))
+    return 0;
+  for (sqlite3_uint64 k = 0; (meta & TWKB_HAS_IDLIST) && k < count; k++) {
+    if (!twkbValidateVarint(b, n, pi, &skipped, v))
+      return 0;
   }
-  sqlite3_free(points);
+  if (type == TG_MULTIPOINT)
+    return twkbValidatePoints(b, n, pi, count, dims, v);
+  for (sqlite3_uint64 k = 0; k < count; k++) {
+    sqlite3_uint64 nPoints;
+    int ok = type == TG_MULTILINESTRING
+                 ? twkbValidateCount(b, n, pi, dims, &nPoints, v) &&
+                       twkbValidatePoints(b, n, pi, nPoints, dims, v)
+             : type == TG_MULTIPOLYGON
+                 ? twkbValidateRings(b, n, pi, dims, v)
+                 : twkbValidateGeom(b, n, pi, depth + 1, v);
+    if (!ok)
+      return 0;
+  }
+  return 1;
 }
 
-struct Array {
-  size_t element_size;
-  size_t length;
-  size_t capacity;
-  void *z;
-};
+// Unlike WKB, trailing bytes after the geometry are an error, as in
+// twkbParse().
+static int twkbValidate(const void *twkb, size_t n, struct validation *v) {
+  size_t i = 0;
+  v->input = twkb;
+  if (!twkbValidateGeom(twkb, n, &i, 0, v))
+    return 0;
+  if (i != n)
+    return validationFail(v, "trailing bytes", (const unsigned char *)twkb + i);
+  return 1;
+}
 
-int tg_array_init(struct Array *array, size_t element_size, size_t init_capacity) {
-  int sz = element_size * init_capacity;
-  void *z = sqlite3_malloc(sz);
-  if (!z) {
-    return SQLITE_NOMEM;
-  }
-  memset(z, 0, sz);
+// Accepts what parseBlob() accepts: TWKB for blobs that can't be WKB, and
+// blobs starting with 1 as TWKB when they aren't valid WKB. Reasons are WKB's
+// unless the blob can only be TWKB.
+static int blobValidate(const unsigned char *b, size_t n,
+                        struct validation *v) {
+  if (n > 0 && b[0] > 1)
+    return twkbValidate(b, n, v);
+  if (wkbValidate(b, n, v))
+    return 1;
+  struct validation twkb;
+  return n > 0 && b[0] == 1 && twkbValidate(b, n, &twkb);
+}
 
-  array->element_size = element_size;
-  array->length = 0;
-  array->capacity = init_capacity;
-  array->z = z;
-  return SQLITE_OK;
+static int wktIsWs(char c) {
+  return c == ' ' || c == '\t' || c == '\n' || c == '\r';
 }
 
-int tg_array_append(struct Array *array, const void *element) {
-  if (array->length == array->capacity) {
-    size_t new_capacity = array->capacity * 2 + 100;
-    void *z = sqlite3_realloc64(array->z, array->element_size * new_capacity);
-    if (z) {
-      array->capacity = new_capacity;
-      array->z = z;
+static long wktTrimWs(const char *wkt, long len, long i) {
+  while (i < len && wktIsWs(wkt[i]))
+    i++;
+  return i;
+}
+
+// Mirrors tg's wkt2type(): the geometry type, 0 when missing, -1 for a bad
+// Z/M/EMPTY specifier and below that an unknown type name.
+static int wktType(const char *wkt, long len, int *z, int *m, int *empty) {
+  *z = *m = *empty = 0;
+  char name[32];
+  long i = 0;
+  long j = 0;
+  int nws = 0;
+  for (; i < len; i++) {
+    if (j == sizeof(name) - 1)
+      goto bad_type;
+    if (wktIsWs(wkt[i])) {
+      if (j > 0 && name[j - 1] == ' ')
+        continue;
+      name[j] = ' ';
+      if (++nws > 2)
+        return -1;
+    } else if (wkt[i] >= 'a' && wkt[i] <= 'z') {
+      name[j] = wkt[i] - 32;
     } else {
-      return SQLITE_NOMEM;
+      name[j] = wkt[i];
     }
+    j++;
   }
-  memcpy(&((unsigned char *)array->z)[array->length * array->element_size],
-         element, array->element_size);
-  array->length++;
-  return SQLITE_OK;
+  name[j] = '\0';
+  if (j > 6 && strcmp(name + j - 6, " EMPTY") == 0) {
+    j -= 6;
+    name[j] = '\0';
+    *empty = 1;
+  }
+  if (j > 3) {
+    if (name[j - 2] == 'Z' && name[j - 1] == 'M') {
+      j -= 2;
+      *z = *m = 1;
+    } else if (name[j - 1] == 'Z') {
+      j -= 1;
+      *z = 1;
+    } else if (name[j - 1] == 'M') {
+      j -= 1;
+      *m = 1;
+    }
+    if (name[j - 1] == ' ')
+      j -= 1;
+    name[j] = '\0';
+  }
+  if (j == 0)
+    return 0;
+  if (!strcmp(name, "POINT"))
+    return TG_POINT;
+  if (!strcmp(name, "LINESTRING"))
+    return TG_LINESTRING;
+  if (!strcmp(name, "POLYGON"))
+    return TG_POLYGON;
+  if (!strcmp(name, "MULTIPOINT"))
+    return TG_MULTIPOINT;
+  if (!strcmp(name, "MULTILINESTRING"))
+    return TG_MULTILINESTRING;
+  if (!strcmp(name, "MULTIPOLYGON"))
+    return TG_MULTIPOLYGON;
+  if (!strcmp(name, "GEOMETRYCOLLECTION"))
+    return TG_GEOMETRYCOLLECTION;
+  if (strchr(name, ' '))
+    return -1;
+bad_type:
+  return -2;
 }
 
-void tg_array_cleanup(struct Array *array) {
-  if (!array)
-    return;
-  array->element_size = 0;
-  array->length = 0;
-  array->capacity = 0;
-  sqlite3_free(array->z);
-  array->z = NULL;
+// The end of the parenthesized group starting at i, or a negative value when
+// it is unbalanced. Like tg, every '(' in the group counts towards the limit.
+static long wktBalance(const char *wkt, long len, long i) {
+  long depth = 1;
+  long opened = 1;
+  for (i++; i < len; i++) {
+    if (wkt[i] == '(') {
+      depth++;
+      opened++;
+    } else if (wkt[i] == ')' && --depth == 0) {
+      return opened > VALIDATE_MAXDEPTH ? -(i + 1) : i + 1;
+    }
+  }
+  return -(i + 1);
 }
 
-#pragma region tg_group_multipoint
-static void tg_group_multipoint_step(sqlite3_context *context, int argc,
-                               sqlite3_value *argv[]) {
-
-  int rc;
-  struct Array *array;
-  array = (struct Array *)sqlite3_aggregate_context(context, sizeof(*array));
-  if (!array) {
-    return;
+// Mirrors tg's wkt_vnumber(). Returns the end of the number at i, or -(pos+1)
+// of the offending character.
+static long wktNumber(const char *data, long dlen, long i) {
+  if (data[i] == '-') {
+    i++;
+    if (i == dlen)
+      return -(i + 1);
   }
-  if(!array->z) {
-    rc = tg_array_init(array, sizeof(struct tg_point), 128);
-    if(rc!=SQLITE_OK) {
-      sqlite3_result_error_nomem(context);
-      return;
-    }
+  if ((data[i] < '0' || data[i] > '9') && data[i] != '.')
+    return -(i + 1);
+  while (i < dlen && data[i] >= '0' && data[i] <= '9')
+    i++;
+  if (i == dlen)
+    return i;
+  if (data[i] == '.') {
+    i++;
+    if (i == dlen || data[i] < '0' || data[i] > '9')
+      return -(i + 1);
+    while (i < dlen && data[i] >= '0' && data[i] <= '9')
+      i++;
   }
-
-  struct tg_geom *geom;
-  char * errmsg;
-  rc = geomValue(argv[0], &geom, &errmsg);
-  if (rc != SQLITE_OK) {
-    sqlite3_result_error(context, errmsg, -1);
-    sqlite3_free(errmsg);
-    return;
+  if (i == dlen)
+    return i;
+  if (data[i] == 'e' || data[i] == 'E') {
+    i++;
+    if (i == dlen)
+      return -(i + 1);
+    if (data[i] == '+' || data[i] == '-')
+      i++;
+    if (i == dlen || data[i] < '0' || data[i] > '9')
+      return -(i + 1);
+    while (i < dlen && data[i] >= '0' && data[i] <= '9')
+      i++;
   }
+  return i;
+}
 
-  if (tg_geom_typeof(geom) != TG_POINT) {
-    sqlite3_result_error(
-        context, "parameters to tg_group_multipoint() must be Point gemetries",
-        -1);
-    tg_geom_free(geom);
-    return;
+static const char *wktPosnError(int dims) {
+  switch (dims) {
+  case 2:
+    return "each position must have two numbers";
+  case 3:
+    return "each position must have three numbers";
+  case 4:
+    return "each position must have four numbers";
+  default:
+    return "each position must have two to four numbers";
   }
+}
 
-  struct tg_point src = tg_geom_point(geom);
-  tg_array_append(array, &src);
-  tg_geom_free(geom);
+static int wktValidatePoint(const char *wkt, long len, int z, int m,
+                            struct validation *v) {
+  int dims = z ? m ? 4 : 3 : m ? 3 : 0;
+  int pdims = 0;
+  long i = wktTrimWs(wkt, len, 0);
+  if (i == len)
+    return validationFail(v, wktPosnError(dims), wkt + i);
+  while (1) {
+    long s = i;
+    if ((i = wktNumber(wkt, len, i)) < 0)
+      return validationFail(v, "invalid number", wkt + s);
+    if (pdims == 4)
+      return validationFail(v, wktPosnError(dims), wkt + s);
+    pdims++;
+    if (i == len)
+      break;
+    if (!wktIsWs(wkt[i]))
+      return validationFail(v, "invalid number", wkt + i);
+    if ((i = wktTrimWs(wkt, len, i)) == len)
+      break;
+  }
+  if (dims == 0 ? pdims < 2 : pdims != dims)
+    return validationFail(v, wktPosnError(dims), wkt);
+  return 1;
 }
 
-static void tg_group_multipoint_final(sqlite3_context *context) {
-  struct Array *a;
-  a = (struct Array *)sqlite3_aggregate_context(context, sizeof(*a));
-  if (a == 0) {
-    return;
+// Mirrors tg's parse_wkt_posns(). Returns the dimensions of the positions, or
+// -1 when invalid. Only the first and last positions are converted to doubles,
+// for the ring closure check.
+static int wktValidatePosns(int base, int dims, const char *wkt, long len,
+                            struct validation *v) {
+  long npoints = 0;
+  long firstX = 0, firstY = 0, lastX = 0, lastY = 0;
+  long i = wktTrimWs(wkt, len, 0);
+  // 'MULTIPOINT ((1 2),(3 4))' is not standard, but must be supported
+  int xparens = i < len && base == VALIDATE_BASE_POINT && wkt[i] == '(';
+  while (i < len) {
+    if (xparens) {
+      if (wkt[i] != '(')
+        return validationFailDims(v, "expected '('", wkt + i);
+      i = wktTrimWs(wkt, len, i + 1);
+    }
+    long posn = i;
+    long x = 0, y = 0;
+    int pdims = 0;
+    while (i < len) {
+      if (wkt[i] != '-' && (wkt[i] < '0' || wkt[i] > '9'))
+        return validationFailDims(v, "expected a number", wkt + i);
+      long s = i;
+      if ((i = wktNumber(wkt, len, i)) < 0)
+        return validationFailDims(v, "invalid number", wkt + s);
+      if (pdims == 4)
+        return validationFailDims(v, wktPosnError(dims), wkt + posn);
+      if (pdims == 0)
+        x = s;
+      else if (pdims == 1)
+        y = s;
+      pdims++;
+      if (i == len || !wktIsWs(wkt[i]))
+        break;
+      if ((i = wktTrimWs(wkt, len, i + 1)) == len)
+        break;
+      if (wkt[i] == ')' || wkt[i] == ',')
+        break;
+    }
+    if (xparens) {
+      if (i == len || wkt[i] != ')')
+        return validationFailDims(v, "expected ')'", wkt + i);
+      i = wktTrimWs(wkt, len, i + 1);
+    }
+    if (i < len) {
+      if (wkt[i] != ',')
+        return validationFailDims(v, "expected ','", wkt + i);
+      i = wktTrimWs(wkt, len, i + 1);
+      if (i == len)
+        return validationFailDims(v, "expected position, got end of stream",
+                              wkt + i);
+    }
+    if (dims != pdims) {
+      if (dims == 0 && pdims >= 2)
+        dims = pdims;
+      else
+        return validationFailDims(v, wktPosnError(dims), wkt + posn);
+    }
+    if (npoints++ == 0) {
+      firstX = x;
+      firstY = y;
+    }
+    lastX = x;
+    lastY = y;
   }
-  if (a->z == 0) {
-    // TODO check if null?
-    resultGeomPointer(context, tg_geom_new_multipoint_empty());
-    return;
+  if (base == VALIDATE_BASE_LINE && npoints < 2)
+    return validationFailDims(v, "lines must have two or more positions", wkt);
+  if (base == VALIDATE_BASE_RING) {
+    if (npoints < 3)
+      return validationFailDims(v, "rings must have three or more positions",
+                            wkt);
+    // the same conversion tg uses, so closure compares identical doubles
+    if (!(strtod(wkt + firstX, NULL) == strtod(wkt + lastX, NULL) &&
+          strtod(wkt + firstY, NULL) == strtod(wkt + lastY, NULL)))
+      return validationFailDims(
+                 v, "rings must have matching first and last positions",
+                 wkt + lastX);
   }
-  if (a->length) {
-    struct tg_geom *geom = tg_geom_new_multipoint((struct tg_point *) a->z, a->length);
-    if (!geom) {
-      sqlite3_result_error_nomem(context);
-    } else {
-      resultGeomPointer(context, geom);
-    }
+  return dims;
+}
+
+// Mirrors tg's parse_wkt_multi_posns(): the rings of one polygon.
+static int wktValidateRings(int dims, const char *wkt, long len,
+                            struct validation *v) {
+  long nrings = 0;
+  long i = wktTrimWs(wkt, len, 0);
+  while (i < len) {
+    if (wkt[i] != '(')
+      return validationFailDims(v, "expected '('", wkt + i);
+    long j = wktBalance(wkt, len, i);
+    if (j < 0)
+      return validationFailDims(v, "unbalanced '()'", wkt + i);
+    dims = wktValidatePosns(VALIDATE_BASE_RING, dims, wkt + i + 1, j - i - 2,
+                            v);
+    if (dims == -1)
+      return -1;
+    nrings++;
+    i = wktTrimWs(wkt, len, j);
+    if (i == len)
+      break;
+    if (wkt[i] != ',')
+      return validationFailDims(v, "expected ','", wkt + i);
+    i = wktTrimWs(wkt, len, i + 1);
+    if (i == len)
+      return validationFailDims(v, "expected '(', got end of stream", wkt + i);
   }
-  tg_array_cleanup(a);
+  if (nrings == 0)
+    return validationFailDims(v, "polygons must have one or more rings", wkt);
+  return dims;
 }
 
-static void tg_group_bbox_step(sqlite3_context *context, int argc, sqlite3_value *argv[]) {
-  int rc;
-  struct tg_rect* rect;
-  rect = (struct tg_rect *)sqlite3_aggregate_context(context, sizeof(*rect));
-  if (!rect) {
-    return;
+// MultiLineString and MultiPolygon bodies: comma separated groups, with the
+// dimensions of the first position carried through all of them.
+static int wktValidateGroups(int base, int dims, const char *wkt, long len,
+                             struct validation *v) {
+  long i = wktTrimWs(wkt, len, 0);
+  while (i < len) {
+    if (wkt[i] != '(')
+      return validationFail(v, "expected '('", wkt + i);
+    long j = wktBalance(wkt, len, i);
+    if (j < 0)
+      return validationFail(v, "unbalanced '()'", wkt + i);
+    if (base == VALIDATE_BASE_RING)
+      dims = wktValidateRings(dims, wkt + i + 1, j - i - 2, v);
+    else
+      dims = wktValidatePosns(base, dims, wkt + i + 1, j - i - 2, v);
+    if (dims == -1)
+      return 0;
+    i = wktTrimWs(wkt, len, j);
+    if (i == len)
+      break;
+    if (wkt[i] != ',')
+      return validationFail(v, "expected ','", wkt + i);
+    i = wktTrimWs(wkt, len, i + 1);
+    if (i == len)
+      return validationFail(v, "expected '('", wkt + i);
   }
+  return 1;
+}
 
-  struct tg_geom *geom;
-  char * errmsg;
-  rc = geomValue(argv[0], &geom, &errmsg);
-  if (rc != SQLITE_OK) {
-    sqlite3_result_error(context, errmsg, -1);
-    sqlite3_free(errmsg);
-    return;
+static int wktValidateGeom(const char *wkt, long len, struct validation *v);
+
+// Mirrors tg's parse_wkt_geometrycollection(), including how it splits
+// children at top-level commas and requires one child per comma plus one.
+static int wktValidateCollection(const char *wkt, long len,
+                                 struct validation *v) {
+  long i = 0;
+  long commas = 0;
+  long ngeoms = 0;
+  while (i < len) {
+    long s = i;
+    for (; i < len; i++) {
+      if (wkt[i] == ',')
+        break;
+      if (wkt[i] == '(') {
+        i = wktBalance(wkt, len, i);
+        if (i < 0)
+          return validationFail(v, "unbalanced '()'", wkt + s);
+        break;
+      }
+    }
+    if (i - s > 0) {
+      if (!wktValidateGeom(wkt + s, i - s, v))
+        return 0;
+      ngeoms++;
+    }
+    i = wktTrimWs(wkt, len, i);
+    if (i == len)
+      break;
+    if (wkt[i] != ',')
+      return validationFail(v, "expected ','", wkt + i);
+    commas++;
+    i++;
   }
-  struct tg_rect current = tg_geom_rect(geom);
-  // See if this is the first geometry for the bbox, which would be zero'ed out
-  if(!rect->min.x && !rect->min.y && !rect->max.x && !rect->max.y) {
-    memcpy(rect, &current, sizeof(*rect));
+  if (commas + 1 != ngeoms)
+    return validationFail(v, "missing type", wkt + i);
+  return 1;
+}
+
+// Mirrors tg's parse_wkt().
+static int wktValidateGeom(const char *wkt, long len, struct validation *v) {
+  if (len == 0)
+    return validationFail(v, "missing type", wkt);
+  long i = wktTrimWs(wkt, len, 0);
+  long s = i;
+  while (i < len && wkt[i] != '(')
+    i++;
+  long e = i;
+  while (e - 1 > s && wktIsWs(wkt[e - 1]))
+    e--;
+  int z, m, empty;
+  int type = wktType(wkt + s, e - s, &z, &m, &empty);
+  if (type == 0)
+    return validationFail(v, "missing type", wkt + s);
+  if (type == -1)
+    return validationFail(
+        v, "invalid type specifier, expected 'Z', 'M', 'ZM', or 'EMPTY'",
+        wkt + s);
+  if (type < 0)
+    return validationFail(v, "unknown type", wkt + s);
+  if (empty)
+    return 1;
+  if (i == len)
+    return validationFail(v, "expected '('", wkt + i);
+  long j = wktBalance(wkt, len, i);
+  if (j <= 0)
+    return validationFail(v, "unbalanced '()'", wkt + i);
+  for (long k = j; k < len; k++) {
+    if (!wktIsWs(wkt[k]))
+      return validationFail(v, "too much data after last ')'", wkt + k);
   }
-  else {
-    struct tg_rect result = tg_rect_expand(*rect, current);
-    memcpy(rect, &result, sizeof(*rect));
+  const char *body = wkt + i + 1;
+  long n = j - i - 2;
+  int dims = z ? m ? 4 : 3 : m ? 3 : 0;
+  switch (type) {
+  case TG_POINT:
+    return wktValidatePoint(body, n, z, m, v);
+  case TG_LINESTRING:
+    return wktValidatePosns(VALIDATE_BASE_LINE, dims, body, n, v) != -1;
+  case TG_POLYGON:
+    return wktValidateRings(dims, body, n, v) != -1;
+  case TG_MULTIPOINT:
+    return wktValidatePosns(VALIDATE_BASE_POINT, dims, body, n, v) != -1;
+  case TG_MULTILINESTRING:
+    return wktValidateGroups(VALIDATE_BASE_LINE, dims, body, n, v);
+  case TG_MULTIPOLYGON:
+    return wktValidateGroups(VALIDATE_BASE_RING, dims, body, n, v);
+  default:
+    return wktValidateCollection(body, n, v);
   }
-  tg_geom_free(geom);  
 }
 
-static void tg_group_bbox_final(sqlite3_context *context) {
-  int rc;
-  struct tg_rect* rect;
-  rect = (struct tg_rect *)sqlite3_aggregate_context(context, sizeof(*rect));
-  if (rect == 0)
-    return;
-  struct tg_point points[] = {
-    {rect->min.x, rect->min.y},
-    {rect->max.x, rect->min.y},
-    {rect->max.x, rect->max.y},
-    {rect->min.x, rect->max.y},
-    {rect->min.x, rect->min.y},
-  };
-  struct tg_ring* ring = tg_ring_new(points, 5);
-  // rings upcast to tg_geom; the pointer destructor's tg_geom_free()
-  // dispatches back to tg_ring_free()
-  resultGeomPointer(context, (struct tg_geom *) ring);
+static int wktValidate(const char *wkt, size_t n, struct validation *v) {
+  v->input = wkt ? wkt : "";
+  return wktValidateGeom(v->input, (long)n, v);
 }
 
-static void tg_group_multipolygon_step(sqlite3_context *context, int argc, sqlite3_value *argv[]) {
-  int rc;
-  struct Array *array;
-  array = (struct Array *)sqlite3_aggregate_context(context, sizeof(*array));
-  if (!array) {
-    return;
-  }
-  if(!array->z) {
-    rc = tg_array_init(array, sizeof(struct tg_poly *), 128);
-    if(rc!=SQLITE_OK) {
-      sqlite3_result_error_nomem(context);
-      return;
+// Strict JSON syntax, the same grammar tg's json_validn() enforces: RFC 8259
+// values, well-formed UTF-8 in strings and at most VALIDATE_MAXDEPTH levels of
+// nesting. Returns a pointer past the value, or NULL with the failure recorded.
+static const unsigned char *jsonValidateValue(const unsigned char *p,
+                                              const unsigned char *end,
+                                              int depth, struct validation *v);
+
+static const unsigned char *jsonValidateString(const unsigned char *p,
+                                               const unsigned char *end,
+                                               struct validation *v) {
+  for (p++; p < end; p++) {
+    unsigned char c = *p;
+    if (c == '"')
+      return p + 1;
+    if (c < 0x20)
+      break;
+    if (c == '\\') {
+      // tg's validator resumes scanning after a malformed escape instead of
+      // rejecting it, so leave those to tg
+      if (++p == end) {
+        v->defer = 1;
+        break;
+      }
+      if (*p == 'u') {
+        for (int k = 0; k < 4; k++) {
+          if (++p == end || !isxdigit(*p)) {
+            v->defer = 1;
+            return jsonValidationFail(v, p);
+          }
+        }
+      } else if (!strchr("\"\\/bfnrt", *p) || !*p) {
+        v->defer = 1;
+        break;
+      }
+    } else if (c > 127) {
+      uint32_t cp;
+      int nb;
+      if (c >> 5 == 6) {
+        nb = 2;
+        cp = c & 31;
+      } else if (c >> 4 == 14) {
+        nb = 3;
+        cp = c & 15;
+      } else if (c >> 3 == 30) {
+        nb = 4;
+        cp = c & 7;
+      } else {
+        break;
+      }
+      if (end - p < nb)
+        break;
+      for (int k = 1; k < nb; k++) {
+        if (p[k] >> 6 != 2)
+          return jsonValidationFail(v, p);
+        cp = (cp << 6) | (p[k] & 63);
+      }
+      // no overlong forms, surrogates, or code points past U+10FFFE
+      if (cp < 128 || cp >= 0x10FFFF || (cp >= 0xD800 && cp <= 0xDFFF))
+        break;
+      p += nb - 1;
     }
   }
+  return jsonValidationFail(v, p);
+}
 
-  struct tg_geom *geom;
-  char * errmsg;
-  rc = geomValue(argv[0], &geom, &errmsg);
-  if (rc != SQLITE_OK) {
-    sqlite3_result_error(context, errmsg, -1);
-    sqlite3_free(errmsg);
-    return;
+static const unsigned char *jsonValidateNumber(const unsigned char *p,
+                                               const unsigned char *end,
+                                               struct validation *v) {
+  if (*p == '-')
+    p++;
+  if (p == end || *p < '0' || *p > '9')
+    return jsonValidationFail(v, p);
+  if (*p == '0') {
+    p++;
+  } else {
+    while (p < end && *p >= '0' && *p <= '9')
+      p++;
   }
-
-  const struct tg_poly * p = tg_geom_poly(geom);
-  if(!p) {
-    sqlite3_result_error(
-      context, "inputs to tg_group_multipolygon() must be Polygon geometries",
-      -1);
-    tg_geom_free(geom);
-    return;
+  if (p < end && *p == '.') {
+    p++;
+    if (p == end || *p < '0' || *p > '9')
+      return jsonValidationFail(v, p);
+    while (p < end && *p >= '0' && *p <= '9')
+      p++;
   }
-
-  struct tg_poly * p2 = tg_poly_clone(p);
-  tg_array_append(array, &p2);
-  tg_geom_free(geom);
+  if (p < end && (*p == 'e' || *p == 'E')) {
+    p++;
+    if (p < end && (*p == '+' || *p == '-'))
+      p++;
+    if (p == end || *p < '0' || *p > '9')
+      return jsonValidationFail(v, p);
+    while (p < end && *p >= '0' && *p <= '9')
+      p++;
+  }
+  return p;
 }
 
-static void tg_group_multipolygon_final(sqlite3_context *context) {
-  struct Array *a;
-  a = (struct Array *)sqlite3_aggregate_context(context, sizeof(*a));
-  if (a == 0)
-    return;
-  if (a->z == 0) {
-    // TODO oom handle
-    //resultGeomPointer(context, tg_geom_new_multipolygon_empty());
-  }
-  if (a->length) {
+static const unsigned char *jsonValidateLiteral(const unsigned char *p,
+                                                const unsigned char *end,
+                                                const char *zLiteral,
+                                                struct validation *v) {
+  size_t n = strlen(zLiteral);
+  if ((size_t)(end - p) < n || memcmp(p, zLiteral, n) != 0)
+    return jsonValidationFail(v, p);
+  return p + n;
+}
 
-    struct tg_geom *geom = tg_geom_new_multipolygon((const struct tg_poly **) a->z, a->length);
-    if (!geom) {
-      sqlite3_result_error_nomem(context);
-    } else {
-      resultGeomPointer(context, geom);
+static const unsigned char *jsonValidateContainer(const unsigned char *p,
+                                                  const unsigned char *end,
+                                                  int depth,
+                                                  struct validation *v) {
+  unsigned char close = *p == '{' ? '}' : ']';
+  p = (const unsigned char *)tg_json_skip_ws((const char *)p + 1,
+                                             (const char *)end);
+  if (p < end && *p == close)
+    return p + 1;
+  while (p < end) {
+    if (close == '}') {
+      if (*p != '"')
+        break;
+      p = jsonValidateString(p, end, v);
+      if (!p)
+        return NULL;
+      p = (const unsigned char *)tg_json_skip_ws((const char *)p,
+                                                 (const char *)end);
+      if (p == end || *p != ':')
+        break;
+      p++;
     }
-  }else {
-    resultGeomPointer(context, tg_geom_new_multipolygon_empty());
-  }
-  for(int i = 0; i < a->length; i++) {
-    tg_poly_free( ( (struct tg_poly**) a->z)[i]);
+    p = jsonValidateValue(p, end, depth + 1, v);
+    if (!p)
+      return NULL;
+    p = (const unsigned char *)tg_json_skip_ws((const char *)p,
+                                               (const char *)end);
+    if (p < end && *p == close)
+      return p + 1;
+    if (p == end || *p != ',')
+      break;
+    p = (const unsigned char *)tg_json_skip_ws((const char *)p + 1,
+                                               (const char *)end);
   }
-  tg_array_cleanup(a);
+  return jsonValidationFail(v, p);
 }
 
-static void tg_group_multilinestring_step(sqlite3_context *context, int argc, sqlite3_value *argv[]) {
-  int rc;
-  struct Array *array;
-  array = (struct Array *)sqlite3_aggregate_context(context, sizeof(*array));
-  if (!array) {
-    return;
-  }
-  if(!array->z) {
-    rc = tg_array_init(array, sizeof(struct tg_line *), 128);
-    if(rc!=SQLITE_OK) {
-      sqlite3_result_error_nomem(context);
-      return;
-    }
+static const unsigned char *jsonValidateValue(const unsigned char *p,
+                                              const unsigned char *end,
+                                              int depth, struct validation *v) {
+  p = (const unsigned char *)tg_json_skip_ws((const char *)p,
+                                             (const char *)end);
+  if (p == end || depth > VALIDATE_MAXDEPTH)
+    return jsonValidationFail(v, p);
+  switch (*p) {
+  case '{':
+  case '[':
+    return jsonValidateContainer(p, end, depth, v);
+  case '"':
+    return jsonValidateString(p, end, v);
+  case 't':
+    return jsonValidateLiteral(p, end, "true", v);
+  case 'f':
+    return jsonValidateLiteral(p, end, "false", v);
+  case 'n':
+    return jsonValidateLiteral(p, end, "null", v);
+  default:
+    if (*p == '-' || (*p >= '0' && *p <= '9'))
+      return jsonValidateNumber(p, end, v);
+    return jsonValidationFail(v, p);
   }
+}
 
-  struct tg_geom *geom;
-  char * errmsg;
-  rc = geomValue(argv[0], &geom, &errmsg);
-  if (rc != SQLITE_OK) {
-    sqlite3_result_error(context, errmsg, -1);
-    sqlite3_free(errmsg);
-    return;
-  }
+// Helpers for walking JSON that has already passed jsonValidateValue(). Each
+// returns the first or next element of an array or object, or NULL past the
+// last one.
+static const char *jsonFirst(const char *p, const char *end) {
+  p = tg_json_skip_ws(p + 1, end);
+  return *p == ']' || *p == '}' ? NULL : p;
+}
 
-  const struct tg_line * l = tg_geom_line(geom);
-  if(!l) {
-    sqlite3_result_error(
-      context, "inputs to tg_group_multilinestring() must be LineString geometries",
-      -1);
-    tg_geom_free(geom);
-    return;
-  }
+static const char *jsonNext(const char *valueEnd, const char *end) {
+  const char *p = tg_json_skip_ws(valueEnd, end);
+  return *p == ',' ? tg_json_skip_ws(p + 1, end) : NULL;
+}
 
-  struct tg_line * l2 = tg_line_clone(l);
-  tg_array_append(array, &l2);
-  tg_geom_free(geom);
+static int jsonIsNumber(const char *p) {
+  return *p == '-' || (*p >= '0' && *p <= '9');
 }
 
-static void tg_group_multilinestring_final(sqlite3_context *context) {
-  struct Array *a;
-  a = (struct Array *)sqlite3_aggregate_context(context, sizeof(*a));
-  if (a == 0)
-    return;
-  if (a->z == 0) {
-    // TODO oom handle
-    //resultGeomPointer(context, tg_geom_new_multipolygon_empty());
+// The same conversion tg's json_double() does for numbers.
+static double jsonNumberValue(const char *p, const char *end) {
+  char buf[512];
+  const char *q = tg_json_skip_value(p, end);
+  size_t n = q - p;
+  if (n >= sizeof(buf))
+    return 0;
+  memcpy(buf, p, n);
+  buf[n] = '\0';
+  return strtod(buf, NULL);
+}
+
+static const char *geojsonDepthError(int depth) {
+  switch (depth) {
+  case 1:
+    return "'coordinates' must be an array of positions";
+  case 2:
+    return "'coordinates' must be a two deep nested array of positions";
+  default:
+    return "'coordinates' must be a three deep nested array of positions";
   }
-  if (a->length) {
-    struct tg_geom *geom = tg_geom_new_multilinestring((const struct tg_line **) a->z, a->length);
-    if (!geom) {
-      sqlite3_result_error_nomem(context);
-    } else {
-      resultGeomPointer(context, geom);
+}
+
+// Mirrors tg's parse_geojson_posns() over the array at p. Returns the
+// dimensions or -1 when invalid.
+static int geojsonValidatePosns(int base, int dims, int depth, const char *p,
+                                const char *end, struct validation *v) {
+  long npoints = 0;
+  const char *first = NULL, *last = NULL;
+  for (const char *el = jsonFirst(p, end); el;
+       el = jsonNext(tg_json_skip_value(el, end), end)) {
+    if (*el != '[')
+      return validationFailDims(v, geojsonDepthError(depth), el);
+    int pdims = 0;
+    for (const char *num = jsonFirst(el, end); num;
+         num = jsonNext(tg_json_skip_value(num, end), end)) {
+      if (!jsonIsNumber(num))
+        return validationFailDims(
+                   v, "each element in a position must be a number", num);
+      // like tg, anything past four numbers is ignored
+      if (pdims < 4)
+        pdims++;
     }
-  }else {
-    resultGeomPointer(context, tg_geom_new_multilinestring_empty());
+    if (dims == 0)
+      dims = pdims;
+    if (pdims < 2)
+      return validationFailDims(v, "each position must have two or more numbers",
+                            el);
+    if (pdims != dims)
+      return validationFailDims(
+                 v, "each position must have the same number of dimensions",
+                 el);
+    if (npoints++ == 0)
+      first = el;
+    last = el;
   }
-  for(int i = 0; i < a->length; i++) {
-    tg_line_free( ( (struct tg_line**) a->z)[i]);
+  if (base == VALIDATE_BASE_LINE && npoints < 2)
+    return validationFailDims(v, "lines must have two or more positions", p);
+  if (base == VALIDATE_BASE_RING) {
+    if (npoints < 3)
+      return validationFailDims(v, "rings must have three or more positions", p);
+    const char *x0 = jsonFirst(first, end);
+    const char *y0 = jsonNext(tg_json_skip_value(x0, end), end);
+    const char *x1 = jsonFirst(last, end);
+    const char *y1 = jsonNext(tg_json_skip_value(x1, end), end);
+    if (!(jsonNumberValue(x0, end) == jsonNumberValue(x1, end) &&
+          jsonNumberValue(y0, end) == jsonNumberValue(y1, end)))
+      return validationFailDims(
+                 v, "rings must have matching first and last positions", last);
   }
-  tg_array_cleanup(a);
+  return dims;
 }
 
-static void tg_group_geometry_collection_step(sqlite3_context *context, int argc,
-                               sqlite3_value *argv[]) {
-
-  int rc;
-  struct Array *array;
-  array = (struct Array *)sqlite3_aggregate_context(context, sizeof(*array));
-  if (!array) {
-    return;
-  }
-  if(!array->z) {
-    rc = tg_array_init(array, sizeof(struct tg_geom*), 128);
-    if(rc!=SQLITE_OK) {
-      sqlite3_result_error_nomem(context);
-      return;
-    }
+// Mirrors tg's parse_geojson_multi_posns(): the rings of one polygon.
+static int geojsonValidateRings(int dims, int depth, const char *p,
+                                const char *end, struct validation *v) {
+  long nrings = 0;
+  for (const char *el = jsonFirst(p, end); el;
+       el = jsonNext(tg_json_skip_value(el, end), end)) {
+    if (*el != '[')
+      return validationFailDims(v, "'coordinates' must be a nested array", el);
+    dims = geojsonValidatePosns(VALIDATE_BASE_RING, dims, depth, el, end, v);
+    if (dims == -1)
+      return -1;
+    nrings++;
   }
+  if (nrings == 0)
+    return validationFailDims(v, "polygons must have one or more rings", p);
+  return dims;
+}
 
-  struct tg_geom *geom;
-  char * errmsg;
-  rc = geomValue(argv[0], &geom, &errmsg);
-  if (rc != SQLITE_OK) {
-    sqlite3_result_error(context, errmsg, -1);
-    sqlite3_free(errmsg);
-    return;
-  }
+#define GEOJSON_KIND_GEOMETRY 1
+#define GEOJSON_KIND_FEATURE 2
+#define GEOJSON_KIND_FEATURECOLLECTION 3
 
-  struct tg_geom *x = tg_geom_clone(geom);
-  tg_array_append(array, &x);
-  tg_geom_free(geom);
+// Whether the JSON string at p (including quotes) equals zName.
+static int jsonStringIs(const char *p, const char *end, const char *zName) {
+  size_t n = strlen(zName);
+  return (size_t)(end - p) == n + 2 && *p == '"' &&
+         memcmp(p + 1, zName, n) == 0;
 }
 
-static void tg_group_geometry_collection_final(sqlite3_context *context) {
-  struct Array *a;
-  a = (struct Array *)sqlite3_aggregate_context(context, sizeof(*a));
-  if (a == 0)
-    return;
-  if (a->z == 0) {
-    struct tg_geom * g = tg_geom_new_geometrycollection_empty();
-    if(!g) {
-      sqlite3_result_error_nomem(context);
-    }else {
-      resultGeomPointer(context, g);
+// Mirrors tg's parse_geojson() and take_basic_geojson() for the object at p.
+// Returns 1 when valid, 0 when invalid, and -1 when a member name or the
+// 'type' string uses escapes, which tg compares after unescaping; callers
+// then defer to tg itself.
+static int geojsonValidateObject(const char *p, const char *end, int *pKind,
+                                 struct validation *v) {
+  if (*p != '{')
+    return validationFail(v, "expected an object", p);
+  const char *type = NULL, *coordinates = NULL, *geometries = NULL,
+             *features = NULL, *geometry = NULL, *properties = NULL,
+             *id = NULL;
+  for (const char *key = jsonFirst(p, end); key;) {
+    const char *keyEnd = tg_json_skip_string(key, end);
+    if (memchr(key, '\\', keyEnd - key))
+      return -1;
+    const char *value = tg_json_skip_ws(tg_json_skip_ws(keyEnd, end) + 1, end);
+    if (jsonStringIs(key, keyEnd, "type")) {
+      if (!type)
+        type = value;
+    } else if (jsonStringIs(key, keyEnd, "coordinates")) {
+      coordinates = value;
+    } else if (jsonStringIs(key, keyEnd, "geometries")) {
+      geometries = value;
+    } else if (jsonStringIs(key, keyEnd, "features")) {
+      features = value;
+    } else if (jsonStringIs(key, keyEnd, "geometry")) {
+      geometry = value;
+    } else if (jsonStringIs(key, keyEnd, "properties")) {
+      if (!properties)
+        properties = value;
+    } else if (jsonStringIs(key, keyEnd, "id")) {
+      if (!id)
+        id = value;
     }
+    key = jsonNext(tg_json_skip_value(value, end), end);
   }
-  else if (a->length) {
-    struct tg_geom *geom = tg_geom_new_geometrycollection( (const struct tg_geom *const*) a->z, a->length);
-    if (!geom) {
-      sqlite3_result_error_nomem(context);
-    } else {
-      resultGeomPointer(context, geom);
+  if (!type)
+    return validationFail(v, "'type' is required", p);
+  const char *typeEnd = tg_json_skip_value(type, end);
+  if (*type == '"' && memchr(type, '\\', typeEnd - type))
+    return -1;
+  int base;
+  *pKind = GEOJSON_KIND_GEOMETRY;
+  if (jsonStringIs(type, typeEnd, "Point") ||
+      jsonStringIs(type, typeEnd, "LineString") ||
+      jsonStringIs(type, typeEnd, "Polygon") ||
+      jsonStringIs(type, typeEnd, "MultiPoint") ||
+      jsonStringIs(type, typeEnd, "MultiLineString") ||
+      jsonStringIs(type, typeEnd, "MultiPolygon")) {
+    if (!coordinates)
+      return validationFail(v, "missing 'coordinates'", p);
+    if (*coordinates != '[')
+      return validationFail(v, "'coordinates' must be an array", coordinates);
+    const char *first = jsonFirst(coordinates, end);
+    if (jsonStringIs(type, typeEnd, "Point")) {
+      int dims = 0;
+      for (const char *num = first; num;
+           num = jsonNext(tg_json_skip_value(num, end), end)) {
+        if (!jsonIsNumber(num))
+          return validationFail(v, "'coordinates' must only contain numbers",
+                                num);
+        dims++;
+      }
+      if (first && dims < 2)
+        return validationFail(
+            v, "'coordinates' must have two or more numbers", coordinates);
+      return 1;
+    }
+    if (jsonStringIs(type, typeEnd, "LineString")) {
+      return !first || geojsonValidatePosns(VALIDATE_BASE_LINE, 0, 1,
+                                            coordinates, end, v) != -1;
     }
+    if (jsonStringIs(type, typeEnd, "Polygon")) {
+      return !first ||
+             geojsonValidateRings(0, 2, coordinates, end, v) != -1;
+    }
+    if (jsonStringIs(type, typeEnd, "MultiPoint")) {
+      return geojsonValidatePosns(VALIDATE_BASE_POINT, 0, 1, coordinates, end,
+                                  v) != -1;
+    }
+    base = jsonStringIs(type, typeEnd, "MultiLineString") ? VALIDATE_BASE_LINE
+                                                          : VALIDATE_BASE_RING;
+    int dims = 0;
+    for (const char *el = first; el;
+         el = jsonNext(tg_json_skip_value(el, end), end)) {
+      if (*el != '[')
+        return validationFail(
+            v, geojsonDepthError(base == VALIDATE_BASE_LINE ? 2 : 3), el);
+      if (base == VALIDATE_BASE_LINE)
+        dims = geojsonValidatePosns(base, dims, 2, el, end, v);
+      else
+        dims = geojsonValidateRings(dims, 3, el, end, v);
+      if (dims == -1)
+        return 0;
+    }
+    return 1;
   }
-  for(int i = 0; i < a->length; i++) {
-    tg_geom_free( ( (struct tg_geom**) a->z)[i]);
+  if (jsonStringIs(type, typeEnd, "GeometryCollection") ||
+      jsonStringIs(type, typeEnd, "FeatureCollection")) {
+    int isCollection = jsonStringIs(type, typeEnd, "GeometryCollection");
+    const char *target = isCollection ? geometries : features;
+    if (!target)
+      return validationFail(v, isCollection ? "missing 'geometries'"
+                                            : "missing 'features'",
+                            p);
+    if (*target != '[')
+      return validationFail(v, isCollection ? "'geometries' must be an array"
+                                            : "'features' must be an array",
+                            target);
+    for (const char *el = jsonFirst(target, end); el;
+         el = jsonNext(tg_json_skip_value(el, end), end)) {
+      int kind;
+      int rc = geojsonValidateObject(el, end, &kind, v);
+      if (rc != 1)
+        return rc;
+      if (isCollection && kind != GEOJSON_KIND_GEOMETRY)
+        return validationFail(v,
+                              "'geometries' must only contain objects with "
+                              "the 'type' of Point, LineString, Polygon, "
+                              "MultiPoint, MultiLineString, MultiPolygon, or "
+                              "GeometryCollection",
+                              el);
+      if (!isCollection && kind != GEOJSON_KIND_FEATURE)
+        return validationFail(v,
+                              "'features' must only contain objects with the "
+                              "'type' of Feature",
+                              el);
+    }
+    if (!isCollection)
+      *pKind = GEOJSON_KIND_FEATURECOLLECTION;
+    return 1;
   }
-  tg_array_cleanup(a);
+  if (jsonStringIs(type, typeEnd, "Feature")) {
+    *pKind = GEOJSON_KIND_FEATURE;
+    if (properties && *properties != '{' && *properties != 'n')
+      return validationFail(v, "'properties' must be an object or null",
+                            properties);
+    if (id && *id != '"' && !jsonIsNumber(id))
+      return validationFail(v, "'id' must be a string or number", id);
+    if (!geometry)
+      return validationFail(v, "missing 'geometry'", p);
+    if (*geometry == 'n')
+      return 1;
+    if (*geometry != '{')
+      return validationFail(v, "'geometry' must be an object or null",
+                            geometry);
+    int kind;
+    int rc = geojsonValidateObject(geometry, end, &kind, v);
+    if (rc != 1)
+      return rc;
+    if (kind != GEOJSON_KIND_GEOMETRY)
+      return validationFail(v,
+                            "'geometry' must only contain an object with the "
+                            "'type' of Point, LineString, Polygon, "
+                            "MultiPoint, MultiLineString, MultiPolygon, or "
+                            "GeometryCollection",
+                            geometry);
+    return 1;
+  }
+  return validationFail(v, "unknown type", type);
 }
 
-struct feature_collection_context {
-  sqlite3_str * s;
-  int n;
-};
-static void tg_feature_collection_step(sqlite3_context *context, int argc,
-                               sqlite3_value *argv[]) {
-  int rc;
-  struct feature_collection_context *ctx;
-  ctx = sqlite3_aggregate_context(context, sizeof(*ctx));
-  if(!ctx) {
-    return;
-  }
-  if(!ctx->s) {
-    ctx->s = sqlite3_str_new(NULL);
-    if(!ctx->s) {
-      return;
-    }
-    sqlite3_str_appendall(ctx->s, "{\"type\":\"FeatureCollection\", \"features\": [");
+static int geojsonValidate(const char *s, size_t n, struct validation *v) {
+  v->input = s ? s : "";
+  v->defer = 0;
+  const unsigned char *p = (const unsigned char *)v->input;
+  const unsigned char *end = p + n;
+  const unsigned char *q = jsonValidateValue(p, end, 1, v);
+  if (q) {
+    q = (const unsigned char *)tg_json_skip_ws((const char *)q,
+                                               (const char *)end);
+    if (q != end)
+      return validationFail(v, "invalid json", q);
+    int kind;
+    int rc = geojsonValidateObject(
+        tg_json_skip_ws((const char *)p, (const char *)end),
+        (const char *)end, &kind, v);
+    if (rc != -1)
+      return rc;
+  } else if (!v->defer) {
+    return 0;
   }
-  if(ctx->n) {
-    sqlite3_str_appendchar(ctx->s, 1, ',');
+  // escaped member names and malformed escapes are rare enough to let tg
+  // settle them
+  struct tg_geom *geom = tg_parse_geojsonn_ix(s, n, TG_NONE);
+  const char *zError = tg_geom_error(geom);
+  if (zError) {
+    if (strncmp(zError, "ParseError: ", 12) == 0)
+      zError += 12;
+    sqlite3_snprintf(sizeof(v->zFallback), v->zFallback, "%s", zError);
+    validationFail(v, v->zFallback, NULL);
   }
+  tg_geom_free(geom);
+  return zError == NULL;
+}
 
-  struct tg_geom *geom;
-  char * errmsg;
-  rc = geomValue(argv[0], &geom, &errmsg);
+static void tg_valid_geojson(sqlite3_context *context, int argc,
+                             sqlite3_value **argv) {
+  struct validation v;
+  const char *s = (const char *)sqlite3_value_text(argv[0]);
+  int n = sqlite3_value_bytes(argv[0]);
+  sqlite3_result_int(context, geojsonValidate(s, n, &v));
+}
+static void tg_valid_wkt(sqlite3_context *context, int argc,
+                         sqlite3_value **argv) {
+  struct validation v;
+  const char *s = (const char *)sqlite3_value_text(argv[0]);
+  int n = sqlite3_value_bytes(argv[0]);
+  sqlite3_result_int(context, wktValidate(s, n, &v));
+}
+static void tg_valid_wkb(sqlite3_context *context, int argc,
+                         sqlite3_value **argv) {
+  struct validation v;
+  const void *b = sqlite3_value_blob(argv[0]);
+  int n = sqlite3_value_bytes(argv[0]);
+  sqlite3_result_int(context, wkbValidate(b, n, &v));
+}
+
+// tg_validate(geometry): NULL when the input parses, otherwise a JSON object
+// with the reason and the byte offset where validation stopped.
+static void tg_validate(sqlite3_context *context, int argc,
+                        sqlite3_value **argv) {
+  struct validation v;
+  int n = sqlite3_value_bytes(argv[0]);
+  int valid;
+  if (sqlite3_value_subtype(argv[0]) == JSON_SUBTYPE ||
+      (n > 0 && ((const char *)sqlite3_value_blob(argv[0]))[0] == '{')) {
+    valid = geojsonValidate((const char *)sqlite3_value_text(argv[0]), n, &v);
+  } else if (sqlite3_value_type(argv[0]) == SQLITE_BLOB) {
+    valid = blobValidate(sqlite3_value_blob(argv[0]), n, &v);
+  } else if (sqlite3_value_type(argv[0]) == SQLITE_TEXT) {
+    valid = wktValidate((const char *)sqlite3_value_text(argv[0]), n, &v);
+  } else if (sqlite3_value_pointer(argv[0], TG_GEOM_POINTER_NAME)) {
+    valid = 1;
+  } else {
+    valid = validationFail(&v, INVALID_GEO_INPUT, NULL);
+  }
+  if (valid) {
+    sqlite3_result_null(context);
+    return;
+  }
+  sqlite3_str *s = sqlite3_str_new(NULL);
+  sqlite3_str_appendall(s, "{\"reason\":\"");
+  for (const char *c = v.reason; *c; c++) {
+    if (*c == '"' || *c == '\\')
+      sqlite3_str_appendchar(s, 1, '\\');
+    if ((unsigned char)*c < 0x20)
+      sqlite3_str_appendf(s, "\\u%04x", *c);
+    else
+      sqlite3_str_appendchar(s, 1, *c);
+  }
+  if (v.offset < 0)
+    sqlite3_str_appendall(s, "\",\"offset\":null}");
+  else
+    sqlite3_str_appendf(s, "\",\"offset\":%lld}", v.offset);
+  int len = sqlite3_str_length(s);
+  char *z = sqlite3_str_finish(s);
+  if (!z) {
+    sqlite3_result_error_nomem(context);
+    return;
+  }
+  sqlite3_result_text(context, z, len, sqlite3_free);
+  sqlite3_result_subtype(context, JSON_SUBTYPE);
+}
+
+#pragma endregion
+
+#pragma region tg_geom()
+
+static void tg_geom(sqlite3_context *context, int argc, sqlite3_value **argv) {
+  tg_stats_enter(sqlite3_context_db_handle(context));
+  int n = sqlite3_value_bytes(argv[0]);
+  enum tg_index index = TG_NONE;
+  struct tg_geom *geom = NULL;
+  if (argc > 1) {
+    const char *value = (const char *)sqlite3_value_text(argv[1]);
+    if (sqlite3_stricmp("none", value) == 0)
+      index = TG_NONE;
+    else if (sqlite3_stricmp("natural", value) == 0)
+      index = TG_NATURAL;
+    else if (sqlite3_stricmp("ystripes", value) == 0)
+      index = TG_YSTRIPES;
+    else {
+      sqlite3_result_error(
+          context,
+          "unrecognized index option. Should be one of none/natural/ystripes",
+          -1);
+      return;
+    }
+  }
+  switch (sqlite3_value_type(argv[0])) {
+  case SQLITE_BLOB: {
+    int twkb;
+    geom = parseBlob(sqlite3_value_blob(argv[0]), n, index, &twkb);
+    break;
+  }
+  case SQLITE_TEXT: {
+    const char *text = (const char *)sqlite3_value_text(argv[0]);
+    if (sqlite3_value_subtype(argv[0]) == JSON_SUBTYPE ||
+        // JSON is many SQL queries don't have a subtype,
+        // so to distinguish between WKT/geojson, see if it
+        // starts with "{", which almost always is geojson
+        (n > 0 && text[0] == '{')) {
+      geom = tg_parse_geojsonn_ix(text, n, index);
+    } else {
+      geom = tg_parse_wktn_ix(text, n, index);
+    }
+    break;
+  }
+  default:
+    sqlite3_result_error(context,
+                         "tg_geom() input must be WKT, WKB, or GeoJSON", -1);
+    return;
+  }
+  if (tg_geom_error(geom)) {
+    sqlite3_result_error(context, tg_geom_error(geom), -1);
+    tg_geom_free(geom);
+    return;
+  }
+  sqlite3_result_pointer(context, geom, TG_GEOM_POINTER_NAME,
+                         (void (*)(void *))tg_geom_free);
+}
+static void tg_type(sqlite3_context *context, int argc, sqlite3_value **argv) {
+  tg_stats_enter(sqlite3_context_db_handle(context));
+  struct tg_geom *geom;
+  char * errmsg;
+  int rc = geomValue(argv[0], &geom, &errmsg);
+  if (rc != SQLITE_OK) {
+    sqlite3_result_error(context, errmsg, -1);
+    sqlite3_free(errmsg);
+    return;
+  }
+
+    sqlite3_result_text(context, tg_geom_type_string(tg_geom_typeof(geom)), -1,
+                        SQLITE_STATIC);
+
+  tg_geom_free(geom);
+}
+
+static void tg_extra_json(sqlite3_context *context, int argc,
+                          sqlite3_value **argv) {
+  tg_stats_enter(sqlite3_context_db_handle(context));
+  struct tg_geom *geom;
+  char * errmsg;
+  int rc = geomValue(argv[0], &geom, &errmsg);
+  if (rc != SQLITE_OK) {
+    sqlite3_result_error(context, errmsg, -1);
+    sqlite3_free(errmsg);
+    return;
+  }
+
+  const char *result = tg_geom_extra_json(geom);
+  if (result) {
+    // TODO what if null character in json?
+    sqlite3_result_text(context, result, -1, SQLITE_TRANSIENT);
+    sqlite3_result_subtype(context, JSON_SUBTYPE);
+  } else {
+    sqlite3_result_null(context);
+  }
+
+  tg_geom_free(geom);
+}
+#pragma endregion
+
+#pragma region constructors
+
+static void tg_point(sqlite3_context *context, int argc, sqlite3_value **argv) {
+  tg_stats_enter(sqlite3_context_db_handle(context));
+  int typeX = sqlite3_value_type(argv[0]);
+  int typeY = sqlite3_value_type(argv[1]);
+  if (typeX != SQLITE_INTEGER && typeX != SQLITE_FLOAT) {
+    sqlite3_result_error(context, "point X value must be an integer or float",
+                         -1);
+    return;
+  }
+  if (typeY != SQLITE_INTEGER && typeY != SQLITE_FLOAT) {
+    sqlite3_result_error(context, "point Y value must be an integer or float",
+                         -1);
+    return;
+  }
+  double x = sqlite3_value_double(argv[0]);
+  double y = sqlite3_value_double(argv[1]);
+  struct tg_point point = {x, y};
+  struct tg_geom *geom = tg_geom_new_point(point);
+  if (tg_geom_error(geom)) {
+    sqlite3_result_error(context, tg_geom_error(geom), -1);
+    tg_geom_free(geom);
+    return;
+  }
+  resultGeomPointer(context, geom);
+}
+
+static void tg_poly_exterior_(sqlite3_context *context, int argc,
+                          sqlite3_value **argv) {
+  tg_stats_enter(sqlite3_context_db_handle(context));
+  struct tg_geom *geom;
+  char * errmsg;
+  int rc = geomValue(argv[0], &geom, &errmsg);
   if (rc != SQLITE_OK) {
     sqlite3_result_error(context, errmsg, -1);
     sqlite3_free(errmsg);
     return;
   }
-
-  size_t size = tg_geom_geojson(geom, NULL, 0);
-  void *buffer = sqlite3_malloc(size + 1);
-  if (buffer == 0) {
+  const struct tg_poly * p = tg_geom_poly(geom);
+  if(!p) {
+    sqlite3_result_error(context, "argument to tg_poly_exterior() is not a polygon", -1);
+    tg_geom_free(geom);
+    return;
+  }
+  const struct tg_ring *ring = tg_poly_exterior(p);
+  // "A tg_ring can always be safely upcasted to a tg_poly or tg_geom"
+  // clone (rc increment) so the ring outlives its parent geom
+  resultGeomPointer(context, (struct tg_geom*) tg_ring_clone(ring));
+  tg_geom_free(geom);
+}
+
+static void tg_multipoint(sqlite3_context *context, int argc,
+                          sqlite3_value **argv) {
+  tg_stats_enter(sqlite3_context_db_handle(context));
+  if (argc == 0) {
+    struct tg_geom *geom = tg_geom_new_multipoint_empty();
+    if (!geom) {
+      sqlite3_result_error_nomem(context);
+    } else {
+      resultGeomPointer(context, geom);
+    }
+    return;
+  }
+
+  struct tg_point *points = sqlite3_malloc(argc * sizeof(struct tg_point));
+  if (!points) {
+    sqlite3_result_error_nomem(context);
+    return;
+  }
+  memset(points, 0, argc * sizeof(struct tg_point));
+
+  for (int i = 0; i < argc; i++) {
+    struct tg_geom *geom;
+    char * errmsg;
+    int rc = geomValue(argv[i], &geom, &errmsg);
+    if (rc != SQLITE_OK) {
+      const char *zErr = sqlite3_mprintf(
+          "argument to tg_multipoint() at index %i is an invalid geometry: %z",
+          i, errmsg);
+      sqlite3_result_error(context, zErr, -1);
+      sqlite3_free((void *)zErr);
+      sqlite3_free(points);
+      return;
+    }
+
+    if (tg_geom_typeof(geom) != TG_POINT) {
+      const char *zErr = sqlite3_mprintf(
+          "argument to tg_multipoint() at index %i expected a point, found %s",
+          i, tg_geom_type_string(tg_geom_typeof(geom)));
+      sqlite3_result_error(context, zErr, -1);
+      sqlite3_free((void *)zErr);
+      tg_geom_free(geom);
+      sqlite3_free(points);
+      return;
+    }
+    struct tg_point src = tg_geom_point(geom);
+    struct tg_point *dest = &points[i];
+    dest->x = src.x;
+    dest->y = src.y;
+    tg_geom_free(geom);
+  }
+  struct tg_geom *geom = tg_geom_new_multipoint(points, argc);
+  if (!geom) {
+    sqlite3_result_error_nomem(context);
+  } else {
+    resultGeomPointer(context, geom);
+  }
+  sqlite3_free(points);
+}
+
+static void tg_line(sqlite3_context *context, int argc,
+                          sqlite3_value **argv) {
+  tg_stats_enter(sqlite3_context_db_handle(context));
+  if (argc == 0) {
+    struct tg_geom *geom = tg_geom_new_linestring_empty();
+    if (!geom) {
+      sqlite3_result_error_nomem(context);
+    } else {
+      resultGeomPointer(context, geom);
+    }
+    return;
+  }
+
+  struct tg_point *points = sqlite3_malloc(argc * sizeof(struct tg_point));
+  if (!points) {
+    sqlite3_result_error_nomem(context);
+    return;
+  }
+  memset(points, 0, argc * sizeof(struct tg_point));
+
+  for (int i = 0; i < argc; i++) {
+    struct tg_geom *geom;
+    char * errmsg;
+    int rc = geomValue(argv[i], &geom, &errmsg);
+    if (rc != SQLITE_OK) {
+      const char *zErr = sqlite3_mprintf(
+          "argument to tg_line() at index %i is an invalid geometry: %z",
+          i, errmsg);
+      sqlite3_result_error(context, zErr, -1);
+      sqlite3_free((void *)zErr);
+      sqlite3_free(points);
+      return;
+    }
+
+    if (tg_geom_typeof(geom) != TG_POINT) {
+      const char *zErr = sqlite3_mprintf(
+          "argument to tg_line() at index %i expected a point, found %s",
+          i, tg_geom_type_string(tg_geom_typeof(geom)));
+      sqlite3_result_error(context, zErr, -1);
+      sqlite3_free((void *)zErr);
+      tg_geom_free(geom);
+      sqlite3_free(points);
+      return;
+    }
+    struct tg_point src = tg_geom_point(geom);
+    struct tg_point *dest = &points[i];
+    dest->x = src.x;
+    dest->y = src.y;
+    tg_geom_free(geom);
+  }
+  struct tg_geom *geom = (struct tg_geom *) tg_line_new(points, argc);
+  if (!geom) {
+    sqlite3_result_error_nomem(context);
+  } else {
+    resultGeomPointer(context, geom);
+  }
+  sqlite3_free(points);
+}
+
+struct Array {
+  size_t element_size;
+  size_t length;
+  size_t capacity;
+  void *z;
+};
+
+int tg_array_init(struct Array *array, size_t element_size, size_t init_capacity) {
+  int sz = element_size * init_capacity;
+  void *z = sqlite3_malloc(sz);
+  if (!z) {
+    return SQLITE_NOMEM;
+  }
+  memset(z, 0, sz);
+
+  array->element_size = element_size;
+  array->length = 0;
+  array->capacity = init_capacity;
+  array->z = z;
+  return SQLITE_OK;
+}
+
+int tg_array_append(struct Array *array, const void *element) {
+  if (array->length == array->capacity) {
+    size_t new_capacity = array->capacity * 2 + 100;
+    void *z = sqlite3_realloc64(array->z, array->element_size * new_capacity);
+    if (z) {
+      array->capacity = new_capacity;
+      array->z = z;
+    } else {
+      return SQLITE_NOMEM;
+    }
+  }
+  memcpy(&((unsigned char *)array->z)[array->length * array->element_size],
+         element, array->element_size);
+  array->length++;
+  return SQLITE_OK;
+}
+
+void tg_array_cleanup(struct Array *array) {
+  if (!array)
+    return;
+  array->element_size = 0;
+  array->length = 0;
+  array->capacity = 0;
+  sqlite3_free(array->z);
+  array->z = NULL;
+}
+
+#pragma region tg_group_multipoint
+static void tg_group_multipoint_step(sqlite3_context *context, int argc,
+                               sqlite3_value *argv[]) {
+  tg_stats_enter(sqlite3_context_db_handle(context));
+
+  int rc;
+  struct Array *array;
+  array = (struct Array *)sqlite3_aggregate_context(context, sizeof(*array));
+  if (!array) {
+    return;
+  }
+  if(!array->z) {
+    rc = tg_array_init(array, sizeof(struct tg_point), 128);
+    if(rc!=SQLITE_OK) {
+      sqlite3_result_error_nomem(context);
+      return;
+    }
+  }
+
+  struct tg_geom *geom;
+  char * errmsg;
+  rc = geomValue(argv[0], &geom, &errmsg);
+  if (rc != SQLITE_OK) {
+    sqlite3_result_error(context, errmsg, -1);
+    sqlite3_free(errmsg);
+    return;
+  }
+
+  if (tg_geom_typeof(geom) != TG_POINT) {
+    sqlite3_result_error(
+        context, "parameters to tg_group_multipoint() must be Point gemetries",
+        -1);
+    tg_geom_free(geom);
+    return;
+  }
+
+  struct tg_point src = tg_geom_point(geom);
+  tg_array_append(array, &src);
+  tg_geom_free(geom);
+}
+
+static void tg_group_multipoint_final(sqlite3_context *context) {
+  struct Array *a;
+  a = (struct Array *)sqlite3_aggregate_context(context, sizeof(*a));
+  if (a == 0) {
+    return;
+  }
+  if (a->z == 0) {
+    // TODO check if null?
+    resultGeomPointer(context, tg_geom_new_multipoint_empty());
+    return;
+  }
+  if (a->length) {
+    struct tg_geom *geom = tg_geom_new_multipoint((struct tg_point *) a->z, a->length);
+    if (!geom) {
+      sqlite3_result_error_nomem(context);
+    } else {
+      resultGeomPointer(context, geom);
+    }
+  }
+  tg_array_cleanup(a);
+}
+
+static void tg_group_bbox_step(sqlite3_context *context, int argc, sqlite3_value *argv[]) {
+  tg_stats_enter(sqlite3_context_db_handle(context));
+  int rc;
+  struct tg_rect* rect;
+  rect = (struct tg_rect *)sqlite3_aggregate_context(context, sizeof(*rect));
+  if (!rect) {
+    return;
+  }
+
+  struct tg_geom *geom;
+  char * errmsg;
+  rc = geomValue(argv[0], &geom, &errmsg);
+  if (rc != SQLITE_OK) {
+    sqlite3_result_error(context, errmsg, -1);
+    sqlite3_free(errmsg);
+    return;
+  }
+  struct tg_rect current = tg_geom_rect(geom);
+  // See if this is the first geometry for the bbox, which would be zero'ed out
+  if(!rect->min.x && !rect->min.y && !rect->max.x && !rect->max.y) {
+    memcpy(rect, &current, sizeof(*rect));
+  }
+  else {
+    struct tg_rect result = tg_rect_expand(*rect, current);
+    memcpy(rect, &result, sizeof(*rect));
+  }
+  tg_geom_free(geom);  
+}
+
+static void tg_group_bbox_final(sqlite3_context *context) {
+  int rc;
+  struct tg_rect* rect;
+  rect = (struct tg_rect *)sqlite3_aggregate_context(context, sizeof(*rect));
+  if (rect == 0)
+    return;
+  struct tg_point points[] = {
+    {rect->min.x, rect->min.y},
+    {rect->max.x, rect->min.y},
+    {rect->max.x, rect->max.y},
+    {rect->min.x, rect->max.y},
+    {rect->min.x, rect->min.y},
+  };
+  struct tg_ring* ring = tg_ring_new(points, 5);
+  // rings upcast to tg_geom; the pointer destructor's tg_geom_free()
+  // dispatches back to tg_ring_free()
+  resultGeomPointer(context, (struct tg_geom *) ring);
+}
+
+static void tg_group_multipolygon_step(sqlite3_context *context, int argc, sqlite3_value *argv[]) {
+  tg_stats_enter(sqlite3_context_db_handle(context));
+  int rc;
+  struct Array *array;
+  array = (struct Array *)sqlite3_aggregate_context(context, sizeof(*array));
+  if (!array) {
+    return;
+  }
+  if(!array->z) {
+    rc = tg_array_init(array, sizeof(struct tg_poly *), 128);
+    if(rc!=SQLITE_OK) {
+      sqlite3_result_error_nomem(context);
+      return;
+    }
+  }
+
+  struct tg_geom *geom;
+  char * errmsg;
+  rc = geomValue(argv[0], &geom, &errmsg);
+  if (rc != SQLITE_OK) {
+    sqlite3_result_error(context, errmsg, -1);
+    sqlite3_free(errmsg);
+    return;
+  }
+
+  const struct tg_poly * p = tg_geom_poly(geom);
+  if(!p) {
+    sqlite3_result_error(
+      context, "inputs to tg_group_multipolygon() must be Polygon geometries",
+      -1);
+    tg_geom_free(geom);
+    return;
+  }
+
+  struct tg_poly * p2 = tg_poly_clone(p);
+  tg_array_append(array, &p2);
+  tg_geom_free(geom);
+}
+
+static void tg_group_multipolygon_final(sqlite3_context *context) {
+  struct Array *a;
+  a = (struct Array *)sqlite3_aggregate_context(context, sizeof(*a));
+  if (a == 0)
+    return;
+  if (a->z == 0) {
+    // TODO oom handle
+    //resultGeomPointer(context, tg_geom_new_multipolygon_empty());
+  }
+  if (a->length) {
+
+    struct tg_geom *geom = tg_geom_new_multipolygon((const struct tg_poly **) a->z, a->length);
+    if (!geom) {
+      sqlite3_result_error_nomem(context);
+    } else {
+      resultGeomPointer(context, geom);
+    }
+  }else {
+    resultGeomPointer(context, tg_geom_new_multipolygon_empty());
+  }
+  for(int i = 0; i < a->length; i++) {
+    tg_poly_free( ( (struct tg_poly**) a->z)[i]);
+  }
+  tg_array_cleanup(a);
+}
+
+static void tg_group_multilinestring_step(sqlite3_context *context, int argc, sqlite3_value *argv[]) {
+  tg_stats_enter(sqlite3_context_db_handle(context));
+  int rc;
+  struct Array *array;
+  array = (struct Array *)sqlite3_aggregate_context(context, sizeof(*array));
+  if (!array) {
+    return;
+  }
+  if(!array->z) {
+    rc = tg_array_init(array, sizeof(struct tg_line *), 128);
+    if(rc!=SQLITE_OK) {
+      sqlite3_result_error_nomem(context);
+      return;
+    }
+  }
+
+  struct tg_geom *geom;
+  char * errmsg;
+  rc = geomValue(argv[0], &geom, &errmsg);
+  if (rc != SQLITE_OK) {
+    sqlite3_result_error(context, errmsg, -1);
+    sqlite3_free(errmsg);
+    return;
+  }
+
+  const struct tg_line * l = tg_geom_line(geom);
+  if(!l) {
+    sqlite3_result_error(
+      context, "inputs to tg_group_multilinestring() must be LineString geometries",
+      -1);
+    tg_geom_free(geom);
+    return;
+  }
+
+  struct tg_line * l2 = tg_line_clone(l);
+  tg_array_append(array, &l2);
+  tg_geom_free(geom);
+}
+
+static void tg_group_multilinestring_final(sqlite3_context *context) {
+  struct Array *a;
+  a = (struct Array *)sqlite3_aggregate_context(context, sizeof(*a));
+  if (a == 0)
+    return;
+  if (a->z == 0) {
+    // TODO oom handle
+    //resultGeomPointer(context, tg_geom_new_multipolygon_empty());
+  }
+  if (a->length) {
+    struct tg_geom *geom = tg_geom_new_multilinestring((const struct tg_line **) a->z, a->length);
+    if (!geom) {
+      sqlite3_result_error_nomem(context);
+    } else {
+      resultGeomPointer(context, geom);
+    }
+  }else {
+    resultGeomPointer(context, tg_geom_new_multilinestring_empty());
+  }
+  for(int i = 0; i < a->length; i++) {
+    tg_line_free( ( (struct tg_line**) a->z)[i]);
+  }
+  tg_array_cleanup(a);
+}
+
+static void tg_group_geometry_collection_step(sqlite3_context *context, int argc,
+                               sqlite3_value *argv[]) {
+  tg_stats_enter(sqlite3_context_db_handle(context));
+
+  int rc;
+  struct Array *array;
+  array = (struct Array *)sqlite3_aggregate_context(context, sizeof(*array));
+  if (!array) {
+    return;
+  }
+  if(!array->z) {
+    rc = tg_array_init(array, sizeof(struct tg_geom*), 128);
+    if(rc!=SQLITE_OK) {
+      sqlite3_result_error_nomem(context);
+      return;
+    }
+  }
+
+  struct tg_geom *geom;
+  char * errmsg;
+  rc = geomValue(argv[0], &geom, &errmsg);
+  if (rc != SQLITE_OK) {
+    sqlite3_result_error(context, errmsg, -1);
+    sqlite3_free(errmsg);
+    return;
+  }
+
+  struct tg_geom *x = tg_geom_clone(geom);
+  tg_array_append(array, &x);
+  tg_geom_free(geom);
+}
+
+static void tg_group_geometry_collection_final(sqlite3_context *context) {
+  struct Array *a;
+  a = (struct Array *)sqlite3_aggregate_context(context, sizeof(*a));
+  if (a == 0)
+    return;
+  if (a->z == 0) {
+    struct tg_geom * g = tg_geom_new_geometrycollection_empty();
+    if(!g) {
+      sqlite3_result_error_nomem(context);
+    }else {
+      resultGeomPointer(context, g);
+    }
+  }
+  else if (a->length) {
+    struct tg_geom *geom = tg_geom_new_geometrycollection( (const struct tg_geom *const*) a->z, a->length);
+    if (!geom) {
+      sqlite3_result_error_nomem(context);
+    } else {
+      resultGeomPointer(context, geom);
+    }
+  }
+  for(int i = 0; i < a->length; i++) {
+    tg_geom_free( ( (struct tg_geom**) a->z)[i]);
+  }
+  tg_array_cleanup(a);
+}
+
+struct feature_collection_context {
+  sqlite3_str * s;
+  int n;
+};
+static void tg_feature_collection_step(sqlite3_context *context, int argc,
+                               sqlite3_value *argv[]) {
+  tg_stats_enter(sqlite3_context_db_handle(context));
+  int rc;
+  struct feature_collection_context *ctx;
+  ctx = sqlite3_aggregate_context(context, sizeof(*ctx));
+  if(!ctx) {
+    return;
+  }
+  if(!ctx->s) {
+    ctx->s = sqlite3_str_new(NULL);
+    if(!ctx->s) {
+      return;
+    }
+    sqlite3_str_appendall(ctx->s, "{\"type\":\"FeatureCollection\", \"features\": [");
+  }
+  if(ctx->n) {
+    sqlite3_str_appendchar(ctx->s, 1, ',');
+  }
+
+  struct tg_geom *geom;
+  char * errmsg;
+  rc = geomValue(argv[0], &geom, &errmsg);
+  if (rc != SQLITE_OK) {
+    sqlite3_result_error(context, errmsg, -1);
+    sqlite3_free(errmsg);
+    return;
+  }
+
+  size_t size;
+  char *buffer = serializeGeom(geom, tg_geom_geojson,
+                               sqlite3_value_bytes(argv[0]), &size);
+  if (buffer == 0) {
+    sqlite3_result_error_nomem(context);
+    tg_geom_free(geom);
+    return;
+  }
+
+  // if geometry already has extra json ,it's already a Feature object
+  if(tg_geom_extra_json(geom)) {
+    sqlite3_str_appendf(ctx->s, "%.*s", size+1, buffer);
+  }
+  else {
+    sqlite3_str_appendf(ctx->s, "{\"type\": \"Feature\", \"geometry\": %.*s, ", size+1, buffer);
+    if(argc > 1 && sqlite3_value_subtype(argv[1]) == JSON_SUBTYPE) {
+      const unsigned char * s = sqlite3_value_text(argv[1]);
+      int n = sqlite3_value_bytes(argv[1]);
+      sqlite3_str_appendf(ctx->s, "\"properties\": %.*s", n, s);
+    } else {
+      sqlite3_str_appendall(ctx->s, "\"properties\": {}");
+    }
+    sqlite3_str_appendall(ctx->s, "}");
+  }
+  sqlite3_free(buffer);
+  ctx->n++;
+
+  tg_geom_free(geom);
+
+
+}
+
+static void tg_feature_collection_final(sqlite3_context *context) {
+  struct feature_collection_context *ctx;
+  ctx = sqlite3_aggregate_context(context, sizeof(*ctx));
+  if(!ctx) {
+    return;
+  }
+  if(!ctx->s) {
+    return;
+  }
+  sqlite3_str_appendall(ctx->s, "]}");
+  int n = sqlite3_str_length(ctx->s);
+  const char * z = sqlite3_str_finish(ctx->s);
+  sqlite3_result_text(context, z, n, sqlite3_free);
+  sqlite3_result_subtype(context, JSON_SUBTYPE);
+}
+
+#pragma endregion
+
+#pragma region tg_write_geojson()
+
+// A buffered file writer that tg serializes into directly, so exporting
+// features never holds more than one buffer's worth of output in memory.
+struct tg_file_writer {
+  FILE *f;
+  char *buffer;
+  size_t n;
+  size_t capacity;
+};
+
+#define TG_FILE_WRITER_CAPACITY (64 * 1024)
+
+static int tg_file_writer_flush(struct tg_file_writer *w) {
+  if (w->n && fwrite(w->buffer, 1, w->n, w->f) != w->n) {
+    return SQLITE_IOERR;
+  }
+  w->n = 0;
+  return SQLITE_OK;
+}
+
+static int tg_file_writer_append(struct tg_file_writer *w, const char *z,
+                                 size_t n) {
+  if (w->capacity - w->n < n) {
+    int rc = tg_file_writer_flush(w);
+    if (rc != SQLITE_OK)
+      return rc;
+    if (n > w->capacity) {
+      return fwrite(z, 1, n, w->f) == n ? SQLITE_OK : SQLITE_IOERR;
+    }
+  }
+  memcpy(w->buffer + w->n, z, n);
+  w->n += n;
+  return SQLITE_OK;
+}
+
+// Serializes geom as GeoJSON into the free space of the buffer, flushing and
+// retrying when it doesn't fit, and growing the buffer for features larger
+// than the whole buffer.
+static int tg_file_writer_geojson(struct tg_file_writer *w,
+                                  const struct tg_geom *geom) {
+  // tg writes a trailing NUL, so one byte of the free space is not usable
+  size_t size = tg_geom_geojson(geom, w->buffer + w->n, w->capacity - w->n);
+  if (size < w->capacity - w->n) {
+    w->n += size;
+    return SQLITE_OK;
+  }
+  int rc = tg_file_writer_flush(w);
+  if (rc != SQLITE_OK)
+    return rc;
+  if (size >= w->capacity) {
+    char *buffer = sqlite3_realloc64(w->buffer, size + 1);
+    if (!buffer)
+      return SQLITE_NOMEM;
+    w->buffer = buffer;
+    w->capacity = size + 1;
+  }
+  w->n = tg_geom_geojson(geom, w->buffer, w->capacity);
+  return SQLITE_OK;
+}
+
+static int tg_file_writer_open(struct tg_file_writer *w, const char *path) {
+  w->f = fopen(path, "wb");
+  if (!w->f)
+    return SQLITE_CANTOPEN;
+  w->buffer = sqlite3_malloc(TG_FILE_WRITER_CAPACITY);
+  if (!w->buffer) {
+    fclose(w->f);
+    w->f = NULL;
+    return SQLITE_NOMEM;
+  }
+  w->capacity = TG_FILE_WRITER_CAPACITY;
+  w->n = 0;
+  return SQLITE_OK;
+}
+
+static int tg_file_writer_close(struct tg_file_writer *w) {
+  int rc = SQLITE_OK;
+  if (w->f) {
+    rc = tg_file_writer_flush(w);
+    if (fclose(w->f) != 0 && rc == SQLITE_OK)
+      rc = SQLITE_IOERR;
+  }
+  sqlite3_free(w->buffer);
+  memset(w, 0, sizeof(*w));
+  return rc;
+}
+
+// Text written around the features by a tg_write_geojson() variant.
+struct geojson_write_format {
+  const char *zHeader;
+  // between two features
+  const char *zSeparator;
+  // after every feature
+  const char *zTerminator;
+  const char *zFooter;
+};
+
+struct geojson_write_context {
+  struct tg_file_writer writer;
+  sqlite3_int64 n;
+  int failed;
+  // re-serializes $properties, prepared on first use
+  sqlite3_stmt *stmtProperties;
+  // replaces the properties of Feature inputs, prepared on first use
+  sqlite3_stmt *stmtSetProperties;
+};
+
+// Writes the Feature geom with its properties replaced by the given JSON
+// object.
+static int tg_write_geojson_feature(sqlite3_context *context,
+                                    struct geojson_write_context *ctx,
+                                    const struct tg_geom *geom,
+                                    const char *properties, int nProperties) {
+  int rc;
+  if (!ctx->stmtSetProperties) {
+    rc = sqlite3_prepare_v2(sqlite3_context_db_handle(context),
+                            "select json_set(?1, '$.properties', json(?2))",
+                            -1, &ctx->stmtSetProperties, NULL);
+    if (rc != SQLITE_OK)
+      return rc;
+  }
+  size_t size = tg_geom_geojson(geom, NULL, 0);
+  char *zFeature = sqlite3_malloc64(size + 1);
+  if (!zFeature)
+    return SQLITE_NOMEM;
+  tg_geom_geojson(geom, zFeature, size + 1);
+  sqlite3_stmt *stmt = ctx->stmtSetProperties;
+  sqlite3_bind_text(stmt, 1, zFeature, (int)size, sqlite3_free);
+  sqlite3_bind_text(stmt, 2, properties, nProperties, SQLITE_STATIC);
+  if (sqlite3_step(stmt) == SQLITE_ROW) {
+    rc = tg_file_writer_append(&ctx->writer,
+                               (const char *)sqlite3_column_text(stmt, 0),
+                               sqlite3_column_bytes(stmt, 0));
+  } else {
+    rc = sqlite3_errcode(sqlite3_context_db_handle(context));
+  }
+  sqlite3_reset(stmt);
+  sqlite3_clear_bindings(stmt);
+  return rc;
+}
+
+static void tg_write_geojson_step(sqlite3_context *context, int argc,
+                                  sqlite3_value *argv[]) {
+  tg_stats_enter(sqlite3_context_db_handle(context));
+  const struct geojson_write_format *format =
+      (const struct geojson_write_format *)sqlite3_user_data(context);
+  struct geojson_write_context *ctx =
+      sqlite3_aggregate_context(context, sizeof(*ctx));
+  if (!ctx) {
+    sqlite3_result_error_nomem(context);
+    return;
+  }
+  if (ctx->failed) {
+    return;
+  }
+  int rc = SQLITE_OK;
+  if (!ctx->writer.f) {
+    const char *path = (const char *)sqlite3_value_text(argv[0]);
+    if (!path) {
+      ctx->failed = 1;
+      sqlite3_result_error(context, "path must be text", -1);
+      return;
+    }
+    rc = tg_file_writer_open(&ctx->writer, path);
+    if (rc != SQLITE_OK) {
+      ctx->failed = 1;
+      char *zErr = sqlite3_mprintf("could not open %s for writing", path);
+      sqlite3_result_error(context, zErr, -1);
+      sqlite3_free(zErr);
+      return;
+    }
+    rc = tg_file_writer_append(&ctx->writer, format->zHeader,
+                               strlen(format->zHeader));
+    if (rc != SQLITE_OK)
+      goto error;
+  }
+  // NULL geometries are skipped, like other aggregates skip NULLs, but still
+  // create the file, so a left join onto one row always produces an output
+  if (sqlite3_value_type(argv[1]) == SQLITE_NULL &&
+      !sqlite3_value_pointer(argv[1], TG_GEOM_POINTER_NAME)) {
+    return;
+  }
+
+  // properties are written as json() re-serializes them, so malformed JSON
+  // never reaches the file. The text lives until stmtProperties is reset.
+  const char *properties = NULL;
+  int nProperties = 0;
+  if (argc > 2 && sqlite3_value_type(argv[2]) != SQLITE_NULL) {
+    if (!ctx->stmtProperties) {
+      rc = sqlite3_prepare_v2(sqlite3_context_db_handle(context),
+                              "select json(?1)", -1, &ctx->stmtProperties,
+                              NULL);
+      if (rc != SQLITE_OK)
+        goto error;
+    }
+    sqlite3_bind_value(ctx->stmtProperties, 1, argv[2]);
+    if (sqlite3_step(ctx->stmtProperties) == SQLITE_ROW) {
+      properties = (const char *)sqlite3_column_text(ctx->stmtProperties, 0);
+      nProperties = sqlite3_column_bytes(ctx->stmtProperties, 0);
+    }
+    if (!properties || properties[0] != '{') {
+      sqlite3_reset(ctx->stmtProperties);
+      ctx->failed = 1;
+      sqlite3_result_error(context, "properties must be a JSON object", -1);
+      return;
+    }
+  }
+
+  struct tg_geom *geom;
+  char *errmsg;
+  rc = geomValue(argv[1], &geom, &errmsg);
+  if (rc != SQLITE_OK) {
+    if (ctx->stmtProperties)
+      sqlite3_reset(ctx->stmtProperties);
+    ctx->failed = 1;
+    sqlite3_result_error(context, errmsg, -1);
+    sqlite3_free(errmsg);
+    return;
+  }
+  // a FeatureCollection would end up as one Feature's "geometry", which is
+  // not valid GeoJSON
+  if (tg_geom_is_featurecollection(geom)) {
+    tg_geom_free(geom);
+    if (ctx->stmtProperties)
+      sqlite3_reset(ctx->stmtProperties);
+    ctx->failed = 1;
+    sqlite3_result_error(
+        context, "cannot write a FeatureCollection as a single feature", -1);
+    return;
+  }
+
+  struct tg_file_writer *w = &ctx->writer;
+  if (ctx->n) {
+    rc = tg_file_writer_append(w, format->zSeparator,
+                               strlen(format->zSeparator));
+  }
+  // like tg_group_feature_collection_geojson(), geometries with extra json
+  // are already a Feature object, whose properties the argument replaces
+  if (rc == SQLITE_OK && tg_geom_extra_json(geom) && properties) {
+    rc = tg_write_geojson_feature(context, ctx, geom, properties, nProperties);
+  } else if (rc == SQLITE_OK && tg_geom_extra_json(geom)) {
+    rc = tg_file_writer_geojson(w, geom);
+  } else if (rc == SQLITE_OK) {
+    static const char zFeature[] = "{\"type\":\"Feature\",\"geometry\":";
+    static const char zProperties[] = ",\"properties\":";
+    rc = tg_file_writer_append(w, zFeature, sizeof(zFeature) - 1);
+    if (rc == SQLITE_OK)
+      rc = tg_file_writer_geojson(w, geom);
+    if (rc == SQLITE_OK)
+      rc = tg_file_writer_append(w, zProperties, sizeof(zProperties) - 1);
+    if (rc == SQLITE_OK)
+      rc = properties ? tg_file_writer_append(w, properties, nProperties)
+                      : tg_file_writer_append(w, "{}", 2);
+    if (rc == SQLITE_OK)
+      rc = tg_file_writer_append(w, "}", 1);
+  }
+  if (rc == SQLITE_OK) {
+    rc = tg_file_writer_append(w, format->zTerminator,
+                               strlen(format->zTerminator));
+  }
+  tg_geom_free(geom);
+  if (ctx->stmtProperties)
+    sqlite3_reset(ctx->stmtProperties);
+  if (rc != SQLITE_OK)
+    goto error;
+  ctx->n++;
+  return;
+
+error:
+  ctx->failed = 1;
+  if (rc == SQLITE_NOMEM) {
+    sqlite3_result_error_nomem(context);
+  } else {
+    sqlite3_result_error(context, "error writing GeoJSON", -1);
+  }
+}
+
+static void tg_write_geojson_final(sqlite3_context *context) {
+  const struct geojson_write_format *format =
+      (const struct geojson_write_format *)sqlite3_user_data(context);
+  struct geojson_write_context *ctx = sqlite3_aggregate_context(context, 0);
+  if (ctx) {
+    sqlite3_finalize(ctx->stmtProperties);
+    ctx->stmtProperties = NULL;
+    sqlite3_finalize(ctx->stmtSetProperties);
+    ctx->stmtSetProperties = NULL;
+  }
+  if (!ctx || !ctx->writer.f) {
+    sqlite3_result_int64(context, 0);
+    return;
+  }
+  int rc = SQLITE_OK;
+  if (!ctx->failed) {
+    rc = tg_file_writer_append(&ctx->writer, format->zFooter,
+                               strlen(format->zFooter));
+  }
+  int rcClose = tg_file_writer_close(&ctx->writer);
+  if (ctx->failed) {
+    return;
+  }
+  if (rc != SQLITE_OK || rcClose != SQLITE_OK) {
+    sqlite3_result_error(context, "error writing GeoJSON", -1);
+    return;
+  }
+  sqlite3_result_int64(context, ctx->n);
+}
+
+#pragma endregion
+
+
+#pragma endregion
+
+#pragma region each table functions
+
+struct control {
+  // resulting column name in the table function
+  char *name;
+  // free the target
+  void (*xFree)(void *p);
+  // determine if the table function has completed
+  int (*xEof)(void *p, sqlite3_int64 iRowid);
+  // result the column value at the given rowid
+  void (*xResult)(sqlite3_context *context, void *p, sqlite3_int64 iRowid);
+  // for bbox filtering: the multi geometry type whose children are the rows,
+  // found with tg_geom_search(). When 0, rows are scanned with xRect instead.
+  enum tg_geom_type multiType;
+  // bounding box of the item at the given rowid, only needed without multiType
+  struct tg_rect (*xRect)(void *p, sqlite3_int64 iRowid);
+};
+
+#pragma region tg_points_each
+int pointsEachEof(void *p, sqlite3_int64 iRowid) {
+  return iRowid >= tg_geom_num_points((struct tg_geom *)p);
+}
+void pointsEachResult(sqlite3_context *context, void *p, sqlite3_int64 iRowid) {
+  struct tg_point point = tg_geom_point_at((struct tg_geom *)p, iRowid);
+  struct tg_geom *g = tg_geom_new_point(point);
+  sqlite3_result_pointer(context, g, TG_GEOM_POINTER_NAME,
+                         (void (*)(void *))tg_geom_free);
+}
+
+void pointsEachFree(void *p) { tg_geom_free((struct tg_geom *)p); }
+#pragma endregion
+
+#pragma region tg_lines_each
+int linesEachEof(void *p, sqlite3_int64 iRowid) {
+  return iRowid >= tg_geom_num_lines((struct tg_geom *)p);
+}
+void linesEachResult(sqlite3_context *context, void *p, sqlite3_int64 iRowid) {
+  const struct tg_line *line = tg_geom_line_at((struct tg_geom *)p, iRowid);
+  sqlite3_result_pointer(context, (void *)line, TG_GEOM_POINTER_NAME, NULL);
+}
+
+void linesEachFree(void *p) { tg_geom_free((struct tg_geom *)p); }
+#pragma endregion
+
+#pragma region tg_geometries_each
+int geometriesEachEof(void *p, sqlite3_int64 iRowid) {
+  return iRowid >= tg_geom_num_geometries((struct tg_geom *)p);
+}
+void geometriesEachResult(sqlite3_context *context, void *p,
+                          sqlite3_int64 iRowid) {
+  const struct tg_geom *geom = tg_geom_geometry_at((struct tg_geom *)p, iRowid);
+  sqlite3_result_pointer(context, (void *)geom, TG_GEOM_POINTER_NAME, NULL);
+}
+
+void geometriesEachFree(void *p) { tg_geom_free((struct tg_geom *)p); }
+#pragma endregion
+
+#pragma region tg_polygons_each
+int polygonsEachEof(void *p, sqlite3_int64 iRowid) {
+  return iRowid >= tg_geom_num_polys((struct tg_geom *)p);
+}
+void polygonsEachResult(sqlite3_context *context, void *p,
+                        sqlite3_int64 iRowid) {
+  const struct tg_poly *poly = tg_geom_poly_at((struct tg_geom *)p, iRowid);
+
+  // rationale: tg_poly can safely upcast to tg_geom
+  // https://github.com/tidwall/tg/blob/main/docs/API.md#upcasting
+  sqlite3_result_pointer(context, (void *)(void *)poly, TG_GEOM_POINTER_NAME,
+                         NULL);
+}
+
+void polygonsEachFree(void *p) { tg_geom_free((struct tg_geom *)p); }
+#pragma endregion
+
+#pragma region tg_holes_each
+// the cursor target is always the tg_geom from geomValue(); resolve it to a
+// poly here rather than casting, so non-polygon inputs yield zero rows
+// instead of misreading memory
+int holesEachEof(void *p, sqlite3_int64 iRowid) {
+  const struct tg_poly *poly = tg_geom_poly((struct tg_geom *)p);
+  if (!poly)
+    return 1;
+  return iRowid >= tg_poly_num_holes(poly);
+}
+void holesEachResult(sqlite3_context *context, void *p,
+                        sqlite3_int64 iRowid) {
+  const struct tg_poly *poly = tg_geom_poly((struct tg_geom *)p);
+  const struct tg_ring *ring = tg_poly_hole_at(poly, iRowid);
+
+  // rationale: tg_ring can safely upcast to tg_geom
+  sqlite3_result_pointer(context, (void *)(void *)ring, TG_GEOM_POINTER_NAME,
+                         NULL);
+}
+
+struct tg_rect holesEachRect(void *p, sqlite3_int64 iRowid) {
+  const struct tg_poly *poly = tg_geom_poly((struct tg_geom *)p);
+  return tg_ring_rect(tg_poly_hole_at(poly, iRowid));
+}
+
+void holesEachFree(void *p) { tg_geom_free((struct tg_geom *)p); }
+#pragma endregion
+
+typedef struct template_each_vtab template_each_vtab;
+struct template_each_vtab {
+  sqlite3_vtab base;
+  struct control *pControl;
+  sqlite3 *db;
+  // statements for the ->> override, prepared on first use, see tg_each_arrow()
+  sqlite3_stmt *stmtArrow;
+  sqlite3_stmt *stmtJsonb;
+  // a reference to the last feature passed to ->>, the length of its extra
+  // JSON, and its JSONB encoding once a second key is looked up on it, see
+  // tg_each_arrow_memo()
+  struct tg_geom *lastGeom;
+  int nLastJson;
+  void *lastJsonb;
+  int nLastJsonb;
+};
+
+typedef struct template_each_cursor template_each_cursor;
+struct template_each_cursor {
+  sqlite3_vtab_cursor base;
+  sqlite3_int64 iRowid;
+  void *target;
+  // when a bbox argument is given, the sorted rowids of the matching items
+  // (sqlite3_int64), and the position of the current row in it
+  int hasBbox;
+  struct Array matches;
+  sqlite3_int64 iMatch;
+};
+
+static int template_eachConnect(sqlite3 *db, void *pAux, int argc,
+                                const char *const *argv, sqlite3_vtab **ppVtab,
+                                char **pzErr) {
+  template_each_vtab *pNew;
+  int rc;
+
+  struct control *pControl = (struct control *)pAux;
+  const char *schema =
+      sqlite3_mprintf("CREATE TABLE x(%w, source hidden, bbox hidden)",
+                      pControl->name);
+#define TEMPLATE_EACH_TARGET 0
+#define TEMPLATE_EACH_SOURCE 1
+#define TEMPLATE_EACH_BBOX 2
+  rc = sqlite3_declare_vtab(db, schema);
+  sqlite3_free((void *)schema);
+  if (rc == SQLITE_OK) {
+    pNew = sqlite3_malloc(sizeof(*pNew));
+    *ppVtab = (sqlite3_vtab *)pNew;
+    if (pNew == 0)
+      return SQLITE_NOMEM;
+    memset(pNew, 0, sizeof(*pNew));
+    pNew->pControl = pControl;
+    pNew->db = db;
+  }
+  return rc;
+}
+
+static int template_eachDisconnect(sqlite3_vtab *pVtab) {
+  template_each_vtab *p = (template_each_vtab *)pVtab;
+  sqlite3_finalize(p->stmtArrow);
+  sqlite3_finalize(p->stmtJsonb);
+  tg_geom_free(p->lastGeom);
+  sqlite3_free(p->lastJsonb);
+  sqlite3_free(p);
+  return SQLITE_OK;
+}
+
+static int template_eachOpen(sqlite3_vtab *p, sqlite3_vtab_cursor **ppCursor) {
+  template_each_cursor *pCur;
+  pCur = sqlite3_malloc(sizeof(*pCur));
+  if (pCur == 0)
+    return SQLITE_NOMEM;
+  memset(pCur, 0, sizeof(*pCur));
+  *ppCursor = &pCur->base;
+  return SQLITE_OK;
+}
+
+static int template_eachClose(sqlite3_vtab_cursor *cur) {
+  template_each_cursor *pCur = (template_each_cursor *)cur;
+  if (pCur->target) {
+    struct control *pControl = ((template_each_vtab *)cur->pVtab)->pControl;
+    pControl->xFree(pCur->target);
+    pCur->target = NULL;
+  }
+  tg_array_cleanup(&pCur->matches);
+  sqlite3_free(pCur);
+  return SQLITE_OK;
+}
+
+static int template_eachBestIndex(sqlite3_vtab *pVTab,
+                                  sqlite3_index_info *pIdxInfo) {
+  int hasSource = 0;
+  int iBbox = -1;
+  for (int i = 0; i < pIdxInfo->nConstraint; i++) {
+    const struct sqlite3_index_constraint *pCons = &pIdxInfo->aConstraint[i];
+    switch (pCons->iColumn) {
+    case TEMPLATE_EACH_SOURCE: {
+      if (!hasSource && !pCons->usable ||
+          pCons->op != SQLITE_INDEX_CONSTRAINT_EQ)
+        return SQLITE_CONSTRAINT;
+      hasSource = 1;
+      pIdxInfo->aConstraintUsage[i].argvIndex = 1;
+      pIdxInfo->aConstraintUsage[i].omit = 1;
+      break;
+    }
+    case TEMPLATE_EACH_BBOX: {
+      if (!pCons->usable || pCons->op != SQLITE_INDEX_CONSTRAINT_EQ)
+        return SQLITE_CONSTRAINT;
+      iBbox = i;
+      break;
+    }
+    }
+  }
+  if (!hasSource) {
+    pVTab->zErrMsg = sqlite3_mprintf("source argument is required");
+    return SQLITE_ERROR;
+  }
+
+  pIdxInfo->idxNum = 1;
+  pIdxInfo->estimatedCost = (double)10;
+  pIdxInfo->estimatedRows = 10;
+  if (iBbox >= 0) {
+    pIdxInfo->aConstraintUsage[iBbox].argvIndex = 2;
+    pIdxInfo->aConstraintUsage[iBbox].omit = 1;
+    pIdxInfo->idxNum |= 2;
+    pIdxInfo->estimatedCost = (double)5;
+  }
+  return SQLITE_OK;
+}
+
+struct template_each_search_ctx {
+  struct Array *matches;
+  int rc;
+};
+
+static bool template_each_search_iter(const struct tg_geom *child, int index,
+                                      void *udata) {
+  struct template_each_search_ctx *ctx =
+      (struct template_each_search_ctx *)udata;
+  sqlite3_int64 iRowid = index;
+  ctx->rc = tg_array_append(ctx->matches, &iRowid);
+  return ctx->rc == SQLITE_OK;
+}
+
+static int template_each_rowid_cmp(const void *a, const void *b) {
+  sqlite3_int64 x = *(const sqlite3_int64 *)a;
+  sqlite3_int64 y = *(const sqlite3_int64 *)b;
+  return (x > y) - (x < y);
+}
+
+// Collects the rowids of the items of target whose bounding boxes intersect
+// rect. Children of multi geometries come from tg_geom_search(), which uses
+// the geometry's own index when tg built one, and are put back in rowid order.
+static int template_each_search(struct control *pControl, struct tg_geom *target,
+                                struct tg_rect rect, struct Array *matches) {
+  int rc = tg_array_init(matches, sizeof(sqlite3_int64), 8);
+  if (rc != SQLITE_OK)
+    return rc;
+  if (pControl->multiType) {
+    if (tg_geom_typeof(target) != pControl->multiType)
+      return SQLITE_OK;
+    struct template_each_search_ctx ctx = {matches, SQLITE_OK};
+    tg_geom_search(target, rect, template_each_search_iter, &ctx);
+    if (ctx.rc != SQLITE_OK)
+      return ctx.rc;
+    qsort(matches->z, matches->length, sizeof(sqlite3_int64),
+          template_each_rowid_cmp);
+    return SQLITE_OK;
+  }
+  for (sqlite3_int64 i = 0; !pControl->xEof(target, i); i++) {
+    if (tg_rect_intersects_rect(pControl->xRect(target, i), rect)) {
+      rc = tg_array_append(matches, &i);
+      if (rc != SQLITE_OK)
+        return rc;
+    }
+  }
+  return SQLITE_OK;
+}
+
+static int template_eachFilter(sqlite3_vtab_cursor *pVtabCursor, int idxNum,
+                               const char *idxStr, int argc,
+                               sqlite3_value **argv) {
+  template_each_cursor *pCur = (template_each_cursor *)pVtabCursor;
+  pCur->iRowid = 0;
+  tg_stats_enter(((template_each_vtab *)pVtabCursor->pVtab)->db);
+  struct control *pControl =
+      ((template_each_vtab *)pVtabCursor->pVtab)->pControl;
+  if (pCur->target) {
+    pControl->xFree(pCur->target);
+    pCur->target = 0;
+  }
+  struct tg_geom *geom;
+  char * errmsg;
+  int rc = geomValue(argv[0], &geom, &errmsg);
+  if (rc != SQLITE_OK) {
+    sqlite3_free(pVtabCursor->pVtab->zErrMsg);
+    pVtabCursor->pVtab->zErrMsg = sqlite3_mprintf("%s", errmsg);
+    sqlite3_free(errmsg);
+    return SQLITE_ERROR;
+  }
+  pCur->target = geom;
+
+  tg_array_cleanup(&pCur->matches);
+  pCur->iMatch = 0;
+  pCur->hasBbox = (idxNum & 2) && argc > 1 &&
+                  sqlite3_value_type(argv[1]) != SQLITE_NULL;
+  if (pCur->hasBbox) {
+    struct tg_geom *bbox;
+    rc = geomValue(argv[1], &bbox, &errmsg);
+    if (rc != SQLITE_OK) {
+      sqlite3_free(pVtabCursor->pVtab->zErrMsg);
+      pVtabCursor->pVtab->zErrMsg = sqlite3_mprintf("%s", errmsg);
+      sqlite3_free(errmsg);
+      return SQLITE_ERROR;
+    }
+    struct tg_rect rect = tg_geom_rect(bbox);
+    tg_geom_free(bbox);
+    rc = template_each_search(pControl, geom, rect, &pCur->matches);
+    if (rc != SQLITE_OK) {
+      return rc;
+    }
+    if (pCur->matches.length) {
+      pCur->iRowid = ((sqlite3_int64 *)pCur->matches.z)[0];
+    }
+  }
+  return SQLITE_OK;
+}
+
+static int template_eachRowid(sqlite3_vtab_cursor *cur, sqlite_int64 *pRowid) {
+  template_each_cursor *pCur = (template_each_cursor *)cur;
+  *pRowid = pCur->iRowid;
+  return SQLITE_OK;
+}
+
+static int template_eachNext(sqlite3_vtab_cursor *cur) {
+  template_each_cursor *pCur = (template_each_cursor *)cur;
+  if (pCur->hasBbox) {
+    pCur->iMatch++;
+    if (pCur->iMatch < (sqlite3_int64)pCur->matches.length) {
+      pCur->iRowid = ((sqlite3_int64 *)pCur->matches.z)[pCur->iMatch];
+    }
+    return SQLITE_OK;
+  }
+  pCur->iRowid++;
+  return SQLITE_OK;
+}
+
+static int template_eachEof(sqlite3_vtab_cursor *cur) {
+  template_each_cursor *pCur = (template_each_cursor *)cur;
+  if (pCur->hasBbox) {
+    return pCur->iMatch >= (sqlite3_int64)pCur->matches.length;
+  }
+  struct control *pControl = ((template_each_vtab *)cur->pVtab)->pControl;
+  return pControl->xEof(pCur->target, pCur->iRowid);
+}
+
+static int template_eachColumn(sqlite3_vtab_cursor *cur,
+                               sqlite3_context *context, int i) {
+  template_each_cursor *pCur = (template_each_cursor *)cur;
+  switch (i) {
+  case TEMPLATE_EACH_TARGET: {
+    struct control *pControl =
+        ((template_each_vtab *)pCur->base.pVtab)->pControl;
+    pControl->xResult(context, pCur->target, pCur->iRowid);
+    break;
+  }
+  }
+  return SQLITE_OK;
+}
+
+
+// Remembers the feature ->> was last called on, and encodes its extra JSON
+// as JSONB the second time a key is requested from the same feature, so
+// features that are only asked for one key never pay for the extra jsonb()
+// step. The memo holds a reference rather than a copy: a tg_each() row hands
+// out clones of one geometry, so its extra JSON pointer is the key, and as
+// the reference keeps that text alive the pointer can't be reused by another
+// feature. Only equal-length text at another address (the same GeoJSON
+// parsed again) is compared. Without JSONB support (SQLite before 3.45.0)
+// nothing is cached and ->> works on the JSON text directly.
+static int tg_each_arrow_memo(template_each_vtab *p, struct tg_geom *g) {
+  if (sqlite3_libversion_number() < 3045000) {
+    return SQLITE_OK;
+  }
+  const char *json = tg_geom_extra_json(g);
+  const char *last = p->lastGeom ? tg_geom_extra_json(p->lastGeom) : NULL;
+  if (json != last) {
+    int n = (int)strlen(json);
+    if (!last || p->nLastJson != n || memcmp(last, json, n) != 0) {
+      tg_geom_free(p->lastGeom);
+      sqlite3_free(p->lastJsonb);
+      p->lastJsonb = NULL;
+      p->lastGeom = tg_geom_clone(g);
+      p->nLastJson = n;
+      return SQLITE_OK;
+    }
+  }
+  if (p->lastJsonb) {
+    return SQLITE_OK;
+  }
+
+  int rc;
+  if (!p->stmtJsonb) {
+    rc = sqlite3_prepare_v3(p->db, "select jsonb(?1)", -1,
+                            SQLITE_PREPARE_PERSISTENT, &p->stmtJsonb, NULL);
+    if (rc != SQLITE_OK)
+      return rc;
+  }
+  sqlite3_bind_text(p->stmtJsonb, 1, json, p->nLastJson, SQLITE_STATIC);
+  rc = sqlite3_step(p->stmtJsonb);
+  if (rc == SQLITE_ROW) {
+    int nJsonb = sqlite3_column_bytes(p->stmtJsonb, 0);
+    p->lastJsonb = sqlite3_malloc(nJsonb > 0 ? nJsonb : 1);
+    if (p->lastJsonb) {
+      memcpy(p->lastJsonb, sqlite3_column_blob(p->stmtJsonb, 0), nJsonb);
+      p->nLastJsonb = nJsonb;
+      rc = SQLITE_OK;
+    } else {
+      rc = SQLITE_NOMEM;
+    }
+  }
+  sqlite3_reset(p->stmtJsonb);
+  sqlite3_clear_bindings(p->stmtJsonb);
+  return rc;
+}
+
+// overwrite `->>` on `tg_each()` to extract JSON path from `tg_geom_extra_json()`
+static void tg_each_arrow(sqlite3_context *context, int argc,
+                              sqlite3_value **argv) {
+  tg_stats_enter(sqlite3_context_db_handle(context));
+  int rc;
+  template_each_vtab *p = (template_each_vtab *)sqlite3_user_data(context);
+  sqlite3_stmt *stmt = NULL;
+  struct tg_geom *g = NULL;
+  char * errmsg = NULL;
+
+  rc = geomValue(argv[0], &g, &errmsg);
+  if (rc != SQLITE_OK) {
+    sqlite3_result_error(context, errmsg, -1);
+    sqlite3_free(errmsg);
+    goto cleanup;
+  }
+
+  const char * extra_json = tg_geom_extra_json(g);
+  if(!extra_json) {
+    goto cleanup;
+  }
+
+  if (!p->stmtArrow) {
+    rc = sqlite3_prepare_v3(p->db, "select ?1 ->> ?2", -1,
+                            SQLITE_PREPARE_PERSISTENT, &p->stmtArrow, NULL);
+    if (rc != SQLITE_OK) {
+      sqlite3_result_error(context, "error preparing", -1);
+      goto cleanup;
+    }
+  }
+  stmt = p->stmtArrow;
+
+  rc = tg_each_arrow_memo(p, g);
+  if (rc != SQLITE_OK) {
+    sqlite3_result_error(context, sqlite3_errmsg(p->db), -1);
+    stmt = NULL;
+    goto cleanup;
+  }
+  // both the memo and the geometry outlive this call, so bind without copying
+  if (p->lastJsonb) {
+    sqlite3_bind_blob(stmt, 1, p->lastJsonb, p->nLastJsonb, SQLITE_STATIC);
+  } else {
+    sqlite3_bind_text(stmt, 1, extra_json, -1, SQLITE_STATIC);
+  }
+  sqlite3_bind_value(stmt, 2, argv[1]);
+  rc = sqlite3_step(stmt);
+  if(rc != SQLITE_ROW) {
+    sqlite3_result_error(context, sqlite3_errmsg(sqlite3_context_db_handle(context)), -1);
+    goto cleanup;
+  }
+  sqlite3_result_value(context, sqlite3_column_value(stmt, 0));
+
+  cleanup:
+    tg_geom_free(g);
+    if (stmt) {
+      sqlite3_reset(stmt);
+      sqlite3_clear_bindings(stmt);
+    }
+}
+static int template_eachFindFunction(sqlite3_vtab *pVtab, int nArg, const char *zName,
+                           void (**pxFunc)(sqlite3_context *, int,
+                                           sqlite3_value **),
+                           void **ppArg) {
+  if (sqlite3_stricmp(zName, "->>") == 0 && nArg == 2) {
+    *pxFunc = tg_each_arrow;
+    *ppArg = pVtab;
+    return 1;
+  }
+  return 0;
+}
+
+static sqlite3_module template_eachModule = {
+    /* iVersion    */ 0,
+    /* xCreate     */ 0,
+    /* xConnect    */ template_eachConnect,
+    /* xBestIndex  */ template_eachBestIndex,
+    /* xDisconnect */ template_eachDisconnect,
+    /* xDestroy    */ 0,
+    /* xOpen       */ template_eachOpen,
+    /* xClose      */ template_eachClose,
+    /* xFilter     */ template_eachFilter,
+    /* xNext       */ template_eachNext,
+    /* xEof        */ template_eachEof,
+    /* xColumn     */ template_eachColumn,
+    /* xRowid      */ template_eachRowid,
+    /* xUpdate     */ 0,
+    /* xBegin      */ 0,
+    /* xSync       */ 0,
+    /* xCommit     */ 0,
+    /* xRollback   */ 0,
+    /* xFindMethod */ template_eachFindFunction,
+    /* xRename     */ 0,
+    /* xSavepoint  */ 0,
+    /* xRelease    */ 0,
+    /* xRollbackTo */ 0,
+    /* xShadowName */ 0};
+#pragma endregion
+
+#pragma region tg_bbox() table function
+
+typedef struct tg_bbox_vtab tg_bbox_vtab;
+struct tg_bbox_vtab {
+  sqlite3_vtab base;
+  sqlite3 *db;
+};
+
+typedef struct tg_bbox_cursor tg_bbox_cursor;
+struct tg_bbox_cursor {
+  sqlite3_vtab_cursor base;
+  sqlite3_int64 iRowid;
+  struct tg_rect rect;
+};
+
+static int tg_bboxConnect(sqlite3 *db, void *pAux, int argc,
+                          const char *const *argv, sqlite3_vtab **ppVtab,
+                          char **pzErr) {
+  tg_bbox_vtab *pNew;
+  int rc;
+#define TG_BBOX_MINX 0
+#define TG_BBOX_MAXX 1
+#define TG_BBOX_MINY 2
+#define TG_BBOX_MAXY 3
+#define TG_BBOX_SOURCE 4
+  rc = sqlite3_declare_vtab(
+      db, "CREATE TABLE x(minX, maxX, minY, maxY, source hidden)");
+  if (rc == SQLITE_OK) {
+    pNew = sqlite3_malloc(sizeof(*pNew));
+    *ppVtab = (sqlite3_vtab *)pNew;
+    if (pNew == 0)
+      return SQLITE_NOMEM;
+    memset(pNew, 0, sizeof(*pNew));
+    pNew->db = db;
+  }
+  return rc;
+}
+
+static int tg_bboxDisconnect(sqlite3_vtab *pVtab) {
+  tg_bbox_vtab *p = (tg_bbox_vtab *)pVtab;
+  sqlite3_free(p);
+  return SQLITE_OK;
+}
+
+static int tg_bboxOpen(sqlite3_vtab *p, sqlite3_vtab_cursor **ppCursor) {
+  tg_bbox_cursor *pCur;
+  pCur = sqlite3_malloc(sizeof(*pCur));
+  if (pCur == 0)
+    return SQLITE_NOMEM;
+  memset(pCur, 0, sizeof(*pCur));
+  *ppCursor = &pCur->base;
+  return SQLITE_OK;
+}
+
+static int tg_bboxClose(sqlite3_vtab_cursor *cur) {
+  tg_bbox_cursor *pCur = (tg_bbox_cursor *)cur;
+  sqlite3_free(pCur);
+  return SQLITE_OK;
+}
+
+static int tg_bboxBestIndex(sqlite3_vtab *pVTab, sqlite3_index_info *pIdxInfo) {
+  int hasSource = 0;
+  for (int i = 0; i < pIdxInfo->nConstraint; i++) {
+    const struct sqlite3_index_constraint *pCons = &pIdxInfo->aConstraint[i];
+    switch (pCons->iColumn) {
+    case TG_BBOX_SOURCE: {
+      if (!hasSource && !pCons->usable ||
+          pCons->op != SQLITE_INDEX_CONSTRAINT_EQ)
+        return SQLITE_CONSTRAINT;
+      hasSource = 1;
+      pIdxInfo->aConstraintUsage[i].argvIndex = 1;
+      pIdxInfo->aConstraintUsage[i].omit = 1;
+    }
+    }
+  }
+  if (!hasSource) {
+    pVTab->zErrMsg = sqlite3_mprintf("source argument is required");
+    return SQLITE_ERROR;
+  }
+
+  pIdxInfo->idxNum = 1;
+  pIdxInfo->estimatedCost = (double)10;
+  pIdxInfo->estimatedRows = 10;
+  return SQLITE_OK;
+}
+
+static int tg_bboxFilter(sqlite3_vtab_cursor *pVtabCursor, int idxNum,
+                         const char *idxStr, int argc, sqlite3_value **argv) {
+  tg_bbox_cursor *pCur = (tg_bbox_cursor *)pVtabCursor;
+  pCur->iRowid = 0;
+  tg_stats_enter(((tg_bbox_vtab *)pVtabCursor->pVtab)->db);
+  struct tg_geom *geom;
+  char * errmsg;
+  int rc = geomValue(argv[0], &geom, &errmsg);
+  if (rc != SQLITE_OK) {
+    sqlite3_free(pVtabCursor->pVtab->zErrMsg);
+    pVtabCursor->pVtab->zErrMsg = sqlite3_mprintf("%s", errmsg);
+    sqlite3_free(errmsg);
+    return SQLITE_ERROR;
+  }
+
+  pCur->rect = tg_geom_rect(geom);
+  tg_geom_free(geom);
+  return SQLITE_OK;
+}
+
+static int tg_bboxRowid(sqlite3_vtab_cursor *cur, sqlite_int64 *pRowid) {
+  tg_bbox_cursor *pCur = (tg_bbox_cursor *)cur;
+  *pRowid = pCur->iRowid;
+  return SQLITE_OK;
+}
+
+static int tg_bboxNext(sqlite3_vtab_cursor *cur) {
+  tg_bbox_cursor *pCur = (tg_bbox_cursor *)cur;
+  pCur->iRowid++;
+  return SQLITE_OK;
+}
+
+static int tg_bboxEof(sqlite3_vtab_cursor *cur) {
+  tg_bbox_cursor *pCur = (tg_bbox_cursor *)cur;
+  return pCur->iRowid >= 1;
+}
+
+static int tg_bboxColumn(sqlite3_vtab_cursor *cur, sqlite3_context *context,
+                         int i) {
+  tg_bbox_cursor *pCur = (tg_bbox_cursor *)cur;
+  switch (i) {
+  case TG_BBOX_MINX:
+    sqlite3_result_double(context, pCur->rect.min.x);
+    break;
+  case TG_BBOX_MAXX:
+    sqlite3_result_double(context, pCur->rect.max.x);
+    break;
+  case TG_BBOX_MINY:
+    sqlite3_result_double(context, pCur->rect.min.y);
+    break;
+  case TG_BBOX_MAXY:
+    sqlite3_result_double(context, pCur->rect.max.y);
+    break;
+  case TG_BBOX_SOURCE:
+    // TODO resolve back to original geometry?
+    sqlite3_result_null(context);
+    break;
+  }
+  return SQLITE_OK;
+}
+
+static sqlite3_module tg_bboxModule = {
+    /* iVersion    */ 0,
+    /* xCreate     */ 0,
+    /* xConnect    */ tg_bboxConnect,
+    /* xBestIndex  */ tg_bboxBestIndex,
+    /* xDisconnect */ tg_bboxDisconnect,
+    /* xDestroy    */ 0,
+    /* xOpen       */ tg_bboxOpen,
+    /* xClose      */ tg_bboxClose,
+    /* xFilter     */ tg_bboxFilter,
+    /* xNext       */ tg_bboxNext,
+    /* xEof        */ tg_bboxEof,
+    /* xColumn     */ tg_bboxColumn,
+    /* xRowid      */ tg_bboxRowid,
+    /* xUpdate     */ 0,
+    /* xBegin      */ 0,
+    /* xSync       */ 0,
+    /* xCommit     */ 0,
+    /* xRollback   */ 0,
+    /* xFindMethod */ 0,
+    /* xRename     */ 0,
+    /* xSavepoint  */ 0,
+    /* xRelease    */ 0,
+    /* xRollbackTo */ 0,
+    /* xShadowName */ 0};
+#pragma endregion
+
+#pragma region tg_coords() table function
+
+// One run of coordinates in a geometry: a Point, a LineString, a single ring
+// of a Polygon, or all the points of a MultiPoint. Runs are flattened from the
+// geometry once per xFilter, and coordinates are read straight out of them.
+struct coords_run {
+  // The vertices of a line or ring. NULL for points, which are read with
+  // tg_geom_point_at() from multipoint instead (or from point, for a Point).
+  const struct tg_point *points;
+  const struct tg_geom *multipoint;
+  struct tg_point point;
+  int n;
+  // the part_index of the run, or of the first vertex if partPerVertex
+  int part;
+  int partPerVertex;
+  // the ring_index of the run, or -1 for non-polygons (NULL ring_index)
+  int ring;
+  // Z and/or M values for the run, (hasZ + hasM) per vertex. Can be shorter
+  // than n vertices, in which case the missing values are 0 (like tg does).
+  const double *extra;
+  int nExtra;
+  double pointExtra[2];
+  int hasZ;
+  int hasM;
+  // rowid of the first vertex in this run
+  sqlite3_int64 offset;
+};
+
+typedef struct tg_coords_vtab tg_coords_vtab;
+struct tg_coords_vtab {
+  sqlite3_vtab base;
+  sqlite3 *db;
+};
+
+typedef struct tg_coords_cursor tg_coords_cursor;
+struct tg_coords_cursor {
+  sqlite3_vtab_cursor base;
+  // the source geometry, owned by the cursor
+  struct tg_geom *geom;
+  struct Array runs;
+  // current position: index into runs, and vertex index inside that run
+  int iRun;
+  sqlite3_int64 iVertex;
+  // inclusive bounds from rowid and vertex_index constraints
+  sqlite3_int64 rowidMin;
+  sqlite3_int64 rowidMax;
+  sqlite3_int64 vertexMin;
+  sqlite3_int64 vertexMax;
+};
+
+#define TG_COORDS_X 0
+#define TG_COORDS_Y 1
+#define TG_COORDS_Z 2
+#define TG_COORDS_M 3
+#define TG_COORDS_PART_INDEX 4
+#define TG_COORDS_RING_INDEX 5
+#define TG_COORDS_VERTEX_INDEX 6
+#define TG_COORDS_SOURCE 7
+
+#define TG_COORDS_MAX_INDEX ((sqlite3_int64)0x7fffffffffffffffLL)
+
+static int tg_coordsConnect(sqlite3 *db, void *pAux, int argc,
+                            const char *const *argv, sqlite3_vtab **ppVtab,
+                            char **pzErr) {
+  tg_coords_vtab *pNew;
+  int rc = sqlite3_declare_vtab(
+      db, "CREATE TABLE x(x, y, z, m, part_index, ring_index, vertex_index, "
+          "source hidden)");
+  if (rc == SQLITE_OK) {
+    pNew = sqlite3_malloc(sizeof(*pNew));
+    *ppVtab = (sqlite3_vtab *)pNew;
+    if (pNew == 0)
+      return SQLITE_NOMEM;
+    memset(pNew, 0, sizeof(*pNew));
+    pNew->db = db;
+  }
+  return rc;
+}
+
+static int tg_coordsDisconnect(sqlite3_vtab *pVtab) {
+  sqlite3_free(pVtab);
+  return SQLITE_OK;
+}
+
+static int tg_coordsOpen(sqlite3_vtab *p, sqlite3_vtab_cursor **ppCursor) {
+  tg_coords_cursor *pCur = sqlite3_malloc(sizeof(*pCur));
+  if (pCur == 0)
+    return SQLITE_NOMEM;
+  memset(pCur, 0, sizeof(*pCur));
+  *ppCursor = &pCur->base;
+  return SQLITE_OK;
+}
+
+static void tg_coords_cursor_reset(tg_coords_cursor *pCur) {
+  tg_geom_free(pCur->geom);
+  pCur->geom = NULL;
+  tg_array_cleanup(&pCur->runs);
+}
+
+static int tg_coordsClose(sqlite3_vtab_cursor *cur) {
+  tg_coords_cursor *pCur = (tg_coords_cursor *)cur;
+  tg_coords_cursor_reset(pCur);
+  sqlite3_free(pCur);
+  return SQLITE_OK;
+}
+
+// idxStr is "s" for the source argument, followed by one pair of characters
+// per rowid ('r') or vertex_index ('v') constraint, in argv order, naming the
+// column and the operator: '=', '>', 'G' (>=), '<', 'L' (<=).
+static int tg_coordsBestIndex(sqlite3_vtab *pVTab,
+                              sqlite3_index_info *pIdxInfo) {
+  int iSource = -1;
+  char zIdx[64] = "s";
+  int nIdx = 1;
+  int nArg = 1;
+  for (int i = 0; i < pIdxInfo->nConstraint; i++) {
+    const struct sqlite3_index_constraint *pCons = &pIdxInfo->aConstraint[i];
+    if (pCons->iColumn == TG_COORDS_SOURCE) {
+      if (!pCons->usable || pCons->op != SQLITE_INDEX_CONSTRAINT_EQ)
+        return SQLITE_CONSTRAINT;
+      iSource = i;
+      continue;
+    }
+    if (!pCons->usable)
+      continue;
+    if (pCons->iColumn != -1 && pCons->iColumn != TG_COORDS_VERTEX_INDEX)
+      continue;
+    char op;
+    switch (pCons->op) {
+    case SQLITE_INDEX_CONSTRAINT_EQ:
+      op = '=';
+      break;
+    case SQLITE_INDEX_CONSTRAINT_GT:
+      op = '>';
+      break;
+    case SQLITE_INDEX_CONSTRAINT_GE:
+      op = 'G';
+      break;
+    case SQLITE_INDEX_CONSTRAINT_LT:
+      op = '<';
+      break;
+    case SQLITE_INDEX_CONSTRAINT_LE:
+      op = 'L';
+      break;
+    default:
+      continue;
+    }
+    if (nIdx + 2 >= (int)sizeof(zIdx))
+      continue;
+    zIdx[nIdx++] = pCons->iColumn == -1 ? 'r' : 'v';
+    zIdx[nIdx++] = op;
+    pIdxInfo->aConstraintUsage[i].argvIndex = ++nArg;
+    pIdxInfo->aConstraintUsage[i].omit = 1;
+  }
+  if (iSource < 0) {
+    pVTab->zErrMsg = sqlite3_mprintf("source argument is required");
+    return SQLITE_ERROR;
+  }
+  pIdxInfo->aConstraintUsage[iSource].argvIndex = 1;
+  pIdxInfo->aConstraintUsage[iSource].omit = 1;
+  zIdx[nIdx] = 0;
+
+  pIdxInfo->idxNum = 1;
+  pIdxInfo->idxStr = sqlite3_mprintf("%s", zIdx);
+  pIdxInfo->needToFreeIdxStr = 1;
+  pIdxInfo->estimatedCost = nIdx > 1 ? (double)10 : (double)1000;
+  pIdxInfo->estimatedRows = nIdx > 1 ? 10 : 1000;
+  if (pIdxInfo->nOrderBy == 1 && pIdxInfo->aOrderBy[0].iColumn == -1 &&
+      !pIdxInfo->aOrderBy[0].desc) {
+    pIdxInfo->orderByConsumed = 1;
+  }
+  return SQLITE_OK;
+}
+
+// Appends the runs of geom to the cursor. part is the part_index to use
+// (members of a collection all get the index of the member), or -1 to number
+// the parts of a Multi* geometry.
+static int tg_coords_add_runs(tg_coords_cursor *pCur,
+                              const struct tg_geom *geom, int part,
+                              sqlite3_int64 *pOffset) {
+  struct coords_run run;
+  memset(&run, 0, sizeof(run));
+  run.hasZ = tg_geom_has_z(geom);
+  run.hasM = tg_geom_has_m(geom);
+  int stride = run.hasZ + run.hasM;
+  const double *extra = tg_geom_extra_coords(geom);
+  int nExtra = tg_geom_num_extra_coords(geom);
+  int rc;
+
+#define COORDS_ADD_RUN()                                                       \
+  do {                                                                         \
+    run.extra = extra;                                                         \
+    run.nExtra = nExtra > 0 ? nExtra : 0;                                      \
+    run.offset = *pOffset;                                                     \
+    *pOffset += run.n;                                                         \
+    rc = tg_array_append(&pCur->runs, &run);                                   \
+    if (rc != SQLITE_OK)                                                       \
+      return rc;                                                               \
+    if (extra && nExtra > 0) {                                                 \
+      extra += (sqlite3_int64)run.n * stride;                                  \
+      nExtra -= run.n * stride;                                                \
+    }                                                                          \
+  } while (0)
+
+  switch (tg_geom_typeof(geom)) {
+  case TG_POINT: {
+    if (tg_geom_is_empty(geom))
+      return SQLITE_OK;
+    run.point = tg_geom_point(geom);
+    run.n = 1;
+    run.part = part < 0 ? 0 : part;
+    run.ring = -1;
+    int j = 0;
+    if (run.hasZ)
+      run.pointExtra[j++] = tg_geom_z(geom);
+    if (run.hasM)
+      run.pointExtra[j++] = tg_geom_m(geom);
+    // read back from the run's own pointExtra in tg_coordsColumn()
+    extra = NULL;
+    nExtra = j;
+    COORDS_ADD_RUN();
+    return SQLITE_OK;
+  }
+  case TG_LINESTRING: {
+    const struct tg_line *line = tg_geom_line(geom);
+    run.points = tg_line_points(line);
+    run.n = tg_line_num_points(line);
+    run.part = part < 0 ? 0 : part;
+    run.ring = -1;
+    if (run.n)
+      COORDS_ADD_RUN();
+    return SQLITE_OK;
+  }
+  case TG_POLYGON:
+  case TG_MULTIPOLYGON: {
+    int nPolys = tg_geom_typeof(geom) == TG_POLYGON ? 1 : tg_geom_num_polys(geom);
+    for (int i = 0; i < nPolys; i++) {
+      const struct tg_poly *poly = tg_geom_typeof(geom) == TG_POLYGON
+                                       ? tg_geom_poly(geom)
+                                       : tg_geom_poly_at(geom, i);
+      run.part = part < 0 ? i : part;
+      int nHoles = tg_poly_num_holes(poly);
+      for (int r = 0; r <= nHoles; r++) {
+        const struct tg_ring *ring =
+            r == 0 ? tg_poly_exterior(poly) : tg_poly_hole_at(poly, r - 1);
+        run.points = tg_ring_points(ring);
+        run.n = tg_ring_num_points(ring);
+        run.ring = r;
+        if (run.n)
+          COORDS_ADD_RUN();
+      }
+    }
+    return SQLITE_OK;
+  }
+  case TG_MULTIPOINT: {
+    run.multipoint = geom;
+    run.n = tg_geom_num_points(geom);
+    run.part = part < 0 ? 0 : part;
+    run.partPerVertex = part < 0;
+    run.ring = -1;
+    if (run.n)
+      COORDS_ADD_RUN();
+    return SQLITE_OK;
+  }
+  case TG_MULTILINESTRING: {
+    int nLines = tg_geom_num_lines(geom);
+    for (int i = 0; i < nLines; i++) {
+      const struct tg_line *line = tg_geom_line_at(geom, i);
+      run.points = tg_line_points(line);
+      run.n = tg_line_num_points(line);
+      run.part = part < 0 ? i : part;
+      run.ring = -1;
+      if (run.n)
+        COORDS_ADD_RUN();
+    }
+    return SQLITE_OK;
+  }
+  case TG_GEOMETRYCOLLECTION: {
+    int nGeoms = tg_geom_num_geometries(geom);
+    for (int i = 0; i < nGeoms; i++) {
+      rc = tg_coords_add_runs(pCur, tg_geom_geometry_at(geom, i),
+                              part < 0 ? i : part, pOffset);
+      if (rc != SQLITE_OK)
+        return rc;
+    }
+    return SQLITE_OK;
+  }
+  }
+#undef COORDS_ADD_RUN
+  return SQLITE_OK;
+}
+
+static struct coords_run *tg_coords_run_at(tg_coords_cursor *pCur, int i) {
+  return &((struct coords_run *)pCur->runs.z)[i];
+}
+
+// Moves the cursor to the first vertex at or after (iRun, iVertex) that
+// satisfies the rowid and vertex_index bounds.
+static void tg_coords_seek(tg_coords_cursor *pCur) {
+  while (pCur->iRun < (int)pCur->runs.length) {
+    struct coords_run *run = tg_coords_run_at(pCur, pCur->iRun);
+    if (run->offset > pCur->rowidMax) {
+      break;
+    }
+    // every vertex of a MultiPoint's run reports vertex_index 0, so the
+    // bounds take all of the run or none of it
+    sqlite3_int64 lo = pCur->vertexMin;
+    sqlite3_int64 hi = pCur->vertexMax;
+    if (run->partPerVertex) {
+      int matches = pCur->vertexMin <= 0 && pCur->vertexMax >= 0;
+      lo = matches ? 0 : 1;
+      hi = matches ? TG_COORDS_MAX_INDEX : 0;
+    }
+    if (pCur->rowidMin - run->offset > lo)
+      lo = pCur->rowidMin - run->offset;
+    if (pCur->rowidMax - run->offset < hi)
+      hi = pCur->rowidMax - run->offset;
+    if (hi > run->n - 1)
+      hi = run->n - 1;
+    if (pCur->iVertex < lo)
+      pCur->iVertex = lo;
+    if (pCur->iVertex <= hi) {
+      return;
+    }
+    pCur->iRun++;
+    pCur->iVertex = 0;
+  }
+  pCur->iRun = (int)pCur->runs.length;
+}
+
+static int tg_coordsFilter(sqlite3_vtab_cursor *pVtabCursor, int idxNum,
+                           const char *idxStr, int argc,
+                           sqlite3_value **argv) {
+  tg_coords_cursor *pCur = (tg_coords_cursor *)pVtabCursor;
+  tg_coords_cursor_reset(pCur);
+  tg_stats_enter(((tg_coords_vtab *)pVtabCursor->pVtab)->db);
+
+  char *errmsg;
+  int rc = geomValue(argv[0], &pCur->geom, &errmsg);
+  if (rc != SQLITE_OK) {
+    sqlite3_free(pVtabCursor->pVtab->zErrMsg);
+    pVtabCursor->pVtab->zErrMsg = sqlite3_mprintf("%s", errmsg);
+    sqlite3_free(errmsg);
+    return SQLITE_ERROR;
+  }
+
+  pCur->rowidMin = 0;
+  pCur->rowidMax = TG_COORDS_MAX_INDEX;
+  pCur->vertexMin = 0;
+  pCur->vertexMax = TG_COORDS_MAX_INDEX;
+  for (int i = 1; idxStr[i] && idxStr[i + 1] && (i + 1) / 2 < argc; i += 2) {
+    sqlite3_value *value = argv[(i + 1) / 2];
+    int type = sqlite3_value_numeric_type(value);
+    sqlite3_int64 *pMin = idxStr[i] == 'r' ? &pCur->rowidMin : &pCur->vertexMin;
+    sqlite3_int64 *pMax = idxStr[i] == 'r' ? &pCur->rowidMax : &pCur->vertexMax;
+    if (type != SQLITE_INTEGER && type != SQLITE_FLOAT) {
+      // comparisons against NULL or non-numbers never match
+      *pMin = 1;
+      *pMax = 0;
+      continue;
+    }
+    double d = sqlite3_value_double(value);
+    if (d > 9e18)
+      d = 9e18;
+    if (d < -9e18)
+      d = -9e18;
+    // round towards the integers that still satisfy the constraint
+    sqlite3_int64 floorD = (sqlite3_int64)d;
+    if ((double)floorD > d)
+      floorD--;
+    sqlite3_int64 ceilD = floorD == d ? floorD : floorD + 1;
+    switch (idxStr[i + 1]) {
+    case '=':
+      if (floorD != d) {
+        *pMin = 1;
+        *pMax = 0;
+      } else {
+        if (floorD > *pMin)
+          *pMin = floorD;
+        if (floorD < *pMax)
+          *pMax = floorD;
+      }
+      break;
+    case '>':
+      if (floorD + 1 > *pMin)
+        *pMin = floorD + 1;
+      break;
+    case 'G':
+      if (ceilD > *pMin)
+        *pMin = ceilD;
+      break;
+    case '<':
+      if (ceilD - 1 < *pMax)
+        *pMax = ceilD - 1;
+      break;
+    case 'L':
+      if (floorD < *pMax)
+        *pMax = floorD;
+      break;
+    }
+  }
+
+  rc = tg_array_init(&pCur->runs, sizeof(struct coords_run), 8);
+  if (rc != SQLITE_OK) {
+    return rc;
+  }
+  sqlite3_int64 offset = 0;
+  rc = tg_coords_add_runs(pCur, pCur->geom, -1, &offset);
+  if (rc != SQLITE_OK) {
+    return rc;
+  }
+
+  // binary search for the run holding the smallest possible rowid, so seeking
+  // into a large geometry doesn't walk every run before it
+  int lo = 0, hi = (int)pCur->runs.length;
+  while (lo < hi) {
+    int mid = lo + (hi - lo) / 2;
+    struct coords_run *run = tg_coords_run_at(pCur, mid);
+    if (run->offset + run->n <= pCur->rowidMin) {
+      lo = mid + 1;
+    } else {
+      hi = mid;
+    }
+  }
+  pCur->iRun = lo;
+  pCur->iVertex = 0;
+  tg_coords_seek(pCur);
+  return SQLITE_OK;
+}
+
+static int tg_coordsNext(sqlite3_vtab_cursor *cur) {
+  tg_coords_cursor *pCur = (tg_coords_cursor *)cur;
+  pCur->iVertex++;
+  tg_coords_seek(pCur);
+  return SQLITE_OK;
+}
+
+static int tg_coordsEof(sqlite3_vtab_cursor *cur) {
+  tg_coords_cursor *pCur = (tg_coords_cursor *)cur;
+  return pCur->iRun >= (int)pCur->runs.length;
+}
+
+static int tg_coordsRowid(sqlite3_vtab_cursor *cur, sqlite_int64 *pRowid) {
+  tg_coords_cursor *pCur = (tg_coords_cursor *)cur;
+  *pRowid = tg_coords_run_at(pCur, pCur->iRun)->offset + pCur->iVertex;
+  return SQLITE_OK;
+}
+
+static int tg_coordsColumn(sqlite3_vtab_cursor *cur, sqlite3_context *context,
+                           int i) {
+  tg_coords_cursor *pCur = (tg_coords_cursor *)cur;
+  struct coords_run *run = tg_coords_run_at(pCur, pCur->iRun);
+  int iVertex = (int)pCur->iVertex;
+  switch (i) {
+  case TG_COORDS_X:
+  case TG_COORDS_Y: {
+    struct tg_point point;
+    if (run->points) {
+      point = run->points[iVertex];
+    } else if (run->multipoint) {
+      point = tg_geom_point_at(run->multipoint, iVertex);
+    } else {
+      point = run->point;
+    }
+    sqlite3_result_double(context, i == TG_COORDS_X ? point.x : point.y);
+    break;
+  }
+  case TG_COORDS_Z:
+  case TG_COORDS_M: {
+    int want = i == TG_COORDS_Z ? run->hasZ : run->hasM;
+    if (!want) {
+      sqlite3_result_null(context);
+      break;
+    }
+    const double *extra =
+        run->points || run->multipoint ? run->extra : run->pointExtra;
+    int stride = run->hasZ + run->hasM;
+    sqlite3_int64 j =
+        (sqlite3_int64)iVertex * stride + (i == TG_COORDS_M && run->hasZ);
+    sqlite3_result_double(context,
+                          extra && j < run->nExtra ? extra[j] : 0);
+    break;
+  }
+  case TG_COORDS_PART_INDEX:
+    sqlite3_result_int(context, run->partPerVertex ? run->part + iVertex
+                                                   : run->part);
+    break;
+  case TG_COORDS_RING_INDEX:
+    if (run->ring < 0) {
+      sqlite3_result_null(context);
+    } else {
+      sqlite3_result_int(context, run->ring);
+    }
+    break;
+  case TG_COORDS_VERTEX_INDEX:
+    sqlite3_result_int(context, run->partPerVertex ? 0 : iVertex);
+    break;
+  case TG_COORDS_SOURCE:
+    sqlite3_result_null(context);
+    break;
+  }
+  return SQLITE_OK;
+}
+
+static sqlite3_module tg_coordsModule = {
+    /* iVersion    */ 0,
+    /* xCreate     */ 0,
+    /* xConnect    */ tg_coordsConnect,
+    /* xBestIndex  */ tg_coordsBestIndex,
+    /* xDisconnect */ tg_coordsDisconnect,
+    /* xDestroy    */ 0,
+    /* xOpen       */ tg_coordsOpen,
+    /* xClose      */ tg_coordsClose,
+    /* xFilter     */ tg_coordsFilter,
+    /* xNext       */ tg_coordsNext,
+    /* xEof        */ tg_coordsEof,
+    /* xColumn     */ tg_coordsColumn,
+    /* xRowid      */ tg_coordsRowid,
+    /* xUpdate     */ 0,
+    /* xBegin      */ 0,
+    /* xSync       */ 0,
+    /* xCommit     */ 0,
+    /* xRollback   */ 0,
+    /* xFindMethod */ 0,
+    /* xRename     */ 0,
+    /* xSavepoint  */ 0,
+    /* xRelease    */ 0,
+    /* xRollbackTo */ 0,
+    /* xShadowName */ 0};
+#pragma endregion
+
+#pragma region thread pool
+
+// A small fixed-size pool of worker threads for embarrassingly parallel work
+// like decoding a batch of records. tg_pool_run() hands out task indexes
+// [0, nTasks) to the workers and the calling thread, and returns once all of
+// them have finished. Tasks must not call into SQLite: they only run tg
+// parsing and predicates on memory the caller owns. Without threads (Windows,
+// Emscripten, or SQLITE_TG_OMIT_THREADS) every task runs on the caller.
+struct tg_pool {
+  int nWorkers;
+#ifndef SQLITE_TG_OMIT_THREADS
+  pthread_t *aThread;
+  pthread_mutex_t mutex;
+  // signaled when a job is posted, or the pool is shutting down
+  pthread_cond_t cvWork;
+  // signaled when the last task of a job finishes
+  pthread_cond_t cvDone;
+  int shutdown;
+#endif
+  void (*xTask)(void *ctx, int i);
+  void *ctx;
+  int nTasks;
+  int iNext;
+  int nDone;
+};
+
+// Number of threads to use when a caller doesn't ask for a specific number.
+static int tg_pool_default_threads(void) {
+  int n = 1;
+#if !defined(SQLITE_TG_OMIT_THREADS) && defined(_SC_NPROCESSORS_ONLN)
+  long ncpu = sysconf(_SC_NPROCESSORS_ONLN);
+  n = ncpu > 4 ? 4 : (ncpu > 0 ? (int)ncpu : 1);
+#endif
+  return n;
+}
+
+#ifndef SQLITE_TG_OMIT_THREADS
+static void *tg_pool_worker(void *p) {
+  struct tg_pool *pool = (struct tg_pool *)p;
+  pthread_mutex_lock(&pool->mutex);
+  while (1) {
+    while (!pool->shutdown && pool->iNext >= pool->nTasks) {
+      pthread_cond_wait(&pool->cvWork, &pool->mutex);
+    }
+    if (pool->shutdown)
+      break;
+    int i = pool->iNext++;
+    pthread_mutex_unlock(&pool->mutex);
+    pool->xTask(pool->ctx, i);
+    pthread_mutex_lock(&pool->mutex);
+    if (++pool->nDone == pool->nTasks) {
+      pthread_cond_signal(&pool->cvDone);
+    }
+  }
+  pthread_mutex_unlock(&pool->mutex);
+  return NULL;
+}
+#endif
+
+// Creates a pool that runs tasks on nThreads threads in total, the calling
+// thread included. The pool may end up with fewer threads than asked for if
+// the host SQLite is single-threaded or threads can't be started.
+static int tg_pool_new(int nThreads, struct tg_pool **ppPool) {
+  struct tg_pool *pool = sqlite3_malloc(sizeof(*pool));
+  if (!pool)
+    return SQLITE_NOMEM;
+  memset(pool, 0, sizeof(*pool));
+#ifndef SQLITE_TG_OMIT_THREADS
+  int nWorkers = sqlite3_threadsafe() ? nThreads - 1 : 0;
+  if (nWorkers > 0) {
+    pool->aThread = sqlite3_malloc(nWorkers * sizeof(pthread_t));
+    if (!pool->aThread) {
+      sqlite3_free(pool);
+      return SQLITE_NOMEM;
+    }
+    pthread_mutex_init(&pool->mutex, NULL);
+    pthread_cond_init(&pool->cvWork, NULL);
+    pthread_cond_init(&pool->cvDone, NULL);
+    for (int i = 0; i < nWorkers; i++) {
+      if (pthread_create(&pool->aThread[i], NULL, tg_pool_worker, pool) != 0)
+        break;
+      pool->nWorkers++;
+    }
+  }
+#endif
+  *ppPool = pool;
+  return SQLITE_OK;
+}
+
+static void tg_pool_run(struct tg_pool *pool, int nTasks,
+                        void (*xTask)(void *ctx, int i), void *ctx) {
+  if (pool->nWorkers == 0 || nTasks <= 1) {
+    for (int i = 0; i < nTasks; i++) {
+      xTask(ctx, i);
+    }
+    return;
+  }
+#ifndef SQLITE_TG_OMIT_THREADS
+  pthread_mutex_lock(&pool->mutex);
+  pool->xTask = xTask;
+  pool->ctx = ctx;
+  pool->iNext = 0;
+  pool->nDone = 0;
+  pool->nTasks = nTasks;
+  pthread_cond_broadcast(&pool->cvWork);
+  while (pool->iNext < pool->nTasks) {
+    int i = pool->iNext++;
+    pthread_mutex_unlock(&pool->mutex);
+    xTask(ctx, i);
+    pthread_mutex_lock(&pool->mutex);
+    pool->nDone++;
+  }
+  while (pool->nDone < pool->nTasks) {
+    pthread_cond_wait(&pool->cvDone, &pool->mutex);
+  }
+  pool->nTasks = 0;
+  pool->iNext = 0;
+  pthread_mutex_unlock(&pool->mutex);
+#endif
+}
+
+static int tg_pool_threads(struct tg_pool *pool) {
+  return pool ? pool->nWorkers + 1 : 1;
+}
+
+static void tg_pool_free(struct tg_pool *pool) {
+  if (!pool)
+    return;
+#ifndef SQLITE_TG_OMIT_THREADS
+  if (pool->aThread) {
+    pthread_mutex_lock(&pool->mutex);
+    pool->shutdown = 1;
+    pthread_cond_broadcast(&pool->cvWork);
+    pthread_mutex_unlock(&pool->mutex);
+    for (int i = 0; i < pool->nWorkers; i++) {
+      pthread_join(pool->aThread[i], NULL);
+    }
+    pthread_cond_destroy(&pool->cvDone);
+    pthread_cond_destroy(&pool->cvWork);
+    pthread_mutex_destroy(&pool->mutex);
+    sqlite3_free(pool->aThread);
+  }
+#endif
+  sqlite3_free(pool);
+}
+
+#pragma endregion
+
+#pragma region tg0 virtual table
+
+#define TG0_COLUMN_SHAPE 0
+#define TG0_COLUMN_REST 1
+
+#define TG0_SQL_RTREE_DROP "DROP TABLE \"%w\".\"%w_rtree\""
+#define TG0_SQL_DELETE "DELETE FROM \"%w\".\"%w_rtree\" WHERE id = ?1"
+
+// clang-format off
+// The different overloaded and intercepted functions for tg0() tables.
+#define TG0_FUNC_INTERSECTS SQLITE_INDEX_CONSTRAINT_FUNCTION
+#define TG0_FUNC_DISJOINT   SQLITE_INDEX_CONSTRAINT_FUNCTION + 1
+#define TG0_FUNC_CONTAINS   SQLITE_INDEX_CONSTRAINT_FUNCTION + 2
+#define TG0_FUNC_WITHIN     SQLITE_INDEX_CONSTRAINT_FUNCTION + 3
+#define TG0_FUNC_COVERS     SQLITE_INDEX_CONSTRAINT_FUNCTION + 4
+#define TG0_FUNC_COVEREDBY  SQLITE_INDEX_CONSTRAINT_FUNCTION + 5
+// clang-format on
+
+enum TG0_PLAN {
+  // full scan, admit all rtree entries
+  FULLSCAN,
+  // only emit boundaries that interect a query geometry
+  INTERSECT,
+  // TODO disjoint/contains/within/covers/coveredby
+};
+
+// What one tg0Filter() run of a cursor did, see tg0_last_query_stats(). The
+// *Ns timings are only measured while tg_stats timing is on.
+struct tg0_query_stats {
+  // the enum TG0_PLAN, or -1 for none
+  int plan;
+  // whether it was served from the table's resident=1 copy
+  int resident;
+  // rows the rtree query returned
+  sqlite3_int64 rtreeRows;
+  // bytes of the candidate shapes decoded for the predicate
+  sqlite3_int64 shapeBytes;
+  sqlite3_int64 predicateCalls;
+  // rows the cursor returned
+  sqlite3_int64 accepted;
+  sqlite3_int64 rtreeNs;
+  sqlite3_int64 decodeNs;
+  sqlite3_int64 predicateNs;
+};
+
+// The different shapes of rtree queries a tg0 cursor can run.
+enum TG0_READ_STMT {
+  // SELECT id, _shape, ... FROM rtree
+  TG0_READ_STMT_FULLSCAN,
+  // SELECT id, _shape, ... FROM rtree WHERE <bounding box overlaps ?1-?4>
+  TG0_READ_STMT_INTERSECT,
+  TG0_READ_STMT_COUNT,
+};
+
+typedef struct tg0_vtab tg0_vtab;
+struct tg0_vtab {
+  sqlite3_vtab base;
+
+  // the SQLite connection of the host database
+  sqlite3 *db;
+  // Name of the schema the table exists on. Must be freed with sqlite3_free()
+  // on destruction
+  char *schemaName;
+  // Name of the table the table exists on. must be freed with sqlite3_free() on
+  // destruction
+  char *tableName;
+
+  int numAuxColumns;
+
+  // Cached statements for tg0Update(), prepared on first use and finalized in
+  // tg0Disconnect(). Writes can come in at a high rate (ex moving objects),
+  // so they shouldn't pay for a sqlite3_prepare_v2() each time.
+  sqlite3_stmt *stmtInsert;
+  sqlite3_stmt *stmtDelete;
+  // UPDATE where _shape changed: new id, bounding box, shape, and aux columns
+  sqlite3_stmt *stmtUpdateShape;
+  // UPDATE where only the rowid (and maybe aux columns) changed
+  sqlite3_stmt *stmtUpdateRowid;
+  // UPDATE where only aux columns changed, written straight to the
+  // rtree's _rowid table so the R-Tree node isn't touched
+  sqlite3_stmt *stmtUpdateAux;
+
+  // Cached read statements, one per plan shape. A cursor checks one out in
+  // tg0Filter() and hands it back when it closes, so nested-loop joins that
+  // re-filter once per outer row only pay for a reset + rebind. If two
+  // cursors need the same shape at once, the second prepares its own.
+  sqlite3_stmt *aReadStmt[TG0_READ_STMT_COUNT];
+
+  // Threads to refine candidates on, from the threads= option. Intersect
+  // queries read candidates in batches and decode and check them on pool,
+  // created on first use, see tg0_cursor_fill_batch().
+  int nThreads;
+  struct tg_pool *pool;
+
+  // Precision of the TWKB that shapes are stored as, from the twkb= option,
+  // or TG0_WKB to store them as WKB.
+  int twkbPrecision;
+  // From the type=point option: shapes are points, stored as the rtree's
+  // "+_x" and "+_y" columns instead of a "+_shape" blob. Read statements
+  // then have _x as column 1, and _y after the aux columns.
+  int points;
+
+  // From the content= option of external content tables, else NULL: the
+  // table that holds the shapes and aux columns, whose content_rowid column
+  // matches the tg0 rowid and whose shape_column holds _shape. The rtree then
+  // only stores bounding boxes, and reads join the content table for the
+  // rest. ", c.<shape_column>, c.<aux>..." of that join is
+  // zContentColumns. All four are sqlite3_free()'ed on destruction.
+  char *zContent;
+  char *zContentRowid;
+  char *zShapeColumn;
+  char *zContentColumns;
+  // From the triggers=1 option: tg0Create() added triggers that keep the
+  // table in sync with zContent, which tg0Destroy() drops.
+  int triggers;
+
+  // From the resident=1 option: queries are served from pResident, an
+  // in-memory copy of the table loaded on first use, which tg0Update()
+  // keeps in sync. It's dropped (and re-loaded by the next query) on
+  // rollback, and when PRAGMA data_version shows that another connection
+  // changed the database. A copy bigger than residentLimit bytes (from
+  // resident_mb=) isn't kept, and the table then uses the rtree for the rest
+  // of the connection.
+  int resident;
+  sqlite3_int64 residentLimit;
+  int residentOverLimit;
+  struct tg0_resident *pResident;
+  sqlite3_int64 residentDataVersion;
+  sqlite3_stmt *stmtDataVersion;
+  // the shape tg0_bind_shape() last bound while pResident was loaded,
+  // decoded for tg0_resident_write()
+  int residentPending;
+  struct tg_rect residentPendingRect;
+  struct tg_geom *residentPendingGeom;
+
+  // the connection's counters, and the next table in their list of tables
+  struct tg_stats *stats;
+  tg0_vtab *nextTable;
+  // the most recently finished query on this table
+  struct tg0_query_stats lastQuery;
+};
+
+// rtree columns a table stores its shapes in: _shape, or _x and _y, or none
+// for external content tables
+#define TG0_SHAPE_COLUMNS(p) ((p)->zContent ? 0 : (p)->points ? 2 : 1)
+
+// tg0_vtab.twkbPrecision of tables that store WKB
+#define TG0_WKB (TWKB_MIN_PRECISION - 1)
+
+// candidates read ahead and refined together, see tg0_cursor_fill_batch()
+#define TG0_BATCH 1024
+// candidates per pool task
+#define TG0_BATCH_TASK 64
+
+// A candidate row read ahead from the rtree statement.
+struct tg0_candidate {
+  sqlite3_int64 id;
+  // the _shape blob, at this offset of tg0_cursor.batchShapes
+  sqlite3_uint64 offset;
+  int nShape;
+  // 1 if the predicate holds, 0 if not, -1 if the shape couldn't be parsed,
+  // with the reason in error (NULL when out of memory)
+  int result;
+  char *error;
+  // the point of type=point tables, which have no _shape blob
+  double x;
+  double y;
+  // the SQLite type of _shape, which is TEXT or NULL for some rows of
+  // external content tables
+  int type;
+};
+
+typedef struct tg0_cursor tg0_cursor;
+struct tg0_cursor {
+  sqlite3_vtab_cursor base;
+  // a statement that iterates over some sort of `select id, _shape` query.
+  // Checked out from tg0_vtab.aReadStmt, see tg0_read_stmt_checkout().
+  sqlite3_stmt *stmt;
+  // which shape of query stmt is, or -1 if the cursor doesn't hold one
+  int stmtKind;
+  // the result code of the most recent sqlite3_step() on stmt
+  int stepStatus;
+  // The type of tree query that should be made
+  enum TG0_PLAN plan;
+  // the "query geometry" in predicate-style queries, and its bounding box
+  struct tg_geom *queryGeom;
+  struct tg_rect queryRect;
+  // What queryGeom was parsed from: the value type, and either its bytes
+  // (sqlite3_malloc'ed copy) or the pointer-passed geometry. When the next
+  // tg0Filter() call gets the same argument, queryGeom is reused as-is.
+  int queryKeyType;
+  void *queryKey;
+  int nQueryKey;
+  const void *queryKeyPointer;
+  // the current tg0Filter() run, copied to tg0_vtab.lastQuery when it's over
+  struct tg0_query_stats query;
+
+  // Whether the current query reads candidates in batches. If so, the
+  // current row is aBatch[iBatch], and batchEof is set once stmt and the
+  // batch are both exhausted.
+  int batched;
+  int batchEof;
+  struct tg0_candidate *aBatch;
+  int nBatch;
+  int iBatch;
+  // the batch's _shape blobs, back to back
+  unsigned char *batchShapes;
+  sqlite3_uint64 nBatchShapes;
+  sqlite3_uint64 nBatchShapesAlloc;
+  // the batch's aux column values, numAuxColumns per candidate
+  sqlite3_value **aBatchAux;
+
+  // Set when the current query is served from the table's resident copy,
+  // which the cursor holds a reference to: the current row is entry
+  // aResident[iResident] of it.
+  struct tg0_resident *resident;
+  int *aResident;
+  int nResident;
+  int nResidentAlloc;
+  int iResident;
+};
+
+// The in-memory copy of a resident=1 table. Entries are packed in Hilbert
+// order of their bounding box centers under a tree of node boxes, like a
+// static packed R-Tree. Writes tombstone the entries they replace and append
+// new ones past the packed range, which queries scan linearly, until
+// tg0_resident_pack() re-packs everything once enough has piled up.
+//
+// Cursors hold a reference while they read from it, and keep the entries
+// they found: tombstoned entries are only freed once no cursor can read them,
+// and nothing is re-packed under a cursor.
+
+// children per node of the packed tree
+#define TG0_RESIDENT_NODE 16
+#define TG0_RESIDENT_MAX_LEVELS 16
+// what a sqlite3_value_dup()'ed aux value costs besides its bytes
+#define TG0_RESIDENT_VALUE_OVERHEAD 64
+#define TG0_RESIDENT_DEFAULT_MB 64
+// written or deleted entries a query tolerates before re-packing
+#define TG0_RESIDENT_REPACK 256
+
+struct tg0_resident_entry {
+  sqlite3_int64 id;
+  struct tg_rect rect;
+  // the decoded shape, or NULL for type=point tables, whose point is rect.min
+  struct tg_geom *geom;
+  // set once deleted, until the next tg0_resident_pack() drops the entry
+  int dead;
+};
+
+struct tg0_resident {
+  int nRef;
+  int numAuxColumns;
+  struct tg0_resident_entry *aEntry;
+  // numAuxColumns aux values per entry
+  sqlite3_value **aAux;
+  int nEntry;
+  int nAlloc;
+  int nDead;
+  // aEntry[0, nPacked) are under the packed tree, later entries were written
+  // since it was built
+  int nPacked;
+  // Node boxes, level by level. Level 0 is the packed entries themselves, and
+  // node i of level k >= 1, at aNode[aLevelOffset[k] + i], covers children
+  // [i * TG0_RESIDENT_NODE, (i + 1) * TG0_RESIDENT_NODE) of level k - 1.
+  struct tg_rect *aNode;
+  int nNode;
+  int nLevel;
+  int aLevelOffset[TG0_RESIDENT_MAX_LEVELS];
+  int aLevelCount[TG0_RESIDENT_MAX_LEVELS];
+  // Open addressing from id to entry index, with linear probing. -1 is an
+  // empty slot and -2 a deleted one, nHashUsed counts both used and deleted.
+  int *aHash;
+  int nHash;
+  int nHashUsed;
+  // approximate memory use, checked against tg0_vtab.residentLimit
+  sqlite3_int64 nBytes;
+};
+
+static void tg0_resident_free_entry(struct tg0_resident *r, int i) {
+  struct tg0_resident_entry *entry = &r->aEntry[i];
+  if (entry->geom) {
+    r->nBytes -= tg_geom_memsize(entry->geom);
+    tg_geom_free(entry->geom);
+    entry->geom = NULL;
+  }
+  for (int j = 0; j < r->numAuxColumns; j++) {
+    sqlite3_value **pValue = &r->aAux[(sqlite3_int64)i * r->numAuxColumns + j];
+    if (*pValue) {
+      r->nBytes -= TG0_RESIDENT_VALUE_OVERHEAD + sqlite3_value_bytes(*pValue);
+      sqlite3_value_free(*pValue);
+      *pValue = NULL;
+    }
+  }
+}
+
+static void tg0_resident_release(struct tg0_resident *r) {
+  if (!r || --r->nRef > 0) {
+    return;
+  }
+  for (int i = 0; i < r->nEntry; i++) {
+    tg0_resident_free_entry(r, i);
+  }
+  sqlite3_free(r->aEntry);
+  sqlite3_free(r->aAux);
+  sqlite3_free(r->aNode);
+  sqlite3_free(r->aHash);
+  sqlite3_free(r);
+}
+
+static unsigned int tg0_resident_hash_of(sqlite3_int64 id) {
+  sqlite3_uint64 h = (sqlite3_uint64)id * 0x9E3779B97F4A7C15ULL;
+  return (unsigned int)(h >> 32);
+}
+
+// The index of the live entry with the given id, or -1.
+static int tg0_resident_find(struct tg0_resident *r, sqlite3_int64 id) {
+  if (!r->nHash) {
+    return -1;
+  }
+  unsigned int mask = r->nHash - 1;
+  for (unsigned int h = tg0_resident_hash_of(id) & mask;; h = (h + 1) & mask) {
+    int i = r->aHash[h];
+    if (i == -1) {
+      return -1;
+    }
+    if (i >= 0 && r->aEntry[i].id == id) {
+      return i;
+    }
+  }
+}
+
+static void tg0_resident_hash_put(struct tg0_resident *r, int i) {
+  unsigned int mask = r->nHash - 1;
+  unsigned int h = tg0_resident_hash_of(r->aEntry[i].id) & mask;
+  while (r->aHash[h] >= 0) {
+    h = (h + 1) & mask;
+  }
+  if (r->aHash[h] == -1) {
+    r->nHashUsed++;
+  }
+  r->aHash[h] = i;
+}
+
+static void tg0_resident_hash_delete(struct tg0_resident *r, int i) {
+  unsigned int mask = r->nHash - 1;
+  for (unsigned int h = tg0_resident_hash_of(r->aEntry[i].id) & mask;
+       r->aHash[h] != -1; h = (h + 1) & mask) {
+    if (r->aHash[h] == i) {
+      r->aHash[h] = -2;
+      return;
+    }
+  }
+}
+
+// Re-creates the hash from the live entries, sized for nEntry + nExtra.
+static int tg0_resident_hash_rebuild(struct tg0_resident *r, int nExtra) {
+  int nHash = 16;
+  while (nHash < 2 * (r->nEntry + nExtra)) {
+    nHash *= 2;
+  }
+  int *aHash = sqlite3_malloc64((sqlite3_uint64)nHash * sizeof(int));
+  if (!aHash) {
+    return SQLITE_NOMEM;
+  }
+  memset(aHash, 0xff, (size_t)nHash * sizeof(int));
+  r->nBytes += ((sqlite3_int64)nHash - r->nHash) * (sqlite3_int64)sizeof(int);
+  sqlite3_free(r->aHash);
+  r->aHash = aHash;
+  r->nHash = nHash;
+  r->nHashUsed = 0;
+  for (int i = 0; i < r->nEntry; i++) {
+    if (!r->aEntry[i].dead) {
+      tg0_resident_hash_put(r, i);
+    }
+  }
+  return SQLITE_OK;
+}
+
+// Adds an entry past the packed range, taking ownership of geom and copying
+// the aux values.
+static int tg0_resident_append(struct tg0_resident *r, sqlite3_int64 id,
+                               struct tg_rect rect, struct tg_geom *geom,
+                               sqlite3_value **aux) {
+  if (r->nEntry == r->nAlloc) {
+    int nAlloc = r->nAlloc ? r->nAlloc * 2 : 64;
+    struct tg0_resident_entry *aEntry =
+        sqlite3_realloc64(r->aEntry, (sqlite3_uint64)nAlloc * sizeof(*aEntry));
+    if (!aEntry) {
+      tg_geom_free(geom);
+      return SQLITE_NOMEM;
+    }
+    r->aEntry = aEntry;
+    if (r->numAuxColumns) {
+      sqlite3_value **aAux = sqlite3_realloc64(
+          r->aAux, (sqlite3_uint64)nAlloc * r->numAuxColumns * sizeof(*aAux));
+      if (!aAux) {
+        tg_geom_free(geom);
+        return SQLITE_NOMEM;
+      }
+      r->aAux = aAux;
+    }
+    r->nBytes += (sqlite3_int64)(nAlloc - r->nAlloc) *
+                 (sizeof(*aEntry) + r->numAuxColumns * sizeof(*r->aAux));
+    r->nAlloc = nAlloc;
+  }
+  int i = r->nEntry;
+  struct tg0_resident_entry *entry = &r->aEntry[i];
+  entry->id = id;
+  entry->rect = rect;
+  entry->geom = geom;
+  entry->dead = 0;
+  // counted first, so a failure below leaves it to be freed with the rest
+  r->nEntry++;
+  if (geom) {
+    r->nBytes += tg_geom_memsize(geom);
+  }
+  int rc = SQLITE_OK;
+  for (int j = 0; j < r->numAuxColumns; j++) {
+    sqlite3_value *value = sqlite3_value_dup(aux[j]);
+    r->aAux[(sqlite3_int64)i * r->numAuxColumns + j] = value;
+    if (!value) {
+      rc = SQLITE_NOMEM;
+      continue;
+    }
+    r->nBytes += TG0_RESIDENT_VALUE_OVERHEAD + sqlite3_value_bytes(value);
+  }
+  if (rc != SQLITE_OK) {
+    tg0_resident_free_entry(r, i);
+    entry->dead = 1;
+    r->nDead++;
+    return rc;
+  }
+  if (2 * (r->nHashUsed + 1) > r->nHash) {
+    return tg0_resident_hash_rebuild(r, 1);
+  }
+  tg0_resident_hash_put(r, i);
+  return SQLITE_OK;
+}
+
+// Tombstones an entry. Its shape and aux values stay until the next
+// tg0_resident_pack() while a cursor may still read them.
+static void tg0_resident_remove(struct tg0_resident *r, int i) {
+  if (r->nRef == 1) {
+    tg0_resident_free_entry(r, i);
+  }
+  tg0_resident_hash_delete(r, i);
+  r->aEntry[i].dead = 1;
+  r->nDead++;
+}
+
+struct tg0_resident_key {
+  sqlite3_uint64 key;
+  int i;
+};
+
+static int tg0_resident_key_cmp(const void *a, const void *b) {
+  const struct tg0_resident_key *x = a, *y = b;
+  if (x->key != y->key) {
+    return x->key < y->key ? -1 : 1;
+  }
+  return x->i - y->i;
+}
+
+// Drops dead entries, sorts the rest by the Hilbert key of their centers
+// (see tg_hilbert()) over their extent, and builds the node levels over them.
+static int tg0_resident_pack(struct tg0_resident *r) {
+  int n = 0;
+  struct tg_rect extent = {{0, 0}, {0, 0}};
+  for (int i = 0; i < r->nEntry; i++) {
+    if (r->aEntry[i].dead) {
+      tg0_resident_free_entry(r, i);
+      continue;
+    }
+    struct tg_rect rect = r->aEntry[i].rect;
+    if (n == 0) {
+      extent = rect;
+    } else {
+      extent = tg_rect_expand(extent, rect);
+    }
+    r->aEntry[n] = r->aEntry[i];
+    if (r->numAuxColumns) {
+      memmove(&r->aAux[(sqlite3_int64)n * r->numAuxColumns],
+              &r->aAux[(sqlite3_int64)i * r->numAuxColumns],
+              r->numAuxColumns * sizeof(*r->aAux));
+    }
+    n++;
+  }
+  r->nEntry = n;
+  r->nDead = 0;
+
+  int rc = SQLITE_OK;
+  struct tg0_resident_key *aKey =
+      sqlite3_malloc64((sqlite3_uint64)(n ? n : 1) * sizeof(*aKey));
+  struct tg0_resident_entry *aEntry =
+      sqlite3_malloc64((sqlite3_uint64)(n ? n : 1) * sizeof(*aEntry));
+  sqlite3_value **aAux =
+      r->numAuxColumns
+          ? sqlite3_malloc64((sqlite3_uint64)(n ? n : 1) * r->numAuxColumns *
+                             sizeof(*aAux))
+          : NULL;
+  if (!aKey || !aEntry || (r->numAuxColumns && !aAux)) {
+    rc = SQLITE_NOMEM;
+    goto done;
+  }
+  for (int i = 0; i < n; i++) {
+    struct tg_rect rect = r->aEntry[i].rect;
+    uint32_t x = tg_curve_cell((rect.min.x + rect.max.x) / 2, extent.min.x,
+                               extent.max.x, TG_CURVE_DEFAULT_ORDER);
+    uint32_t y = tg_curve_cell((rect.min.y + rect.max.y) / 2, extent.min.y,
+                               extent.max.y, TG_CURVE_DEFAULT_ORDER);
+    aKey[i].key = tg_hilbert_key(x, y, TG_CURVE_DEFAULT_ORDER);
+    aKey[i].i = i;
+  }
+  qsort(aKey, n, sizeof(*aKey), tg0_resident_key_cmp);
+  for (int i = 0; i < n; i++) {
+    aEntry[i] = r->aEntry[aKey[i].i];
+    if (r->numAuxColumns) {
+      memcpy(&aAux[(sqlite3_int64)i * r->numAuxColumns],
+             &r->aAux[(sqlite3_int64)aKey[i].i * r->numAuxColumns],
+             r->numAuxColumns * sizeof(*aAux));
+    }
+  }
+  r->nBytes -= (sqlite3_int64)(r->nAlloc - (n ? n : 1)) *
+               (sizeof(*aEntry) + r->numAuxColumns * sizeof(*aAux));
+  sqlite3_free(r->aEntry);
+  sqlite3_free(r->aAux);
+  r->aEntry = aEntry;
+  r->aAux = aAux;
+  r->nAlloc = n ? n : 1;
+  aEntry = NULL;
+  aAux = NULL;
+
+  int nNode = 0;
+  int nLevel = 1;
+  r->aLevelCount[0] = n;
+  while (r->aLevelCount[nLevel - 1] > 1 && nLevel < TG0_RESIDENT_MAX_LEVELS) {
+    r->aLevelOffset[nLevel] = nNode;
+    r->aLevelCount[nLevel] =
+        (r->aLevelCount[nLevel - 1] + TG0_RESIDENT_NODE - 1) / TG0_RESIDENT_NODE;
+    nNode += r->aLevelCount[nLevel];
+    nLevel++;
+  }
+  struct tg_rect *aNode =
+      sqlite3_realloc64(r->aNode, (sqlite3_uint64)(nNode ? nNode : 1) *
+                                      sizeof(*aNode));
+  if (!aNode) {
+    rc = SQLITE_NOMEM;
+    goto done;
+  }
+  r->nBytes += ((sqlite3_int64)nNode - r->nNode) * sizeof(*aNode);
+  r->nNode = nNode;
+  r->aNode = aNode;
+  for (int k = 1; k < nLevel; k++) {
+    for (int i = 0; i < r->aLevelCount[k]; i++) {
+      int begin = i * TG0_RESIDENT_NODE;
+      int end = begin + TG0_RESIDENT_NODE;
+      if (end > r->aLevelCount[k - 1]) {
+        end = r->aLevelCount[k - 1];
+      }
+      struct tg_rect rect =
+          k == 1 ? r->aEntry[begin].rect
+                 : aNode[r->aLevelOffset[k - 1] + begin];
+      for (int c = begin + 1; c < end; c++) {
+        rect = tg_rect_expand(rect, k == 1 ? r->aEntry[c].rect
+                                           : aNode[r->aLevelOffset[k - 1] + c]);
+      }
+      aNode[r->aLevelOffset[k] + i] = rect;
+    }
+  }
+  r->nLevel = nLevel;
+  r->nPacked = n;
+  rc = tg0_resident_hash_rebuild(r, 0);
+
+done:
+  sqlite3_free(aKey);
+  sqlite3_free(aEntry);
+  sqlite3_free(aAux);
+  return rc;
+}
+
+// Appends the index of every live entry whose box overlaps rect to
+// *paSlot, which has room for *pnAlloc.
+static int tg0_resident_search(struct tg0_resident *r, struct tg_rect rect,
+                               int **paSlot, int *pnSlot, int *pnAlloc) {
+  int nSlot = 0;
+  // each node pops once and pushes at most TG0_RESIDENT_NODE children
+  int aStack[2 * TG0_RESIDENT_NODE * TG0_RESIDENT_MAX_LEVELS];
+  int nStack = 0;
+  if (r->nPacked) {
+    aStack[nStack++] = r->nLevel - 1;
+    aStack[nStack++] = 0;
+  }
+  int i = r->nPacked;
+  while (nStack > 0 || i < r->nEntry) {
+    int level, index;
+    if (nStack > 0) {
+      index = aStack[--nStack];
+      level = aStack[--nStack];
+    } else {
+      // then the entries written since the last pack
+      level = 0;
+      index = i++;
+    }
+    if (level > 0) {
+      if (!tg_rect_intersects_rect(r->aNode[r->aLevelOffset[level] + index],
+                                   rect)) {
+        continue;
+      }
+      int begin = index * TG0_RESIDENT_NODE;
+      int end = begin + TG0_RESIDENT_NODE;
+      if (end > r->aLevelCount[level - 1]) {
+        end = r->aLevelCount[level - 1];
+      }
+      // pushed backwards, so they pop in order
+      for (int c = end - 1; c >= begin; c--) {
+        aStack[nStack++] = level - 1;
+        aStack[nStack++] = c;
+      }
+      continue;
+    }
+    if (r->aEntry[index].dead ||
+        !tg_rect_intersects_rect(r->aEntry[index].rect, rect)) {
+      continue;
+    }
+    if (nSlot == *pnAlloc) {
+      int nAlloc = *pnAlloc ? *pnAlloc * 2 : 256;
+      int *aSlot =
+          sqlite3_realloc64(*paSlot, (sqlite3_uint64)nAlloc * sizeof(int));
+      if (!aSlot) {
+        return SQLITE_NOMEM;
+      }
+      *paSlot = aSlot;
+      *pnAlloc = nAlloc;
+    }
+    (*paSlot)[nSlot++] = index;
+  }
+  *pnSlot = nSlot;
+  return SQLITE_OK;
+}
+
+void tg_vtab_set_error(sqlite3_vtab *pVTab, const char *zFormat, ...) {
+  va_list args;
+  sqlite3_free(pVTab->zErrMsg);
+  va_start(args, zFormat);
+  pVTab->zErrMsg = sqlite3_vmprintf(zFormat, args);
+  va_end(args);
+}
+
+int db_supports_rtree(sqlite3*db) {
+  sqlite3_stmt * stmt;
+  int rc = sqlite3_prepare_v2(db, "select name from pragma_module_list where name = 'rtree';", -1, &stmt, NULL);
+  // TODO could be that PRAGMA module_list is not allowed
+  if(rc != SQLITE_OK) {
+    return 0;
+  }
+  rc = sqlite3_step(stmt);
+  sqlite3_finalize(stmt);
+  return rc == SQLITE_ROW;
+}
+
+// Copies an option value like content='parcels', without the quotes of 'x',
+// "x", [x] or `x`.
+static char *tg0_option_dequote(const char *z) {
+  char *zOut = sqlite3_malloc64(strlen(z) + 1);
+  if (!zOut) {
+    return NULL;
+  }
+  char quote = z[0] == '[' ? ']' : z[0];
+  if (quote != '\'' && quote != '"' && quote != ']' && quote != '`') {
+    strcpy(zOut, z);
+    return zOut;
+  }
+  int n = 0;
+  for (int i = 1; z[i]; i++) {
+    if (z[i] == quote) {
+      // doubled quotes stand for one
+      if (z[i + 1] != quote) {
+        break;
+      }
+      i++;
+    }
+    zOut[n++] = z[i];
+  }
+  zOut[n] = 0;
+  return zOut;
+}
+
+// Creates the triggers of the triggers=1 option, which mirror writes to the
+// content table onto the tg0 table, like the ones the FTS5 documentation
+// suggests for external content tables.
+static int tg0_create_triggers(tg0_vtab *p, char **pzErr) {
+  // UPDATE OF can't name the implicit rowid
+  int rowidColumn = sqlite3_stricmp(p->zContentRowid, "rowid") != 0;
+  char *zSql = sqlite3_mprintf(
+      "CREATE TRIGGER \"%w\".\"%w_ai\" AFTER INSERT ON \"%w\" BEGIN "
+      "INSERT INTO \"%w\"(rowid, _shape) VALUES (new.\"%w\", new.\"%w\"); "
+      "END;"
+      "CREATE TRIGGER \"%w\".\"%w_ad\" AFTER DELETE ON \"%w\" BEGIN "
+      "INSERT INTO \"%w\"(\"%w\", rowid) VALUES ('delete', old.\"%w\"); "
+      "END;"
+      "CREATE TRIGGER \"%w\".\"%w_au\" AFTER UPDATE OF \"%w\"%s%w%s ON \"%w\" "
+      "BEGIN "
+      "INSERT INTO \"%w\"(\"%w\", rowid) VALUES ('delete', old.\"%w\"); "
+      "INSERT INTO \"%w\"(rowid, _shape) VALUES (new.\"%w\", new.\"%w\"); "
+      "END;",
+      p->schemaName, p->tableName, p->zContent, p->tableName, p->zContentRowid,
+      p->zShapeColumn, p->schemaName, p->tableName, p->zContent, p->tableName,
+      p->tableName, p->zContentRowid, p->schemaName, p->tableName,
+      p->zShapeColumn, rowidColumn ? ", \"" : "",
+      rowidColumn ? p->zContentRowid : "", rowidColumn ? "\"" : "",
+      p->zContent, p->tableName, p->tableName, p->zContentRowid, p->tableName,
+      p->zContentRowid, p->zShapeColumn);
+  if (!zSql) {
+    return SQLITE_NOMEM;
+  }
+  char *zErr = NULL;
+  int rc = sqlite3_exec(p->db, zSql, NULL, NULL, &zErr);
+  sqlite3_free(zSql);
+  if (rc != SQLITE_OK) {
+    *pzErr = sqlite3_mprintf("Error creating tg0 content triggers: %s", zErr);
+  }
+  sqlite3_free(zErr);
+  return rc;
+}
+
+static int tg0_init(sqlite3 *db, void *pAux, int argc, const char *const *argv,
+                    sqlite3_vtab **ppVtab, char **pzErr, bool isCreate) {
+  tg0_vtab *pNew;
+  int rc;
+  // Only checked on create: an existing table's rtree already needs the
+  // module, and xConnect can run while the schema is being reloaded, when
+  // the check's own statement fails with SQLITE_SCHEMA.
+  if(isCreate && !db_supports_rtree(db)) {
+    *pzErr = sqlite3_mprintf("The current SQLite connection does not include the R-Tree extension, which is required by tg0.");
+    return SQLITE_ERROR;
+  }
+  // key=value arguments are options, the rest are aux columns
+  int nThreads = 1;
+  int twkbPrecision = TG0_WKB;
+  int points = 0;
+  int numAuxColumns = 0;
+  char *zContent = NULL;
+  char *zContentRowid = NULL;
+  char *zShapeColumn = NULL;
+  int triggers = 0;
+  int resident = 0;
+  int residentMb = 0;
+  rc = SQLITE_ERROR;
+  for (int i = 3; i < argc; i++) {
+    const char *zValue = strchr(argv[i], '=');
+    if (!zValue) {
+      numAuxColumns++;
+      continue;
+    }
+    int nKey = (int)(zValue - argv[i]);
+    while (nKey > 0 && isspace((unsigned char)argv[i][nKey - 1])) {
+      nKey--;
+    }
+    zValue++;
+    while (isspace((unsigned char)*zValue)) {
+      zValue++;
+    }
+    if (nKey == 7 && sqlite3_strnicmp(argv[i], "threads", 7) == 0) {
+      char *zEnd;
+      long n = strtol(zValue, &zEnd, 10);
+      while (isspace((unsigned char)*zEnd)) {
+        zEnd++;
+      }
+      if (zEnd == zValue || *zEnd || n < 0 || n > 64) {
+        *pzErr = sqlite3_mprintf("threads must be between 0 and 64, not '%s'",
+                                 zValue);
+        goto fail;
+      }
+      nThreads = n ? (int)n : tg_pool_default_threads();
+    } else if (nKey == 4 && sqlite3_strnicmp(argv[i], "twkb", 4) == 0) {
+      char *zEnd;
+      long n = strtol(zValue, &zEnd, 10);
+      while (isspace((unsigned char)*zEnd)) {
+        zEnd++;
+      }
+      if (zEnd == zValue || *zEnd || n < TWKB_MIN_PRECISION ||
+          n > TWKB_MAX_PRECISION) {
+        *pzErr = sqlite3_mprintf(
+            "twkb precision must be between %d and %d, not '%s'",
+            TWKB_MIN_PRECISION, TWKB_MAX_PRECISION, zValue);
+        goto fail;
+      }
+      twkbPrecision = (int)n;
+    } else if (nKey == 4 && sqlite3_strnicmp(argv[i], "type", 4) == 0) {
+      if (sqlite3_stricmp(zValue, "point") == 0) {
+        points = 1;
+      } else if (sqlite3_stricmp(zValue, "geometry") == 0) {
+        points = 0;
+      } else {
+        *pzErr = sqlite3_mprintf(
+            "type must be 'geometry' or 'point', not '%s'", zValue);
+        goto fail;
+      }
+    } else if ((nKey == 7 && sqlite3_strnicmp(argv[i], "content", 7) == 0) ||
+               (nKey == 13 &&
+                sqlite3_strnicmp(argv[i], "content_rowid", 13) == 0) ||
+               (nKey == 12 &&
+                sqlite3_strnicmp(argv[i], "shape_column", 12) == 0)) {
+      char **pz = nKey == 7    ? &zContent
+                  : nKey == 13 ? &zContentRowid
+                               : &zShapeColumn;
+      sqlite3_free(*pz);
+      *pz = tg0_option_dequote(zValue);
+      if (!*pz) {
+        rc = SQLITE_NOMEM;
+        goto fail;
+      }
+      if (!**pz) {
+        *pzErr = sqlite3_mprintf("%.*s can't be empty", nKey, argv[i]);
+        goto fail;
+      }
+    } else if (nKey == 8 && sqlite3_strnicmp(argv[i], "triggers", 8) == 0) {
+      if (strcmp(zValue, "0") != 0 && strcmp(zValue, "1") != 0) {
+        *pzErr = sqlite3_mprintf("triggers must be 0 or 1, not '%s'", zValue);
+        goto fail;
+      }
+      triggers = zValue[0] == '1';
+    } else if (nKey == 8 && sqlite3_strnicmp(argv[i], "resident", 8) == 0) {
+      if (strcmp(zValue, "0") != 0 && strcmp(zValue, "1") != 0) {
+        *pzErr = sqlite3_mprintf("resident must be 0 or 1, not '%s'", zValue);
+        goto fail;
+      }
+      resident = zValue[0] == '1';
+    } else if (nKey == 11 &&
+               sqlite3_strnicmp(argv[i], "resident_mb", 11) == 0) {
+      char *zEnd;
+      long n = strtol(zValue, &zEnd, 10);
+      while (isspace((unsigned char)*zEnd)) {
+        zEnd++;
+      }
+      if (zEnd == zValue || *zEnd || n < 1 || n > 1048576) {
+        *pzErr = sqlite3_mprintf(
+            "resident_mb must be between 1 and 1048576, not '%s'", zValue);
+        goto fail;
+      }
+      residentMb = (int)n;
+    } else {
+      *pzErr = sqlite3_mprintf("unknown tg0 option '%.*s'", nKey, argv[i]);
+      goto fail;
+    }
+  }
+
+  if (points && twkbPrecision != TG0_WKB) {
+    *pzErr = sqlite3_mprintf("twkb can't be used with type=point");
+    goto fail;
+  }
+  if (zContent && (points || twkbPrecision != TG0_WKB)) {
+    *pzErr = sqlite3_mprintf(
+        "twkb and type=point can't be used with content, which stores no "
+        "shapes");
+    goto fail;
+  }
+  if (zContent && resident) {
+    *pzErr = sqlite3_mprintf("resident can't be used with content");
+    goto fail;
+  }
+  if (residentMb && !resident) {
+    *pzErr = sqlite3_mprintf("resident_mb needs resident=1");
+    goto fail;
+  }
+  if (!zContent && (zContentRowid || zShapeColumn || triggers)) {
+    *pzErr = sqlite3_mprintf(
+        "content_rowid, shape_column, and triggers need a content table");
+    goto fail;
+  }
+
+  // External content tables get a hidden column named after the table, for
+  // FTS5-style commands like INSERT INTO t(t) VALUES ('rebuild')
+  sqlite3_str *strSchema = sqlite3_str_new(NULL);
+  sqlite3_str_appendall(strSchema, "CREATE TABLE x(_shape");
+  for (int i = 3; i < argc; i++) {
+    if (!strchr(argv[i], '=')) {
+      sqlite3_str_appendf(strSchema, ", %w", argv[i]);
+    }
+  }
+  if (zContent) {
+    sqlite3_str_appendf(strSchema, ", \"%w\" HIDDEN", argv[2]);
+  }
+  sqlite3_str_appendall(strSchema, ")");
+  const char *zSchema = sqlite3_str_finish(strSchema);
+  if (!zSchema) {
+    rc = SQLITE_NOMEM;
+    goto fail;
+  }
+
+  rc = sqlite3_declare_vtab(db, zSchema);
+  sqlite3_free((void *)zSchema);
+  if (rc != SQLITE_OK) {
+    *pzErr = sqlite3_mprintf("Error declaring vtab schema for tg0 virtual table.");
+    goto fail;
+  }
+
+  char *zContentColumns = NULL;
+  if (zContent) {
+    if (!zContentRowid) {
+      zContentRowid = sqlite3_mprintf("rowid");
+    }
+    if (!zShapeColumn) {
+      zShapeColumn = sqlite3_mprintf("_shape");
+    }
+    // aux columns have the same names in the content table
+    sqlite3_str *strColumns = sqlite3_str_new(NULL);
+    sqlite3_str_appendf(strColumns, ", c.\"%w\"", zShapeColumn);
+    for (int i = 3; i < argc; i++) {
+      if (!strchr(argv[i], '=')) {
+        sqlite3_str_appendf(strColumns, ", c.\"%w\"", argv[i]);
+      }
+    }
+    zContentColumns = sqlite3_str_finish(strColumns);
+    if (!zContentRowid || !zShapeColumn || !zContentColumns) {
+      sqlite3_free(zContentColumns);
+      rc = SQLITE_NOMEM;
+      goto fail;
+    }
+  }
+
+  pNew = sqlite3_malloc(sizeof(*pNew));
+  *ppVtab = (sqlite3_vtab *)pNew;
+  if (pNew == 0) {
+    sqlite3_free(zContentColumns);
+    rc = SQLITE_NOMEM;
+    goto fail;
+  }
+  memset(pNew, 0, sizeof(*pNew));
+  const char *schemaName = argv[1];
+  const char *tableName = argv[2];
+
+  pNew->db = db;
+  pNew->schemaName = sqlite3_mprintf("%s", schemaName);
+  pNew->tableName = sqlite3_mprintf("%s", tableName);
+  pNew->numAuxColumns = numAuxColumns;
+  pNew->nThreads = nThreads;
+  pNew->twkbPrecision = twkbPrecision;
+  pNew->points = points;
+  pNew->zContent = zContent;
+  pNew->zContentRowid = zContentRowid;
+  pNew->zShapeColumn = zShapeColumn;
+  pNew->zContentColumns = zContentColumns;
+  pNew->triggers = triggers;
+  pNew->resident = resident;
+  pNew->residentLimit =
+      (sqlite3_int64)(residentMb ? residentMb : TG0_RESIDENT_DEFAULT_MB) << 20;
+  pNew->lastQuery.plan = -1;
+
+  if (isCreate) {
+    sqlite3_stmt *stmt = NULL;
+    int rcCreate = SQLITE_OK;
+    sqlite3_str *strRtreeSchema = sqlite3_str_new(NULL);
+    sqlite3_str_appendf(strRtreeSchema,
+                        "CREATE VIRTUAL TABLE \"%w\".\"%w_rtree\" using "
+                        "rtree(id, minX, maxX, minY, maxY",
+                        schemaName, tableName);
+    // external content tables only index bounding boxes
+    if (!zContent) {
+      sqlite3_str_appendall(strRtreeSchema,
+                            points ? ", +_x REAL, +_y REAL" : ", +_shape BLOB");
+      for (int i = 0; i < numAuxColumns; i++) {
+        sqlite3_str_appendf(strRtreeSchema, ", +c%d", i + 1);
+      }
+    }
+    sqlite3_str_appendall(strRtreeSchema, ")");
+    const char *zCreate = sqlite3_str_finish(strRtreeSchema);
+    if (!zCreate) {
+      rcCreate = SQLITE_NOMEM;
+    } else {
+      rcCreate = sqlite3_prepare_v2(db, zCreate, -1, &stmt, 0);
+      sqlite3_free((void *)zCreate);
+      if (rcCreate != SQLITE_OK) {
+        *pzErr = sqlite3_mprintf("Error preparing rtree shadow table for tg0 table.");
+        rcCreate = SQLITE_ERROR;
+      } else {
+        rcCreate = sqlite3_step(stmt) == SQLITE_DONE ? SQLITE_OK : SQLITE_ERROR;
+        if (rcCreate != SQLITE_OK) {
+          *pzErr = sqlite3_mprintf("Error creating rtree shadow table for tg0 table.");
+        }
+      }
+    }
+    sqlite3_finalize(stmt);
+    if (rcCreate == SQLITE_OK && triggers) {
+      rcCreate = tg0_create_triggers(pNew, pzErr);
+    }
+    if (rcCreate != SQLITE_OK) {
+      // xDisconnect is not called when xCreate fails, so clean up here
+      sqlite3_free(pNew->schemaName);
+      sqlite3_free(pNew->tableName);
+      sqlite3_free(pNew->zContent);
+      sqlite3_free(pNew->zContentRowid);
+      sqlite3_free(pNew->zShapeColumn);
+      sqlite3_free(pNew->zContentColumns);
+      sqlite3_free(pNew);
+      *ppVtab = NULL;
+      return rcCreate;
+    }
+  }
+  pNew->stats = pAux;
+  pNew->nextTable = pNew->stats->tables;
+  pNew->stats->tables = pNew;
+  return SQLITE_OK;
+
+fail:
+  sqlite3_free(zContent);
+  sqlite3_free(zContentRowid);
+  sqlite3_free(zShapeColumn);
+  return rc;
+}
+
+static int tg0Create(sqlite3 *db, void *pAux, int argc, const char *const *argv,
+                     sqlite3_vtab **ppVtab, char **pzErr) {
+  return tg0_init(db, pAux, argc, argv, ppVtab, pzErr, true);
+}
+static int tg0Connect(sqlite3 *db, void *pAux, int argc,
+                      const char *const *argv, sqlite3_vtab **ppVtab,
+                      char **pzErr) {
+  return tg0_init(db, pAux, argc, argv, ppVtab, pzErr, false);
+}
+
+static void tg0_finalize_statements(tg0_vtab *p) {
+  for (int i = 0; i < TG0_READ_STMT_COUNT; i++) {
+    sqlite3_finalize(p->aReadStmt[i]);
+    p->aReadStmt[i] = NULL;
+  }
+  sqlite3_finalize(p->stmtInsert);
+  sqlite3_finalize(p->stmtDelete);
+  sqlite3_finalize(p->stmtUpdateShape);
+  sqlite3_finalize(p->stmtUpdateRowid);
+  sqlite3_finalize(p->stmtUpdateAux);
+  sqlite3_finalize(p->stmtDataVersion);
+  p->stmtDataVersion = NULL;
+  p->stmtInsert = NULL;
+  p->stmtDelete = NULL;
+  p->stmtUpdateShape = NULL;
+  p->stmtUpdateRowid = NULL;
+  p->stmtUpdateAux = NULL;
+}
+
+static int tg0Disconnect(sqlite3_vtab *pVtab) {
+  tg0_vtab *p = (tg0_vtab *)pVtab;
+  tg0_vtab **pp = &p->stats->tables;
+  while (*pp && *pp != p) {
+    pp = &(*pp)->nextTable;
+  }
+  if (*pp) {
+    *pp = p->nextTable;
+  }
+  tg0_finalize_statements(p);
+  tg_pool_free(p->pool);
+  tg0_resident_release(p->pResident);
+  tg_geom_free(p->residentPendingGeom);
+  sqlite3_free(p->schemaName);
+  sqlite3_free(p->tableName);
+  sqlite3_free(p->zContent);
+  sqlite3_free(p->zContentRowid);
+  sqlite3_free(p->zShapeColumn);
+  sqlite3_free(p->zContentColumns);
+  sqlite3_free(p);
+  return SQLITE_OK;
+}
+static int tg0Destroy(sqlite3_vtab *pVtab) {
+  tg0_vtab *p = (tg0_vtab *)pVtab;
+  sqlite3_stmt *stmt;
+  // cached statements reference the rtree table, so release them before
+  // dropping it
+  tg0_finalize_statements(p);
+  const char *zSql =
+      sqlite3_mprintf(TG0_SQL_RTREE_DROP, p->schemaName, p->tableName);
+  int rc = sqlite3_prepare_v2(p->db, zSql, -1, &stmt, 0);
+  sqlite3_free((void *)zSql);
+
+  if (rc == SQLITE_OK) {
+    // ignore if there's an error?
+    sqlite3_step(stmt);
+  }
+
+  sqlite3_finalize(stmt);
+  if (p->triggers) {
+    // the content table may be gone already, and its triggers with it
+    zSql = sqlite3_mprintf("DROP TRIGGER IF EXISTS \"%w\".\"%w_ai\";"
+                           "DROP TRIGGER IF EXISTS \"%w\".\"%w_ad\";"
+                           "DROP TRIGGER IF EXISTS \"%w\".\"%w_au\";",
+                           p->schemaName, p->tableName, p->schemaName,
+                           p->tableName, p->schemaName, p->tableName);
+    if (zSql) {
+      sqlite3_exec(p->db, zSql, NULL, NULL, NULL);
+      sqlite3_free((void *)zSql);
+    }
+  }
+  tg0Disconnect(pVtab);
+  return SQLITE_OK;
+}
+
+static int tg0Open(sqlite3_vtab *p, sqlite3_vtab_cursor **ppCursor) {
+  tg0_cursor *pCur;
+  pCur = sqlite3_malloc(sizeof(*pCur));
+  if (pCur == 0)
+    return SQLITE_NOMEM;
+  memset(pCur, 0, sizeof(*pCur));
+  pCur->stmtKind = -1;
+  pCur->query.plan = -1;
+  *ppCursor = &pCur->base;
+  return SQLITE_OK;
+}
+
+// Reports a failed prepare or step of one of the vtab's read statements, as
+// "<zWhat>: <sqlite3_errmsg()>". A content= table that was dropped or renamed
+// after the tg0 table was created is the usual cause, so that case names the
+// missing table instead.
+static int tg0_read_error(tg0_vtab *p, const char *zWhat) {
+  char *zErr = sqlite3_mprintf("%s", sqlite3_errmsg(p->db));
+  int missing = 0;
+  if (p->zContent) {
+    char *zSql = sqlite3_mprintf("SELECT 1 FROM \"%w\".\"%w\"",
+                                 p->schemaName, p->zContent);
+    sqlite3_stmt *stmt = NULL;
+    missing = zSql && sqlite3_prepare_v2(p->db, zSql, -1, &stmt, NULL) ==
+                          SQLITE_ERROR;
+    sqlite3_finalize(stmt);
+    sqlite3_free(zSql);
+  }
+  if (missing) {
+    tg_vtab_set_error(&p->base,
+                      "content table \"%w\".\"%w\" of tg0 table %s is "
+                      "missing: %s",
+                      p->schemaName, p->zContent, p->tableName, zErr);
+  } else {
+    tg_vtab_set_error(&p->base, "%s: %s", zWhat, zErr);
+  }
+  sqlite3_free(zErr);
+  return SQLITE_ERROR;
+}
+
+// Hands out a prepared statement for the given query shape, either the one
+// cached on the vtab or a freshly prepared one if another cursor holds it.
+static int tg0_read_stmt_checkout(tg0_vtab *p, int kind,
+                                  sqlite3_stmt **ppStmt) {
+  if (p->aReadStmt[kind]) {
+    *ppStmt = p->aReadStmt[kind];
+    p->aReadStmt[kind] = NULL;
+    return SQLITE_OK;
+  }
+  sqlite3_str *strSql = sqlite3_str_new(NULL);
+  if (p->zContent) {
+    // CROSS JOIN keeps the rtree as the outer loop, so the content table is
+    // only probed by content_rowid for the rtree's candidates
+    sqlite3_str_appendf(strSql,
+                        "SELECT r.id%s FROM \"%w\".\"%w_rtree\" as r "
+                        "CROSS JOIN \"%w\".\"%w\" as c ON c.\"%w\" = r.id",
+                        p->zContentColumns, p->schemaName, p->tableName,
+                        p->schemaName, p->zContent, p->zContentRowid);
+  } else {
+    sqlite3_str_appendall(strSql,
+                          p->points ? "SELECT id, _x" : "SELECT id, _shape");
+    for (int i = 0; i < p->numAuxColumns; i++) {
+      sqlite3_str_appendf(strSql, ", c%d", i + 1);
+    }
+    if (p->points) {
+      sqlite3_str_appendall(strSql, ", _y");
+    }
+    sqlite3_str_appendf(strSql, " FROM \"%w\".\"%w_rtree\" as r",
+                        p->schemaName, p->tableName);
+  }
+  if (kind == TG0_READ_STMT_INTERSECT) {
+    sqlite3_str_appendall(strSql, " WHERE r.minX <= ?1 "
+                                  "AND r.maxX >= ?2 "
+                                  "AND r.minY <= ?3 "
+                                  "AND r.maxY >= ?4");
+  }
+  const char *zSql = sqlite3_str_finish(strSql);
+  if (!zSql) {
+    return SQLITE_NOMEM;
+  }
+  int rc = sqlite3_prepare_v3(p->db, zSql, -1, SQLITE_PREPARE_PERSISTENT,
+                              ppStmt, NULL);
+  sqlite3_free((void *)zSql);
+  if (rc != SQLITE_OK) {
+    tg0_read_error(p, "prep error");
+  }
+  return rc;
+}
+
+// Returns a statement from tg0_read_stmt_checkout() to the vtab's cache.
+static void tg0_read_stmt_checkin(tg0_vtab *p, int kind, sqlite3_stmt *stmt) {
+  if (!stmt) {
+    return;
+  }
+  if (p->aReadStmt[kind]) {
+    sqlite3_finalize(stmt);
+    return;
+  }
+  sqlite3_reset(stmt);
+  sqlite3_clear_bindings(stmt);
+  p->aReadStmt[kind] = stmt;
+}
+
+static void tg0_resident_drop(tg0_vtab *p) {
+  tg0_resident_release(p->pResident);
+  p->pResident = NULL;
+}
+
+// PRAGMA data_version of the table's schema, which changes when another
+// connection commits to it, or -1 on error.
+static sqlite3_int64 tg0_data_version(tg0_vtab *p) {
+  if (!p->stmtDataVersion) {
+    char *zSql = sqlite3_mprintf("PRAGMA \"%w\".data_version", p->schemaName);
+    if (!zSql) {
+      return -1;
+    }
+    int rc = sqlite3_prepare_v3(p->db, zSql, -1, SQLITE_PREPARE_PERSISTENT,
+                                &p->stmtDataVersion, NULL);
+    sqlite3_free(zSql);
+    if (rc != SQLITE_OK) {
+      return -1;
+    }
+  }
+  sqlite3_int64 version = -1;
+  if (sqlite3_step(p->stmtDataVersion) == SQLITE_ROW) {
+    version = sqlite3_column_int64(p->stmtDataVersion, 0);
+  }
+  sqlite3_reset(p->stmtDataVersion);
+  return version;
+}
+
+// Reads the whole table into p->pResident, unless it takes more than
+// p->residentLimit bytes, which sets p->residentOverLimit instead.
+static int tg0_resident_load(tg0_vtab *p) {
+  struct tg0_resident *r = sqlite3_malloc(sizeof(*r));
+  sqlite3_value **aux =
+      sqlite3_malloc64((p->numAuxColumns + 1) * sizeof(*aux));
+  if (!r || !aux) {
+    sqlite3_free(r);
+    sqlite3_free(aux);
+    return SQLITE_NOMEM;
+  }
+  memset(r, 0, sizeof(*r));
+  r->nRef = 1;
+  r->numAuxColumns = p->numAuxColumns;
+
+  sqlite3_int64 version = tg0_data_version(p);
+  sqlite3_stmt *stmt = NULL;
+  int rc = tg0_read_stmt_checkout(p, TG0_READ_STMT_FULLSCAN, &stmt);
+  int overLimit = 0;
+  int step = SQLITE_DONE;
+  while (rc == SQLITE_OK && (step = sqlite3_step(stmt)) == SQLITE_ROW) {
+    struct tg_geom *geom = NULL;
+    struct tg_rect rect;
+    if (p->points) {
+      rect.min.x = rect.max.x = sqlite3_column_double(stmt, 1);
+      rect.min.y = rect.max.y =
+          sqlite3_column_double(stmt, 2 + p->numAuxColumns);
+    } else {
+      // kept for many queries, so worth indexing
+      int twkb;
+      geom = parseBlob(sqlite3_column_blob(stmt, 1),
+                       sqlite3_column_bytes(stmt, 1), TG_DEFAULT, &twkb);
+      if (!geom) {
+        rc = SQLITE_NOMEM;
+        break;
+      }
+      if (tg_geom_error(geom)) {
+        tg_vtab_set_error(&p->base, "%s", tg_geom_error(geom));
+        tg_geom_free(geom);
+        rc = SQLITE_ERROR;
+        break;
+      }
+      rect = tg_geom_rect(geom);
+    }
+    for (int j = 0; j < p->numAuxColumns; j++) {
+      aux[j] = sqlite3_column_value(stmt, 2 + j);
+    }
+    rc = tg0_resident_append(r, sqlite3_column_int64(stmt, 0), rect, geom,
+                             aux);
+    if (rc == SQLITE_OK && r->nBytes > p->residentLimit) {
+      overLimit = 1;
+      break;
+    }
+  }
+  if (rc == SQLITE_OK && !overLimit && step != SQLITE_DONE) {
+    tg_vtab_set_error(&p->base, "error loading resident tg0 table: %s",
+                      sqlite3_errmsg(p->db));
+    rc = SQLITE_ERROR;
+  }
+  if (stmt) {
+    tg0_read_stmt_checkin(p, TG0_READ_STMT_FULLSCAN, stmt);
+  }
+  sqlite3_free(aux);
+  if (rc == SQLITE_OK && !overLimit) {
+    rc = tg0_resident_pack(r);
+    overLimit = r->nBytes > p->residentLimit;
+  }
+  if (rc != SQLITE_OK || overLimit) {
+    tg0_resident_release(r);
+    p->residentOverLimit = overLimit;
+    return rc;
+  }
+  p->pResident = r;
+  p->residentDataVersion = version;
+  return SQLITE_OK;
+}
+
+// Sets *pr to a new reference to the table's resident copy, loading it if
+// needed, or to NULL when queries should read the rtree.
+static int tg0_resident_acquire(tg0_vtab *p, struct tg0_resident **pr) {
+  *pr = NULL;
+  if (!p->resident || p->residentOverLimit) {
+    return SQLITE_OK;
+  }
+  if (p->pResident && tg0_data_version(p) != p->residentDataVersion) {
+    tg0_resident_drop(p);
+  }
+  if (!p->pResident) {
+    int rc = tg0_resident_load(p);
+    if (rc != SQLITE_OK || !p->pResident) {
+      return rc;
+    }
+  }
+  struct tg0_resident *r = p->pResident;
+  int nOverflow = r->nEntry - r->nPacked;
+  if (r->nRef == 1 &&
+      ((nOverflow > TG0_RESIDENT_REPACK && nOverflow * 16 > r->nPacked) ||
+       (r->nDead > TG0_RESIDENT_REPACK && r->nDead * 4 > r->nEntry))) {
+    int rc = tg0_resident_pack(r);
+    if (rc != SQLITE_OK) {
+      tg0_resident_drop(p);
+      return rc;
+    }
+  }
+  p->pResident->nRef++;
+  *pr = p->pResident;
+  return SQLITE_OK;
+}
+
+static void tg0_cursor_clear_query(tg0_cursor *pCur) {
+  tg_geom_free(pCur->queryGeom);
+  pCur->queryGeom = NULL;
+  sqlite3_free(pCur->queryKey);
+  pCur->queryKey = NULL;
+  pCur->nQueryKey = 0;
+  pCur->queryKeyType = 0;
+  pCur->queryKeyPointer = NULL;
+}
+
+// Sets pCur->queryGeom from the given predicate argument, skipping the parse
+// if it's the same argument the previous tg0Filter() call was given.
+static int tg0_cursor_query_geom(tg0_cursor *pCur, sqlite3_value *value) {
+  int type = sqlite3_value_type(value);
+  const void *pointer = NULL;
+  const void *bytes = NULL;
+  int n = 0;
+  if (type == SQLITE_NULL) {
+    pointer = sqlite3_value_pointer(value, TG_GEOM_POINTER_NAME);
+  } else if (type == SQLITE_TEXT || type == SQLITE_BLOB) {
+    bytes = type == SQLITE_TEXT ? (const void *)sqlite3_value_text(value)
+                                : sqlite3_value_blob(value);
+    n = sqlite3_value_bytes(value);
+  }
+
+  // Pointer values can be compared by address: queryGeom holds a reference
+  // to the previous one, so the address can't have been re-used.
+  if (pCur->queryGeom && type == pCur->queryKeyType &&
+      ((pointer && pointer == pCur->queryKeyPointer) ||
+       (bytes && n == pCur->nQueryKey &&
+        memcmp(bytes, pCur->queryKey, n) == 0))) {
+    return SQLITE_OK;
+  }
+  tg0_cursor_clear_query(pCur);
+
+  char *errmsg;
+  int rc = geomValue(value, &pCur->queryGeom, &errmsg);
+  if (rc != SQLITE_OK) {
+    tg_vtab_set_error(pCur->base.pVtab, "%s", errmsg);
+    sqlite3_free(errmsg);
+    return SQLITE_ERROR;
+  }
+  pCur->queryKeyType = type;
+  pCur->queryKeyPointer = pointer;
+  if (bytes) {
+    pCur->queryKey = sqlite3_malloc(n > 0 ? n : 1);
+    if (!pCur->queryKey) {
+      tg0_cursor_clear_query(pCur);
+      return SQLITE_NOMEM;
+    }
+    memcpy(pCur->queryKey, bytes, n);
+    pCur->nQueryKey = n;
+  }
+  return SQLITE_OK;
+}
+
+// Hands the stats of the cursor's finished run (if any) to its table.
+static void tg0_cursor_publish_query(tg0_cursor *pCur) {
+  if (pCur->query.plan >= 0) {
+    ((tg0_vtab *)pCur->base.pVtab)->lastQuery = pCur->query;
+  }
+  memset(&pCur->query, 0, sizeof(pCur->query));
+  pCur->query.plan = -1;
+}
+
+// Releases the current batch's candidates, keeping the buffers for the next.
+static void tg0_cursor_clear_batch(tg0_cursor *pCur) {
+  int numAuxColumns = ((tg0_vtab *)pCur->base.pVtab)->numAuxColumns;
+  for (int i = 0; i < pCur->nBatch; i++) {
+    sqlite3_free(pCur->aBatch[i].error);
+    for (int j = 0; j < numAuxColumns; j++) {
+      sqlite3_value_free(pCur->aBatchAux[i * numAuxColumns + j]);
+    }
+  }
+  pCur->nBatch = 0;
+  pCur->iBatch = -1;
+  pCur->nBatchShapes = 0;
+}
+
+static int tg0Close(sqlite3_vtab_cursor *cur) {
+  tg0_cursor *pCur = (tg0_cursor *)cur;
+  tg0_cursor_publish_query(pCur);
+  tg0_cursor_clear_batch(pCur);
+  sqlite3_free(pCur->aBatch);
+  sqlite3_free(pCur->aBatchAux);
+  sqlite3_free(pCur->batchShapes);
+  tg0_resident_release(pCur->resident);
+  sqlite3_free(pCur->aResident);
+  if (pCur->stmt) {
+    tg0_read_stmt_checkin((tg0_vtab *)cur->pVtab, pCur->stmtKind, pCur->stmt);
+  }
+  tg0_cursor_clear_query(pCur);
+  sqlite3_free(pCur);
+  return SQLITE_OK;
+}
+
+static int tg0BestIndex(sqlite3_vtab *pVtab, sqlite3_index_info *pIdxInfo) {
+
+  int iPredicateTerm = -1;
+  int predicate = 0;
+
+  for (int i = 0; i < pIdxInfo->nConstraint; i++) {
+    if (!pIdxInfo->aConstraint[i].usable)
+      continue;
+
+    int iColumn = pIdxInfo->aConstraint[i].iColumn;
+    int op = pIdxInfo->aConstraint[i].op;
+    if (op == TG0_FUNC_INTERSECTS || op == TG0_FUNC_DISJOINT ||
+        op == TG0_FUNC_CONTAINS || op == TG0_FUNC_WITHIN ||
+        op == TG0_FUNC_COVERS || op == TG0_FUNC_COVEREDBY) {
+      if (iPredicateTerm >= 0) {
+        sqlite3_free(pVtab->zErrMsg);
+        pVtab->zErrMsg = sqlite3_mprintf(
+            "only 1 predicate is allowed on tg0 WHERE clauses.");
+        return SQLITE_ERROR;
+      }
+      iPredicateTerm = i;
+      predicate = op;
+    }
+  }
+  if (iPredicateTerm >= 0) {
+    pIdxInfo->idxStr = (char *)"predicate";
+    pIdxInfo->idxNum = predicate;
+    pIdxInfo->aConstraintUsage[iPredicateTerm].argvIndex = 1;
+    pIdxInfo->aConstraintUsage[iPredicateTerm].omit = 1;
+    pIdxInfo->estimatedCost = 30.0;
+    pIdxInfo->estimatedRows = 10;
+  } else {
+    pIdxInfo->idxStr = (char *)"fullscan";
+    pIdxInfo->estimatedCost = 3000000.0;
+    pIdxInfo->estimatedRows = 100000;
+  }
+
+  return SQLITE_OK;
+}
+
+// forward delcaration bc tg0Filter uses it
+static int tg0Next(sqlite3_vtab_cursor *cur);
+
+// Points the cursor at a reset statement of the given query shape, re-using
+// the one it already holds when possible.
+static int tg0_cursor_use_stmt(tg0_cursor *pCur, int kind) {
+  tg0_vtab *p = (tg0_vtab *)pCur->base.pVtab;
+  if (pCur->stmt && pCur->stmtKind == kind) {
+    sqlite3_reset(pCur->stmt);
+    return SQLITE_OK;
+  }
+  if (pCur->stmt) {
+    tg0_read_stmt_checkin(p, pCur->stmtKind, pCur->stmt);
+    pCur->stmt = NULL;
+    pCur->stmtKind = -1;
+  }
+  int rc = tg0_read_stmt_checkout(p, kind, &pCur->stmt);
+  if (rc != SQLITE_OK) {
+    return rc;
+  }
+  pCur->stmtKind = kind;
+  return SQLITE_OK;
+}
+
+// The tg_stat that a _shape value of the given type and bytes counts as,
+// telling formats apart like geomValue() does.
+static enum tg_stat tg0_shape_format(int type, const unsigned char *b, int n) {
+  if (n > 0 && b[0] == '{') {
+    return TG_STAT_PARSE_GEOJSON;
+  }
+  if (type == SQLITE_TEXT) {
+    return TG_STAT_PARSE_WKT;
+  }
+  // see parseBlob()
+  return n > 0 && b[0] > 1 ? TG_STAT_PARSE_TWKB : TG_STAT_PARSE_WKB;
+}
+
+// Decodes and checks one pool task's share of the batch. Runs on any thread,
+// so it only touches the candidates' copied bytes and the query geometry.
+//
+// Point layers skip tg entirely: a first loop pulls the coordinates of
+// little-endian 2D WKB and 2D TWKB points (or the coordinates of type=point
+// tables) into arrays, a second checks them all against
+// the query's bounding box (the rtree's float32 boxes are slightly larger),
+// and only the points inside it are tested with tg_geom_intersects_xy().
+// Everything else is parsed and checked one by one.
+static void tg0_refine_task(void *ctx, int iTask) {
+  tg0_cursor *pCur = (tg0_cursor *)ctx;
+  int points = ((tg0_vtab *)pCur->base.pVtab)->points;
+  int begin = iTask * TG0_BATCH_TASK;
+  int end = begin + TG0_BATCH_TASK;
+  if (end > pCur->nBatch) {
+    end = pCur->nBatch;
+  }
+  double ax[TG0_BATCH_TASK], ay[TG0_BATCH_TASK];
+  unsigned char aPoint[TG0_BATCH_TASK], aInside[TG0_BATCH_TASK];
+  int n = end - begin;
+
+  for (int i = 0; i < n; i++) {
+    const struct tg0_candidate *candidate = &pCur->aBatch[begin + i];
+    if (points) {
+      ax[i] = candidate->x;
+      ay[i] = candidate->y;
+      aPoint[i] = 1;
+      continue;
+    }
+    const unsigned char *shape = pCur->batchShapes + candidate->offset;
+    aPoint[i] = candidate->type == SQLITE_BLOB &&
+                (wkbPointXY(shape, candidate->nShape, &ax[i], &ay[i]) ||
+                 twkbPointXY(shape, candidate->nShape, &ax[i], &ay[i]));
+    if (!aPoint[i]) {
+      ax[i] = ay[i] = 0;
+    }
+  }
+
+  const struct tg_rect rect = pCur->queryRect;
+  for (int i = 0; i < n; i++) {
+    aInside[i] = (ax[i] >= rect.min.x) & (ax[i] <= rect.max.x) &
+                 (ay[i] >= rect.min.y) & (ay[i] <= rect.max.y);
+  }
+
+  sqlite3_uint64 buffer[512];
+  struct tg_arena arena;
+  tg_arena_init(&arena, buffer, sizeof(buffer));
+  for (int i = 0; i < n; i++) {
+    struct tg0_candidate *candidate = &pCur->aBatch[begin + i];
+    if (aPoint[i]) {
+      candidate->result =
+          aInside[i] && tg_geom_intersects_xy(pCur->queryGeom, ax[i], ay[i]);
+      continue;
+    }
+    // only external content tables can have rows without a shape
+    if (candidate->type == SQLITE_NULL) {
+      candidate->result = 0;
+      continue;
+    }
+    tg_arena_begin(&arena);
+    const unsigned char *shape = pCur->batchShapes + candidate->offset;
+    struct tg_geom *geom;
+    switch (tg0_shape_format(candidate->type, shape, candidate->nShape)) {
+    case TG_STAT_PARSE_GEOJSON:
+      geom = tg_parse_geojsonn_ix((const char *)shape, candidate->nShape,
+                                  TG_NONE);
+      break;
+    case TG_STAT_PARSE_WKT:
+      geom = tg_parse_wktn_ix((const char *)shape, candidate->nShape, TG_NONE);
+      break;
+    default: {
+      int twkb;
+      geom = parseBlob(shape, candidate->nShape, TG_NONE, &twkb);
+      break;
+    }
+    }
+    if (!geom) {
+      candidate->result = -1;
+    } else if (tg_geom_error(geom)) {
+      candidate->result = -1;
+      candidate->error = sqlite3_mprintf("%s", tg_geom_error(geom));
+    } else {
+      candidate->result = tg_geom_intersects(geom, pCur->queryGeom);
+    }
+    tg_geom_free(geom);
+    tg_arena_end(&arena);
+  }
+}
+
+// Reads the next TG0_BATCH candidates from stmt, then decodes and checks them
+// on the table's pool. Candidates keep their rtree order.
+static int tg0_cursor_fill_batch(tg0_cursor *pCur) {
+  tg0_vtab *p = (tg0_vtab *)pCur->base.pVtab;
+  tg0_cursor_clear_batch(pCur);
+  if (!pCur->aBatch) {
+    pCur->aBatch = sqlite3_malloc64(TG0_BATCH * sizeof(*pCur->aBatch));
+    if (p->numAuxColumns) {
+      pCur->aBatchAux = sqlite3_malloc64((sqlite3_uint64)TG0_BATCH *
+                                         p->numAuxColumns *
+                                         sizeof(*pCur->aBatchAux));
+    }
+    if (!pCur->aBatch || (p->numAuxColumns && !pCur->aBatchAux)) {
+      return SQLITE_NOMEM;
+    }
+  }
+  if (!p->pool) {
+    int rc = tg_pool_new(p->nThreads, &p->pool);
+    if (rc != SQLITE_OK) {
+      return rc;
+    }
+  }
+
+  while (pCur->nBatch < TG0_BATCH) {
+    sqlite3_int64 start = tg_stats_clock();
+    pCur->stepStatus = sqlite3_step(pCur->stmt);
+    pCur->query.rtreeNs += tg_stats_time(TG_STAT_RTREE_NS, start);
+    if (pCur->stepStatus == SQLITE_DONE) {
+      break;
+    }
+    if (pCur->stepStatus != SQLITE_ROW) {
+      return tg0_read_error(p, "tg0Next step error");
+    }
+    pCur->query.rtreeRows++;
+
+    struct tg0_candidate *candidate = &pCur->aBatch[pCur->nBatch];
+    const void *shape = NULL;
+    int nShape = 0;
+    if (p->points) {
+      candidate->x = sqlite3_column_double(pCur->stmt, 1);
+      candidate->y =
+          sqlite3_column_double(pCur->stmt, 2 + p->numAuxColumns);
+    } else {
+      // TEXT shapes of external content tables are copied as they are
+      candidate->type = sqlite3_column_type(pCur->stmt, 1);
+      shape = sqlite3_column_blob(pCur->stmt, 1);
+      nShape = sqlite3_column_bytes(pCur->stmt, 1);
+      if (p->zContent && candidate->type != SQLITE_NULL) {
+        tg_stats_add(tg0_shape_format(candidate->type, shape, nShape), 1);
+      }
+    }
+    if (pCur->nBatchShapes + nShape > pCur->nBatchShapesAlloc) {
+      sqlite3_uint64 nAlloc = (pCur->nBatchShapes + nShape) * 2;
+      unsigned char *batchShapes = sqlite3_realloc64(pCur->batchShapes, nAlloc);
+      if (!batchShapes) {
+        return SQLITE_NOMEM;
+      }
+      pCur->batchShapes = batchShapes;
+      pCur->nBatchShapesAlloc = nAlloc;
+    }
+    if (nShape) {
+      memcpy(pCur->batchShapes + pCur->nBatchShapes, shape, nShape);
+    }
+    candidate->id = sqlite3_column_int64(pCur->stmt, 0);
+    candidate->offset = pCur->nBatchShapes;
+    candidate->nShape = nShape;
+    candidate->result = 0;
+    candidate->error = NULL;
+    pCur->nBatchShapes += nShape;
+    // counted first, so tg0_cursor_clear_batch() frees what was copied
+    pCur->nBatch++;
+    for (int j = 0; j < p->numAuxColumns; j++) {
+      sqlite3_value *value =
+          sqlite3_value_dup(sqlite3_column_value(pCur->stmt, 2 + j));
+      pCur->aBatchAux[(pCur->nBatch - 1) * p->numAuxColumns + j] = value;
+      if (!value) {
+        for (j++; j < p->numAuxColumns; j++) {
+          pCur->aBatchAux[(pCur->nBatch - 1) * p->numAuxColumns + j] = NULL;
+        }
+        return SQLITE_NOMEM;
+      }
+    }
+    pCur->query.shapeBytes += nShape;
+  }
+
+  // Candidates are decoded and checked in the same pass, and with several
+  // threads those passes overlap, so both are counted as predicate time.
+  sqlite3_int64 start = tg_stats_clock();
+  tg_pool_run(p->pool, (pCur->nBatch + TG0_BATCH_TASK - 1) / TG0_BATCH_TASK,
+              tg0_refine_task, pCur);
+  pCur->query.predicateNs += tg_stats_time(TG_STAT_PREDICATE_NS, start);
+
+  sqlite3_int64 accepted = 0;
+  for (int i = 0; i < pCur->nBatch; i++) {
+    struct tg0_candidate *candidate = &pCur->aBatch[i];
+    if (candidate->result < 0) {
+      if (!candidate->error) {
+        return SQLITE_NOMEM;
+      }
+      tg_vtab_set_error(pCur->base.pVtab, "%s", candidate->error);
+      return SQLITE_ERROR;
+    }
+    accepted += candidate->result;
+  }
+  pCur->query.predicateCalls += pCur->nBatch;
+  if (!p->points) {
+    // external content tables count each candidate's format as it's read
+    if (!p->zContent) {
+      tg_stats_add(p->twkbPrecision != TG0_WKB ? TG_STAT_PARSE_TWKB
+                                                : TG_STAT_PARSE_WKB,
+                   pCur->nBatch);
+    }
+    tg_stats_add(TG_STAT_PARSE_BYTES, pCur->nBatchShapes);
+  }
+  tg_stats_add(TG_STAT_TG0_CANDIDATES, pCur->nBatch);
+  tg_stats_add(TG_STAT_TG0_ACCEPTED, accepted);
+  return SQLITE_OK;
+}
+
+// tg0Next() for batched queries: moves to the next accepted candidate,
+// refilling the batch as needed.
+static int tg0_cursor_next_batched(tg0_cursor *pCur) {
+  while (1) {
+    while (++pCur->iBatch < pCur->nBatch) {
+      if (pCur->aBatch[pCur->iBatch].result) {
+        pCur->query.accepted++;
+        return SQLITE_OK;
+      }
+    }
+    if (pCur->stepStatus != SQLITE_ROW) {
+      pCur->batchEof = 1;
+      return SQLITE_OK;
+    }
+    int rc = tg0_cursor_fill_batch(pCur);
+    if (rc != SQLITE_OK) {
+      return rc;
+    }
+  }
+}
+
+// Runs the cursor's query against the resident copy r, taking over the
+// reference: a full scan gets every entry, an intersect query the entries
+// whose box overlaps queryRect and whose shape intersects queryGeom.
+static int tg0_cursor_resident_query(tg0_cursor *pCur,
+                                     struct tg0_resident *r) {
+  pCur->resident = r;
+  pCur->iResident = 0;
+  pCur->nResident = 0;
+  pCur->query.resident = 1;
+  struct tg_rect all = {{-INFINITY, -INFINITY}, {INFINITY, INFINITY}};
+  int rc = tg0_resident_search(r, pCur->plan == INTERSECT ? pCur->queryRect : all,
+                               &pCur->aResident, &pCur->nResident,
+                               &pCur->nResidentAlloc);
+  if (rc != SQLITE_OK) {
+    return rc;
+  }
+  pCur->query.rtreeRows += pCur->nResident;
+  if (pCur->plan != INTERSECT) {
+    pCur->query.accepted += pCur->nResident;
+    return SQLITE_OK;
+  }
+
+  sqlite3_int64 start = tg_stats_clock();
+  int nAccepted = 0;
+  for (int i = 0; i < pCur->nResident; i++) {
+    const struct tg0_resident_entry *entry = &r->aEntry[pCur->aResident[i]];
+    int accepted = entry->geom ? tg_geom_intersects(entry->geom, pCur->queryGeom)
+                               : tg_geom_intersects_xy(pCur->queryGeom,
+                                                       entry->rect.min.x,
+                                                       entry->rect.min.y);
+    if (accepted) {
+      pCur->aResident[nAccepted++] = pCur->aResident[i];
+    }
+  }
+  pCur->query.predicateNs += tg_stats_time(TG_STAT_PREDICATE_NS, start);
+  pCur->query.predicateCalls += pCur->nResident;
+  pCur->query.accepted += nAccepted;
+  tg_stats_add(TG_STAT_TG0_CANDIDATES, pCur->nResident);
+  tg_stats_add(TG_STAT_TG0_ACCEPTED, nAccepted);
+  pCur->nResident = nAccepted;
+  return SQLITE_OK;
+}
+
+static int tg0Filter(sqlite3_vtab_cursor *pVtabCursor, int idxNum,
+                     const char *idxStr, int argc, sqlite3_value **argv) {
+  tg0_cursor *pCur = (tg0_cursor *)pVtabCursor;
+  tg0_vtab *p = (tg0_vtab *)pVtabCursor->pVtab;
+  tg_stats_enter(p->db);
+  tg0_cursor_publish_query(pCur);
+  tg0_cursor_clear_batch(pCur);
+  pCur->batched = 0;
+  pCur->batchEof = 0;
+  tg0_resident_release(pCur->resident);
+  pCur->resident = NULL;
+
+  if (strcmp(idxStr, "fullscan") == 0) {
+    pCur->plan = FULLSCAN;
+    pCur->query.plan = FULLSCAN;
+    struct tg0_resident *r;
+    int rc = tg0_resident_acquire(p, &r);
+    if (rc != SQLITE_OK) {
+      return rc;
+    }
+    if (r) {
+      return tg0_cursor_resident_query(pCur, r);
+    }
+    rc = tg0_cursor_use_stmt(pCur, TG0_READ_STMT_FULLSCAN);
+    if (rc != SQLITE_OK) {
+      return rc;
+    }
+    return tg0Next(pVtabCursor);
+  } else if (strcmp(idxStr, "predicate") == 0) {
+    switch (idxNum) {
+    case TG0_FUNC_INTERSECTS: {
+      pCur->plan = INTERSECT;
+      pCur->query.plan = INTERSECT;
+
+      int rc = tg0_cursor_query_geom(pCur, argv[0]);
+      if (rc != SQLITE_OK) {
+        return rc;
+      }
+      struct tg_rect rect = tg_geom_rect(pCur->queryGeom);
+      pCur->queryRect = rect;
+
+      struct tg0_resident *r;
+      rc = tg0_resident_acquire(p, &r);
+      if (rc != SQLITE_OK) {
+        return rc;
+      }
+      if (r) {
+        return tg0_cursor_resident_query(pCur, r);
+      }
+      rc = tg0_cursor_use_stmt(pCur, TG0_READ_STMT_INTERSECT);
+      if (rc != SQLITE_OK) {
+        return rc;
+      }
+      sqlite3_bind_double(pCur->stmt, 1, rect.max.x);
+      sqlite3_bind_double(pCur->stmt, 2, rect.min.x);
+      sqlite3_bind_double(pCur->stmt, 3, rect.max.y);
+      sqlite3_bind_double(pCur->stmt, 4, rect.min.y);
+      pCur->batched = 1;
+      pCur->stepStatus = SQLITE_ROW;
+      return tg0_cursor_next_batched(pCur);
+    }
+    case TG0_FUNC_DISJOINT:
+    case TG0_FUNC_CONTAINS:
+    case TG0_FUNC_WITHIN:
+    case TG0_FUNC_COVERS:
+    case TG0_FUNC_COVEREDBY: {
+      sqlite3_free(pVtabCursor->pVtab->zErrMsg);
+      pVtabCursor->pVtab->zErrMsg =
+          sqlite3_mprintf("The given predicate inside the WHERE clause on tg0 "
+                          "table is not supported yet");
+      return SQLITE_ERROR;
+    }
+    default: {
+      sqlite3_free(pVtabCursor->pVtab->zErrMsg);
+      pVtabCursor->pVtab->zErrMsg = sqlite3_mprintf("unknown query plan");
+      return SQLITE_ERROR;
+    }
+    }
+    return tg0Next(pVtabCursor);
+  } else {
+    sqlite3_free(pVtabCursor->pVtab->zErrMsg);
+    pVtabCursor->pVtab->zErrMsg = sqlite3_mprintf("unknown idxStr");
+    return SQLITE_ERROR;
+  }
+}
+
+static int tg0Rowid(sqlite3_vtab_cursor *cur, sqlite_int64 *pRowid) {
+  tg0_cursor *pCur = (tg0_cursor *)cur;
+  if (pCur->resident) {
+    *pRowid = pCur->resident->aEntry[pCur->aResident[pCur->iResident]].id;
+    return SQLITE_OK;
+  }
+  if (pCur->batched) {
+    *pRowid = pCur->aBatch[pCur->iBatch].id;
+    return SQLITE_OK;
+  }
+  *pRowid = sqlite3_column_int64(pCur->stmt, 0);
+  return SQLITE_OK;
+}
+
+static int tg0Next(sqlite3_vtab_cursor *cur) {
+  tg0_cursor *pCur = (tg0_cursor *)cur;
+  tg0_vtab *p = (tg0_vtab *)cur->pVtab;
+  tg_stats_enter(p->db);
+  if (pCur->resident) {
+    pCur->iResident++;
+    return SQLITE_OK;
+  }
+  if (pCur->batched) {
+    return tg0_cursor_next_batched(pCur);
+  }
+  // full scans accept every row
+  sqlite3_int64 start = tg_stats_clock();
+  pCur->stepStatus = sqlite3_step(pCur->stmt);
+  pCur->query.rtreeNs += tg_stats_time(TG_STAT_RTREE_NS, start);
+  if (pCur->stepStatus == SQLITE_DONE) {
+    return SQLITE_OK;
+  }
+  if (pCur->stepStatus != SQLITE_ROW) {
+    return tg0_read_error(p, "tg0Next step error");
+  }
+  pCur->query.rtreeRows++;
+  pCur->query.accepted++;
+  return SQLITE_OK;
+}
+
+static int tg0Eof(sqlite3_vtab_cursor *cur) {
+  tg0_cursor *pCur = (tg0_cursor *)cur;
+  if (pCur->resident) {
+    return pCur->iResident >= pCur->nResident;
+  }
+  if (pCur->batched) {
+    return pCur->batchEof;
+  }
+  return pCur->stepStatus != SQLITE_ROW;
+}
+
+// Results the _shape of a resident entry, encoded like the rtree stores it.
+static int tg0_resident_column_shape(tg0_vtab *p,
+                                     const struct tg0_resident_entry *entry,
+                                     sqlite3_context *context) {
+  if (!entry->geom) {
+    unsigned char wkb[21];
+    wkbPointWrite(wkb, entry->rect.min.x, entry->rect.min.y);
+    sqlite3_result_blob(context, wkb, sizeof(wkb), SQLITE_TRANSIENT);
+    return SQLITE_OK;
+  }
+  if (p->twkbPrecision != TG0_WKB) {
+    size_t size;
+    const char *zErr;
+    unsigned char *b = twkbEncode(entry->geom, p->twkbPrecision, &size, &zErr);
+    if (!b) {
+      return zErr ? SQLITE_ERROR : SQLITE_NOMEM;
+    }
+    sqlite3_result_blob64(context, b, size, sqlite3_free);
+    return SQLITE_OK;
+  }
+  size_t size = tg_geom_wkb(entry->geom, 0, 0);
+  unsigned char *b = sqlite3_malloc64(size + 1);
+  if (!b) {
+    return SQLITE_NOMEM;
+  }
+  tg_geom_wkb(entry->geom, b, size + 1);
+  sqlite3_result_blob64(context, b, size, sqlite3_free);
+  return SQLITE_OK;
+}
+
+static int tg0Column(sqlite3_vtab_cursor *cur, sqlite3_context *context,
+                     int i) {
+  tg0_cursor *pCur = (tg0_cursor *)cur;
+  if (i == TG0_COLUMN_SHAPE) {
+    // UPDATEs that don't SET _shape don't need it, see tg0_update()
+    if (sqlite3_vtab_nochange(context)) {
+      return SQLITE_OK;
+    }
+    tg0_vtab *p = (tg0_vtab *)cur->pVtab;
+    if (pCur->resident) {
+      return tg0_resident_column_shape(
+          p, &pCur->resident->aEntry[pCur->aResident[pCur->iResident]],
+          context);
+    }
+    if (p->points) {
+      // type=point tables read _shape back as WKB
+      unsigned char wkb[21];
+      if (pCur->batched) {
+        struct tg0_candidate *candidate = &pCur->aBatch[pCur->iBatch];
+        wkbPointWrite(wkb, candidate->x, candidate->y);
+      } else {
+        wkbPointWrite(
+            wkb, sqlite3_column_double(pCur->stmt, 1),
+            sqlite3_column_double(pCur->stmt, 2 + p->numAuxColumns));
+      }
+      sqlite3_result_blob(context, wkb, sizeof(wkb), SQLITE_TRANSIENT);
+      return SQLITE_OK;
+    }
+    if (pCur->batched) {
+      struct tg0_candidate *candidate = &pCur->aBatch[pCur->iBatch];
+      if (candidate->type == SQLITE_TEXT) {
+        sqlite3_result_text(context,
+                            (const char *)pCur->batchShapes + candidate->offset,
+                            candidate->nShape, SQLITE_TRANSIENT);
+      } else if (candidate->type == SQLITE_BLOB) {
+        sqlite3_result_blob(context, pCur->batchShapes + candidate->offset,
+                            candidate->nShape, SQLITE_TRANSIENT);
+      }
+      return SQLITE_OK;
+    }
+    sqlite3_result_value(context, sqlite3_column_value(pCur->stmt, 1));
+  } else if (i > ((tg0_vtab *)cur->pVtab)->numAuxColumns) {
+    // the hidden command column of external content tables reads as NULL
+  } else if (pCur->resident) {
+    struct tg0_resident *r = pCur->resident;
+    sqlite3_result_value(context,
+                         r->aAux[(sqlite3_int64)pCur->aResident[pCur->iResident] *
+                                     r->numAuxColumns +
+                                 i - TG0_COLUMN_REST]);
+  } else if (pCur->batched) {
+    int numAuxColumns = ((tg0_vtab *)cur->pVtab)->numAuxColumns;
+    sqlite3_result_value(context,
+                         pCur->aBatchAux[pCur->iBatch * numAuxColumns + i -
+                                         TG0_COLUMN_REST]);
+  } else if (i >= TG0_COLUMN_REST) {
+    sqlite3_result_value(
+        context, sqlite3_column_value(pCur->stmt, 2 + i - TG0_COLUMN_REST));
+  }
+
+  return SQLITE_OK;
+}
+
+// Prepares zSql into *pStmt unless a previous call already did, so the
+// statement can be reset and re-bound on later calls. Takes ownership of zSql.
+static int tg0_cached_stmt(tg0_vtab *p, sqlite3_stmt **pStmt, char *zSql) {
+  if (*pStmt) {
+    sqlite3_free(zSql);
+    return SQLITE_OK;
+  }
+  if (!zSql) {
+    return SQLITE_NOMEM;
+  }
+  int rc = sqlite3_prepare_v3(p->db, zSql, -1, SQLITE_PREPARE_PERSISTENT,
+                              pStmt, NULL);
+  sqlite3_free(zSql);
+  if (rc != SQLITE_OK) {
+    tg_vtab_set_error(&p->base, "error preparing tg0 statement: %s",
+                      sqlite3_errmsg(p->db));
+  }
+  return rc;
+}
+
+// Parses the given _shape value and encodes it into the WKB or TWKB that is
+// stored in the rtree's _shape column. On success, *pBuffer must be
+// sqlite3_free()'ed.
+static int tg0_shape_encode(tg0_vtab *p, sqlite3_value *value,
+                            struct tg_rect *rect, void **pBuffer,
+                            size_t *pSize) {
+  struct tg_geom *geom;
+  char *errmsg;
+  int rc = geomValue(value, &geom, &errmsg);
+  if (rc != SQLITE_OK) {
+    tg_vtab_set_error(&p->base, "%s", errmsg);
+    sqlite3_free(errmsg);
+    return SQLITE_ERROR;
+  }
+  *rect = tg_geom_rect(geom);
+
+  if (p->twkbPrecision != TG0_WKB) {
+    // rounding moves vertices by up to half a step, so the stored shape
+    // stays inside the grown box
+    double half = p->twkbPrecision < 0
+                      ? twkbPowers[-p->twkbPrecision] / 2
+                      : 0.5 / twkbPowers[p->twkbPrecision];
+    rect->min.x -= half;
+    rect->min.y -= half;
+    rect->max.x += half;
+    rect->max.y += half;
+    const char *zErr;
+    *pBuffer = twkbEncode(geom, p->twkbPrecision, pSize, &zErr);
+    tg_geom_free(geom);
+    if (*pBuffer) {
+      return SQLITE_OK;
+    }
+    if (zErr) {
+      tg_vtab_set_error(&p->base, "%s", zErr);
+      return SQLITE_ERROR;
+    }
+    return SQLITE_NOMEM;
+  }
+
+  // TODO see if the input is already WKB and just use that
+  size_t size = tg_geom_wkb(geom, 0, 0);
+  void *buffer = sqlite3_malloc(size + 1);
+  if (buffer == 0) {
+    tg_geom_free(geom);
+    return SQLITE_NOMEM;
+  }
+  tg_geom_wkb(geom, buffer, size + 1);
+  tg_geom_free(geom);
+  *pBuffer = buffer;
+  *pSize = size;
+  return SQLITE_OK;
+}
+
+// Reads the point of a _shape value for type=point tables. WKB and TWKB points
+// and pointer values are read without building a geometry.
+static int tg0_point_decode(tg0_vtab *p, sqlite3_value *value, double *x,
+                            double *y) {
+  const struct tg_geom *pointer =
+      sqlite3_value_pointer(value, TG_GEOM_POINTER_NAME);
+  if (sqlite3_value_type(value) == SQLITE_BLOB &&
+      (wkbPointXY(sqlite3_value_blob(value), sqlite3_value_bytes(value), x,
+                  y) ||
+       twkbPointXY(sqlite3_value_blob(value), sqlite3_value_bytes(value), x,
+                   y))) {
+    tg_stats_add(TG_STAT_PARSE_BYTES, sqlite3_value_bytes(value));
+  } else if (pointer && tg_geom_typeof(pointer) == TG_POINT &&
+             !tg_geom_is_empty(pointer)) {
+    struct tg_point point = tg_geom_point(pointer);
+    *x = point.x;
+    *y = point.y;
+    tg_stats_add(TG_STAT_POINTER_VALUES, 1);
+  } else {
+    struct tg_geom *geom;
+    char *errmsg;
+    if (geomValue(value, &geom, &errmsg) != SQLITE_OK) {
+      tg_vtab_set_error(&p->base, "%s", errmsg);
+      sqlite3_free(errmsg);
+      return SQLITE_ERROR;
+    }
+    int isPoint = tg_geom_typeof(geom) == TG_POINT && !tg_geom_is_empty(geom);
+    struct tg_point point = tg_geom_point(geom);
+    tg_geom_free(geom);
+    if (!isPoint) {
+      tg_vtab_set_error(&p->base,
+                        "tg0 tables with type=point only store points");
+      return SQLITE_ERROR;
+    }
+    *x = point.x;
+    *y = point.y;
+  }
+  // POINT EMPTY as WKB has NaN coordinates
+  if (isnan(*x) || isnan(*y)) {
+    tg_vtab_set_error(&p->base, "tg0 tables with type=point only store points");
+    return SQLITE_ERROR;
+  }
+  return SQLITE_OK;
+}
+
+// Encodes a _shape value, and binds its bounding box to ?2-?5 of an INSERT or
+// UPDATE of the rtree, and what's stored of it to the next
+// TG0_SHAPE_COLUMNS(p) parameters.
+static int tg0_bind_shape(tg0_vtab *p, sqlite3_stmt *stmt,
+                          sqlite3_value *value) {
+  int rc;
+  if (p->zContent) {
+    // only the bounding box is stored, so WKB and TWKB points aren't parsed
+    double x, y;
+    struct tg_rect rect;
+    if (sqlite3_value_type(value) == SQLITE_BLOB &&
+        (wkbPointXY(sqlite3_value_blob(value), sqlite3_value_bytes(value), &x,
+                    &y) ||
+         twkbPointXY(sqlite3_value_blob(value), sqlite3_value_bytes(value), &x,
+                     &y))) {
+      rect.min.x = rect.max.x = x;
+      rect.min.y = rect.max.y = y;
+      tg_stats_add(TG_STAT_PARSE_BYTES, sqlite3_value_bytes(value));
+    } else {
+      struct tg_geom *geom;
+      char *errmsg;
+      if (geomValue(value, &geom, &errmsg) != SQLITE_OK) {
+        tg_vtab_set_error(&p->base, "%s", errmsg);
+        sqlite3_free(errmsg);
+        return SQLITE_ERROR;
+      }
+      rect = tg_geom_rect(geom);
+      tg_geom_free(geom);
+    }
+    sqlite3_bind_double(stmt, 2, rect.min.x);
+    sqlite3_bind_double(stmt, 3, rect.max.x);
+    sqlite3_bind_double(stmt, 4, rect.min.y);
+    sqlite3_bind_double(stmt, 5, rect.max.y);
+    return SQLITE_OK;
+  }
+  if (p->points) {
+    double x, y;
+    rc = tg0_point_decode(p, value, &x, &y);
+    if (rc == SQLITE_OK && p->pResident) {
+      p->residentPendingRect.min.x = p->residentPendingRect.max.x = x;
+      p->residentPendingRect.min.y = p->residentPendingRect.max.y = y;
+      p->residentPending = 1;
+    }
+    if (rc == SQLITE_OK) {
+      sqlite3_bind_double(stmt, 2, x);
+      sqlite3_bind_double(stmt, 3, x);
+      sqlite3_bind_double(stmt, 4, y);
+      sqlite3_bind_double(stmt, 5, y);
+      sqlite3_bind_double(stmt, 6, x);
+      sqlite3_bind_double(stmt, 7, y);
+    }
+    return rc;
+  }
+  struct tg_rect rect;
+  void *buffer;
+  size_t size;
+  rc = tg0_shape_encode(p, value, &rect, &buffer, &size);
+  if (rc == SQLITE_OK && p->pResident) {
+    // the resident copy keeps what's stored, so TWKB tables see the same
+    // rounded shape either way
+    int twkb;
+    struct tg_geom *geom = parseBlob(buffer, size, TG_DEFAULT, &twkb);
+    if (geom && !tg_geom_error(geom)) {
+      p->residentPendingGeom = geom;
+      p->residentPendingRect = tg_geom_rect(geom);
+      p->residentPending = 1;
+    } else {
+      tg_geom_free(geom);
+      tg0_resident_drop(p);
+    }
+  }
+  if (rc == SQLITE_OK) {
+    sqlite3_bind_double(stmt, 2, rect.min.x);
+    sqlite3_bind_double(stmt, 3, rect.max.x);
+    sqlite3_bind_double(stmt, 4, rect.min.y);
+    sqlite3_bind_double(stmt, 5, rect.max.y);
+    sqlite3_bind_blob(stmt, 6, buffer, size, sqlite3_free);
+  }
+  return rc;
+}
+
+// Steps a cached write statement to completion and resets it for the next use.
+static int tg0_step_write(tg0_vtab *p, sqlite3_stmt *stmt, const char *zOp) {
+  int rc = sqlite3_step(stmt);
+  if (rc != SQLITE_DONE) {
+    tg_vtab_set_error(&p->base, "error %s rtree row: %s", zOp,
+                      sqlite3_errmsg(p->db));
+  }
+  sqlite3_reset(stmt);
+  sqlite3_clear_bindings(stmt);
+  return rc == SQLITE_DONE ? SQLITE_OK : SQLITE_ERROR;
+}
+
+static int tg0_delete(tg0_vtab *p, sqlite3_int64 id) {
+  int rc = tg0_cached_stmt(
+      p, &p->stmtDelete,
+      sqlite3_mprintf(TG0_SQL_DELETE, p->schemaName, p->tableName));
+  if (rc != SQLITE_OK) {
+    return rc;
+  }
+  sqlite3_bind_int64(p->stmtDelete, 1, id);
+  return tg0_step_write(p, p->stmtDelete, "deleting");
+}
+
+static int tg0_insert(tg0_vtab *p, sqlite3_value **argv,
+                      sqlite_int64 *pRowid) {
+  int rc;
+  if (!p->stmtInsert) {
+    // a NULL id makes the rtree pick the next rowid itself
+    sqlite3_str *strInsert = sqlite3_str_new(NULL);
+    sqlite3_str_appendf(
+        strInsert,
+        "INSERT INTO \"%w\".\"%w_rtree\"(id, minX, maxX, minY, maxY, %s",
+        p->schemaName, p->tableName, p->points ? "_x, _y" : "_shape");
+    for (int i = 0; i < p->numAuxColumns; i++) {
+      sqlite3_str_appendf(strInsert, ", c%d", i + 1);
+    }
+    sqlite3_str_appendall(strInsert, ") VALUES (?1, ?2, ?3, ?4, ?5, ?6");
+    if (p->points) {
+      sqlite3_str_appendall(strInsert, ", ?7");
+    }
+    for (int i = 0; i < p->numAuxColumns; i++) {
+      sqlite3_str_appendf(strInsert, ", ?%d",
+                          6 + TG0_SHAPE_COLUMNS(p) + i);
+    }
+    sqlite3_str_appendall(strInsert, ")");
+    rc = tg0_cached_stmt(p, &p->stmtInsert, sqlite3_str_finish(strInsert));
+    if (rc != SQLITE_OK) {
+      return rc;
+    }
+  }
+
+  sqlite3_stmt *stmt = p->stmtInsert;
+  rc = tg0_bind_shape(p, stmt, argv[2 + TG0_COLUMN_SHAPE]);
+  if (rc != SQLITE_OK) {
+    return rc;
+  }
+  if (sqlite3_value_type(argv[1]) != SQLITE_NULL) {
+    sqlite3_bind_int64(stmt, 1, sqlite3_value_int64(argv[1]));
+  }
+  for (int i = 0; i < p->numAuxColumns; i++) {
+    sqlite3_bind_value(stmt, 6 + TG0_SHAPE_COLUMNS(p) + i,
+                       argv[2 + TG0_COLUMN_REST + i]);
+  }
+  rc = tg0_step_write(p, stmt, "inserting");
+  if (rc == SQLITE_OK) {
+    *pRowid = sqlite3_last_insert_rowid(p->db);
+  }
+  return rc;
+}
+
+// UPDATE operations come in three flavors, from cheapest to most expensive:
+//
+// 1. Only aux columns changed: the new values are written directly to the
+//    rtree's _rowid table, where it keeps aux columns, so the R-Tree node and
+//    bounding box are untouched.
+// 2. The rowid changed but _shape didn't: the rtree row is re-keyed, and the
+//    rtree re-uses its existing bounding box and _shape.
+// 3. _shape changed: it's re-encoded and the bounding box is updated in place.
+//
+// tg0Column() reports _shape as "unchanged" when SQLite asks with
+// sqlite3_vtab_nochange(), which is how case 1 and 2 are detected.
+static int tg0_update(tg0_vtab *p, sqlite3_value **argv) {
+  int rc;
+  sqlite3_int64 oldRowid = sqlite3_value_int64(argv[0]);
+  if (sqlite3_value_type(argv[1]) == SQLITE_NULL) {
+    tg_vtab_set_error(&p->base, "rowid on tg0 tables cannot be NULL");
+    return SQLITE_ERROR;
+  }
+  sqlite3_int64 newRowid = sqlite3_value_int64(argv[1]);
+  sqlite3_value **aux = &argv[2 + TG0_COLUMN_REST];
+
+  if (!sqlite3_value_nochange(argv[2 + TG0_COLUMN_SHAPE])) {
+    if (!p->stmtUpdateShape) {
+      sqlite3_str *strUpdate = sqlite3_str_new(NULL);
+      sqlite3_str_appendf(strUpdate,
+                          "UPDATE \"%w\".\"%w_rtree\" SET id = ?1, minX = ?2, "
+                          "maxX = ?3, minY = ?4, maxY = ?5, %s",
+                          p->schemaName, p->tableName,
+                          p->points ? "_x = ?6, _y = ?7" : "_shape = ?6");
+      for (int i = 0; i < p->numAuxColumns; i++) {
+        sqlite3_str_appendf(strUpdate, ", c%d = ?%d", i + 1,
+                            6 + TG0_SHAPE_COLUMNS(p) + i);
+      }
+      sqlite3_str_appendf(strUpdate, " WHERE id = ?%d",
+                          6 + TG0_SHAPE_COLUMNS(p) + p->numAuxColumns);
+      rc = tg0_cached_stmt(p, &p->stmtUpdateShape,
+                           sqlite3_str_finish(strUpdate));
+      if (rc != SQLITE_OK) {
+        return rc;
+      }
+    }
+    sqlite3_stmt *stmt = p->stmtUpdateShape;
+    rc = tg0_bind_shape(p, stmt, argv[2 + TG0_COLUMN_SHAPE]);
+    if (rc != SQLITE_OK) {
+      return rc;
+    }
+    sqlite3_bind_int64(stmt, 1, newRowid);
+    for (int i = 0; i < p->numAuxColumns; i++) {
+      sqlite3_bind_value(stmt, 6 + TG0_SHAPE_COLUMNS(p) + i, aux[i]);
+    }
+    sqlite3_bind_int64(stmt, 6 + TG0_SHAPE_COLUMNS(p) + p->numAuxColumns,
+                       oldRowid);
+    return tg0_step_write(p, stmt, "updating");
+  }
+
+  if (newRowid != oldRowid) {
+    if (!p->stmtUpdateRowid) {
+      sqlite3_str *strUpdate = sqlite3_str_new(NULL);
+      sqlite3_str_appendf(strUpdate, "UPDATE \"%w\".\"%w_rtree\" SET id = ?1",
+                          p->schemaName, p->tableName);
+      for (int i = 0; i < p->numAuxColumns; i++) {
+        sqlite3_str_appendf(strUpdate, ", c%d = ?%d", i + 1, 2 + i);
+      }
+      sqlite3_str_appendf(strUpdate, " WHERE id = ?%d", 2 + p->numAuxColumns);
+      rc = tg0_cached_stmt(p, &p->stmtUpdateRowid,
+                           sqlite3_str_finish(strUpdate));
+      if (rc != SQLITE_OK) {
+        return rc;
+      }
+    }
+    sqlite3_stmt *stmt = p->stmtUpdateRowid;
+    sqlite3_bind_int64(stmt, 1, newRowid);
+    for (int i = 0; i < p->numAuxColumns; i++) {
+      sqlite3_bind_value(stmt, 2 + i, aux[i]);
+    }
+    sqlite3_bind_int64(stmt, 2 + p->numAuxColumns, oldRowid);
+    return tg0_step_write(p, stmt, "updating");
+  }
+
+  if (p->numAuxColumns == 0) {
+    // nothing that tg0 stores has changed
+    return SQLITE_OK;
+  }
+  if (!p->stmtUpdateAux) {
+    // The rtree stores "+_shape" as a0 (or "+_x" and "+_y" as a0 and a1), so
+    // "+cN" aux columns come after them
+    sqlite3_str *strUpdate = sqlite3_str_new(NULL);
+    sqlite3_str_appendf(strUpdate, "UPDATE \"%w\".\"%w_rtree_rowid\" SET ",
+                        p->schemaName, p->tableName);
+    for (int i = 0; i < p->numAuxColumns; i++) {
+      sqlite3_str_appendf(strUpdate, "%sa%d = ?%d", i ? ", " : "",
+                          TG0_SHAPE_COLUMNS(p) + i, 1 + i);
+    }
+    sqlite3_str_appendf(strUpdate, " WHERE rowid = ?%d",
+                        1 + p->numAuxColumns);
+    rc = tg0_cached_stmt(p, &p->stmtUpdateAux, sqlite3_str_finish(strUpdate));
+    if (rc != SQLITE_OK) {
+      return rc;
+    }
+  }
+  sqlite3_stmt *stmt = p->stmtUpdateAux;
+  for (int i = 0; i < p->numAuxColumns; i++) {
+    sqlite3_bind_value(stmt, 1 + i, aux[i]);
+  }
+  sqlite3_bind_int64(stmt, 1 + p->numAuxColumns, oldRowid);
+  return tg0_step_write(p, stmt, "updating");
+}
+
+// Writes to external content tables only index bounding boxes: the content
+// table itself is left for the application (or the triggers=1 triggers) to
+// keep in sync. Rows with a NULL _shape aren't indexed.
+static int tg0_content_insert(tg0_vtab *p, sqlite3_int64 id,
+                              sqlite3_value *shape) {
+  if (sqlite3_value_type(shape) == SQLITE_NULL &&
+      !sqlite3_value_pointer(shape, TG_GEOM_POINTER_NAME)) {
+    return SQLITE_OK;
+  }
+  int rc = tg0_cached_stmt(
+      p, &p->stmtInsert,
+      sqlite3_mprintf("INSERT INTO \"%w\".\"%w_rtree\"(id, minX, maxX, minY, "
+                      "maxY) VALUES (?1, ?2, ?3, ?4, ?5)",
+                      p->schemaName, p->tableName));
+  if (rc != SQLITE_OK) {
+    return rc;
+  }
+  rc = tg0_bind_shape(p, p->stmtInsert, shape);
+  if (rc != SQLITE_OK) {
+    return rc;
+  }
+  sqlite3_bind_int64(p->stmtInsert, 1, id);
+  return tg0_step_write(p, p->stmtInsert, "inserting");
+}
+
+// The 'rebuild' command: re-indexes every row of the content table.
+static int tg0_content_rebuild(tg0_vtab *p) {
+  char *zSql = sqlite3_mprintf("DELETE FROM \"%w\".\"%w_rtree\"",
+                               p->schemaName, p->tableName);
+  if (!zSql) {
+    return SQLITE_NOMEM;
+  }
+  int rc = sqlite3_exec(p->db, zSql, NULL, NULL, NULL);
+  sqlite3_free(zSql);
+  if (rc != SQLITE_OK) {
+    tg_vtab_set_error(&p->base, "error clearing rtree: %s",
+                      sqlite3_errmsg(p->db));
+    return rc;
+  }
+
+  sqlite3_stmt *stmt;
+  zSql = sqlite3_mprintf("SELECT \"%w\", \"%w\" FROM \"%w\".\"%w\"",
+                         p->zContentRowid, p->zShapeColumn, p->schemaName,
+                         p->zContent);
+  if (!zSql) {
+    return SQLITE_NOMEM;
+  }
+  rc = sqlite3_prepare_v2(p->db, zSql, -1, &stmt, NULL);
+  sqlite3_free(zSql);
+  if (rc != SQLITE_OK) {
+    tg_vtab_set_error(&p->base, "error reading tg0 content table: %s",
+                      sqlite3_errmsg(p->db));
+    return rc;
+  }
+  int step;
+  while ((step = sqlite3_step(stmt)) == SQLITE_ROW) {
+    rc = tg0_content_insert(p, sqlite3_column_int64(stmt, 0),
+                            sqlite3_column_value(stmt, 1));
+    if (rc != SQLITE_OK) {
+      break;
+    }
+  }
+  if (rc == SQLITE_OK && step != SQLITE_DONE) {
+    tg_vtab_set_error(&p->base, "error reading tg0 content table: %s",
+                      sqlite3_errmsg(p->db));
+    rc = step;
+  }
+  sqlite3_finalize(stmt);
+  return rc;
+}
+
+// FTS5-style commands, INSERTed into the hidden column named after the table:
+//
+//   INSERT INTO t(t) VALUES ('rebuild');
+//   INSERT INTO t(t, rowid) VALUES ('delete', 42);
+static int tg0_content_command(tg0_vtab *p, sqlite3_value **argv) {
+  const char *zCommand = (const char *)sqlite3_value_text(
+      argv[2 + TG0_COLUMN_REST + p->numAuxColumns]);
+  if (sqlite3_stricmp(zCommand, "rebuild") == 0) {
+    return tg0_content_rebuild(p);
+  }
+  if (sqlite3_stricmp(zCommand, "delete") == 0) {
+    if (sqlite3_value_type(argv[1]) == SQLITE_NULL) {
+      tg_vtab_set_error(&p->base, "the 'delete' command needs a rowid");
+      return SQLITE_ERROR;
+    }
+    return tg0_delete(p, sqlite3_value_int64(argv[1]));
+  }
+  tg_vtab_set_error(&p->base, "unknown tg0 command '%s'", zCommand);
+  return SQLITE_ERROR;
+}
+
+// An UPDATE of an external content table re-keys the rtree row when only
+// the rowid changed, and otherwise re-indexes it.
+static int tg0_content_update(tg0_vtab *p, sqlite3_value **argv) {
+  sqlite3_int64 oldRowid = sqlite3_value_int64(argv[0]);
+  if (sqlite3_value_type(argv[1]) == SQLITE_NULL) {
+    tg_vtab_set_error(&p->base, "rowid on tg0 tables cannot be NULL");
+    return SQLITE_ERROR;
+  }
+  sqlite3_int64 newRowid = sqlite3_value_int64(argv[1]);
+  sqlite3_value *shape = argv[2 + TG0_COLUMN_SHAPE];
+  if (!sqlite3_value_nochange(shape)) {
+    int rc = tg0_delete(p, oldRowid);
+    if (rc != SQLITE_OK) {
+      return rc;
+    }
+    return tg0_content_insert(p, newRowid, shape);
+  }
+  if (newRowid == oldRowid) {
+    return SQLITE_OK;
+  }
+  int rc = tg0_cached_stmt(
+      p, &p->stmtUpdateRowid,
+      sqlite3_mprintf("UPDATE \"%w\".\"%w_rtree\" SET id = ?1 WHERE id = ?2",
+                      p->schemaName, p->tableName));
+  if (rc != SQLITE_OK) {
+    return rc;
+  }
+  sqlite3_bind_int64(p->stmtUpdateRowid, 1, newRowid);
+  sqlite3_bind_int64(p->stmtUpdateRowid, 2, oldRowid);
+  return tg0_step_write(p, p->stmtUpdateRowid, "updating");
+}
+
+// Applies a write of tg0Update() that returned rc to the resident copy, with
+// the shape tg0_bind_shape() decoded for it. Cursors reading the copy keep
+// the entries they found, so the scan of an UPDATE or DELETE doesn't see its
+// own writes. A copy that runs out of memory is dropped for the next query
+// to re-load.
+static void tg0_resident_write(tg0_vtab *p, int rc, int argc,
+                               sqlite3_value **argv, sqlite3_int64 rowid) {
+  struct tg0_resident *r = p->pResident;
+  struct tg_geom *geom = p->residentPendingGeom;
+  struct tg_rect rect = p->residentPendingRect;
+  int pending = p->residentPending;
+  p->residentPendingGeom = NULL;
+  p->residentPending = 0;
+  if (!r || rc != SQLITE_OK) {
+    tg_geom_free(geom);
+    return;
+  }
+
+  sqlite3_value **aux = &argv[2 + TG0_COLUMN_REST];
+  if (argc == 1) {
+    int i = tg0_resident_find(r, sqlite3_value_int64(argv[0]));
+    if (i >= 0) {
+      tg0_resident_remove(r, i);
+    }
+  } else if (sqlite3_value_type(argv[0]) == SQLITE_NULL) {
+    rc = tg0_resident_append(r, rowid, rect, geom, aux);
+  } else {
+    sqlite3_int64 newRowid = sqlite3_value_int64(argv[1]);
+    int i = tg0_resident_find(r, sqlite3_value_int64(argv[0]));
+    if (i < 0) {
+      tg_geom_free(geom);
+      tg0_resident_drop(p);
+      return;
+    }
+    if (!pending) {
+      // the entry keeps its shape, under its new rowid and aux values
+      geom = r->aEntry[i].geom ? tg_geom_clone(r->aEntry[i].geom) : NULL;
+      rect = r->aEntry[i].rect;
+    }
+    tg0_resident_remove(r, i);
+    rc = tg0_resident_append(r, newRowid, rect, geom, aux);
+  }
+  if (rc != SQLITE_OK || r->nBytes > p->residentLimit) {
+    p->residentOverLimit = rc == SQLITE_OK;
+    tg0_resident_drop(p);
+  }
+}
+
+static int tg0Update(sqlite3_vtab *pVTab, int argc, sqlite3_value **argv,
+                     sqlite_int64 *pRowid) {
+  tg0_vtab *p = (tg0_vtab *)pVTab;
+  tg_stats_enter(p->db);
+  int rc;
+  // DELETE operation
+  if (argc == 1) {
+    rc = tg0_delete(p, sqlite3_value_int64(argv[0]));
+    tg0_resident_write(p, rc, argc, argv, 0);
+    return rc;
+  }
+  if (p->zContent) {
+    if (sqlite3_value_type(argv[2 + TG0_COLUMN_REST + p->numAuxColumns]) !=
+        SQLITE_NULL) {
+      if (sqlite3_value_type(argv[0]) != SQLITE_NULL) {
+        tg_vtab_set_error(pVTab, "tg0 commands can only be INSERTed");
+        return SQLITE_ERROR;
+      }
+      return tg0_content_command(p, argv);
+    }
+    if (sqlite3_value_type(argv[0]) != SQLITE_NULL) {
+      return tg0_content_update(p, argv);
+    }
+    if (sqlite3_value_type(argv[1]) == SQLITE_NULL) {
+      tg_vtab_set_error(pVTab, "external content tg0 tables need a rowid, the "
+                               "content table's content_rowid");
+      return SQLITE_ERROR;
+    }
+    *pRowid = sqlite3_value_int64(argv[1]);
+    return tg0_content_insert(p, *pRowid, argv[2 + TG0_COLUMN_SHAPE]);
+  }
+  // INSERT operations
+  if (sqlite3_value_type(argv[0]) == SQLITE_NULL) {
+    rc = tg0_insert(p, argv, pRowid);
+    tg0_resident_write(p, rc, argc, argv, rc == SQLITE_OK ? *pRowid : 0);
+    return rc;
+  }
+  // UPDATE operations
+  rc = tg0_update(p, argv);
+  tg0_resident_write(p, rc, argc, argv, 0);
+  return rc;
+}
+
+static int tg0FindFunction(sqlite3_vtab *pVtab, int nArg, const char *zName,
+                           void (**pxFunc)(sqlite3_context *, int,
+                                           sqlite3_value **),
+                           void **ppArg) {
+  if (sqlite3_stricmp(zName, "tg_intersects") == 0 && nArg == 2) {
+    *pxFunc = tg_predicate_impl;
+    *ppArg = (void *)&predicateIntersects;
+    return TG0_FUNC_INTERSECTS;
+  }
+  if (sqlite3_stricmp(zName, "tg_disjoint") == 0 && nArg == 2) {
+    *pxFunc = tg_predicate_impl;
+    *ppArg = (void *)&predicateDisjoint;
+    return TG0_FUNC_DISJOINT;
+  }
+  if (sqlite3_stricmp(zName, "tg_contains") == 0 && nArg == 2) {
+    *pxFunc = tg_predicate_impl;
+    *ppArg = (void *)&predicateContains;
+    return TG0_FUNC_CONTAINS;
+  }
+  if (sqlite3_stricmp(zName, "tg_within") == 0 && nArg == 2) {
+    *pxFunc = tg_predicate_impl;
+    *ppArg = (void *)&predicateWithin;
+    return TG0_FUNC_WITHIN;
+  }
+  if (sqlite3_stricmp(zName, "tg_covers") == 0 && nArg == 2) {
+    *pxFunc = tg_predicate_impl;
+    *ppArg = (void *)&predicateCovers;
+    return TG0_FUNC_COVERS;
+  }
+  if (sqlite3_stricmp(zName, "tg_coveredby") == 0 && nArg == 2) {
+    *pxFunc = tg_predicate_impl;
+    *ppArg = (void *)&predicateCoveredBy;
+    return TG0_FUNC_COVEREDBY;
+  }
+  return 0;
+};
+
+static int tg0ShadowName(const char *zName) {
+
+  static const char *azName[] = {"rtree", "rtree_node", "rtree_parent",
+                                 "rtree_rowid"};
+
+  for (int i = 0; i < sizeof(azName) / sizeof(azName[0]); i++) {
+    if (sqlite3_stricmp(zName, azName[i]) == 0)
+      return 1;
+  }
+  return 0;
+}
+
+// Only resident=1 tables care about transactions: their copy holds writes
+// that a rollback undoes, so it's dropped and re-loaded by the next query.
+static int tg0Begin(sqlite3_vtab *pVTab) {
+  (void)pVTab;
+  return SQLITE_OK;
+}
+
+static int tg0Rollback(sqlite3_vtab *pVTab) {
+  tg0_resident_drop((tg0_vtab *)pVTab);
+  return SQLITE_OK;
+}
+
+static int tg0Savepoint(sqlite3_vtab *pVTab, int iSavepoint) {
+  (void)pVTab;
+  (void)iSavepoint;
+  return SQLITE_OK;
+}
+
+static int tg0RollbackTo(sqlite3_vtab *pVTab, int iSavepoint) {
+  (void)iSavepoint;
+  tg0_resident_drop((tg0_vtab *)pVTab);
+  return SQLITE_OK;
+}
+
+static sqlite3_module tg0Module = {
+    /* iVersion      */ 3,
+    /* xCreate       */ tg0Create,
+    /* xConnect      */ tg0Connect,
+    /* xBestIndex    */ tg0BestIndex,
+    /* xDisconnect   */ tg0Disconnect,
+    /* xDestroy      */ tg0Destroy,
+    /* xOpen         */ tg0Open,
+    /* xClose        */ tg0Close,
+    /* xFilter       */ tg0Filter,
+    /* xNext         */ tg0Next,
+    /* xEof          */ tg0Eof,
+    /* xColumn       */ tg0Column,
+    /* xRowid        */ tg0Rowid,
+    /* xUpdate       */ tg0Update,
+    /* xBegin        */ tg0Begin,
+    /* xSync         */ 0,
+    /* xCommit       */ 0,
+    /* xRollback     */ tg0Rollback,
+    /* xFindFunction */ tg0FindFunction,
+    /* xRename       */ 0, // TODO
+    /* xSavepoint    */ tg0Savepoint,
+    /* xRelease      */ 0,
+    /* xRollbackTo   */ tg0RollbackTo,
+    /* xShadowName   */ tg0ShadowName};
+// tg0_last_query_stats(table): what the last finished query on the named tg0
+// table did, as a JSON object, or NULL if none has run yet.
+static void tg0_last_query_stats(sqlite3_context *context, int argc,
+                                 sqlite3_value **argv) {
+  struct tg_stats *stats = sqlite3_user_data(context);
+  const char *zTable = (const char *)sqlite3_value_text(argv[0]);
+  tg0_vtab *p = stats->tables;
+  while (p && (!zTable || sqlite3_stricmp(p->tableName, zTable) != 0)) {
+    p = p->nextTable;
+  }
+  if (!p) {
+    char *zErr = sqlite3_mprintf("no tg0 table named '%s' has been used on this connection",
+                                 zTable ? zTable : "");
+    sqlite3_result_error(context, zErr, -1);
+    sqlite3_free(zErr);
+    return;
+  }
+  const struct tg0_query_stats *q = &p->lastQuery;
+  if (q->plan < 0) {
+    sqlite3_result_null(context);
+    return;
+  }
+  char *zJson = sqlite3_mprintf(
+      "{\"plan\":\"%s\",\"rtree_rows\":%lld,\"shape_bytes\":%lld,"
+      "\"predicate_calls\":%lld,\"accepted\":%lld,\"rtree_ns\":%lld,"
+      "\"decode_ns\":%lld,\"predicate_ns\":%lld,\"resident\":%s}",
+      q->plan == INTERSECT ? "intersect" : "fullscan", q->rtreeRows,
+      q->shapeBytes, q->predicateCalls, q->accepted, q->rtreeNs, q->decodeNs,
+      q->predicateNs, q->resident ? "true" : "false");
+  if (!zJson) {
     sqlite3_result_error_nomem(context);
-    tg_geom_free(geom);
     return;
   }
-  tg_geom_geojson(geom, buffer, size + 1);
+  sqlite3_result_text(context, zJson, -1, sqlite3_free);
+  sqlite3_result_subtype(context, JSON_SUBTYPE);
+}
+#pragma endregion
 
-  // if geometry already has extra json ,it's already a Feature object
-  if(tg_geom_extra_json(geom)) {
-    sqlite3_str_appendf(ctx->s, "%.*s", size+1, buffer);
-  }
-  else {
-    sqlite3_str_appendf(ctx->s, "{\"type\": \"Feature\", \"geometry\": %.*s, ", size+1, buffer);
-    if(argc > 1 && sqlite3_value_subtype(argv[1]) == JSON_SUBTYPE) {
-      const unsigned char * s = sqlite3_value_text(argv[1]);
-      int n = sqlite3_value_bytes(argv[1]);
-      sqlite3_str_appendf(ctx->s, "\"properties\": %.*s", n, s);
-    } else {
-      sqlite3_str_appendall(ctx->s, "\"properties\": {}");
-    }
-    sqlite3_str_appendall(ctx->s, "}");
+#pragma region tg0_parallel_query() table function
+
+// Runs one predicate query against a tg0 table on several threads, each with
+// its own read-only connection to the database file. The query's bounding box
+// is cut into strips along x, and every candidate belongs to the strip that
+// holds its minX, so no candidate is read twice. Workers claim strips until
+// none are left, then the cursor emits the matches strip by strip.
+//
+// All connections must read the same state of the database. When this file
+// is linked into a SQLite built with SQLITE_ENABLE_SNAPSHOT (snapshots aren't
+// part of the loadable extension API) and the database is in WAL mode, the
+// workers open the first worker's snapshot. Otherwise one more connection
+// holds the write lock while the workers start their read transactions, so
+// that no commit lands in between.
+
+#if defined(SQLITE_CORE) && defined(SQLITE_ENABLE_SNAPSHOT)
+#define TG0_PARALLEL_SNAPSHOTS
+#endif
+
+// strips per worker, so that workers that finish early can take over some of
+// a slower worker's share
+#define TG0_PARALLEL_STRIPS 8
+
+#define TG0_PARALLEL_ID 0
+#define TG0_PARALLEL_SHAPE 1
+#define TG0_PARALLEL_TABLE 2
+#define TG0_PARALLEL_GEOM 3
+#define TG0_PARALLEL_PREDICATE 4
+#define TG0_PARALLEL_THREADS 5
+
+// idxNum bit for "the query reads _shape", the others are 1 << argument
+#define TG0_PARALLEL_COPY_SHAPES 16
+
+// The predicates tg0_parallel_query() runs, as tg_<name>(_shape, geom). They
+// can only hold for shapes whose bounding box intersects geom's, so the
+// R-Tree finds every candidate.
+static const struct {
+  const char *zName;
+  const struct predicate *predicate;
+} tg0_parallel_predicates[] = {
+    {"intersects", &predicateIntersects}, {"contains", &predicateContains},
+    {"within", &predicateWithin},         {"covers", &predicateCovers},
+    {"coveredby", &predicateCoveredBy},   {"touches", &predicateTouches},
+};
+
+// The matches of one strip, in R-Tree order.
+struct tg0_parallel_strip {
+  sqlite3_int64 *aId;
+  // match i's _shape is shapes[aOffset[i], aOffset[i + 1]), when copied
+  sqlite3_uint64 *aOffset;
+  unsigned char *shapes;
+  int n;
+  int nAlloc;
+  sqlite3_uint64 nShapesAlloc;
+  sqlite3_int64 nCandidates;
+  // how many of the candidates were TWKB, see parseBlob()
+  sqlite3_int64 nTwkb;
+  sqlite3_int64 nShapeBytes;
+  // SQLITE_OK, or the error that stopped the strip, with its message
+  int rc;
+  char *zErr;
+};
+
+typedef struct tg0_parallel_vtab tg0_parallel_vtab;
+struct tg0_parallel_vtab {
+  sqlite3_vtab base;
+  sqlite3 *db;
+};
+
+typedef struct tg0_parallel_cursor tg0_parallel_cursor;
+struct tg0_parallel_cursor {
+  sqlite3_vtab_cursor base;
+  // the pool, the number of threads it was asked for, and the database
+  // (schema name) the connections below are open on
+  struct tg_pool *pool;
+  int nThreads;
+  char *zSchema;
+  // one connection per pool thread, and the statement it reads strips with.
+  // Task i of tg_pool_run() only uses aConn[i], so no connection is ever
+  // used by two threads at once.
+  int nConn;
+  sqlite3 **aConn;
+  sqlite3_stmt **aStmt;
+  // holds the write lock while the workers start, see tg0_parallel_begin()
+  sqlite3 *lock;
+  // guards iNextStrip
+  sqlite3_mutex *mutex;
+
+  struct tg_geom *queryGeom;
+  struct tg_rect queryRect;
+  const struct predicate *predicate;
+  int copyShapes;
+  // whether the table is type=point, so workers read _x and _y
+  int points;
+
+  struct tg0_parallel_strip *aStrip;
+  int nStrip;
+  int iNextStrip;
+  // the current row, aStrip[iStrip]'s match iRow
+  int iStrip;
+  int iRow;
+};
+
+static int tg0_parallelConnect(sqlite3 *db, void *pAux, int argc,
+                               const char *const *argv, sqlite3_vtab **ppVtab,
+                               char **pzErr) {
+  tg0_parallel_vtab *pNew;
+  int rc = sqlite3_declare_vtab(db, "CREATE TABLE x(id, _shape, "
+                                    "\"table\" hidden, geom hidden, "
+                                    "predicate hidden, threads hidden)");
+  if (rc == SQLITE_OK) {
+    pNew = sqlite3_malloc(sizeof(*pNew));
+    *ppVtab = (sqlite3_vtab *)pNew;
+    if (pNew == 0)
+      return SQLITE_NOMEM;
+    memset(pNew, 0, sizeof(*pNew));
+    pNew->db = db;
   }
-  sqlite3_free(buffer);
-  ctx->n++;
+  return rc;
+}
 
-  tg_geom_free(geom);
+static int tg0_parallelDisconnect(sqlite3_vtab *pVtab) {
+  sqlite3_free(pVtab);
+  return SQLITE_OK;
+}
 
+static int tg0_parallelOpen(sqlite3_vtab *p, sqlite3_vtab_cursor **ppCursor) {
+  tg0_parallel_cursor *pCur = sqlite3_malloc(sizeof(*pCur));
+  if (pCur == 0)
+    return SQLITE_NOMEM;
+  memset(pCur, 0, sizeof(*pCur));
+  *ppCursor = &pCur->base;
+  return SQLITE_OK;
+}
 
+static void tg0_parallel_clear_strips(tg0_parallel_cursor *pCur) {
+  for (int i = 0; i < pCur->nStrip; i++) {
+    struct tg0_parallel_strip *strip = &pCur->aStrip[i];
+    sqlite3_free(strip->aId);
+    sqlite3_free(strip->aOffset);
+    sqlite3_free(strip->shapes);
+    sqlite3_free(strip->zErr);
+  }
+  sqlite3_free(pCur->aStrip);
+  pCur->aStrip = NULL;
+  pCur->nStrip = 0;
+  pCur->iStrip = 0;
+  pCur->iRow = 0;
 }
 
-static void tg_feature_collection_final(sqlite3_context *context) {
-  struct feature_collection_context *ctx;
-  ctx = sqlite3_aggregate_context(context, sizeof(*ctx));
-  if(!ctx) {
-    return;
+// Ends the read transactions of the worker connections, and frees their
+// statements, which are prepared for one table at a time.
+static void tg0_parallel_end(tg0_parallel_cursor *pCur) {
+  for (int i = 0; i < pCur->nConn; i++) {
+    if (pCur->aStmt[i]) {
+      sqlite3_finalize(pCur->aStmt[i]);
+      pCur->aStmt[i] = NULL;
+    }
+    if (pCur->aConn[i] && !sqlite3_get_autocommit(pCur->aConn[i])) {
+      sqlite3_exec(pCur->aConn[i], "ROLLBACK", NULL, NULL, NULL);
+    }
   }
-  if(!ctx->s) {
-    return;
+  if (pCur->lock && !sqlite3_get_autocommit(pCur->lock)) {
+    sqlite3_exec(pCur->lock, "ROLLBACK", NULL, NULL, NULL);
   }
-  sqlite3_str_appendall(ctx->s, "]}");
-  int n = sqlite3_str_length(ctx->s);
-  const char * z = sqlite3_str_finish(ctx->s);
-  sqlite3_result_text(context, z, n, sqlite3_free);
-  sqlite3_result_subtype(context, JSON_SUBTYPE);
 }
 
-#pragma endregion
+static void tg0_parallel_close_connections(tg0_parallel_cursor *pCur) {
+  tg0_parallel_end(pCur);
+  for (int i = 0; i < pCur->nConn; i++) {
+    sqlite3_close(pCur->aConn[i]);
+  }
+  sqlite3_free(pCur->aConn);
+  sqlite3_free(pCur->aStmt);
+  pCur->aConn = NULL;
+  pCur->aStmt = NULL;
+  pCur->nConn = 0;
+  sqlite3_close(pCur->lock);
+  pCur->lock = NULL;
+  tg_pool_free(pCur->pool);
+  pCur->pool = NULL;
+  sqlite3_free(pCur->zSchema);
+  pCur->zSchema = NULL;
+}
 
+static int tg0_parallelClose(sqlite3_vtab_cursor *cur) {
+  tg0_parallel_cursor *pCur = (tg0_parallel_cursor *)cur;
+  tg0_parallel_clear_strips(pCur);
+  tg0_parallel_close_connections(pCur);
+  sqlite3_mutex_free(pCur->mutex);
+  tg_geom_free(pCur->queryGeom);
+  sqlite3_free(pCur);
+  return SQLITE_OK;
+}
 
-#pragma endregion
+static int tg0_parallelBestIndex(sqlite3_vtab *pVTab,
+                                 sqlite3_index_info *pIdxInfo) {
+  int aArg[TG0_PARALLEL_THREADS + 1];
+  for (int i = 0; i <= TG0_PARALLEL_THREADS; i++) {
+    aArg[i] = -1;
+  }
+  for (int i = 0; i < pIdxInfo->nConstraint; i++) {
+    const struct sqlite3_index_constraint *pCons = &pIdxInfo->aConstraint[i];
+    if (pCons->iColumn < TG0_PARALLEL_TABLE)
+      continue;
+    if (!pCons->usable || pCons->op != SQLITE_INDEX_CONSTRAINT_EQ)
+      return SQLITE_CONSTRAINT;
+    aArg[pCons->iColumn] = i;
+  }
+  if (aArg[TG0_PARALLEL_TABLE] < 0) {
+    pVTab->zErrMsg = sqlite3_mprintf("table argument is required");
+    return SQLITE_ERROR;
+  }
+  if (aArg[TG0_PARALLEL_GEOM] < 0) {
+    pVTab->zErrMsg = sqlite3_mprintf("geom argument is required");
+    return SQLITE_ERROR;
+  }
+  int argvIndex = 0;
+  pIdxInfo->idxNum = 0;
+  for (int i = TG0_PARALLEL_TABLE; i <= TG0_PARALLEL_THREADS; i++) {
+    if (aArg[i] >= 0) {
+      pIdxInfo->aConstraintUsage[aArg[i]].argvIndex = ++argvIndex;
+      pIdxInfo->aConstraintUsage[aArg[i]].omit = 1;
+      pIdxInfo->idxNum |= 1 << (i - TG0_PARALLEL_TABLE);
+    }
+  }
+  if (pIdxInfo->colUsed & ((sqlite3_uint64)1 << TG0_PARALLEL_SHAPE)) {
+    pIdxInfo->idxNum |= TG0_PARALLEL_COPY_SHAPES;
+  }
+  pIdxInfo->estimatedCost = (double)100000;
+  pIdxInfo->estimatedRows = 100000;
+  return SQLITE_OK;
+}
 
-#pragma region each table functions
+// Opens another connection to the database zSchema of db, with the same VFS.
+// It's the "main" database of the new connection.
+static int tg0_parallel_open_db(sqlite3 *db, const char *zSchema, int flags,
+                                sqlite3 **ppDb, char **pzErrMsg) {
+  sqlite3_vfs *pVfs = NULL;
+  sqlite3_file_control(db, zSchema, SQLITE_FCNTL_VFS_POINTER, &pVfs);
+  int rc = sqlite3_open_v2(sqlite3_db_filename(db, zSchema), ppDb,
+                           flags | SQLITE_OPEN_NOMUTEX,
+                           pVfs ? pVfs->zName : NULL);
+  if (rc != SQLITE_OK) {
+    *pzErrMsg = sqlite3_mprintf("%s", sqlite3_errmsg(*ppDb));
+    sqlite3_close(*ppDb);
+    *ppDb = NULL;
+    return rc;
+  }
+  sqlite3_busy_timeout(*ppDb, 5000);
+  return SQLITE_OK;
+}
 
-struct control {
-  // resulting column name in the table function
-  char *name;
-  // free the target
-  void (*xFree)(void *p);
-  // determine if the table function has completed
-  int (*xEof)(void *p, sqlite3_int64 iRowid);
-  // result the column value at the given rowid
-  void (*xResult)(sqlite3_context *context, void *p, sqlite3_int64 iRowid);
-};
+// Opens nThreads worker connections to the database zSchema, and the lock
+// connection when it is writable, unless the cursor already has them.
+static int tg0_parallel_connect(tg0_parallel_cursor *pCur, const char *zSchema,
+                                int nThreads) {
+  sqlite3 *db = ((tg0_parallel_vtab *)pCur->base.pVtab)->db;
+  char *zErrMsg = NULL;
+  if (pCur->pool && pCur->nThreads == nThreads &&
+      sqlite3_stricmp(pCur->zSchema, zSchema) == 0) {
+    return SQLITE_OK;
+  }
+  tg0_parallel_close_connections(pCur);
+  pCur->zSchema = sqlite3_mprintf("%s", zSchema);
+  if (!pCur->zSchema) {
+    return SQLITE_NOMEM;
+  }
+  int rc = tg_pool_new(nThreads, &pCur->pool);
+  if (rc != SQLITE_OK) {
+    return rc;
+  }
+  pCur->nThreads = nThreads;
+  // there's no use in more connections than threads
+  int nConn = tg_pool_threads(pCur->pool);
+  pCur->aConn = sqlite3_malloc64(nConn * sizeof(*pCur->aConn));
+  pCur->aStmt = sqlite3_malloc64(nConn * sizeof(*pCur->aStmt));
+  if (!pCur->aConn || !pCur->aStmt) {
+    return SQLITE_NOMEM;
+  }
+  memset(pCur->aConn, 0, nConn * sizeof(*pCur->aConn));
+  memset(pCur->aStmt, 0, nConn * sizeof(*pCur->aStmt));
+  pCur->nConn = nConn;
+  for (int i = 0; i < nConn && rc == SQLITE_OK; i++) {
+    rc = tg0_parallel_open_db(db, zSchema, SQLITE_OPEN_READONLY,
+                              &pCur->aConn[i], &zErrMsg);
+  }
+  if (rc == SQLITE_OK && nConn > 1 && sqlite3_db_readonly(db, zSchema) == 0) {
+    rc = tg0_parallel_open_db(db, zSchema, SQLITE_OPEN_READWRITE, &pCur->lock,
+                              &zErrMsg);
+  }
+  if (rc != SQLITE_OK) {
+    tg_vtab_set_error(pCur->base.pVtab, "%s", zErrMsg);
+    sqlite3_free(zErrMsg);
+  }
+  return rc;
+}
 
-#pragma region tg_points_each
-int pointsEachEof(void *p, sqlite3_int64 iRowid) {
-  return iRowid >= tg_geom_num_points((struct tg_geom *)p);
+// Starts a read transaction on every worker connection, all of them on the
+// same state of the database.
+static int tg0_parallel_begin(tg0_parallel_cursor *pCur) {
+  static const char *zRead = "SELECT 1 FROM sqlite_master LIMIT 1";
+  int rc;
+#ifdef TG0_PARALLEL_SNAPSHOTS
+  if (pCur->nConn > 1) {
+    sqlite3_snapshot *snapshot = NULL;
+    rc = sqlite3_exec(pCur->aConn[0], "BEGIN", NULL, NULL, NULL);
+    if (rc == SQLITE_OK) {
+      rc = sqlite3_exec(pCur->aConn[0], zRead, NULL, NULL, NULL);
+    }
+    if (rc == SQLITE_OK &&
+        sqlite3_snapshot_get(pCur->aConn[0], "main", &snapshot) == SQLITE_OK) {
+      for (int i = 1; i < pCur->nConn && rc == SQLITE_OK; i++) {
+        rc = sqlite3_exec(pCur->aConn[i], "BEGIN", NULL, NULL, NULL);
+        if (rc == SQLITE_OK) {
+          rc = sqlite3_snapshot_open(pCur->aConn[i], "main", snapshot);
+        }
+        if (rc == SQLITE_OK) {
+          rc = sqlite3_exec(pCur->aConn[i], zRead, NULL, NULL, NULL);
+        }
+      }
+      sqlite3_snapshot_free(snapshot);
+      return rc;
+    }
+    // not a WAL database, fall back to the write lock
+    tg0_parallel_end(pCur);
+    if (rc != SQLITE_OK) {
+      return rc;
+    }
+  }
+#endif
+  rc = SQLITE_OK;
+  if (pCur->lock) {
+    rc = sqlite3_exec(pCur->lock, "BEGIN IMMEDIATE", NULL, NULL, NULL);
+  }
+  for (int i = 0; i < pCur->nConn && rc == SQLITE_OK; i++) {
+    rc = sqlite3_exec(pCur->aConn[i], "BEGIN", NULL, NULL, NULL);
+    if (rc == SQLITE_OK) {
+      rc = sqlite3_exec(pCur->aConn[i], zRead, NULL, NULL, NULL);
+    }
+  }
+  if (pCur->lock) {
+    sqlite3_exec(pCur->lock, "ROLLBACK", NULL, NULL, NULL);
+  }
+  return rc;
 }
-void pointsEachResult(sqlite3_context *context, void *p, sqlite3_int64 iRowid) {
-  struct tg_point point = tg_geom_point_at((struct tg_geom *)p, iRowid);
-  struct tg_geom *g = tg_geom_new_point(point);
-  sqlite3_result_pointer(context, g, TG_GEOM_POINTER_NAME,
-                         (void (*)(void *))tg_geom_free);
+
+// Appends a match to a strip. Returns 0 when out of memory.
+static int tg0_parallel_strip_add(struct tg0_parallel_strip *strip,
+                                  sqlite3_int64 id, const void *shape,
+                                  int nShape) {
+  if (strip->n == strip->nAlloc) {
+    int nAlloc = strip->nAlloc ? strip->nAlloc * 2 : 64;
+    sqlite3_int64 *aId =
+        sqlite3_realloc64(strip->aId, nAlloc * sizeof(*strip->aId));
+    if (!aId) {
+      return 0;
+    }
+    strip->aId = aId;
+    sqlite3_uint64 *aOffset = sqlite3_realloc64(
+        strip->aOffset, (nAlloc + 1) * sizeof(*strip->aOffset));
+    if (!aOffset) {
+      return 0;
+    }
+    if (!strip->aOffset) {
+      aOffset[0] = 0;
+    }
+    strip->aOffset = aOffset;
+    strip->nAlloc = nAlloc;
+  }
+  sqlite3_uint64 offset = strip->aOffset[strip->n];
+  if (offset + nShape > strip->nShapesAlloc) {
+    sqlite3_uint64 nAlloc = (offset + nShape) * 2;
+    unsigned char *shapes = sqlite3_realloc64(strip->shapes, nAlloc);
+    if (!shapes) {
+      return 0;
+    }
+    strip->shapes = shapes;
+    strip->nShapesAlloc = nAlloc;
+  }
+  if (nShape) {
+    memcpy(strip->shapes + offset, shape, nShape);
+  }
+  strip->aId[strip->n] = id;
+  strip->aOffset[++strip->n] = offset + nShape;
+  return 1;
 }
 
-void pointsEachFree(void *p) { tg_geom_free((struct tg_geom *)p); }
-#pragma endregion
+// Reads and checks the candidates of strip iStrip on connection iConn.
+static void tg0_parallel_run_strip(tg0_parallel_cursor *pCur, int iConn,
+                                   int iStrip) {
+  struct tg0_parallel_strip *strip = &pCur->aStrip[iStrip];
+  sqlite3_stmt *stmt = pCur->aStmt[iConn];
+  const struct tg_rect rect = pCur->queryRect;
+  double width = (rect.max.x - rect.min.x) / pCur->nStrip;
+  // the same expression on both sides of a boundary, so strips share it
+  double lo = iStrip == 0 ? -HUGE_VAL : rect.min.x + iStrip * width;
+  double hi = iStrip == pCur->nStrip - 1 ? HUGE_VAL
+                                         : rect.min.x + (iStrip + 1) * width;
+  sqlite3_bind_double(stmt, 1, lo);
+  sqlite3_bind_double(stmt, 2, hi);
+  sqlite3_bind_double(stmt, 3, rect.max.x);
+  sqlite3_bind_double(stmt, 4, rect.min.x);
+  sqlite3_bind_double(stmt, 5, rect.max.y);
+  sqlite3_bind_double(stmt, 6, rect.min.y);
+
+  sqlite3_uint64 buffer[512];
+  struct tg_arena arena;
+  tg_arena_init(&arena, buffer, sizeof(buffer));
+  int rc;
+  while ((rc = sqlite3_step(stmt)) == SQLITE_ROW) {
+    strip->nCandidates++;
+    if (pCur->points) {
+      double x = sqlite3_column_double(stmt, 1);
+      double y = sqlite3_column_double(stmt, 2);
+      unsigned char wkb[21];
+      int match;
+      if (pCur->predicate == &predicateIntersects) {
+        match = tg_geom_intersects_xy(pCur->queryGeom, x, y);
+      } else {
+        tg_arena_begin(&arena);
+        struct tg_geom *point = tg_geom_new_point((struct tg_point){x, y});
+        match = point && pCur->predicate->func(point, pCur->queryGeom);
+        tg_geom_free(point);
+        tg_arena_end(&arena);
+        if (!point) {
+          rc = SQLITE_NOMEM;
+          break;
+        }
+      }
+      wkbPointWrite(wkb, x, y);
+      if (match &&
+          !tg0_parallel_strip_add(strip, sqlite3_column_int64(stmt, 0), wkb,
+                                  pCur->copyShapes ? sizeof(wkb) : 0)) {
+        rc = SQLITE_NOMEM;
+        break;
+      }
+      continue;
+    }
+    const void *shape = sqlite3_column_blob(stmt, 1);
+    int nShape = sqlite3_column_bytes(stmt, 1);
+    strip->nShapeBytes += nShape;
+    tg_arena_begin(&arena);
+    int twkb;
+    struct tg_geom *geom = parseBlob(shape, nShape, TG_NONE, &twkb);
+    int match = 0;
+    strip->nTwkb += twkb;
+    if (!geom) {
+      rc = SQLITE_NOMEM;
+    } else if (tg_geom_error(geom)) {
+      rc = SQLITE_ERROR;
+      strip->zErr = sqlite3_mprintf("%s", tg_geom_error(geom));
+    } else {
+      match = pCur->predicate->func(geom, pCur->queryGeom);
+    }
+    tg_geom_free(geom);
+    tg_arena_end(&arena);
+    if (rc != SQLITE_ROW) {
+      break;
+    }
+    if (match &&
+        !tg0_parallel_strip_add(strip, sqlite3_column_int64(stmt, 0), shape,
+                                pCur->copyShapes ? nShape : 0)) {
+      rc = SQLITE_NOMEM;
+      break;
+    }
+  }
+  if (rc != SQLITE_DONE) {
+    strip->rc = rc;
+    if (rc != SQLITE_NOMEM && !strip->zErr) {
+      strip->zErr = sqlite3_mprintf("%s", sqlite3_errmsg(pCur->aConn[iConn]));
+    }
+  }
+  sqlite3_reset(stmt);
+}
 
-#pragma region tg_lines_each
-int linesEachEof(void *p, sqlite3_int64 iRowid) {
-  return iRowid >= tg_geom_num_lines((struct tg_geom *)p);
+// Pool task iConn: claims and runs strips on connection iConn until none are
+// left, or one fails.
+static void tg0_parallel_task(void *ctx, int iConn) {
+  tg0_parallel_cursor *pCur = (tg0_parallel_cursor *)ctx;
+  while (1) {
+    sqlite3_mutex_enter(pCur->mutex);
+    int iStrip = pCur->iNextStrip++;
+    sqlite3_mutex_leave(pCur->mutex);
+    if (iStrip >= pCur->nStrip) {
+      return;
+    }
+    tg0_parallel_run_strip(pCur, iConn, iStrip);
+    if (pCur->aStrip[iStrip].rc != SQLITE_OK) {
+      return;
+    }
+  }
 }
-void linesEachResult(sqlite3_context *context, void *p, sqlite3_int64 iRowid) {
-  const struct tg_line *line = tg_geom_line_at((struct tg_geom *)p, iRowid);
-  sqlite3_result_pointer(context, (void *)line, TG_GEOM_POINTER_NAME, NULL);
+
+static int tg0_parallelNext(sqlite3_vtab_cursor *cur) {
+  tg0_parallel_cursor *pCur = (tg0_parallel_cursor *)cur;
+  while (pCur->iStrip < pCur->nStrip) {
+    if (++pCur->iRow < pCur->aStrip[pCur->iStrip].n) {
+      return SQLITE_OK;
+    }
+    pCur->iStrip++;
+    pCur->iRow = -1;
+  }
+  return SQLITE_OK;
 }
 
-void linesEachFree(void *p) { tg_geom_free((struct tg_geom *)p); }
-#pragma endregion
+static int tg0_parallelFilter(sqlite3_vtab_cursor *pVtabCursor, int idxNum,
+                              const char *idxStr, int argc,
+                              sqlite3_value **argv) {
+  tg0_parallel_cursor *pCur = (tg0_parallel_cursor *)pVtabCursor;
+  tg0_parallel_vtab *p = (tg0_parallel_vtab *)pVtabCursor->pVtab;
+  tg_stats_enter(p->db);
+  tg0_parallel_clear_strips(pCur);
+  tg_geom_free(pCur->queryGeom);
+  pCur->queryGeom = NULL;
+
+  // arguments come in column order, the ones given set their idxNum bit
+  sqlite3_value *aArg[4] = {NULL, NULL, NULL, NULL};
+  for (int i = 0, j = 0; i < 4; i++) {
+    if ((idxNum & (1 << i)) && j < argc) {
+      aArg[i] = argv[j++];
+    }
+  }
+  const char *zTable = (const char *)sqlite3_value_text(aArg[0]);
+  if (!zTable) {
+    tg_vtab_set_error(pVtabCursor->pVtab, "table must be text");
+    return SQLITE_ERROR;
+  }
+  // "schema.table" names a table in an attached database
+  char zSchema[128] = "main";
+  const char *zDot = strchr(zTable, '.');
+  if (zDot && zDot - zTable < (int)sizeof(zSchema)) {
+    memcpy(zSchema, zTable, zDot - zTable);
+    zSchema[zDot - zTable] = 0;
+    if (sqlite3_db_filename(p->db, zSchema)) {
+      zTable = zDot + 1;
+    } else {
+      strcpy(zSchema, "main");
+    }
+  }
+  const char *zPredicate =
+      aArg[2] ? (const char *)sqlite3_value_text(aArg[2]) : "intersects";
+  pCur->predicate = NULL;
+  for (size_t i = 0; zPredicate && i < sizeof(tg0_parallel_predicates) /
+                                           sizeof(tg0_parallel_predicates[0]);
+       i++) {
+    if (sqlite3_stricmp(zPredicate, tg0_parallel_predicates[i].zName) == 0) {
+      pCur->predicate = tg0_parallel_predicates[i].predicate;
+    }
+  }
+  if (!pCur->predicate) {
+    tg_vtab_set_error(pVtabCursor->pVtab,
+                      "predicate must be one of intersects, contains, within, "
+                      "covers, coveredby, or touches");
+    return SQLITE_ERROR;
+  }
+  int nThreads = aArg[3] ? sqlite3_value_int(aArg[3]) : 0;
+  if (nThreads < 0 || nThreads > 64) {
+    tg_vtab_set_error(pVtabCursor->pVtab,
+                      "threads must be between 0 and 64, not %d", nThreads);
+    return SQLITE_ERROR;
+  }
+  if (nThreads == 0) {
+    nThreads = tg_pool_default_threads();
+  }
+
+  const char *zPath = sqlite3_db_filename(p->db, zSchema);
+  if (!zPath || !zPath[0]) {
+    tg_vtab_set_error(pVtabCursor->pVtab,
+                      "tg0_parallel_query() needs an on-disk database");
+    return SQLITE_ERROR;
+  }
+  // the workers' connections can't see this connection's pending changes
+  if (sqlite3_libversion_number() >= 3034000 &&
+      sqlite3_txn_state(p->db, zSchema) == SQLITE_TXN_WRITE) {
+    tg_vtab_set_error(pVtabCursor->pVtab,
+                      "tg0_parallel_query() can't run in a write transaction");
+    return SQLITE_ERROR;
+  }
+
+  char *errmsg;
+  int rc = geomValue(aArg[1], &pCur->queryGeom, &errmsg);
+  if (rc != SQLITE_OK) {
+    tg_vtab_set_error(pVtabCursor->pVtab, "%s", errmsg);
+    sqlite3_free(errmsg);
+    return rc;
+  }
+  pCur->queryRect = tg_geom_rect(pCur->queryGeom);
+  pCur->copyShapes = (idxNum & TG0_PARALLEL_COPY_SHAPES) != 0;
+
+  if (!pCur->mutex && sqlite3_threadsafe()) {
+    pCur->mutex = sqlite3_mutex_alloc(SQLITE_MUTEX_FAST);
+    if (!pCur->mutex) {
+      return SQLITE_NOMEM;
+    }
+  }
+  rc = tg0_parallel_connect(pCur, zSchema, nThreads);
+  if (rc != SQLITE_OK) {
+    return rc;
+  }
+  // type=point tables store _x and _y in place of _shape
+  for (int points = 0; points < 2; points++) {
+    char *zSql = sqlite3_mprintf(
+        "SELECT id, %s FROM \"main\".\"%w_rtree\" WHERE minX >= ?1 AND "
+        "minX < ?2 AND minX <= ?3 AND maxX >= ?4 AND minY <= ?5 AND "
+        "maxY >= ?6",
+        points ? "_x, _y" : "_shape", zTable);
+    if (!zSql) {
+      return SQLITE_NOMEM;
+    }
+    rc = SQLITE_OK;
+    for (int i = 0; i < pCur->nConn && rc == SQLITE_OK; i++) {
+      rc = sqlite3_prepare_v2(pCur->aConn[i], zSql, -1, &pCur->aStmt[i], NULL);
+    }
+    sqlite3_free(zSql);
+    pCur->points = points;
+    // only a missing column is worth another try
+    if (rc == SQLITE_OK || pCur->aStmt[0]) {
+      break;
+    }
+  }
+  if (rc != SQLITE_OK) {
+    // external content tables have an rtree without shapes
+    sqlite3_stmt *stmt = NULL;
+    char *zSql =
+        sqlite3_mprintf("SELECT id FROM \"main\".\"%w_rtree\"", zTable);
+    int isContent =
+        zSql && sqlite3_prepare_v2(pCur->aConn[0], zSql, -1, &stmt, NULL) ==
+                    SQLITE_OK;
+    sqlite3_finalize(stmt);
+    sqlite3_free(zSql);
+    if (isContent) {
+      tg_vtab_set_error(pVtabCursor->pVtab,
+                        "tg0_parallel_query() is not supported for content= "
+                        "tables: %s",
+                        zTable);
+    } else {
+      tg_vtab_set_error(pVtabCursor->pVtab, "no such tg0 table: %s",
+                        (const char *)sqlite3_value_text(aArg[0]));
+    }
+  }
+  if (rc == SQLITE_OK) {
+    rc = tg0_parallel_begin(pCur);
+    if (rc != SQLITE_OK) {
+      tg_vtab_set_error(pVtabCursor->pVtab, "%s",
+                        sqlite3_errmsg(pCur->aConn[0]));
+    }
+  }
+  if (rc != SQLITE_OK) {
+    tg0_parallel_end(pCur);
+    return rc;
+  }
+
+  pCur->nStrip = pCur->nConn > 1 ? pCur->nConn * TG0_PARALLEL_STRIPS : 1;
+  pCur->aStrip = sqlite3_malloc64(pCur->nStrip * sizeof(*pCur->aStrip));
+  if (!pCur->aStrip) {
+    pCur->nStrip = 0;
+    tg0_parallel_end(pCur);
+    return SQLITE_NOMEM;
+  }
+  memset(pCur->aStrip, 0, pCur->nStrip * sizeof(*pCur->aStrip));
+  pCur->iNextStrip = 0;
+  sqlite3_int64 start = tg_stats_clock();
+  tg_pool_run(pCur->pool, pCur->nConn, tg0_parallel_task, pCur);
+  tg_stats_time(TG_STAT_PREDICATE_NS, start);
+  tg0_parallel_end(pCur);
+
+  sqlite3_int64 candidates = 0, twkb = 0, accepted = 0, shapeBytes = 0;
+  for (int i = 0; i < pCur->nStrip; i++) {
+    struct tg0_parallel_strip *strip = &pCur->aStrip[i];
+    if (strip->rc != SQLITE_OK) {
+      if (strip->zErr) {
+        tg_vtab_set_error(pVtabCursor->pVtab, "%s", strip->zErr);
+      }
+      return strip->rc;
+    }
+    candidates += strip->nCandidates;
+    twkb += strip->nTwkb;
+    accepted += strip->n;
+    shapeBytes += strip->nShapeBytes;
+  }
+  if (!pCur->points) {
+    tg_stats_add(TG_STAT_PARSE_WKB, candidates - twkb);
+    tg_stats_add(TG_STAT_PARSE_TWKB, twkb);
+    tg_stats_add(TG_STAT_PARSE_BYTES, shapeBytes);
+  }
+  tg_stats_add(TG_STAT_TG0_CANDIDATES, candidates);
+  tg_stats_add(TG_STAT_TG0_ACCEPTED, accepted);
+  tg_stats_add(pCur->predicate->stat, candidates);
 
-#pragma region tg_geometries_each
-int geometriesEachEof(void *p, sqlite3_int64 iRowid) {
-  return iRowid >= tg_geom_num_geometries((struct tg_geom *)p);
-}
-void geometriesEachResult(sqlite3_context *context, void *p,
-                          sqlite3_int64 iRowid) {
-  const struct tg_geom *geom = tg_geom_geometry_at((struct tg_geom *)p, iRowid);
-  sqlite3_result_pointer(context, (void *)geom, TG_GEOM_POINTER_NAME, NULL);
+  pCur->iStrip = 0;
+  pCur->iRow = -1;
+  return tg0_parallelNext(pVtabCursor);
 }
 
-void geometriesEachFree(void *p) { tg_geom_free((struct tg_geom *)p); }
-#pragma endregion
+static int tg0_parallelEof(sqlite3_vtab_cursor *cur) {
+  tg0_parallel_cursor *pCur = (tg0_parallel_cursor *)cur;
+  return pCur->iStrip >= pCur->nStrip;
+}
 
-#pragma region tg_polygons_each
-int polygonsEachEof(void *p, sqlite3_int64 iRowid) {
-  return iRowid >= tg_geom_num_polys((struct tg_geom *)p);
+static int tg0_parallelRowid(sqlite3_vtab_cursor *cur, sqlite_int64 *pRowid) {
+  tg0_parallel_cursor *pCur = (tg0_parallel_cursor *)cur;
+  *pRowid = pCur->aStrip[pCur->iStrip].aId[pCur->iRow];
+  return SQLITE_OK;
 }
-void polygonsEachResult(sqlite3_context *context, void *p,
-                        sqlite3_int64 iRowid) {
-  const struct tg_poly *poly = tg_geom_poly_at((struct tg_geom *)p, iRowid);
 
-  // rationale: tg_poly can safely upcast to tg_geom
-  // https://github.com/tidwall/tg/blob/main/docs/API.md#upcasting
-  sqlite3_result_pointer(context, (void *)(void *)poly, TG_GEOM_POINTER_NAME,
-                         NULL);
+static int tg0_parallelColumn(sqlite3_vtab_cursor *cur,
+                              sqlite3_context *context, int i) {
+  tg0_parallel_cursor *pCur = (tg0_parallel_cursor *)cur;
+  struct tg0_parallel_strip *strip = &pCur->aStrip[pCur->iStrip];
+  switch (i) {
+  case TG0_PARALLEL_ID:
+    sqlite3_result_int64(context, strip->aId[pCur->iRow]);
+    break;
+  case TG0_PARALLEL_SHAPE: {
+    sqlite3_uint64 offset = strip->aOffset[pCur->iRow];
+    sqlite3_result_blob(context, strip->shapes + offset,
+                        (int)(strip->aOffset[pCur->iRow + 1] - offset),
+                        SQLITE_TRANSIENT);
+    break;
+  }
+  case TG0_PARALLEL_THREADS:
+    sqlite3_result_int(context, pCur->nConn);
+    break;
+  }
+  return SQLITE_OK;
 }
 
-void polygonsEachFree(void *p) { tg_geom_free((struct tg_geom *)p); }
+static sqlite3_module tg0_parallelModule = {
+    /* iVersion    */ 0,
+    /* xCreate     */ 0,
+    /* xConnect    */ tg0_parallelConnect,
+    /* xBestIndex  */ tg0_parallelBestIndex,
+    /* xDisconnect */ tg0_parallelDisconnect,
+    /* xDestroy    */ 0,
+    /* xOpen       */ tg0_parallelOpen,
+    /* xClose      */ tg0_parallelClose,
+    /* xFilter     */ tg0_parallelFilter,
+    /* xNext       */ tg0_parallelNext,
+    /* xEof        */ tg0_parallelEof,
+    /* xColumn     */ tg0_parallelColumn,
+    /* xRowid      */ tg0_parallelRowid,
+    /* xUpdate     */ 0,
+    /* xBegin      */ 0,
+    /* xSync       */ 0,
+    /* xCommit     */ 0,
+    /* xRollback   */ 0,
+    /* xFindMethod */ 0,
+    /* xRename     */ 0,
+    /* xSavepoint  */ 0,
+    /* xRelease    */ 0,
+    /* xRollbackTo */ 0,
+    /* xShadowName */ 0};
 #pragma endregion
 
-#pragma region tg_holes_each
-// the cursor target is always the tg_geom from geomValue(); resolve it to a
-// poly here rather than casting, so non-polygon inputs yield zero rows
-// instead of misreading memory
-int holesEachEof(void *p, sqlite3_int64 iRowid) {
-  const struct tg_poly *poly = tg_geom_poly((struct tg_geom *)p);
-  if (!poly)
-    return 1;
-  return iRowid >= tg_poly_num_holes(poly);
+#pragma region file readers
+
+// A read-only memory mapping of a whole file, so readers can hand slices of
+// it straight to the tg parsers without copying the file into SQLite values.
+struct tg_mapped_file {
+  const char *data;
+  sqlite3_int64 size;
+#ifdef _WIN32
+  HANDLE hFile;
+  HANDLE hMapping;
+#endif
+};
+
+static int tg_mapped_file_open(struct tg_mapped_file *file, const char *path,
+                               char **errmsg) {
+  memset(file, 0, sizeof(*file));
+#ifdef _WIN32
+  file->hFile = CreateFileA(path, GENERIC_READ, FILE_SHARE_READ, NULL,
+                            OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, NULL);
+  if (file->hFile == INVALID_HANDLE_VALUE) {
+    *errmsg = sqlite3_mprintf("could not open %s", path);
+    return SQLITE_ERROR;
+  }
+  LARGE_INTEGER size;
+  if (!GetFileSizeEx(file->hFile, &size)) {
+    CloseHandle(file->hFile);
+    *errmsg = sqlite3_mprintf("could not read size of %s", path);
+    return SQLITE_ERROR;
+  }
+  file->size = size.QuadPart;
+  if (file->size == 0) {
+    return SQLITE_OK;
+  }
+  file->hMapping =
+      CreateFileMappingA(file->hFile, NULL, PAGE_READONLY, 0, 0, NULL);
+  if (file->hMapping) {
+    file->data = MapViewOfFile(file->hMapping, FILE_MAP_READ, 0, 0, 0);
+  }
+  if (!file->data) {
+    if (file->hMapping)
+      CloseHandle(file->hMapping);
+    CloseHandle(file->hFile);
+    *errmsg = sqlite3_mprintf("could not map %s", path);
+    return SQLITE_ERROR;
+  }
+#else
+  int fd = open(path, O_RDONLY);
+  if (fd < 0) {
+    *errmsg = sqlite3_mprintf("could not open %s: %s", path, strerror(errno));
+    return SQLITE_ERROR;
+  }
+  struct stat st;
+  if (fstat(fd, &st) != 0) {
+    *errmsg = sqlite3_mprintf("could not stat %s: %s", path, strerror(errno));
+    close(fd);
+    return SQLITE_ERROR;
+  }
+  file->size = st.st_size;
+  if (file->size > 0) {
+    void *data = mmap(NULL, (size_t)file->size, PROT_READ, MAP_PRIVATE, fd, 0);
+    if (data == MAP_FAILED) {
+      *errmsg = sqlite3_mprintf("could not map %s: %s", path, strerror(errno));
+      close(fd);
+      return SQLITE_ERROR;
+    }
+#ifdef MADV_SEQUENTIAL
+    madvise(data, (size_t)file->size, MADV_SEQUENTIAL);
+#endif
+    file->data = data;
+  }
+  // the mapping stays valid after the descriptor is closed
+  close(fd);
+#endif
+  return SQLITE_OK;
 }
-void holesEachResult(sqlite3_context *context, void *p,
-                        sqlite3_int64 iRowid) {
-  const struct tg_poly *poly = tg_geom_poly((struct tg_geom *)p);
-  const struct tg_ring *ring = tg_poly_hole_at(poly, iRowid);
 
-  // rationale: tg_ring can safely upcast to tg_geom
-  sqlite3_result_pointer(context, (void *)(void *)ring, TG_GEOM_POINTER_NAME,
-                         NULL);
+static void tg_mapped_file_close(struct tg_mapped_file *file) {
+#ifdef _WIN32
+  if (file->data)
+    UnmapViewOfFile(file->data);
+  if (file->hMapping)
+    CloseHandle(file->hMapping);
+  if (file->hFile && file->hFile != INVALID_HANDLE_VALUE)
+    CloseHandle(file->hFile);
+#else
+  if (file->data)
+    munmap((void *)file->data, (size_t)file->size);
+#endif
+  memset(file, 0, sizeof(*file));
 }
 
-void holesEachFree(void *p) { tg_geom_free((struct tg_geom *)p); }
 #pragma endregion
 
-typedef struct template_each_vtab template_each_vtab;
-struct template_each_vtab {
+#pragma region tg_read_geojson() table function
+
+typedef struct tg_read_geojson_vtab tg_read_geojson_vtab;
+struct tg_read_geojson_vtab {
   sqlite3_vtab base;
-  struct control *pControl;
 };
 
-typedef struct template_each_cursor template_each_cursor;
-struct template_each_cursor {
+typedef struct tg_read_geojson_cursor tg_read_geojson_cursor;
+struct tg_read_geojson_cursor {
   sqlite3_vtab_cursor base;
+  struct tg_mapped_file file;
+  // the next unread byte of the features array, or NULL when exhausted
+  const char *next;
+  // bounds of the current feature inside the mapping
+  const char *feature;
+  const char *featureEnd;
+  // the current feature, parsed, owned by the cursor
+  struct tg_geom *geom;
   sqlite3_int64 iRowid;
-  void *target;
+  int eof;
 };
 
-static int template_eachConnect(sqlite3 *db, void *pAux, int argc,
-                                const char *const *argv, sqlite3_vtab **ppVtab,
-                                char **pzErr) {
-  template_each_vtab *pNew;
-  int rc;
+#define TG_READ_GEOJSON_GEOMETRY 0
+#define TG_READ_GEOJSON_PROPERTIES 1
+#define TG_READ_GEOJSON_PATH 2
 
-  struct control *pControl = (struct control *)pAux;
-  const char *schema =
-      sqlite3_mprintf("CREATE TABLE x(%w, source hidden)", pControl->name);
-#define TEMPLATE_EACH_TARGET 0
-#define TEMPLATE_EACH_SOURCE 1
-  rc = sqlite3_declare_vtab(db, schema);
-  sqlite3_free((void *)schema);
+static int tg_read_geojsonConnect(sqlite3 *db, void *pAux, int argc,
+                                  const char *const *argv,
+                                  sqlite3_vtab **ppVtab, char **pzErr) {
+  tg_read_geojson_vtab *pNew;
+  int rc = sqlite3_declare_vtab(
+      db, "CREATE TABLE x(geometry, properties, path hidden)");
   if (rc == SQLITE_OK) {
+    // reads arbitrary files, so never from triggers, views, or schemas
+    sqlite3_vtab_config(db, SQLITE_VTAB_DIRECTONLY);
     pNew = sqlite3_malloc(sizeof(*pNew));
     *ppVtab = (sqlite3_vtab *)pNew;
     if (pNew == 0)
       return SQLITE_NOMEM;
     memset(pNew, 0, sizeof(*pNew));
-    pNew->pControl = pControl;
   }
   return rc;
 }
 
-static int template_eachDisconnect(sqlite3_vtab *pVtab) {
-  template_each_vtab *p = (template_each_vtab *)pVtab;
-  sqlite3_free(p);
+static int tg_read_geojsonDisconnect(sqlite3_vtab *pVtab) {
+  sqlite3_free(pVtab);
   return SQLITE_OK;
 }
 
-static int template_eachOpen(sqlite3_vtab *p, sqlite3_vtab_cursor **ppCursor) {
-  template_each_cursor *pCur;
-  pCur = sqlite3_malloc(sizeof(*pCur));
+static int tg_read_geojsonOpen(sqlite3_vtab *p,
+                               sqlite3_vtab_cursor **ppCursor) {
+  tg_read_geojson_cursor *pCur = sqlite3_malloc(sizeof(*pCur));
   if (pCur == 0)
     return SQLITE_NOMEM;
   memset(pCur, 0, sizeof(*pCur));
@@ -1099,170 +9139,208 @@ static int template_eachOpen(sqlite3_vtab *p, sqlite3_vtab_cursor **ppCursor) {
   return SQLITE_OK;
 }
 
-static int template_eachClose(sqlite3_vtab_cursor *cur) {
-  template_each_cursor *pCur = (template_each_cursor *)cur;
-  if (pCur->target) {
-    struct control *pControl = ((template_each_vtab *)cur->pVtab)->pControl;
-    pControl->xFree(pCur->target);
-    pCur->target = NULL;
-  }
+static void tg_read_geojson_reset(tg_read_geojson_cursor *pCur) {
+  tg_geom_free(pCur->geom);
+  pCur->geom = NULL;
+  tg_mapped_file_close(&pCur->file);
+  pCur->next = NULL;
+  pCur->feature = NULL;
+  pCur->featureEnd = NULL;
+  pCur->iRowid = 0;
+  pCur->eof = 1;
+}
+
+static int tg_read_geojsonClose(sqlite3_vtab_cursor *cur) {
+  tg_read_geojson_cursor *pCur = (tg_read_geojson_cursor *)cur;
+  tg_read_geojson_reset(pCur);
   sqlite3_free(pCur);
   return SQLITE_OK;
 }
 
-static int template_eachBestIndex(sqlite3_vtab *pVTab,
-                                  sqlite3_index_info *pIdxInfo) {
-  int hasSource = 0;
+static int tg_read_geojsonBestIndex(sqlite3_vtab *pVTab,
+                                    sqlite3_index_info *pIdxInfo) {
+  int hasPath = 0;
   for (int i = 0; i < pIdxInfo->nConstraint; i++) {
     const struct sqlite3_index_constraint *pCons = &pIdxInfo->aConstraint[i];
-    switch (pCons->iColumn) {
-    case TEMPLATE_EACH_SOURCE: {
-      if (!hasSource && !pCons->usable ||
-          pCons->op != SQLITE_INDEX_CONSTRAINT_EQ)
+    if (pCons->iColumn == TG_READ_GEOJSON_PATH) {
+      if (!pCons->usable || pCons->op != SQLITE_INDEX_CONSTRAINT_EQ)
         return SQLITE_CONSTRAINT;
-      hasSource = 1;
+      hasPath = 1;
       pIdxInfo->aConstraintUsage[i].argvIndex = 1;
       pIdxInfo->aConstraintUsage[i].omit = 1;
     }
-    }
   }
-  if (!hasSource) {
-    pVTab->zErrMsg = sqlite3_mprintf("source argument is required");
+  if (!hasPath) {
+    pVTab->zErrMsg = sqlite3_mprintf("path argument is required");
     return SQLITE_ERROR;
   }
-
   pIdxInfo->idxNum = 1;
-  pIdxInfo->estimatedCost = (double)10;
-  pIdxInfo->estimatedRows = 10;
+  pIdxInfo->estimatedCost = (double)100000;
+  pIdxInfo->estimatedRows = 100000;
   return SQLITE_OK;
 }
 
-static int template_eachFilter(sqlite3_vtab_cursor *pVtabCursor, int idxNum,
-                               const char *idxStr, int argc,
-                               sqlite3_value **argv) {
-  template_each_cursor *pCur = (template_each_cursor *)pVtabCursor;
-  pCur->iRowid = 0;
-  struct control *pControl =
-      ((template_each_vtab *)pVtabCursor->pVtab)->pControl;
-  if (pCur->target) {
-    pControl->xFree(pCur->target);
-    pCur->target = 0;
+// Parses the feature at pCur->next and advances past it, or sets eof at the
+// end of the features array.
+static int tg_read_geojson_step(tg_read_geojson_cursor *pCur) {
+  const char *end = pCur->file.data + pCur->file.size;
+  tg_geom_free(pCur->geom);
+  pCur->geom = NULL;
+
+  if (!pCur->next) {
+    pCur->eof = 1;
+    return SQLITE_OK;
   }
-  struct tg_geom *geom;
-  char * errmsg;
-  int rc = geomValue(argv[0], &geom, &errmsg);
-  if (rc != SQLITE_OK) {
-    sqlite3_free(pVtabCursor->pVtab->zErrMsg);
-    pVtabCursor->pVtab->zErrMsg = sqlite3_mprintf("%s", errmsg);
-    sqlite3_free(errmsg);
+  const char *p = tg_json_skip_ws(pCur->next, end);
+  if (p < end && *p == ']') {
+    pCur->eof = 1;
+    return SQLITE_OK;
+  }
+  // every feature after the first must follow a comma
+  if (pCur->feature) {
+    if (p >= end || *p != ',') {
+      tg_vtab_set_error(pCur->base.pVtab,
+                        "malformed GeoJSON after feature %lld: expected ',' "
+                        "or ']'",
+                        pCur->iRowid - 1);
+      return SQLITE_ERROR;
+    }
+    p = tg_json_skip_ws(p + 1, end);
+  }
+  const char *featureEnd = tg_json_skip_value(p, end);
+  if (!featureEnd) {
+    tg_vtab_set_error(pCur->base.pVtab, "malformed GeoJSON in feature %lld",
+                      pCur->iRowid);
     return SQLITE_ERROR;
   }
-  pCur->target = geom;
-  return SQLITE_OK;
-}
-
-static int template_eachRowid(sqlite3_vtab_cursor *cur, sqlite_int64 *pRowid) {
-  template_each_cursor *pCur = (template_each_cursor *)cur;
-  *pRowid = pCur->iRowid;
-  return SQLITE_OK;
-}
-
-static int template_eachNext(sqlite3_vtab_cursor *cur) {
-  template_each_cursor *pCur = (template_each_cursor *)cur;
-  pCur->iRowid++;
-  return SQLITE_OK;
-}
-
-static int template_eachEof(sqlite3_vtab_cursor *cur) {
-  template_each_cursor *pCur = (template_each_cursor *)cur;
-  struct control *pControl = ((template_each_vtab *)cur->pVtab)->pControl;
-  return pControl->xEof(pCur->target, pCur->iRowid);
-}
-
-static int template_eachColumn(sqlite3_vtab_cursor *cur,
-                               sqlite3_context *context, int i) {
-  template_each_cursor *pCur = (template_each_cursor *)cur;
-  switch (i) {
-  case TEMPLATE_EACH_TARGET: {
-    struct control *pControl =
-        ((template_each_vtab *)pCur->base.pVtab)->pControl;
-    pControl->xResult(context, pCur->target, pCur->iRowid);
-    break;
+  pCur->geom = tg_parse_geojsonn_ix(p, featureEnd - p, TG_NONE);
+  if (!pCur->geom) {
+    return SQLITE_NOMEM;
   }
+  if (tg_geom_error(pCur->geom)) {
+    tg_vtab_set_error(pCur->base.pVtab, "feature %lld: %s", pCur->iRowid,
+                      tg_geom_error(pCur->geom));
+    return SQLITE_ERROR;
   }
+  pCur->feature = p;
+  pCur->featureEnd = featureEnd;
+  pCur->next = featureEnd;
   return SQLITE_OK;
 }
 
+static int tg_read_geojsonFilter(sqlite3_vtab_cursor *pVtabCursor, int idxNum,
+                                 const char *idxStr, int argc,
+                                 sqlite3_value **argv) {
+  tg_read_geojson_cursor *pCur = (tg_read_geojson_cursor *)pVtabCursor;
+  tg_read_geojson_reset(pCur);
 
-// overwrite `->>` on `tg_each()` to extract JSON path from `tg_geom_extra_json()`
-static void tg_each_arrow(sqlite3_context *context, int argc,
-                              sqlite3_value **argv) {
-  int rc;
-  sqlite3_stmt * stmt = NULL;
-  struct tg_geom *g = NULL;
-  char * errmsg = NULL;
-
-  rc = geomValue(argv[0], &g, &errmsg);
+  const char *path = (const char *)sqlite3_value_text(argv[0]);
+  if (!path) {
+    tg_vtab_set_error(pVtabCursor->pVtab, "path must be text");
+    return SQLITE_ERROR;
+  }
+  char *errmsg;
+  int rc = tg_mapped_file_open(&pCur->file, path, &errmsg);
   if (rc != SQLITE_OK) {
-    sqlite3_result_error(context, errmsg, -1);
+    tg_vtab_set_error(pVtabCursor->pVtab, "%s", errmsg);
     sqlite3_free(errmsg);
-    goto cleanup;
-  }
-
-  const char * extra_json = tg_geom_extra_json(g);
-  if(!extra_json) {
-    goto cleanup;
+    return rc;
   }
 
-  rc = sqlite3_prepare_v2(sqlite3_context_db_handle(context), "select ?1 ->> ?2", -1, &stmt, NULL);
-  if(rc != SQLITE_OK) {
-    sqlite3_result_error(context, "error preparing", -1);
-    goto cleanup;
+  const char *start = pCur->file.data;
+  const char *end = start + pCur->file.size;
+  // only finds where features starts: the array itself is scanned a feature
+  // at a time by tg_read_geojson_step()
+  const char *features;
+  int found = pCur->file.size > 0
+                  ? tg_json_object_member(start, end, "features", &features,
+                                          NULL)
+                  : -1;
+  if (found < 0) {
+    tg_vtab_set_error(pVtabCursor->pVtab, "%s is not a GeoJSON object", path);
+    return SQLITE_ERROR;
   }
-  sqlite3_bind_text(stmt, 1, extra_json, -1, SQLITE_TRANSIENT);
-  sqlite3_bind_value(stmt, 2, argv[1]);
-  rc = sqlite3_step(stmt);
-  if(rc != SQLITE_ROW) {
-    sqlite3_result_error(context, sqlite3_errmsg(sqlite3_context_db_handle(context)), -1);
-    goto cleanup;
+  pCur->eof = 0;
+  if (found) {
+    if (*features != '[') {
+      tg_vtab_set_error(pVtabCursor->pVtab,
+                        "features in %s is not an array", path);
+      return SQLITE_ERROR;
+    }
+    pCur->next = features + 1;
+  } else {
+    // a single Feature or geometry is read as one row
+    pCur->next = start;
+    rc = tg_read_geojson_step(pCur);
+    pCur->next = NULL;
+    return rc;
   }
-  sqlite3_result_value(context, sqlite3_column_value(stmt, 0));
+  return tg_read_geojson_step(pCur);
+}
 
-  cleanup:
-    tg_geom_free(g);
-    sqlite3_finalize(stmt);
+static int tg_read_geojsonNext(sqlite3_vtab_cursor *cur) {
+  tg_read_geojson_cursor *pCur = (tg_read_geojson_cursor *)cur;
+  pCur->iRowid++;
+  return tg_read_geojson_step(pCur);
 }
-static int template_eachFindFunction(sqlite3_vtab *pVtab, int nArg, const char *zName,
-                           void (**pxFunc)(sqlite3_context *, int,
-                                           sqlite3_value **),
-                           void **ppArg) {
-  if (sqlite3_stricmp(zName, "->>") == 0 && nArg == 2) {
-    *pxFunc = tg_each_arrow;
-    return 1;
+
+static int tg_read_geojsonEof(sqlite3_vtab_cursor *cur) {
+  tg_read_geojson_cursor *pCur = (tg_read_geojson_cursor *)cur;
+  return pCur->eof;
+}
+
+static int tg_read_geojsonRowid(sqlite3_vtab_cursor *cur,
+                                sqlite_int64 *pRowid) {
+  tg_read_geojson_cursor *pCur = (tg_read_geojson_cursor *)cur;
+  *pRowid = pCur->iRowid;
+  return SQLITE_OK;
+}
+
+static int tg_read_geojsonColumn(sqlite3_vtab_cursor *cur,
+                                 sqlite3_context *context, int i) {
+  tg_read_geojson_cursor *pCur = (tg_read_geojson_cursor *)cur;
+  switch (i) {
+  case TG_READ_GEOJSON_GEOMETRY:
+    sqlite3_result_pointer(context, tg_geom_clone(pCur->geom),
+                           TG_GEOM_POINTER_NAME,
+                           (void (*)(void *))tg_geom_free);
+    break;
+  case TG_READ_GEOJSON_PROPERTIES: {
+    const char *value, *valueEnd;
+    if (tg_json_object_member(pCur->feature, pCur->featureEnd, "properties",
+                              &value, &valueEnd) == 1 &&
+        *value == '{') {
+      sqlite3_result_text(context, value, valueEnd - value, SQLITE_TRANSIENT);
+    }
+    break;
   }
-  return 0;
+  case TG_READ_GEOJSON_PATH:
+    sqlite3_result_null(context);
+    break;
+  }
+  return SQLITE_OK;
 }
 
-static sqlite3_module template_eachModule = {
+static sqlite3_module tg_read_geojsonModule = {
     /* iVersion    */ 0,
     /* xCreate     */ 0,
-    /* xConnect    */ template_eachConnect,
-    /* xBestIndex  */ template_eachBestIndex,
-    /* xDisconnect */ template_eachDisconnect,
+    /* xConnect    */ tg_read_geojsonConnect,
+    /* xBestIndex  */ tg_read_geojsonBestIndex,
+    /* xDisconnect */ tg_read_geojsonDisconnect,
     /* xDestroy    */ 0,
-    /* xOpen       */ template_eachOpen,
-    /* xClose      */ template_eachClose,
-    /* xFilter     */ template_eachFilter,
-    /* xNext       */ template_eachNext,
-    /* xEof        */ template_eachEof,
-    /* xColumn     */ template_eachColumn,
-    /* xRowid      */ template_eachRowid,
+    /* xOpen       */ tg_read_geojsonOpen,
+    /* xClose      */ tg_read_geojsonClose,
+    /* xFilter     */ tg_read_geojsonFilter,
+    /* xNext       */ tg_read_geojsonNext,
+    /* xEof        */ tg_read_geojsonEof,
+    /* xColumn     */ tg_read_geojsonColumn,
+    /* xRowid      */ tg_read_geojsonRowid,
     /* xUpdate     */ 0,
     /* xBegin      */ 0,
     /* xSync       */ 0,
     /* xCommit     */ 0,
     /* xRollback   */ 0,
-    /* xFindMethod */ template_eachFindFunction,
+    /* xFindMethod */ 0,
     /* xRename     */ 0,
     /* xSavepoint  */ 0,
     /* xRelease    */ 0,
@@ -1270,164 +9348,357 @@ static sqlite3_module template_eachModule = {
     /* xShadowName */ 0};
 #pragma endregion
 
-#pragma region tg_bbox() table function
+#pragma region tg_read_geojsonseq() and tg_read_wkb_stream() table functions
+
+// A file format made of independent records, read by tg_stream_module.
+struct tg_stream_format {
+  // Finds the record at or after p. Sets *pStart/*pEnd to its bounds and
+  // returns 1, returns 0 at the end of the file, or -1 on malformed input.
+  int (*xRecord)(const char *p, const char *end, const char **pStart,
+                 const char **pEnd);
+  struct tg_geom *(*xParse)(const char *data, size_t len);
+  // whether records are GeoJSON, with a properties member
+  int hasProperties;
+};
 
-typedef struct tg_bbox_vtab tg_bbox_vtab;
-struct tg_bbox_vtab {
+// GeoJSONSeq (RFC 8142) and newline-delimited GeoJSON: one GeoJSON text per
+// line, optionally prefixed with a record separator. Blank lines are skipped.
+static int geojsonseqRecord(const char *p, const char *end, const char **pStart,
+                            const char **pEnd) {
+  while (p < end && (*p == 0x1e || *p == ' ' || *p == '\t' || *p == '\n' ||
+                     *p == '\r'))
+    p++;
+  if (p >= end)
+    return 0;
+  const char *newline = memchr(p, '\n', end - p);
+  const char *e = newline ? newline : end;
+  while (e > p && (e[-1] == '\r' || e[-1] == ' ' || e[-1] == '\t'))
+    e--;
+  *pStart = p;
+  *pEnd = e;
+  return 1;
+}
+
+static struct tg_geom *geojsonseqParse(const char *data, size_t len) {
+  return tg_parse_geojsonn_ix(data, len, TG_NONE);
+}
+
+// A stream of WKB geometries, each prefixed by its length in bytes as a 4-byte
+// little-endian unsigned integer.
+static int wkbStreamRecord(const char *p, const char *end, const char **pStart,
+                           const char **pEnd) {
+  if (p >= end)
+    return 0;
+  if (end - p < 4)
+    return -1;
+  const unsigned char *b = (const unsigned char *)p;
+  sqlite3_uint64 n = (sqlite3_uint64)b[0] | ((sqlite3_uint64)b[1] << 8) |
+                     ((sqlite3_uint64)b[2] << 16) |
+                     ((sqlite3_uint64)b[3] << 24);
+  if (n > (sqlite3_uint64)(end - p - 4))
+    return -1;
+  *pStart = p + 4;
+  *pEnd = p + 4 + n;
+  return 1;
+}
+
+static struct tg_geom *wkbStreamParse(const char *data, size_t len) {
+  return tg_parse_wkb_ix((const uint8_t *)data, len, TG_NONE);
+}
+
+// records are located sequentially, then decoded in parallel, this many at a
+// time, and emitted in file order
+#define TG_STREAM_BATCH 256
+
+struct tg_stream_record {
+  const char *start;
+  const char *end;
+  struct tg_geom *geom;
+};
+
+typedef struct tg_stream_vtab tg_stream_vtab;
+struct tg_stream_vtab {
   sqlite3_vtab base;
+  const struct tg_stream_format *format;
 };
 
-typedef struct tg_bbox_cursor tg_bbox_cursor;
-struct tg_bbox_cursor {
+typedef struct tg_stream_cursor tg_stream_cursor;
+struct tg_stream_cursor {
   sqlite3_vtab_cursor base;
-  sqlite3_int64 iRowid;
-  struct tg_rect rect;
+  const struct tg_stream_format *format;
+  struct tg_mapped_file file;
+  // kept across tg_streamFilter() calls that ask for the same nPoolThreads,
+  // so repeated scans don't start new threads
+  struct tg_pool *pool;
+  int nPoolThreads;
+  // the next unread byte of the file
+  const char *next;
+  struct tg_stream_record aRecord[TG_STREAM_BATCH];
+  int nRecord;
+  int iRecord;
+  // ordinal of aRecord[iRecord] in the whole file
+  sqlite3_int64 iOrdinal;
+  int eof;
 };
 
-static int tg_bboxConnect(sqlite3 *db, void *pAux, int argc,
-                          const char *const *argv, sqlite3_vtab **ppVtab,
-                          char **pzErr) {
-  tg_bbox_vtab *pNew;
-  int rc;
-#define TG_BBOX_MINX 0
-#define TG_BBOX_MAXX 1
-#define TG_BBOX_MINY 2
-#define TG_BBOX_MAXY 3
-#define TG_BBOX_SOURCE 4
-  rc = sqlite3_declare_vtab(
-      db, "CREATE TABLE x(minX, maxX, minY, maxY, source hidden)");
+#define TG_STREAM_ORDINAL 0
+#define TG_STREAM_GEOMETRY 1
+#define TG_STREAM_PROPERTIES 2
+#define TG_STREAM_PATH 3
+#define TG_STREAM_THREADS 4
+
+static int tg_streamConnect(sqlite3 *db, void *pAux, int argc,
+                            const char *const *argv, sqlite3_vtab **ppVtab,
+                            char **pzErr) {
+  tg_stream_vtab *pNew;
+  int rc = sqlite3_declare_vtab(db, "CREATE TABLE x(ordinal, geometry, "
+                                    "properties, path hidden, threads hidden)");
   if (rc == SQLITE_OK) {
+    // reads arbitrary files, so never from triggers, views, or schemas
+    sqlite3_vtab_config(db, SQLITE_VTAB_DIRECTONLY);
     pNew = sqlite3_malloc(sizeof(*pNew));
     *ppVtab = (sqlite3_vtab *)pNew;
     if (pNew == 0)
       return SQLITE_NOMEM;
     memset(pNew, 0, sizeof(*pNew));
+    pNew->format = (const struct tg_stream_format *)pAux;
   }
   return rc;
 }
 
-static int tg_bboxDisconnect(sqlite3_vtab *pVtab) {
-  tg_bbox_vtab *p = (tg_bbox_vtab *)pVtab;
-  sqlite3_free(p);
+static int tg_streamDisconnect(sqlite3_vtab *pVtab) {
+  sqlite3_free(pVtab);
   return SQLITE_OK;
 }
 
-static int tg_bboxOpen(sqlite3_vtab *p, sqlite3_vtab_cursor **ppCursor) {
-  tg_bbox_cursor *pCur;
-  pCur = sqlite3_malloc(sizeof(*pCur));
+static int tg_streamOpen(sqlite3_vtab *p, sqlite3_vtab_cursor **ppCursor) {
+  tg_stream_cursor *pCur = sqlite3_malloc(sizeof(*pCur));
   if (pCur == 0)
     return SQLITE_NOMEM;
   memset(pCur, 0, sizeof(*pCur));
+  pCur->format = ((tg_stream_vtab *)p)->format;
+  pCur->eof = 1;
   *ppCursor = &pCur->base;
   return SQLITE_OK;
 }
 
-static int tg_bboxClose(sqlite3_vtab_cursor *cur) {
-  tg_bbox_cursor *pCur = (tg_bbox_cursor *)cur;
+static void tg_stream_clear_batch(tg_stream_cursor *pCur) {
+  for (int i = 0; i < pCur->nRecord; i++) {
+    tg_geom_free(pCur->aRecord[i].geom);
+    pCur->aRecord[i].geom = NULL;
+  }
+  pCur->nRecord = 0;
+  pCur->iRecord = 0;
+}
+
+static void tg_stream_reset(tg_stream_cursor *pCur) {
+  tg_stream_clear_batch(pCur);
+  tg_mapped_file_close(&pCur->file);
+  pCur->next = NULL;
+  pCur->iOrdinal = 0;
+  pCur->eof = 1;
+}
+
+static int tg_streamClose(sqlite3_vtab_cursor *cur) {
+  tg_stream_cursor *pCur = (tg_stream_cursor *)cur;
+  tg_stream_reset(pCur);
+  tg_pool_free(pCur->pool);
   sqlite3_free(pCur);
   return SQLITE_OK;
 }
 
-static int tg_bboxBestIndex(sqlite3_vtab *pVTab, sqlite3_index_info *pIdxInfo) {
-  int hasSource = 0;
+static int tg_streamBestIndex(sqlite3_vtab *pVTab,
+                              sqlite3_index_info *pIdxInfo) {
+  int iPath = -1;
+  int iThreads = -1;
   for (int i = 0; i < pIdxInfo->nConstraint; i++) {
     const struct sqlite3_index_constraint *pCons = &pIdxInfo->aConstraint[i];
-    switch (pCons->iColumn) {
-    case TG_BBOX_SOURCE: {
-      if (!hasSource && !pCons->usable ||
-          pCons->op != SQLITE_INDEX_CONSTRAINT_EQ)
-        return SQLITE_CONSTRAINT;
-      hasSource = 1;
-      pIdxInfo->aConstraintUsage[i].argvIndex = 1;
-      pIdxInfo->aConstraintUsage[i].omit = 1;
-    }
+    if (pCons->iColumn != TG_STREAM_PATH && pCons->iColumn != TG_STREAM_THREADS)
+      continue;
+    if (!pCons->usable || pCons->op != SQLITE_INDEX_CONSTRAINT_EQ)
+      return SQLITE_CONSTRAINT;
+    if (pCons->iColumn == TG_STREAM_PATH) {
+      iPath = i;
+    } else {
+      iThreads = i;
     }
   }
-  if (!hasSource) {
-    pVTab->zErrMsg = sqlite3_mprintf("source argument is required");
+  if (iPath < 0) {
+    pVTab->zErrMsg = sqlite3_mprintf("path argument is required");
     return SQLITE_ERROR;
   }
-
+  pIdxInfo->aConstraintUsage[iPath].argvIndex = 1;
+  pIdxInfo->aConstraintUsage[iPath].omit = 1;
   pIdxInfo->idxNum = 1;
-  pIdxInfo->estimatedCost = (double)10;
-  pIdxInfo->estimatedRows = 10;
+  if (iThreads >= 0) {
+    pIdxInfo->aConstraintUsage[iThreads].argvIndex = 2;
+    pIdxInfo->aConstraintUsage[iThreads].omit = 1;
+    pIdxInfo->idxNum |= 2;
+  }
+  pIdxInfo->estimatedCost = (double)100000;
+  pIdxInfo->estimatedRows = 100000;
   return SQLITE_OK;
 }
 
-static int tg_bboxFilter(sqlite3_vtab_cursor *pVtabCursor, int idxNum,
-                         const char *idxStr, int argc, sqlite3_value **argv) {
-  tg_bbox_cursor *pCur = (tg_bbox_cursor *)pVtabCursor;
-  pCur->iRowid = 0;
-  struct tg_geom *geom;
-  char * errmsg;
-  int rc = geomValue(argv[0], &geom, &errmsg);
-  if (rc != SQLITE_OK) {
-    sqlite3_free(pVtabCursor->pVtab->zErrMsg);
-    pVtabCursor->pVtab->zErrMsg = sqlite3_mprintf("%s", errmsg);
-    sqlite3_free(errmsg);
-    return SQLITE_ERROR;
+static void tg_stream_decode_task(void *ctx, int i) {
+  tg_stream_cursor *pCur = (tg_stream_cursor *)ctx;
+  struct tg_stream_record *record = &pCur->aRecord[i];
+  record->geom =
+      pCur->format->xParse(record->start, record->end - record->start);
+}
+
+// Locates and decodes the next batch of records, or sets eof when the file
+// is exhausted.
+static int tg_stream_fill(tg_stream_cursor *pCur) {
+  const char *end = pCur->file.data + pCur->file.size;
+  tg_stream_clear_batch(pCur);
+  while (pCur->nRecord < TG_STREAM_BATCH) {
+    struct tg_stream_record *record = &pCur->aRecord[pCur->nRecord];
+    int found = pCur->next ? pCur->format->xRecord(pCur->next, end,
+                                                   &record->start, &record->end)
+                           : 0;
+    if (found < 0) {
+      tg_vtab_set_error(pCur->base.pVtab, "record %lld: truncated or malformed",
+                        pCur->iOrdinal + pCur->nRecord);
+      return SQLITE_ERROR;
+    }
+    if (!found)
+      break;
+    pCur->next = record->end;
+    pCur->nRecord++;
+  }
+  if (pCur->nRecord == 0) {
+    pCur->eof = 1;
+    return SQLITE_OK;
   }
 
-  pCur->rect = tg_geom_rect(geom);
-  tg_geom_free(geom);
+  tg_pool_run(pCur->pool, pCur->nRecord, tg_stream_decode_task, pCur);
+
+  for (int i = 0; i < pCur->nRecord; i++) {
+    struct tg_geom *geom = pCur->aRecord[i].geom;
+    if (!geom) {
+      return SQLITE_NOMEM;
+    }
+    if (tg_geom_error(geom)) {
+      tg_vtab_set_error(pCur->base.pVtab, "record %lld: %s",
+                        pCur->iOrdinal + i, tg_geom_error(geom));
+      return SQLITE_ERROR;
+    }
+  }
   return SQLITE_OK;
 }
 
-static int tg_bboxRowid(sqlite3_vtab_cursor *cur, sqlite_int64 *pRowid) {
-  tg_bbox_cursor *pCur = (tg_bbox_cursor *)cur;
-  *pRowid = pCur->iRowid;
-  return SQLITE_OK;
+static int tg_streamFilter(sqlite3_vtab_cursor *pVtabCursor, int idxNum,
+                           const char *idxStr, int argc,
+                           sqlite3_value **argv) {
+  tg_stream_cursor *pCur = (tg_stream_cursor *)pVtabCursor;
+  tg_stream_reset(pCur);
+
+  const char *path = (const char *)sqlite3_value_text(argv[0]);
+  if (!path) {
+    tg_vtab_set_error(pVtabCursor->pVtab, "path must be text");
+    return SQLITE_ERROR;
+  }
+  int nThreads = 0;
+  if ((idxNum & 2) && argc > 1) {
+    nThreads = sqlite3_value_int(argv[1]);
+    if (nThreads < 0 || nThreads > 64) {
+      tg_vtab_set_error(pVtabCursor->pVtab,
+                        "threads must be between 0 and 64, not %d", nThreads);
+      return SQLITE_ERROR;
+    }
+  }
+  if (nThreads == 0) {
+    nThreads = tg_pool_default_threads();
+  }
+
+  char *errmsg;
+  int rc = tg_mapped_file_open(&pCur->file, path, &errmsg);
+  if (rc != SQLITE_OK) {
+    tg_vtab_set_error(pVtabCursor->pVtab, "%s", errmsg);
+    sqlite3_free(errmsg);
+    return rc;
+  }
+  if (pCur->pool && pCur->nPoolThreads != nThreads) {
+    tg_pool_free(pCur->pool);
+    pCur->pool = NULL;
+  }
+  if (!pCur->pool) {
+    rc = tg_pool_new(nThreads, &pCur->pool);
+    if (rc != SQLITE_OK) {
+      return rc;
+    }
+    pCur->nPoolThreads = nThreads;
+  }
+  pCur->next = pCur->file.data;
+  pCur->eof = 0;
+  return tg_stream_fill(pCur);
 }
 
-static int tg_bboxNext(sqlite3_vtab_cursor *cur) {
-  tg_bbox_cursor *pCur = (tg_bbox_cursor *)cur;
-  pCur->iRowid++;
-  return SQLITE_OK;
+static int tg_streamNext(sqlite3_vtab_cursor *cur) {
+  tg_stream_cursor *pCur = (tg_stream_cursor *)cur;
+  pCur->iOrdinal++;
+  if (++pCur->iRecord < pCur->nRecord) {
+    return SQLITE_OK;
+  }
+  return tg_stream_fill(pCur);
 }
 
-static int tg_bboxEof(sqlite3_vtab_cursor *cur) {
-  tg_bbox_cursor *pCur = (tg_bbox_cursor *)cur;
-  return pCur->iRowid >= 1;
+static int tg_streamEof(sqlite3_vtab_cursor *cur) {
+  tg_stream_cursor *pCur = (tg_stream_cursor *)cur;
+  return pCur->eof;
 }
 
-static int tg_bboxColumn(sqlite3_vtab_cursor *cur, sqlite3_context *context,
-                         int i) {
-  tg_bbox_cursor *pCur = (tg_bbox_cursor *)cur;
+static int tg_streamRowid(sqlite3_vtab_cursor *cur, sqlite_int64 *pRowid) {
+  tg_stream_cursor *pCur = (tg_stream_cursor *)cur;
+  *pRowid = pCur->iOrdinal;
+  return SQLITE_OK;
+}
+
+static int tg_streamColumn(sqlite3_vtab_cursor *cur, sqlite3_context *context,
+                           int i) {
+  tg_stream_cursor *pCur = (tg_stream_cursor *)cur;
+  struct tg_stream_record *record = &pCur->aRecord[pCur->iRecord];
   switch (i) {
-  case TG_BBOX_MINX:
-    sqlite3_result_double(context, pCur->rect.min.x);
+  case TG_STREAM_ORDINAL:
+    sqlite3_result_int64(context, pCur->iOrdinal);
     break;
-  case TG_BBOX_MAXX:
-    sqlite3_result_double(context, pCur->rect.max.x);
-    break;
-  case TG_BBOX_MINY:
-    sqlite3_result_double(context, pCur->rect.min.y);
+  case TG_STREAM_GEOMETRY:
+    sqlite3_result_pointer(context, tg_geom_clone(record->geom),
+                           TG_GEOM_POINTER_NAME,
+                           (void (*)(void *))tg_geom_free);
     break;
-  case TG_BBOX_MAXY:
-    sqlite3_result_double(context, pCur->rect.max.y);
+  case TG_STREAM_PROPERTIES: {
+    const char *value, *valueEnd;
+    if (pCur->format->hasProperties &&
+        tg_json_object_member(record->start, record->end, "properties", &value,
+                              &valueEnd) == 1 &&
+        *value == '{') {
+      sqlite3_result_text(context, value, valueEnd - value, SQLITE_TRANSIENT);
+    }
     break;
-  case TG_BBOX_SOURCE:
-    // TODO resolve back to original geometry?
-    sqlite3_result_null(context);
+  }
+  case TG_STREAM_THREADS:
+    sqlite3_result_int(context, tg_pool_threads(pCur->pool));
     break;
   }
   return SQLITE_OK;
 }
 
-static sqlite3_module tg_bboxModule = {
+static sqlite3_module tg_streamModule = {
     /* iVersion    */ 0,
     /* xCreate     */ 0,
-    /* xConnect    */ tg_bboxConnect,
-    /* xBestIndex  */ tg_bboxBestIndex,
-    /* xDisconnect */ tg_bboxDisconnect,
+    /* xConnect    */ tg_streamConnect,
+    /* xBestIndex  */ tg_streamBestIndex,
+    /* xDisconnect */ tg_streamDisconnect,
     /* xDestroy    */ 0,
-    /* xOpen       */ tg_bboxOpen,
-    /* xClose      */ tg_bboxClose,
-    /* xFilter     */ tg_bboxFilter,
-    /* xNext       */ tg_bboxNext,
-    /* xEof        */ tg_bboxEof,
-    /* xColumn     */ tg_bboxColumn,
-    /* xRowid      */ tg_bboxRowid,
+    /* xOpen       */ tg_streamOpen,
+    /* xClose      */ tg_streamClose,
+    /* xFilter     */ tg_streamFilter,
+    /* xNext       */ tg_streamNext,
+    /* xEof        */ tg_streamEof,
+    /* xColumn     */ tg_streamColumn,
+    /* xRowid      */ tg_streamRowid,
     /* xUpdate     */ 0,
     /* xBegin      */ 0,
     /* xSync       */ 0,
@@ -1441,653 +9712,601 @@ static sqlite3_module tg_bboxModule = {
     /* xShadowName */ 0};
 #pragma endregion
 
-#pragma region tg0 virtual table
-
-#define TG0_COLUMN_SHAPE 0
-#define TG0_COLUMN_REST 1
-
-#define TG0_SQL_RTREE_DROP "DROP TABLE \"%w\".\"%w_rtree\""
-#define TG0_SQL_DELETE "DELETE FROM \"%w\".\"%w_rtree\" WHERE id = ?1"
-
-// clang-format off
-// The different overloaded and intercepted functions for tg0() tables.
-#define TG0_FUNC_INTERSECTS SQLITE_INDEX_CONSTRAINT_FUNCTION
-#define TG0_FUNC_DISJOINT   SQLITE_INDEX_CONSTRAINT_FUNCTION + 1
-#define TG0_FUNC_CONTAINS   SQLITE_INDEX_CONSTRAINT_FUNCTION + 2
-#define TG0_FUNC_WITHIN     SQLITE_INDEX_CONSTRAINT_FUNCTION + 3
-#define TG0_FUNC_COVERS     SQLITE_INDEX_CONSTRAINT_FUNCTION + 4
-#define TG0_FUNC_COVEREDBY  SQLITE_INDEX_CONSTRAINT_FUNCTION + 5
-// clang-format on
-
-enum TG0_PLAN {
-  // full scan, admit all rtree entries
-  FULLSCAN,
-  // only emit boundaries that interect a query geometry
-  INTERSECT,
-  // TODO disjoint/contains/within/covers/coveredby
+#pragma region tg_random_*() table functions
+
+// Seeded generators of synthetic geometries for benchmarks and load tests.
+// Each row is generated from a hash of the seed and its rowid alone, so the
+// same arguments always produce the same rows, in any order, and WKB is
+// written directly without building tg geometries.
+
+#define TG_RANDOM_POINTS 0
+#define TG_RANDOM_LINES 1
+#define TG_RANDOM_POLYGONS 2
+
+#define TG_RANDOM_ARG_N 0
+#define TG_RANDOM_ARG_VERTICES 1
+#define TG_RANDOM_ARG_BBOX 2
+#define TG_RANDOM_ARG_SEED 3
+#define TG_RANDOM_ARG_CLUSTERS 4
+#define TG_RANDOM_ARG_HOLES 5
+
+#define TG_RANDOM_MAX_VERTICES 100000
+#define TG_RANDOM_MAX_HOLES 64
+#define TG_RANDOM_MAX_CLUSTERS 1000000
+#define TG_RANDOM_PI 3.14159265358979323846
+
+struct tg_random_kind {
+  int type;
+  const char *schema;
+  // the hidden columns, in argument order, as TG_RANDOM_ARG_* values
+  int aArg[6];
+  int defaultVertices;
+  int minVertices;
 };
 
-typedef struct tg0_vtab tg0_vtab;
-struct tg0_vtab {
+typedef struct tg_random_vtab tg_random_vtab;
+struct tg_random_vtab {
   sqlite3_vtab base;
-
-  // the SQLite connection of the host database
   sqlite3 *db;
-  // Name of the schema the table exists on. Must be freed with sqlite3_free()
-  // on destruction
-  char *schemaName;
-  // Name of the table the table exists on. must be freed with sqlite3_free() on
-  // destruction
-  char *tableName;
-
-  int numAuxColumns;
+  const struct tg_random_kind *kind;
 };
 
-typedef struct tg0_cursor tg0_cursor;
-struct tg0_cursor {
+typedef struct tg_random_cursor tg_random_cursor;
+struct tg_random_cursor {
   sqlite3_vtab_cursor base;
-  // a statement that iterates over some sort of `select id, _shape` query.
-  sqlite3_stmt *stmt;
-  // the result code of the most recent sqlite3_step() on stmt
-  int stepStatus;
-  // The type of tree query that should be made
-  enum TG0_PLAN plan;
-  // the "query geometry" in predicate-style queries.
-  struct tg_geom *queryGeom;
+  const struct tg_random_kind *kind;
+  sqlite3_int64 iRowid;
+  sqlite3_int64 n;
+  int vertices;
+  int holes;
+  int clusters;
+  sqlite3_uint64 seed;
+  struct tg_rect bbox;
+  // the largest radius of a line or polygon, from the bbox area per row
+  double radius;
+  // WKB of the current row, generated on the first read of geometry
+  unsigned char *wkb;
+  size_t nWkb;
+  sqlite3_int64 iGenerated;
 };
 
-void tg_vtab_set_error(sqlite3_vtab *pVTab, const char *zFormat, ...) {
-  va_list args;
-  sqlite3_free(pVTab->zErrMsg);
-  va_start(args, zFormat);
-  pVTab->zErrMsg = sqlite3_vmprintf(zFormat, args);
-  va_end(args);
+#define TG_RANDOM_GEOMETRY 0
+
+static sqlite3_uint64 tg_random_mix(sqlite3_uint64 z) {
+  z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9ULL;
+  z = (z ^ (z >> 27)) * 0x94d049bb133111ebULL;
+  return z ^ (z >> 31);
 }
 
-int db_supports_rtree(sqlite3*db) {
-  sqlite3_stmt * stmt;
-  int rc = sqlite3_prepare_v2(db, "select name from pragma_module_list where name = 'rtree';", -1, &stmt, NULL);
-  // TODO could be that PRAGMA module_list is not allowed
-  if(rc != SQLITE_OK) {
-    return 0;
-  }
-  rc = sqlite3_step(stmt);
-  sqlite3_finalize(stmt);
-  return rc == SQLITE_ROW;
+// splitmix64, uniform in [0, 1)
+static double tg_random_next(sqlite3_uint64 *state) {
+  *state += 0x9e3779b97f4a7c15ULL;
+  return (double)(tg_random_mix(*state) >> 11) * (1.0 / 9007199254740992.0);
 }
 
-static int tg0_init(sqlite3 *db, void *pAux, int argc, const char *const *argv,
-                    sqlite3_vtab **ppVtab, char **pzErr, bool isCreate) {
-  tg0_vtab *pNew;
-  int rc;
-  if(!db_supports_rtree(db)) {
-    *pzErr = sqlite3_mprintf("The current SQLite connection does not include the R-Tree extension, which is required by tg0.");
-    return SQLITE_ERROR;
-  }
-  sqlite3_str *strSchema = sqlite3_str_new(NULL);
-  sqlite3_str_appendall(strSchema, "CREATE TABLE x(_shape");
-  for (int i = 3; i < argc; i++) {
-    sqlite3_str_appendf(strSchema, ", %w", argv[i]);
-  }
-  sqlite3_str_appendall(strSchema, ")");
-  const char *zSchema = sqlite3_str_finish(strSchema);
-  if (!zSchema) {
-    return SQLITE_NOMEM;
-  }
+static double tg_random_normal(sqlite3_uint64 *state) {
+  double u = tg_random_next(state);
+  double v = tg_random_next(state);
+  return sqrt(-2 * log(1 - u)) * cos(2 * TG_RANDOM_PI * v);
+}
+
+static unsigned char *tg_random_put_u32(unsigned char *p, uint32_t x) {
+  for (int k = 0; k < 4; k++)
+    p[k] = (unsigned char)(x >> (8 * k));
+  return p + 4;
+}
 
-  rc = sqlite3_declare_vtab(db, zSchema);
-  sqlite3_free((void *)zSchema);
-  if (rc != SQLITE_OK) {
-    *pzErr = sqlite3_mprintf("Error declaring vtab schema for tg0 virtual table.");
-    return rc;
+static unsigned char *tg_random_put_xy(unsigned char *p, double x, double y) {
+  uint64_t b[2];
+  memcpy(&b[0], &x, 8);
+  memcpy(&b[1], &y, 8);
+  for (int i = 0; i < 2; i++)
+    for (int k = 0; k < 8; k++)
+      *p++ = (unsigned char)(b[i] >> (8 * k));
+  return p;
+}
+
+// The center of the row's geometry: uniform over the bbox, or normally
+// distributed around one of the seeded cluster centers, clamped to the bbox.
+static void tg_random_center(tg_random_cursor *pCur, sqlite3_uint64 *state,
+                             double *px, double *py) {
+  double w = pCur->bbox.max.x - pCur->bbox.min.x;
+  double h = pCur->bbox.max.y - pCur->bbox.min.y;
+  if (!pCur->clusters) {
+    *px = pCur->bbox.min.x + tg_random_next(state) * w;
+    *py = pCur->bbox.min.y + tg_random_next(state) * h;
+    return;
   }
-  pNew = sqlite3_malloc(sizeof(*pNew));
-  *ppVtab = (sqlite3_vtab *)pNew;
-  if (pNew == 0)
-    return SQLITE_NOMEM;
-  memset(pNew, 0, sizeof(*pNew));
-  const char *schemaName = argv[1];
-  const char *tableName = argv[2];
+  sqlite3_uint64 c = (sqlite3_uint64)(tg_random_next(state) * pCur->clusters);
+  sqlite3_uint64 cstate = tg_random_mix(pCur->seed ^ ~c);
+  double cx = pCur->bbox.min.x + tg_random_next(&cstate) * w;
+  double cy = pCur->bbox.min.y + tg_random_next(&cstate) * h;
+  double spread = 0.25 / sqrt((double)pCur->clusters);
+  double x = cx + tg_random_normal(state) * spread * w;
+  double y = cy + tg_random_normal(state) * spread * h;
+  *px = x < pCur->bbox.min.x ? pCur->bbox.min.x
+        : x > pCur->bbox.max.x ? pCur->bbox.max.x
+                               : x;
+  *py = y < pCur->bbox.min.y ? pCur->bbox.min.y
+        : y > pCur->bbox.max.y ? pCur->bbox.max.y
+                               : y;
+}
 
-  pNew->db = db;
-  pNew->schemaName = sqlite3_mprintf("%s", schemaName);
-  pNew->tableName = sqlite3_mprintf("%s", tableName);
-  pNew->numAuxColumns = argc - 3;
+// A regular ring around (cx, cy), counter-clockwise unless cw.
+static unsigned char *tg_random_put_ring(unsigned char *p, int vertices,
+                                         double cx, double cy, double r,
+                                         double rotation, int cw) {
+  p = tg_random_put_u32(p, vertices + 1);
+  for (int i = 0; i <= vertices; i++) {
+    double a = rotation + (cw ? -2 : 2) * TG_RANDOM_PI * (i % vertices) / vertices;
+    p = tg_random_put_xy(p, cx + r * cos(a), cy + r * sin(a));
+  }
+  return p;
+}
 
-  if (isCreate) {
-    sqlite3_stmt *stmt = NULL;
-    int rcCreate = SQLITE_OK;
-    sqlite3_str *strRtreeSchema = sqlite3_str_new(NULL);
-    sqlite3_str_appendf(strRtreeSchema,
-                        "CREATE VIRTUAL TABLE \"%w\".\"%w_rtree\" using "
-                        "rtree(id, minX, maxX, minY, maxY, +_shape BLOB",
-                        schemaName, tableName);
-    for (int i = 3; i < argc; i++) {
-      sqlite3_str_appendf(strRtreeSchema, ", +c%d", i - 3 + 1);
+static void tg_random_generate(tg_random_cursor *pCur) {
+  sqlite3_uint64 state =
+      tg_random_mix(pCur->seed ^ tg_random_mix((sqlite3_uint64)pCur->iRowid));
+  double cx, cy;
+  tg_random_center(pCur, &state, &cx, &cy);
+  unsigned char *p = pCur->wkb;
+  *p++ = 1;
+  switch (pCur->kind->type) {
+  case TG_RANDOM_POINTS: {
+    p = tg_random_put_u32(p, 1);
+    p = tg_random_put_xy(p, cx, cy);
+    break;
+  }
+  case TG_RANDOM_LINES: {
+    // a random walk of about twice the radius, turning gradually
+    double step = 2 * pCur->radius * (0.25 + 0.75 * tg_random_next(&state)) /
+                  (pCur->vertices - 1);
+    double heading = 2 * TG_RANDOM_PI * tg_random_next(&state);
+    double x = cx, y = cy;
+    p = tg_random_put_u32(p, 2);
+    p = tg_random_put_u32(p, pCur->vertices);
+    for (int i = 0; i < pCur->vertices; i++) {
+      p = tg_random_put_xy(p, x, y);
+      double len = step * (0.5 + tg_random_next(&state));
+      x += len * cos(heading);
+      y += len * sin(heading);
+      heading += (tg_random_next(&state) - 0.5) * TG_RANDOM_PI / 2;
     }
-    sqlite3_str_appendall(strRtreeSchema, ")");
-    const char *zCreate = sqlite3_str_finish(strRtreeSchema);
-    if (!zCreate) {
-      rcCreate = SQLITE_NOMEM;
-    } else {
-      rcCreate = sqlite3_prepare_v2(db, zCreate, -1, &stmt, 0);
-      sqlite3_free((void *)zCreate);
-      if (rcCreate != SQLITE_OK) {
-        *pzErr = sqlite3_mprintf("Error preparing rtree shadow table for tg0 table.");
-        rcCreate = SQLITE_ERROR;
+    break;
+  }
+  case TG_RANDOM_POLYGONS: {
+    // Star-shaped around the center: vertices at increasing, jittered angles
+    // less than half a turn apart, each at a positive radius, so the exterior
+    // ring is simple and counter-clockwise. Holes are regular clockwise rings
+    // inside the largest disc around the center that the exterior contains,
+    // which keeps the polygon valid.
+    int v = pCur->vertices;
+    double r = pCur->radius * (0.25 + 0.75 * tg_random_next(&state));
+    double rotation = 2 * TG_RANDOM_PI * tg_random_next(&state);
+    p = tg_random_put_u32(p, 3);
+    p = tg_random_put_u32(p, 1 + pCur->holes);
+    p = tg_random_put_u32(p, v + 1);
+    unsigned char *first = p;
+    double inner = r;
+    double x0 = 0, y0 = 0, px = 0, py = 0;
+    for (int i = 0; i <= v; i++) {
+      double x, y;
+      if (i < v) {
+        double a = rotation + 2 * TG_RANDOM_PI * (i + 0.4 * tg_random_next(&state)) / v;
+        double ri = r * (0.5 + 0.5 * tg_random_next(&state));
+        x = cx + ri * cos(a);
+        y = cy + ri * sin(a);
+        p = tg_random_put_xy(p, x, y);
       } else {
-        rcCreate = sqlite3_step(stmt) == SQLITE_DONE ? SQLITE_OK : SQLITE_ERROR;
-        if (rcCreate != SQLITE_OK) {
-          *pzErr = sqlite3_mprintf("Error creating rtree shadow table for tg0 table.");
-        }
+        memcpy(p, first, 16);
+        p += 16;
+        x = x0, y = y0;
+      }
+      if (i == 0) {
+        x0 = x, y0 = y;
+      } else {
+        double ex = x - px, ey = y - py;
+        double d = fabs((px - cx) * ey - (py - cy) * ex) / sqrt(ex * ex + ey * ey);
+        if (d < inner)
+          inner = d;
       }
+      px = x, py = y;
     }
-    sqlite3_finalize(stmt);
-    if (rcCreate != SQLITE_OK) {
-      // xDisconnect is not called when xCreate fails, so clean up here
-      sqlite3_free(pNew->schemaName);
-      sqlite3_free(pNew->tableName);
-      sqlite3_free(pNew);
-      *ppVtab = NULL;
-      return rcCreate;
+    int holes = pCur->holes;
+    for (int j = 0; j < holes; j++) {
+      if (holes == 1) {
+        p = tg_random_put_ring(p, v, cx, cy, 0.5 * inner, rotation, 1);
+      } else {
+        double a = rotation + 2 * TG_RANDOM_PI * j / holes;
+        p = tg_random_put_ring(p, v, cx + 0.5 * inner * cos(a),
+                               cy + 0.5 * inner * sin(a),
+                               0.4 * inner * sin(TG_RANDOM_PI / holes), rotation, 1);
+      }
     }
+    break;
   }
-  return SQLITE_OK;
-}
-
-static int tg0Create(sqlite3 *db, void *pAux, int argc, const char *const *argv,
-                     sqlite3_vtab **ppVtab, char **pzErr) {
-  return tg0_init(db, pAux, argc, argv, ppVtab, pzErr, true);
-}
-static int tg0Connect(sqlite3 *db, void *pAux, int argc,
-                      const char *const *argv, sqlite3_vtab **ppVtab,
-                      char **pzErr) {
-  return tg0_init(db, pAux, argc, argv, ppVtab, pzErr, false);
-}
-
-static int tg0Disconnect(sqlite3_vtab *pVtab) {
-  tg0_vtab *p = (tg0_vtab *)pVtab;
-  sqlite3_free(p->schemaName);
-  sqlite3_free(p->tableName);
-  sqlite3_free(p);
-  return SQLITE_OK;
+  }
+  pCur->nWkb = p - pCur->wkb;
+  pCur->iGenerated = pCur->iRowid;
 }
-static int tg0Destroy(sqlite3_vtab *pVtab) {
-  tg0_vtab *p = (tg0_vtab *)pVtab;
-  sqlite3_stmt *stmt;
-  const char *zSql =
-      sqlite3_mprintf(TG0_SQL_RTREE_DROP, p->schemaName, p->tableName);
-  int rc = sqlite3_prepare_v2(p->db, zSql, -1, &stmt, 0);
-  sqlite3_free((void *)zSql);
 
+static int tg_randomConnect(sqlite3 *db, void *pAux, int argc,
+                            const char *const *argv, sqlite3_vtab **ppVtab,
+                            char **pzErr) {
+  const struct tg_random_kind *kind = (const struct tg_random_kind *)pAux;
+  tg_random_vtab *pNew;
+  int rc = sqlite3_declare_vtab(db, kind->schema);
   if (rc == SQLITE_OK) {
-    // ignore if there's an error?
-    sqlite3_step(stmt);
+    pNew = sqlite3_malloc(sizeof(*pNew));
+    *ppVtab = (sqlite3_vtab *)pNew;
+    if (pNew == 0)
+      return SQLITE_NOMEM;
+    memset(pNew, 0, sizeof(*pNew));
+    pNew->db = db;
+    pNew->kind = kind;
   }
+  return rc;
+}
 
-  sqlite3_finalize(stmt);
-  tg0Disconnect(pVtab);
+static int tg_randomDisconnect(sqlite3_vtab *pVtab) {
+  sqlite3_free(pVtab);
   return SQLITE_OK;
 }
 
-static int tg0Open(sqlite3_vtab *p, sqlite3_vtab_cursor **ppCursor) {
-  tg0_cursor *pCur;
-  pCur = sqlite3_malloc(sizeof(*pCur));
+static int tg_randomOpen(sqlite3_vtab *p, sqlite3_vtab_cursor **ppCursor) {
+  tg_random_cursor *pCur = sqlite3_malloc(sizeof(*pCur));
   if (pCur == 0)
     return SQLITE_NOMEM;
   memset(pCur, 0, sizeof(*pCur));
+  pCur->kind = ((tg_random_vtab *)p)->kind;
   *ppCursor = &pCur->base;
   return SQLITE_OK;
 }
 
-static int tg0Close(sqlite3_vtab_cursor *cur) {
-  tg0_cursor *pCur = (tg0_cursor *)cur;
-  if (pCur->stmt) {
-    sqlite3_finalize(pCur->stmt);
-  }
-  tg_geom_free(pCur->queryGeom);
-  pCur->queryGeom = NULL;
+static int tg_randomClose(sqlite3_vtab_cursor *cur) {
+  tg_random_cursor *pCur = (tg_random_cursor *)cur;
+  sqlite3_free(pCur->wkb);
   sqlite3_free(pCur);
   return SQLITE_OK;
 }
 
-static int tg0BestIndex(sqlite3_vtab *pVtab, sqlite3_index_info *pIdxInfo) {
-
-  int iPredicateTerm = -1;
-  int predicate = 0;
-
+// idxNum has bit (1 << TG_RANDOM_ARG_*) set for each given argument, which
+// are passed to xFilter in TG_RANDOM_ARG_* order.
+static int tg_randomBestIndex(sqlite3_vtab *pVTab,
+                              sqlite3_index_info *pIdxInfo) {
+  const struct tg_random_kind *kind = ((tg_random_vtab *)pVTab)->kind;
+  int aConstraint[6] = {-1, -1, -1, -1, -1, -1};
   for (int i = 0; i < pIdxInfo->nConstraint; i++) {
-    if (!pIdxInfo->aConstraint[i].usable)
+    const struct sqlite3_index_constraint *pCons = &pIdxInfo->aConstraint[i];
+    if (pCons->iColumn < 1)
       continue;
-
-    int iColumn = pIdxInfo->aConstraint[i].iColumn;
-    int op = pIdxInfo->aConstraint[i].op;
-    if (op == TG0_FUNC_INTERSECTS || op == TG0_FUNC_DISJOINT ||
-        op == TG0_FUNC_CONTAINS || op == TG0_FUNC_WITHIN ||
-        op == TG0_FUNC_COVERS || op == TG0_FUNC_COVEREDBY) {
-      if (iPredicateTerm >= 0) {
-        sqlite3_free(pVtab->zErrMsg);
-        pVtab->zErrMsg = sqlite3_mprintf(
-            "only 1 predicate is allowed on tg0 WHERE clauses.");
-        return SQLITE_ERROR;
-      }
-      iPredicateTerm = i;
-      predicate = op;
-    }
+    if (!pCons->usable || pCons->op != SQLITE_INDEX_CONSTRAINT_EQ)
+      return SQLITE_CONSTRAINT;
+    aConstraint[kind->aArg[pCons->iColumn - 1]] = i;
   }
-  if (iPredicateTerm >= 0) {
-    pIdxInfo->idxStr = (char *)"predicate";
-    pIdxInfo->idxNum = predicate;
-    pIdxInfo->aConstraintUsage[iPredicateTerm].argvIndex = 1;
-    pIdxInfo->aConstraintUsage[iPredicateTerm].omit = 1;
-    pIdxInfo->estimatedCost = 30.0;
-    pIdxInfo->estimatedRows = 10;
-  } else {
-    pIdxInfo->idxStr = (char *)"fullscan";
-    pIdxInfo->estimatedCost = 3000000.0;
-    pIdxInfo->estimatedRows = 100000;
+  if (aConstraint[TG_RANDOM_ARG_N] < 0) {
+    pVTab->zErrMsg = sqlite3_mprintf("n argument is required");
+    return SQLITE_ERROR;
   }
-
+  int argvIndex = 0;
+  pIdxInfo->idxNum = 0;
+  for (int arg = 0; arg < 6; arg++) {
+    int i = aConstraint[arg];
+    if (i < 0)
+      continue;
+    pIdxInfo->aConstraintUsage[i].argvIndex = ++argvIndex;
+    pIdxInfo->aConstraintUsage[i].omit = 1;
+    pIdxInfo->idxNum |= 1 << arg;
+  }
+  pIdxInfo->estimatedCost = (double)100000;
+  pIdxInfo->estimatedRows = 100000;
   return SQLITE_OK;
 }
 
-// forward delcaration bc tg0Filter uses it
-static int tg0Next(sqlite3_vtab_cursor *cur);
-
-static int tg0Filter(sqlite3_vtab_cursor *pVtabCursor, int idxNum,
-                     const char *idxStr, int argc, sqlite3_value **argv) {
-  tg0_cursor *pCur = (tg0_cursor *)pVtabCursor;
-  tg0_vtab *p = (tg0_vtab *)pVtabCursor->pVtab;
-
-  if (pCur->stmt) {
-    sqlite3_finalize(pCur->stmt);
-    pCur->stmt = 0;
-  }
-  if (pCur->queryGeom) {
-    tg_geom_free(pCur->queryGeom);
-    pCur->queryGeom = NULL;
-  }
-
-  if (strcmp(idxStr, "fullscan") == 0) {
-    pCur->plan = FULLSCAN;
-    sqlite3_str *strSqlFullscan = sqlite3_str_new(NULL);
-    sqlite3_str_appendall(strSqlFullscan, "SELECT id, _shape");
-    for (int i = 0; i < p->numAuxColumns; i++) {
-      sqlite3_str_appendf(strSqlFullscan, ", c%d", i + 1);
-    }
-    sqlite3_str_appendf(strSqlFullscan, " FROM \"%w\".\"%w_rtree\"",
-                        p->schemaName, p->tableName);
-
-    const char *zSql = sqlite3_str_finish(strSqlFullscan);
-    if (!zSql) {
-      // TODO what needs to be freed here
-      return SQLITE_NOMEM;
-    }
-    int rc = sqlite3_prepare_v2(p->db, zSql, -1, &pCur->stmt, NULL);
-    sqlite3_free((void *)zSql);
-    if (rc != SQLITE_OK) {
-      sqlite3_free(pVtabCursor->pVtab->zErrMsg);
-      pVtabCursor->pVtab->zErrMsg =
-          sqlite3_mprintf("prep error: %s", sqlite3_errmsg(p->db));
-      return SQLITE_ERROR;
-    }
-    return tg0Next(pVtabCursor);
-  } else if (strcmp(idxStr, "predicate") == 0) {
-    switch (idxNum) {
-    case TG0_FUNC_INTERSECTS: {
-      pCur->plan = INTERSECT;
-
-      char * errmsg;
-      int rc = geomValue(argv[0], &pCur->queryGeom, &errmsg);
-      if (rc != SQLITE_OK) {
-        sqlite3_free(pVtabCursor->pVtab->zErrMsg);
-        pVtabCursor->pVtab->zErrMsg = sqlite3_mprintf("%s", errmsg);
-        sqlite3_free(errmsg);
+static int tg_randomFilter(sqlite3_vtab_cursor *pVtabCursor, int idxNum,
+                           const char *idxStr, int argc,
+                           sqlite3_value **argv) {
+  tg_random_cursor *pCur = (tg_random_cursor *)pVtabCursor;
+  sqlite3_vtab *pVtab = pVtabCursor->pVtab;
+  const struct tg_random_kind *kind = pCur->kind;
+  tg_stats_enter(((tg_random_vtab *)pVtab)->db);
+  pCur->n = 0;
+  pCur->vertices = kind->defaultVertices;
+  pCur->holes = 0;
+  pCur->clusters = 0;
+  pCur->seed = 0;
+  pCur->bbox.min.x = -180;
+  pCur->bbox.min.y = -90;
+  pCur->bbox.max.x = 180;
+  pCur->bbox.max.y = 90;
+
+  int iArg = 0;
+  for (int arg = 0; arg < 6 && iArg < argc; arg++) {
+    if (!(idxNum & (1 << arg)))
+      continue;
+    sqlite3_value *value = argv[iArg++];
+    // NULL keeps the default, to skip over arguments
+    if (arg != TG_RANDOM_ARG_N && sqlite3_value_type(value) == SQLITE_NULL)
+      continue;
+    int isInteger = sqlite3_value_type(value) == SQLITE_INTEGER;
+    sqlite3_int64 i = sqlite3_value_int64(value);
+    switch (arg) {
+    case TG_RANDOM_ARG_N:
+      if (!isInteger || i < 0) {
+        tg_vtab_set_error(pVtab, "n must be a non-negative integer");
         return SQLITE_ERROR;
       }
-      struct tg_rect rect = tg_geom_rect(pCur->queryGeom);
-
-      sqlite3_str *strSqlIntersect = sqlite3_str_new(NULL);
-      sqlite3_str_appendall(strSqlIntersect, "SELECT id, _shape");
-      for (int i = 0; i < p->numAuxColumns; i++) {
-        sqlite3_str_appendf(strSqlIntersect, ", c%d", i + 1);
-      }
-      sqlite3_str_appendf(strSqlIntersect, " FROM \"%w\".\"%w_rtree\" as r ",
-                          p->schemaName, p->tableName);
-      sqlite3_str_appendall(strSqlIntersect, "WHERE r.minX <= ?1  "
-                                             "AND r.maxX >= ?2 "
-                                             "AND r.minY <= ?3 "
-                                             "AND r.maxY >= ?4");
-
-      const char *zSql = sqlite3_str_finish(strSqlIntersect);
-      if (!zSql) {
-        // TODO what needs to be freed here
-        return SQLITE_NOMEM;
+      pCur->n = i;
+      break;
+    case TG_RANDOM_ARG_VERTICES:
+      if (!isInteger || i < kind->minVertices || i > TG_RANDOM_MAX_VERTICES) {
+        tg_vtab_set_error(pVtab, "vertices must be an integer between %d and %d",
+                          kind->minVertices, TG_RANDOM_MAX_VERTICES);
+        return SQLITE_ERROR;
       }
-
-      rc = sqlite3_prepare_v2(p->db, zSql, -1, &pCur->stmt, NULL);
-      sqlite3_free((void *)zSql);
-
+      pCur->vertices = (int)i;
+      break;
+    case TG_RANDOM_ARG_BBOX: {
+      struct tg_geom *geom;
+      char *errmsg;
+      int rc = geomValue(value, &geom, &errmsg);
       if (rc != SQLITE_OK) {
-        sqlite3_free(pVtabCursor->pVtab->zErrMsg);
-        pVtabCursor->pVtab->zErrMsg = sqlite3_mprintf("prep error");
+        tg_vtab_set_error(pVtab, "%s", errmsg);
+        sqlite3_free(errmsg);
+        return SQLITE_ERROR;
+      }
+      int empty = tg_geom_is_empty(geom);
+      pCur->bbox = tg_geom_rect(geom);
+      tg_geom_free(geom);
+      if (empty) {
+        tg_vtab_set_error(pVtab, "bbox must not be empty");
         return SQLITE_ERROR;
       }
-      sqlite3_bind_double(pCur->stmt, 1, rect.max.x);
-      sqlite3_bind_double(pCur->stmt, 2, rect.min.x);
-      sqlite3_bind_double(pCur->stmt, 3, rect.max.y);
-      sqlite3_bind_double(pCur->stmt, 4, rect.min.y);
-      break;
-    }
-    case TG0_FUNC_DISJOINT:
-    case TG0_FUNC_CONTAINS:
-    case TG0_FUNC_WITHIN:
-    case TG0_FUNC_COVERS:
-    case TG0_FUNC_COVEREDBY: {
-      sqlite3_free(pVtabCursor->pVtab->zErrMsg);
-      pVtabCursor->pVtab->zErrMsg =
-          sqlite3_mprintf("The given predicate inside the WHERE clause on tg0 "
-                          "table is not supported yet");
-      return SQLITE_ERROR;
-    }
-    default: {
-      sqlite3_free(pVtabCursor->pVtab->zErrMsg);
-      pVtabCursor->pVtab->zErrMsg = sqlite3_mprintf("unknown query plan");
-      return SQLITE_ERROR;
-    }
-    }
-    return tg0Next(pVtabCursor);
-  } else {
-    sqlite3_free(pVtabCursor->pVtab->zErrMsg);
-    pVtabCursor->pVtab->zErrMsg = sqlite3_mprintf("unknown idxStr");
-    return SQLITE_ERROR;
-  }
-}
-
-static int tg0Rowid(sqlite3_vtab_cursor *cur, sqlite_int64 *pRowid) {
-  tg0_cursor *pCur = (tg0_cursor *)cur;
-  *pRowid = sqlite3_column_int64(pCur->stmt, 0);
-  return SQLITE_OK;
-}
-
-static int tg0Next(sqlite3_vtab_cursor *cur) {
-  tg0_cursor *pCur = (tg0_cursor *)cur;
-  tg0_vtab *p = (tg0_vtab *)cur->pVtab;
-  int stop = 0;
-  while (!stop) {
-    pCur->stepStatus = sqlite3_step(pCur->stmt);
-    if (pCur->stepStatus == SQLITE_DONE) {
       break;
     }
-    if (pCur->stepStatus != SQLITE_ROW) {
-      sqlite3_free(cur->pVtab->zErrMsg);
-      cur->pVtab->zErrMsg =
-          sqlite3_mprintf("tg0Next step error: %d", pCur->stepStatus);
-      return SQLITE_ERROR;
-    }
-
-    switch (pCur->plan) {
-    case FULLSCAN: {
-      stop = 1;
+    case TG_RANDOM_ARG_SEED:
+      if (!isInteger) {
+        tg_vtab_set_error(pVtab, "seed must be an integer");
+        return SQLITE_ERROR;
+      }
+      pCur->seed = (sqlite3_uint64)i;
       break;
-    }
-    case INTERSECT: {
-
-      struct tg_geom *geom;
-      char * errmsg;
-      int rc = geomValue(sqlite3_column_value(pCur->stmt, 1), &geom, &errmsg);
-      if (rc != SQLITE_OK) {
-        sqlite3_free(cur->pVtab->zErrMsg);
-        cur->pVtab->zErrMsg = sqlite3_mprintf("%s", errmsg);
-
-        sqlite3_free(errmsg);
+    case TG_RANDOM_ARG_CLUSTERS:
+      if (!isInteger || i < 0 || i > TG_RANDOM_MAX_CLUSTERS) {
+        tg_vtab_set_error(pVtab, "clusters must be an integer between 0 and %d",
+                          TG_RANDOM_MAX_CLUSTERS);
         return SQLITE_ERROR;
       }
-
-      if (tg_geom_intersects(geom, pCur->queryGeom)) {
-        stop = 1;
-      } else {
-        stop = 0;
+      pCur->clusters = (int)i;
+      break;
+    case TG_RANDOM_ARG_HOLES:
+      if (!isInteger || i < 0 || i > TG_RANDOM_MAX_HOLES) {
+        tg_vtab_set_error(pVtab, "holes must be an integer between 0 and %d",
+                          TG_RANDOM_MAX_HOLES);
+        return SQLITE_ERROR;
       }
-      tg_geom_free(geom);
+      pCur->holes = (int)i;
       break;
     }
-    }
   }
+
+  double area = (pCur->bbox.max.x - pCur->bbox.min.x) *
+                (pCur->bbox.max.y - pCur->bbox.min.y);
+  if (kind->type != TG_RANDOM_POINTS && !(area > 0)) {
+    tg_vtab_set_error(pVtab, "bbox must have a non-zero area");
+    return SQLITE_ERROR;
+  }
+  pCur->radius = pCur->n ? 0.5 * sqrt(area / (double)pCur->n) : 0;
+
+  // room for the largest geometry: every ring of a polygon with holes
+  size_t nWkb = 1 + 4 + 4 +
+                (size_t)(1 + pCur->holes) * (4 + 16 * (pCur->vertices + 1));
+  sqlite3_free(pCur->wkb);
+  pCur->wkb = sqlite3_malloc64(nWkb);
+  if (!pCur->wkb)
+    return SQLITE_NOMEM;
+  pCur->iRowid = 1;
+  pCur->iGenerated = 0;
   return SQLITE_OK;
 }
 
-static int tg0Eof(sqlite3_vtab_cursor *cur) {
-  tg0_cursor *pCur = (tg0_cursor *)cur;
-  return pCur->stepStatus != SQLITE_ROW;
+static int tg_randomNext(sqlite3_vtab_cursor *cur) {
+  tg_random_cursor *pCur = (tg_random_cursor *)cur;
+  pCur->iRowid++;
+  return SQLITE_OK;
 }
 
-static int tg0Column(sqlite3_vtab_cursor *cur, sqlite3_context *context,
-                     int i) {
-  tg0_cursor *pCur = (tg0_cursor *)cur;
-  if (i == TG0_COLUMN_SHAPE) {
-    sqlite3_result_value(context, sqlite3_column_value(pCur->stmt, 1));
-  } else if (i >= TG0_COLUMN_REST) {
-    sqlite3_result_value(
-        context, sqlite3_column_value(pCur->stmt, 2 + i - TG0_COLUMN_REST));
-  }
+static int tg_randomEof(sqlite3_vtab_cursor *cur) {
+  tg_random_cursor *pCur = (tg_random_cursor *)cur;
+  return pCur->iRowid > pCur->n;
+}
 
+static int tg_randomRowid(sqlite3_vtab_cursor *cur, sqlite_int64 *pRowid) {
+  tg_random_cursor *pCur = (tg_random_cursor *)cur;
+  *pRowid = pCur->iRowid;
   return SQLITE_OK;
 }
 
-static int tg0Update(sqlite3_vtab *pVTab, int argc, sqlite3_value **argv,
-                     sqlite_int64 *pRowid) {
-
-  tg0_vtab *p = (tg0_vtab *)pVTab;
-  // DELETE operation
-  if (argc == 1 && sqlite3_value_type(argv[0]) != SQLITE_NULL) {
-    sqlite3_int64 idToDelete = sqlite3_value_int64(argv[0]);
-    sqlite3_stmt *stmt;
-    sqlite3_free(pVTab->zErrMsg);
-    pVTab->zErrMsg = NULL;
-    char *zSql = sqlite3_mprintf(TG0_SQL_DELETE, p->schemaName, p->tableName);
-    int rc = sqlite3_prepare_v2(p->db, zSql, -1, &stmt, NULL);
-    sqlite3_free(zSql);
-    if (rc != SQLITE_OK) {
-      sqlite3_free(pVTab->zErrMsg);
-      pVTab->zErrMsg = sqlite3_mprintf("error preparing delete statement:  %s",
-                                       sqlite3_errmsg(p->db));
-      return SQLITE_ERROR;
-    }
-    sqlite3_bind_int64(stmt, 1, idToDelete);
-    rc = sqlite3_step(stmt);
-    if (rc != SQLITE_DONE) {
-      sqlite3_free(pVTab->zErrMsg);
-      pVTab->zErrMsg = sqlite3_mprintf("error deleting rtree row: %s",
-                                       sqlite3_errmsg(p->db));
-    }
-    sqlite3_finalize(stmt);
+static int tg_randomColumn(sqlite3_vtab_cursor *cur, sqlite3_context *context,
+                           int i) {
+  tg_random_cursor *pCur = (tg_random_cursor *)cur;
+  if (i != TG_RANDOM_GEOMETRY)
     return SQLITE_OK;
-  }
-  // INSERT operations
-  else if (argc > 1 && sqlite3_value_type(argv[0]) == SQLITE_NULL) {
-    // TODO assert argc == 3
+  if (pCur->iGenerated != pCur->iRowid)
+    tg_random_generate(pCur);
+  sqlite3_result_blob(context, pCur->wkb, pCur->nWkb, SQLITE_TRANSIENT);
+  return SQLITE_OK;
+}
 
-    struct tg_geom *geom;
-    char * errmsg;
-    int rc = geomValue(argv[2 + TG0_COLUMN_SHAPE], &geom, &errmsg);
-    if (rc != SQLITE_OK) {
-      sqlite3_free(pVTab->zErrMsg);
-      pVTab->zErrMsg = sqlite3_mprintf("%s", errmsg);
-      sqlite3_free(errmsg);
-      return SQLITE_ERROR;
-    }
-    struct tg_rect rect = tg_geom_rect(geom);
+static sqlite3_module tg_randomModule = {
+    /* iVersion    */ 0,
+    /* xCreate     */ 0,
+    /* xConnect    */ tg_randomConnect,
+    /* xBestIndex  */ tg_randomBestIndex,
+    /* xDisconnect */ tg_randomDisconnect,
+    /* xDestroy    */ 0,
+    /* xOpen       */ tg_randomOpen,
+    /* xClose      */ tg_randomClose,
+    /* xFilter     */ tg_randomFilter,
+    /* xNext       */ tg_randomNext,
+    /* xEof        */ tg_randomEof,
+    /* xColumn     */ tg_randomColumn,
+    /* xRowid      */ tg_randomRowid,
+    /* xUpdate     */ 0,
+    /* xBegin      */ 0,
+    /* xSync       */ 0,
+    /* xCommit     */ 0,
+    /* xRollback   */ 0,
+    /* xFindMethod */ 0,
+    /* xRename     */ 0,
+    /* xSavepoint  */ 0,
+    /* xRelease    */ 0,
+    /* xRollbackTo */ 0,
+    /* xShadowName */ 0};
+#pragma endregion
 
-    sqlite3_stmt *stmt;
-    sqlite3_str *strInsert = sqlite3_str_new(NULL);
-    bool hasRowid = sqlite3_value_type(argv[1]) != SQLITE_NULL;
-    if (hasRowid) {
-      sqlite3_str_appendf(
-          strInsert,
-          "INSERT INTO \"%w\".\"%w_rtree\"(id, minX, maxX, minY, maxY, _shape",
-          p->schemaName, p->tableName);
-    } else {
-      sqlite3_str_appendf(
-          strInsert,
-          "INSERT INTO \"%w\".\"%w_rtree\"(minX, maxX, minY, maxY, _shape",
-          p->schemaName, p->tableName);
-    }
-    for (int i = 0; i < p->numAuxColumns; i++) {
-      sqlite3_str_appendf(strInsert, ", c%d", i + 1);
-    }
-    int paramStart;
-    if (hasRowid) {
-      paramStart = 1;
-    } else {
-      paramStart = 0;
-    }
-    if (hasRowid) {
-      sqlite3_str_appendall(strInsert, ") VALUES (?1, ?2, ?3, ?4, ?5, ?6");
-    } else {
-      sqlite3_str_appendall(strInsert, ") VALUES (?1, ?2, ?3, ?4, ?5");
-    }
-    for (int i = 0; i < p->numAuxColumns; i++) {
-      sqlite3_str_appendf(strInsert, ", ?%d", (6 + paramStart) + i);
-    }
-    sqlite3_str_appendall(strInsert, ")");
+#pragma region tg_stats table
 
-    const char *zSql = sqlite3_str_finish(strInsert);
-    if (!zSql) {
-      // TODO what needs to be freed here
-      return SQLITE_NOMEM;
-    }
-    rc = sqlite3_prepare_v2(p->db, zSql, -1, &stmt, NULL);
-    sqlite3_free((void *)zSql);
+typedef struct tg_stats_vtab tg_stats_vtab;
+struct tg_stats_vtab {
+  sqlite3_vtab base;
+  struct tg_stats *stats;
+};
 
-    if (rc != SQLITE_OK) {
-      sqlite3_free(pVTab->zErrMsg);
-      pVTab->zErrMsg = sqlite3_mprintf(
-          "tgoUpdate Error while preparing rtree insert statement:  %s",
-          sqlite3_errmsg(p->db));
-      tg_geom_free(geom);
-      return rc;
-    }
+typedef struct tg_stats_cursor tg_stats_cursor;
+struct tg_stats_cursor {
+  sqlite3_vtab_cursor base;
+  int iRowid;
+};
 
-    // WKB representation of the inserted geometry
-    // TODO see if the input is already WKB and just use that
-    size_t size = tg_geom_wkb(geom, 0, 0);
-    void *buffer = sqlite3_malloc(size + 1);
-    if (buffer == 0) {
-      tg_geom_free(geom);
+static int tg_statsConnect(sqlite3 *db, void *pAux, int argc,
+                           const char *const *argv, sqlite3_vtab **ppVtab,
+                           char **pzErr) {
+  tg_stats_vtab *pNew;
+#define TG_STATS_NAME 0
+#define TG_STATS_VALUE 1
+  int rc = sqlite3_declare_vtab(db, "CREATE TABLE x(name, value)");
+  if (rc == SQLITE_OK) {
+    pNew = sqlite3_malloc(sizeof(*pNew));
+    *ppVtab = (sqlite3_vtab *)pNew;
+    if (pNew == 0)
       return SQLITE_NOMEM;
-    }
-    tg_geom_wkb(geom, buffer, size + 1);
+    memset(pNew, 0, sizeof(*pNew));
+    pNew->stats = pAux;
+  }
+  return rc;
+}
 
-    if (hasRowid) {
-      rc = sqlite3_bind_int64(stmt, paramStart, sqlite3_value_int64(argv[1]));
-    }
-    rc = sqlite3_bind_double(stmt, paramStart + 1, rect.min.x);
-    rc = sqlite3_bind_double(stmt, paramStart + 2, rect.max.x);
-    rc = sqlite3_bind_double(stmt, paramStart + 3, rect.min.y);
-    rc = sqlite3_bind_double(stmt, paramStart + 4, rect.max.y);
-    rc = sqlite3_bind_blob(stmt, paramStart + 5, buffer, size, sqlite3_free);
-    for (int i = 0; i < p->numAuxColumns; i++) {
-      rc = sqlite3_bind_value(stmt, paramStart + 6 + i,
-                              argv[2 + TG0_COLUMN_REST + i]);
-    }
+static int tg_statsDisconnect(sqlite3_vtab *pVtab) {
+  sqlite3_free(pVtab);
+  return SQLITE_OK;
+}
 
-    rc = sqlite3_step(stmt);
-    if (rc != SQLITE_DONE) {
-      sqlite3_free(pVTab->zErrMsg);
-      pVTab->zErrMsg =
-          sqlite3_mprintf("stepping not done? %s", sqlite3_errmsg(p->db));
-      tg_geom_free(geom);
-      sqlite3_finalize(stmt);
-      return SQLITE_ERROR;
-    }
-    sqlite3_finalize(stmt);
-    tg_geom_free(geom);
-    return SQLITE_OK;
-  }
-  // some sort of UPDATE operation
-  else {
-    sqlite3_free(pVTab->zErrMsg);
-    pVTab->zErrMsg =
-        sqlite3_mprintf("UPDATE operation on tg0 not supported yet.");
-    return SQLITE_ERROR;
-  }
+static int tg_statsOpen(sqlite3_vtab *p, sqlite3_vtab_cursor **ppCursor) {
+  tg_stats_cursor *pCur = sqlite3_malloc(sizeof(*pCur));
+  if (pCur == 0)
+    return SQLITE_NOMEM;
+  memset(pCur, 0, sizeof(*pCur));
+  *ppCursor = &pCur->base;
+  return SQLITE_OK;
 }
 
-static int tg0FindFunction(sqlite3_vtab *pVtab, int nArg, const char *zName,
-                           void (**pxFunc)(sqlite3_context *, int,
-                                           sqlite3_value **),
-                           void **ppArg) {
-  if (sqlite3_stricmp(zName, "tg_intersects") == 0 && nArg == 2) {
-    *pxFunc = tg_predicate_impl;
-    *ppArg = tg_geom_intersects;
-    return TG0_FUNC_INTERSECTS;
-  }
-  if (sqlite3_stricmp(zName, "tg_disjoint") == 0 && nArg == 2) {
-    *pxFunc = tg_predicate_impl;
-    *ppArg = tg_geom_disjoint;
-    return TG0_FUNC_DISJOINT;
-  }
-  if (sqlite3_stricmp(zName, "tg_contains") == 0 && nArg == 2) {
-    *pxFunc = tg_predicate_impl;
-    *ppArg = tg_geom_contains;
-    return TG0_FUNC_CONTAINS;
-  }
-  if (sqlite3_stricmp(zName, "tg_within") == 0 && nArg == 2) {
-    *pxFunc = tg_predicate_impl;
-    *ppArg = tg_geom_within;
-    return TG0_FUNC_WITHIN;
-  }
-  if (sqlite3_stricmp(zName, "tg_covers") == 0 && nArg == 2) {
-    *pxFunc = tg_predicate_impl;
-    *ppArg = tg_geom_covers;
-    return TG0_FUNC_COVERS;
-  }
-  if (sqlite3_stricmp(zName, "tg_coveredby") == 0 && nArg == 2) {
-    *pxFunc = tg_predicate_impl;
-    *ppArg = tg_geom_coveredby;
-    return TG0_FUNC_COVEREDBY;
-  }
-  return 0;
-};
+static int tg_statsClose(sqlite3_vtab_cursor *cur) {
+  sqlite3_free(cur);
+  return SQLITE_OK;
+}
 
-static int tg0ShadowName(const char *zName) {
+static int tg_statsBestIndex(sqlite3_vtab *pVTab,
+                             sqlite3_index_info *pIdxInfo) {
+  pIdxInfo->estimatedCost = (double)TG_STAT_COUNT;
+  pIdxInfo->estimatedRows = TG_STAT_COUNT;
+  return SQLITE_OK;
+}
 
-  static const char *azName[] = {"rtree", "rtree_node", "rtree_parent",
-                                 "rtree_rowid"};
+static int tg_statsFilter(sqlite3_vtab_cursor *pVtabCursor, int idxNum,
+                          const char *idxStr, int argc, sqlite3_value **argv) {
+  ((tg_stats_cursor *)pVtabCursor)->iRowid = 0;
+  return SQLITE_OK;
+}
 
-  for (int i = 0; i < sizeof(azName) / sizeof(azName[0]); i++) {
-    if (sqlite3_stricmp(zName, azName[i]) == 0)
-      return 1;
+static int tg_statsNext(sqlite3_vtab_cursor *cur) {
+  ((tg_stats_cursor *)cur)->iRowid++;
+  return SQLITE_OK;
+}
+
+static int tg_statsEof(sqlite3_vtab_cursor *cur) {
+  return ((tg_stats_cursor *)cur)->iRowid >= TG_STAT_COUNT;
+}
+
+static int tg_statsRowid(sqlite3_vtab_cursor *cur, sqlite_int64 *pRowid) {
+  *pRowid = ((tg_stats_cursor *)cur)->iRowid;
+  return SQLITE_OK;
+}
+
+static int tg_statsColumn(sqlite3_vtab_cursor *cur, sqlite3_context *context,
+                          int i) {
+  tg_stats_cursor *pCur = (tg_stats_cursor *)cur;
+  struct tg_stats *stats = ((tg_stats_vtab *)cur->pVtab)->stats;
+  switch (i) {
+  case TG_STATS_NAME:
+    sqlite3_result_text(context, tgStatNames[pCur->iRowid], -1, SQLITE_STATIC);
+    break;
+  case TG_STATS_VALUE:
+    sqlite3_result_int64(context, stats->a[pCur->iRowid]);
+    break;
   }
-  return 0;
+  return SQLITE_OK;
 }
 
-static sqlite3_module tg0Module = {
-    /* iVersion      */ 3,
-    /* xCreate       */ tg0Create,
-    /* xConnect      */ tg0Connect,
-    /* xBestIndex    */ tg0BestIndex,
-    /* xDisconnect   */ tg0Disconnect,
-    /* xDestroy      */ tg0Destroy,
-    /* xOpen         */ tg0Open,
-    /* xClose        */ tg0Close,
-    /* xFilter       */ tg0Filter,
-    /* xNext         */ tg0Next,
-    /* xEof          */ tg0Eof,
-    /* xColumn       */ tg0Column,
-    /* xRowid        */ tg0Rowid,
-    /* xUpdate       */ tg0Update,
-    /* xBegin        */ 0,
-    /* xSync         */ 0,
-    /* xCommit       */ 0,
-    /* xRollback     */ 0,
-    /* xFindFunction */ tg0FindFunction,
-    /* xRename       */ 0, // TODO
-    /* xSavepoint    */ 0,
-    /* xRelease      */ 0,
-    /* xRollbackTo   */ 0,
-    /* xShadowName   */ tg0ShadowName};
+// DELETE resets counters to 0 (timing is left as-is), and UPDATE of the
+// 'timing' row's value turns the *_ns timers on or off.
+static int tg_statsUpdate(sqlite3_vtab *pVTab, int argc, sqlite3_value **argv,
+                          sqlite_int64 *pRowid) {
+  struct tg_stats *stats = ((tg_stats_vtab *)pVTab)->stats;
+  if (argc == 1) {
+    sqlite3_int64 i = sqlite3_value_int64(argv[0]);
+    if (i >= 0 && i < TG_STAT_COUNT && i != TG_STAT_TIMING) {
+      stats->a[i] = 0;
+    }
+    return SQLITE_OK;
+  }
+  if (sqlite3_value_type(argv[0]) == SQLITE_NULL ||
+      sqlite3_value_int64(argv[0]) != TG_STAT_TIMING ||
+      sqlite3_value_int64(argv[1]) != TG_STAT_TIMING) {
+    sqlite3_free(pVTab->zErrMsg);
+    pVTab->zErrMsg = sqlite3_mprintf(
+        "tg_stats only supports DELETE, and UPDATE of the 'timing' row");
+    return SQLITE_ERROR;
+  }
+  stats->a[TG_STAT_TIMING] = sqlite3_value_int64(argv[2 + TG_STATS_VALUE]) != 0;
+  return SQLITE_OK;
+}
+
+static sqlite3_module tg_statsModule = {
+    /* iVersion    */ 0,
+    /* xCreate     */ 0,
+    /* xConnect    */ tg_statsConnect,
+    /* xBestIndex  */ tg_statsBestIndex,
+    /* xDisconnect */ tg_statsDisconnect,
+    /* xDestroy    */ 0,
+    /* xOpen       */ tg_statsOpen,
+    /* xClose      */ tg_statsClose,
+    /* xFilter     */ tg_statsFilter,
+    /* xNext       */ tg_statsNext,
+    /* xEof        */ tg_statsEof,
+    /* xColumn     */ tg_statsColumn,
+    /* xRowid      */ tg_statsRowid,
+    /* xUpdate     */ tg_statsUpdate,
+    /* xBegin      */ 0,
+    /* xSync       */ 0,
+    /* xCommit     */ 0,
+    /* xRollback   */ 0,
+    /* xFindMethod */ 0,
+    /* xRename     */ 0,
+    /* xSavepoint  */ 0,
+    /* xRelease    */ 0,
+    /* xRollbackTo */ 0,
+    /* xShadowName */ 0};
 #pragma endregion
 
 #pragma region entrypoint
@@ -2103,6 +10322,7 @@ int sqlite3_tg_init(sqlite3 *db, char **pzErrMsg,
   SQLITE_EXTENSION_INIT2(pApi);
 
   (void)pzErrMsg; /* Unused parameter */
+  tg_allocator_install();
 #define DEFAULT_FLAGS (SQLITE_UTF8 | SQLITE_INNOCUOUS | SQLITE_DETERMINISTIC)
 
   const char *debug =
@@ -2129,13 +10349,23 @@ int sqlite3_tg_init(sqlite3 *db, char **pzErrMsg,
       {(char *)"tg_version",        0, tg_version,    NULL,             NULL,         DEFAULT_FLAGS},
 
       // predicates
-      {(char *)"tg_contains",       2, tg_predicate_impl,   tg_geom_contains,   NULL,         DEFAULT_FLAGS},
-      {(char *)"tg_coveredby",      2, tg_predicate_impl,   tg_geom_coveredby,  NULL,         DEFAULT_FLAGS},
-      {(char *)"tg_covers",         2, tg_predicate_impl,   tg_geom_covers,     NULL,         DEFAULT_FLAGS},
-      {(char *)"tg_disjoint",       2, tg_predicate_impl,   tg_geom_disjoint,   NULL,         DEFAULT_FLAGS},
-      {(char *)"tg_intersects",     2, tg_predicate_impl,   tg_geom_intersects, NULL,         DEFAULT_FLAGS},
-      {(char *)"tg_touches",        2, tg_predicate_impl,   tg_geom_touches,    NULL,         DEFAULT_FLAGS},
-      {(char *)"tg_within",         2, tg_predicate_impl,   tg_geom_within,     NULL,         DEFAULT_FLAGS},
+      {(char *)"tg_contains",       2, tg_predicate_impl,   (void *)&predicateContains,     NULL,         DEFAULT_FLAGS},
+      {(char *)"tg_coveredby",      2, tg_predicate_impl,   (void *)&predicateCoveredBy,    NULL,         DEFAULT_FLAGS},
+      {(char *)"tg_covers",         2, tg_predicate_impl,   (void *)&predicateCovers,       NULL,         DEFAULT_FLAGS},
+      {(char *)"tg_disjoint",       2, tg_predicate_impl,   (void *)&predicateDisjoint,     NULL,         DEFAULT_FLAGS},
+      {(char *)"tg_intersects",     2, tg_predicate_impl,   (void *)&predicateIntersects,   NULL,         DEFAULT_FLAGS},
+      {(char *)"tg_touches",        2, tg_predicate_impl,   (void *)&predicateTouches,      NULL,         DEFAULT_FLAGS},
+      {(char *)"tg_within",         2, tg_predicate_impl,   (void *)&predicateWithin,       NULL,         DEFAULT_FLAGS},
+
+      // space-filling curve keys
+      {(char *)"tg_hilbert",        2, tg_curve_impl,       (void *)&curveHilbert,          NULL,         DEFAULT_FLAGS},
+      {(char *)"tg_hilbert",        3, tg_curve_impl,       (void *)&curveHilbert,          NULL,         DEFAULT_FLAGS},
+      {(char *)"tg_hilbert_xy",     3, tg_curve_impl,       (void *)&curveHilbertXY,        NULL,         DEFAULT_FLAGS},
+      {(char *)"tg_hilbert_xy",     4, tg_curve_impl,       (void *)&curveHilbertXY,        NULL,         DEFAULT_FLAGS},
+      {(char *)"tg_zorder",         2, tg_curve_impl,       (void *)&curveZorder,           NULL,         DEFAULT_FLAGS},
+      {(char *)"tg_zorder",         3, tg_curve_impl,       (void *)&curveZorder,           NULL,         DEFAULT_FLAGS},
+      {(char *)"tg_zorder_xy",      3, tg_curve_impl,       (void *)&curveZorderXY,         NULL,         DEFAULT_FLAGS},
+      {(char *)"tg_zorder_xy",      4, tg_curve_impl,       (void *)&curveZorderXY,         NULL,         DEFAULT_FLAGS},
 
       {(char *)"tg_geom",           1, tg_geom,                 NULL,             NULL,         DEFAULT_FLAGS},
       {(char *)"tg_geom",           2, tg_geom,                 NULL,             NULL,         DEFAULT_FLAGS},
@@ -2146,6 +10376,7 @@ int sqlite3_tg_init(sqlite3 *db, char **pzErrMsg,
       {(char *)"tg_valid_geojson",  1, tg_valid_geojson,       NULL,             NULL,         DEFAULT_FLAGS},
       {(char *)"tg_valid_wkb",      1, tg_valid_wkb,           NULL,             NULL,         DEFAULT_FLAGS},
       {(char *)"tg_valid_wkt",      1, tg_valid_wkt,           NULL,             NULL,         DEFAULT_FLAGS},
+      {(char *)"tg_validate",       1, tg_validate,            NULL,             NULL,         DEFAULT_FLAGS | SQLITE_RESULT_SUBTYPE},
 
       //{(char *)"tg_dims",                 1, tg_dims,                 NULL,             NULL,         DEFAULT_FLAGS},
       //{(char *)"tg_is_empty",             1, tg_is_empty,             NULL,             NULL,         DEFAULT_FLAGS},
@@ -2155,6 +10386,8 @@ int sqlite3_tg_init(sqlite3 *db, char **pzErrMsg,
 
       {(char *)"tg_to_wkt",         1, tg_to_wkt,     NULL,             NULL,         DEFAULT_FLAGS},
       {(char *)"tg_to_wkb",         1, tg_to_wkb,     NULL,             NULL,         DEFAULT_FLAGS},
+      {(char *)"tg_to_twkb",        1, tg_to_twkb,    NULL,             NULL,         DEFAULT_FLAGS},
+      {(char *)"tg_to_twkb",        2, tg_to_twkb,    NULL,             NULL,         DEFAULT_FLAGS},
       {(char *)"tg_to_geojson",     1, tg_to_geojson, NULL,             NULL,         DEFAULT_FLAGS | SQLITE_RESULT_SUBTYPE},
 
       {(char *)"tg_multipoint",    -1, tg_multipoint, NULL,             NULL,         DEFAULT_FLAGS},
@@ -2180,24 +10413,28 @@ int sqlite3_tg_init(sqlite3 *db, char **pzErrMsg,
       .xEof = &pointsEachEof,
       .xResult = &pointsEachResult,
       .xFree = &pointsEachFree,
+      .multiType = TG_MULTIPOINT,
   };
   static struct control linesEach = {
       .name = "line",
       .xEof = &linesEachEof,
       .xResult = &linesEachResult,
       .xFree = &linesEachFree,
+      .multiType = TG_MULTILINESTRING,
   };
   static struct control geometriesEach = {
       .name = "geometry",
       .xEof = &geometriesEachEof,
       .xResult = &geometriesEachResult,
       .xFree = &geometriesEachFree,
+      .multiType = TG_GEOMETRYCOLLECTION,
   };
   static struct control polygonsEach = {
       .name = "polygon",
       .xEof = &polygonsEachEof,
       .xResult = &polygonsEachResult,
       .xFree = &polygonsEachFree,
+      .multiType = TG_MULTIPOLYGON,
   };
   
   static struct control holesEach = {
@@ -2205,6 +10442,7 @@ int sqlite3_tg_init(sqlite3 *db, char **pzErrMsg,
       .xEof = &holesEachEof,
       .xResult = &holesEachResult,
       .xFree = &holesEachFree,
+      .xRect = &holesEachRect,
   };
 
   static const struct {
@@ -2264,7 +10502,105 @@ int sqlite3_tg_init(sqlite3 *db, char **pzErrMsg,
     }
   }
 
+  static const struct geojson_write_format geojsonWrite = {
+      .zHeader = "{\"type\":\"FeatureCollection\",\"features\":[\n",
+      .zSeparator = ",\n",
+      .zTerminator = "",
+      .zFooter = "\n]}\n",
+  };
+  static const struct geojson_write_format geojsonseqWrite = {
+      .zHeader = "",
+      .zSeparator = "",
+      .zTerminator = "\n",
+      .zFooter = "",
+  };
+  static const struct {
+    char *zFName;
+    int nArg;
+    const struct geojson_write_format *format;
+  } aWrite[] = {
+      {"tg_write_geojson", 2, &geojsonWrite},
+      {"tg_write_geojson", 3, &geojsonWrite},
+      {"tg_write_geojsonseq", 2, &geojsonseqWrite},
+      {"tg_write_geojsonseq", 3, &geojsonseqWrite},
+  };
+  for (int i = 0; i < sizeof(aWrite) / sizeof(aWrite[0]); i++) {
+    // these write to arbitrary files, so only from top-level SQL
+    rc = sqlite3_create_function_v2(
+        db, aWrite[i].zFName, aWrite[i].nArg, SQLITE_UTF8 | SQLITE_DIRECTONLY,
+        (void *)aWrite[i].format, NULL, tg_write_geojson_step,
+        tg_write_geojson_final, NULL);
+    if (rc != SQLITE_OK) {
+      return rc;
+    }
+  }
+
   rc = sqlite3_create_module(db, "tg_bbox", &tg_bboxModule, NULL);
+  if (rc != SQLITE_OK)
+    return rc;
+  rc = sqlite3_create_module(db, "tg_coords", &tg_coordsModule, NULL);
+  if (rc != SQLITE_OK)
+    return rc;
+  rc = sqlite3_create_module(db, "tg_read_geojson", &tg_read_geojsonModule,
+                             NULL);
+  if (rc != SQLITE_OK)
+    return rc;
+
+  static const struct tg_stream_format geojsonseq = {
+      .xRecord = geojsonseqRecord,
+      .xParse = geojsonseqParse,
+      .hasProperties = 1,
+  };
+  static const struct tg_stream_format wkbStream = {
+      .xRecord = wkbStreamRecord,
+      .xParse = wkbStreamParse,
+  };
+  rc = sqlite3_create_module(db, "tg_read_geojsonseq", &tg_streamModule,
+                             (void *)&geojsonseq);
+  if (rc != SQLITE_OK)
+    return rc;
+  rc = sqlite3_create_module(db, "tg_read_wkb_stream", &tg_streamModule,
+                             (void *)&wkbStream);
+  if (rc != SQLITE_OK)
+    return rc;
+
+  static const struct tg_random_kind randomPoints = {
+      .type = TG_RANDOM_POINTS,
+      .schema = "CREATE TABLE x(geometry, n hidden, bbox hidden, seed hidden, "
+                "clusters hidden)",
+      .aArg = {TG_RANDOM_ARG_N, TG_RANDOM_ARG_BBOX, TG_RANDOM_ARG_SEED,
+               TG_RANDOM_ARG_CLUSTERS},
+      .defaultVertices = 1,
+      .minVertices = 1,
+  };
+  static const struct tg_random_kind randomLines = {
+      .type = TG_RANDOM_LINES,
+      .schema = "CREATE TABLE x(geometry, n hidden, vertices hidden, "
+                "bbox hidden, seed hidden, clusters hidden)",
+      .aArg = {TG_RANDOM_ARG_N, TG_RANDOM_ARG_VERTICES, TG_RANDOM_ARG_BBOX,
+               TG_RANDOM_ARG_SEED, TG_RANDOM_ARG_CLUSTERS},
+      .defaultVertices = 4,
+      .minVertices = 2,
+  };
+  static const struct tg_random_kind randomPolygons = {
+      .type = TG_RANDOM_POLYGONS,
+      .schema = "CREATE TABLE x(geometry, n hidden, vertices hidden, "
+                "bbox hidden, seed hidden, clusters hidden, holes hidden)",
+      .aArg = {TG_RANDOM_ARG_N, TG_RANDOM_ARG_VERTICES, TG_RANDOM_ARG_BBOX,
+               TG_RANDOM_ARG_SEED, TG_RANDOM_ARG_CLUSTERS, TG_RANDOM_ARG_HOLES},
+      .defaultVertices = 8,
+      .minVertices = 3,
+  };
+  rc = sqlite3_create_module(db, "tg_random_points", &tg_randomModule,
+                             (void *)&randomPoints);
+  if (rc != SQLITE_OK)
+    return rc;
+  rc = sqlite3_create_module(db, "tg_random_lines", &tg_randomModule,
+                             (void *)&randomLines);
+  if (rc != SQLITE_OK)
+    return rc;
+  rc = sqlite3_create_module(db, "tg_random_polygons", &tg_randomModule,
+                             (void *)&randomPolygons);
   if (rc != SQLITE_OK)
     return rc;
   rc = sqlite3_create_function_v2(db, "tg_debug", 0, DEFAULT_FLAGS,
@@ -2272,7 +10608,31 @@ int sqlite3_tg_init(sqlite3 *db, char **pzErrMsg,
   if (rc != SQLITE_OK)
     return rc;
 
-  rc = sqlite3_create_module_v2(db, "tg0", &tg0Module, 0, 0);
+  // the connection's counters live as long as anything referencing them
+  struct tg_stats *stats = tg_stats_register(db);
+  if (!stats) {
+    return SQLITE_NOMEM;
+  }
+  rc = sqlite3_create_module_v2(db, "tg_stats", &tg_statsModule,
+                                tg_stats_ref(stats), tg_stats_unref);
+  if (rc != SQLITE_OK) {
+    return rc;
+  }
+
+  rc = sqlite3_create_module_v2(db, "tg0", &tg0Module, tg_stats_ref(stats),
+                                tg_stats_unref);
+  if (rc != SQLITE_OK) {
+    return rc;
+  }
+  rc = sqlite3_create_function_v2(
+      db, "tg0_last_query_stats", 1,
+      SQLITE_UTF8 | SQLITE_INNOCUOUS | SQLITE_RESULT_SUBTYPE,
+      tg_stats_ref(stats), tg0_last_query_stats, NULL, NULL, tg_stats_unref);
+  if (rc != SQLITE_OK) {
+    return rc;
+  }
+  rc = sqlite3_create_module(db, "tg0_parallel_query", &tg0_parallelModule,
+                             NULL);
   if (rc != SQLITE_OK) {
     return rc;
   }
@@ -0,0 +1,514 @@
+#include "sqlite3.h"
+#include "sqlite-tg.h"
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#ifdef __linux__
+#include <linux/perf_event.h>
+#include <signal.h>
+#include <stdint.h>
+#include <sys/ioctl.h>
+#include <sys/ptrace.h>
+#include <sys/syscall.h>
+#include <sys/wait.h>
+#include <unistd.h>
+#endif
+
+// Counts the user-space instructions of fixed workloads over the hot paths
+// (parsing in geomValue(), tg_predicate_impl(), the tg0Next() refine loop,
+// and aggregates) and compares them against the checked-in baseline, failing
+// on any regression beyond the tolerance. Unlike wall-clock benchmarks,
+// counts barely move between runs, so they can gate changes.
+//
+//   dist/test-instructions [baseline] [--update]
+//
+// Two counters are supported, both counting only the thread that runs the
+// workloads:
+//   perf        a perf_event_open() hardware counter, fast but needs a PMU
+//               (not available in most VMs and containers) and a low enough
+//               perf_event_paranoid.
+//   singlestep  a forked copy of the test is traced with ptrace() and
+//               single-stepped through each workload. It needs no hardware
+//               or tools but is slow: a few minutes for all workloads.
+// perf is used when it works and the baseline has perf counts, singlestep
+// otherwise; TG_INSTRUCTIONS_COUNTER=perf|singlestep picks one.
+//
+// The baseline (default tests/instructions.txt) holds one "counter name
+// count" line per workload and counter. Counts depend on the compiler and
+// SQLite, so re-record them with `make test-instructions-update` when the
+// checking machine's toolchain differs from the one noted in the file: a
+// different compiler is a warning, a different SQLite version fails before
+// anything runs, since most workloads spend their instructions in SQLite. A
+// workload without a baseline count fails. The tolerance is 2%, or
+// TG_INSTRUCTIONS_TOLERANCE percent.
+
+#define RUNS 3
+#define MAX_BASELINES 64
+#define TOOLCHAIN_SIZE 256
+
+enum counter_kind { COUNTER_PERF, COUNTER_SINGLESTEP };
+#define N_COUNTERS 2
+static const char *COUNTER_NAMES[N_COUNTERS] = {"perf", "singlestep"};
+
+struct counter {
+  enum counter_kind kind;
+  // the perf_event_open() file descriptor
+  int fd;
+};
+
+struct workload {
+  const char *name;
+  const char *sql;
+};
+
+#define BBOX "'POLYGON((0 0, 100 0, 100 100, 0 100, 0 0))'"
+
+// Sized so that single-stepping all workloads takes minutes, not hours. The
+// tg0 table runs its refine loop on the calling thread only, since neither
+// counter sees the instructions of pool threads.
+static const char *SETUP =
+    "create table points as select rowid as id, geometry "
+    "from tg_random_points(500, " BBOX ", 1);"
+    "create table lines as select rowid as id, geometry "
+    "from tg_random_lines(500, 8, " BBOX ", 2);"
+    "create table polygons as select rowid as id, geometry "
+    "from tg_random_polygons(500, 16, " BBOX ", 3);"
+    "create table shapes(id integer primary key, point, line, poly, wkt, "
+    "geojson);"
+    "insert into shapes select p.id, p.geometry, l.geometry, y.geometry, "
+    "tg_to_wkt(y.geometry), tg_to_geojson(y.geometry) "
+    "from points as p join lines as l using (id) "
+    "join polygons as y using (id);"
+    "create virtual table temp.indexed using tg0(threads=1);"
+    "insert into temp.indexed(rowid, _shape) select id, poly from shapes;";
+
+static const struct workload WORKLOADS[] = {
+    // text parsing costs ~20x more per shape than the rest, so it gets fewer
+    {"parse_wkt", "select count(tg_type(wkt)) from shapes where id <= 50"},
+    {"parse_wkb", "select count(tg_type(poly)) from shapes"},
+    {"parse_geojson",
+     "select count(tg_type(geojson)) from shapes where id <= 50"},
+    {"predicate_intersects_point_polygon",
+     "select sum(tg_intersects(point, poly)) from shapes"},
+    {"predicate_contains_polygon_line",
+     "select sum(tg_contains(poly, line)) from shapes"},
+    {"predicate_touches_polygon_polygon",
+     "select sum(tg_touches(a.poly, b.poly)) "
+     "from shapes as a join shapes as b on b.id = a.id + 1"},
+    {"tg0_refine_window",
+     "select count(*) from temp.indexed "
+     "where tg_intersects(_shape, "
+     "'POLYGON((20 20, 60 20, 60 60, 20 60, 20 20))')"},
+    {"tg0_refine_point",
+     "select count(*) from temp.indexed "
+     "where tg_intersects(_shape, 'POINT(50 50)')"},
+    {"aggregate_multipoint",
+     "select length(tg_to_wkb(tg_group_multipoint(point))) from shapes"},
+    {"aggregate_multipolygon",
+     "select length(tg_to_wkb(tg_group_multipolygon(poly))) from shapes"},
+    {"aggregate_bbox", "select tg_to_wkt(tg_group_bbox(poly)) from shapes"},
+};
+
+#define N_WORKLOADS (int)(sizeof(WORKLOADS) / sizeof(WORKLOADS[0]))
+
+// Returns a disabled user-space instruction counter, or -1 with *pzReason set.
+static int perf_open(const char **pzReason) {
+#ifdef __linux__
+  struct perf_event_attr attr;
+  memset(&attr, 0, sizeof(attr));
+  attr.type = PERF_TYPE_HARDWARE;
+  attr.size = sizeof(attr);
+  attr.config = PERF_COUNT_HW_INSTRUCTIONS;
+  attr.disabled = 1;
+  attr.exclude_kernel = 1;
+  attr.exclude_hv = 1;
+  int fd = (int)syscall(SYS_perf_event_open, &attr, 0, -1, -1, 0);
+  if (fd < 0) {
+    *pzReason = strerror(errno);
+  }
+  return fd;
+#else
+  *pzReason = "perf_event_open() is only available on Linux";
+  return -1;
+#endif
+}
+
+// Instructions spent stepping sql to completion, the fewest of RUNS runs, or
+// -1 on error. When single-stepping, the workload is bracketed by SIGUSR1 and
+// SIGUSR2 for the tracer, which does the counting, and 0 is returned.
+static sqlite3_int64 count_instructions(const struct counter *counter,
+                                        sqlite3 *db, const char *sql) {
+  sqlite3_int64 best = -1;
+#ifdef __linux__
+  sqlite3_stmt *stmt;
+  if (sqlite3_prepare_v2(db, sql, -1, &stmt, NULL) != SQLITE_OK) {
+    fprintf(stderr, "❌ [%s] failed: %s\n", sql, sqlite3_errmsg(db));
+    return -1;
+  }
+  int perf = counter->kind == COUNTER_PERF;
+  for (int run = 0; run < (perf ? RUNS : 1); run++) {
+    int rc;
+    long long count = 0;
+    if (perf) {
+      ioctl(counter->fd, PERF_EVENT_IOC_RESET, 0);
+      ioctl(counter->fd, PERF_EVENT_IOC_ENABLE, 0);
+    } else {
+      raise(SIGUSR1);
+    }
+    while ((rc = sqlite3_step(stmt)) == SQLITE_ROW) {
+    }
+    if (perf) {
+      ioctl(counter->fd, PERF_EVENT_IOC_DISABLE, 0);
+    } else {
+      raise(SIGUSR2);
+    }
+    sqlite3_reset(stmt);
+    if (rc != SQLITE_DONE ||
+        (perf && read(counter->fd, &count, sizeof(count)) != sizeof(count))) {
+      fprintf(stderr, "❌ [%s] failed: %s\n", sql, sqlite3_errmsg(db));
+      best = -1;
+      break;
+    }
+    if (best < 0 || count < best) {
+      best = count;
+    }
+  }
+  sqlite3_finalize(stmt);
+#endif
+  return best;
+}
+
+// Sets up the database and counts every workload into aCount. Returns the
+// number of workloads that failed, or -1 if the setup did.
+static int run_workloads(const struct counter *counter,
+                         sqlite3_int64 *aCount) {
+  sqlite3 *db = NULL;
+  int rc = sqlite3_auto_extension((void (*)())sqlite3_tg_init);
+  if (rc == SQLITE_OK) {
+    rc = sqlite3_open(":memory:", &db);
+  }
+  if (rc == SQLITE_OK) {
+    rc = sqlite3_exec(db, SETUP, NULL, NULL, NULL);
+  }
+  if (rc != SQLITE_OK) {
+    fprintf(stderr, "❌ setup failed: %s\n", db ? sqlite3_errmsg(db) : "");
+    sqlite3_close(db);
+    return -1;
+  }
+  int failures = 0;
+  for (int i = 0; i < N_WORKLOADS; i++) {
+    aCount[i] = count_instructions(counter, db, WORKLOADS[i].sql);
+    failures += aCount[i] < 0;
+  }
+  sqlite3_close(db);
+  return failures;
+}
+
+// Runs the workloads in a forked child that this process single-steps
+// between the child's SIGUSR1 and SIGUSR2, counting one instruction per step.
+// Threads the child starts are not traced. Returns 0, or -1 if any workload
+// failed.
+static int singlestep_workloads(sqlite3_int64 *aCount) {
+#ifdef __linux__
+  fflush(stdout);
+  fflush(stderr);
+  pid_t pid = fork();
+  if (pid < 0) {
+    fprintf(stderr, "❌ fork failed: %s\n", strerror(errno));
+    return -1;
+  }
+  if (pid == 0) {
+    if (ptrace(PTRACE_TRACEME, 0, NULL, NULL) != 0) {
+      fprintf(stderr, "❌ ptrace failed: %s\n", strerror(errno));
+      _exit(1);
+    }
+    raise(SIGSTOP);
+    struct counter counter = {COUNTER_SINGLESTEP, -1};
+    sqlite3_int64 aIgnored[N_WORKLOADS];
+    int failures = run_workloads(&counter, aIgnored);
+    _exit(failures != 0);
+  }
+
+  // -1 between workloads
+  sqlite3_int64 steps = -1;
+  int i = 0;
+  int status;
+  for (int j = 0; j < N_WORKLOADS; j++) {
+    aCount[j] = -1;
+  }
+  while (waitpid(pid, &status, 0) == pid && WIFSTOPPED(status)) {
+    int sig = WSTOPSIG(status);
+    int request = steps < 0 ? PTRACE_CONT : PTRACE_SINGLESTEP;
+    if (sig == SIGUSR1 && steps < 0) {
+      steps = 0;
+      request = PTRACE_SINGLESTEP;
+      sig = 0;
+    } else if (sig == SIGUSR2 && steps >= 0) {
+      // only workloads that ran to completion reach their SIGUSR2
+      if (i < N_WORKLOADS) {
+        aCount[i] = steps;
+      }
+      i++;
+      steps = -1;
+      request = PTRACE_CONT;
+      sig = 0;
+    } else if (sig == SIGTRAP && steps >= 0) {
+      steps++;
+      sig = 0;
+    } else if (sig == SIGSTOP) {
+      sig = 0;
+    }
+    if (ptrace(request, pid, NULL, (void *)(intptr_t)sig) != 0) {
+      fprintf(stderr, "❌ ptrace failed: %s\n", strerror(errno));
+      kill(pid, SIGKILL);
+      waitpid(pid, &status, 0);
+      return -1;
+    }
+  }
+  // the child reports its own errors, and a workload that fails to prepare
+  // never signals, which would shift the counts of the rest
+  if (!WIFEXITED(status) || WEXITSTATUS(status) != 0 || i != N_WORKLOADS) {
+    fprintf(stderr, "❌ single-stepped workloads failed\n");
+    return -1;
+  }
+  return 0;
+#else
+  (void)aCount;
+  fprintf(stderr, "❌ single-stepping is only supported on Linux\n");
+  return -1;
+#endif
+}
+
+struct baseline {
+  char counter[16];
+  char name[128];
+  sqlite3_int64 count;
+};
+
+// Reads the baseline's counts, and into aToolchain the toolchain each
+// counter's counts were recorded with (empty if not noted).
+static int read_baselines(const char *path, struct baseline *aBaseline,
+                          char aToolchain[N_COUNTERS][TOOLCHAIN_SIZE]) {
+  FILE *f = fopen(path, "r");
+  int n = 0;
+  char line[256];
+  for (int k = 0; k < N_COUNTERS; k++) {
+    aToolchain[k][0] = '\0';
+  }
+  if (!f) {
+    return 0;
+  }
+  while (n < MAX_BASELINES && fgets(line, sizeof(line), f)) {
+    if (line[0] == '#') {
+      for (int k = 0; k < N_COUNTERS; k++) {
+        size_t nName = strlen(COUNTER_NAMES[k]);
+        if (strncmp(line + 2, COUNTER_NAMES[k], nName) == 0 &&
+            strncmp(line + 2 + nName, ": ", 2) == 0) {
+          snprintf(aToolchain[k], TOOLCHAIN_SIZE, "%s", line + 4 + nName);
+          aToolchain[k][strcspn(aToolchain[k], "\n")] = '\0';
+        }
+      }
+      continue;
+    }
+    if (sscanf(line, "%15s %127s %lld", aBaseline[n].counter,
+               aBaseline[n].name, &aBaseline[n].count) == 3) {
+      n++;
+    }
+  }
+  fclose(f);
+  return n;
+}
+
+// Rewrites the baseline with aCount as the counts of counter kind, recorded
+// with aToolchain[kind], keeping the counts of the other counter.
+static int write_baselines(const char *path, enum counter_kind kind,
+                           char aToolchain[N_COUNTERS][TOOLCHAIN_SIZE],
+                           const sqlite3_int64 *aCount,
+                           const struct baseline *aBaseline, int nBaseline) {
+  FILE *f = fopen(path, "w");
+  if (!f) {
+    fprintf(stderr, "❌ cannot write %s: %s\n", path, strerror(errno));
+    return 1;
+  }
+  fprintf(f, "# Instruction counts of tests/test-instructions.c workloads, as\n"
+             "# \"counter workload count\" lines, and the toolchain each\n"
+             "# counter's counts were recorded with.\n"
+             "# Regenerate with `make test-instructions-update`.\n");
+  for (int k = 0; k < N_COUNTERS; k++) {
+    if (aToolchain[k][0]) {
+      fprintf(f, "# %s: %s\n", COUNTER_NAMES[k], aToolchain[k]);
+    }
+  }
+  for (int k = 0; k < N_COUNTERS; k++) {
+    if (k == (int)kind) {
+      for (int i = 0; i < N_WORKLOADS; i++) {
+        fprintf(f, "%s %s %lld\n", COUNTER_NAMES[k], WORKLOADS[i].name,
+                aCount[i]);
+      }
+      continue;
+    }
+    for (int i = 0; i < nBaseline; i++) {
+      if (strcmp(aBaseline[i].counter, COUNTER_NAMES[k]) == 0) {
+        fprintf(f, "%s %s %lld\n", aBaseline[i].counter, aBaseline[i].name,
+                aBaseline[i].count);
+      }
+    }
+  }
+  fclose(f);
+  return 0;
+}
+
+int main(int argc, char *argv[]) {
+  const char *path = "tests/instructions.txt";
+  int update = 0;
+  for (int i = 1; i < argc; i++) {
+    if (strcmp(argv[i], "--update") == 0) {
+      update = 1;
+    } else {
+      path = argv[i];
+    }
+  }
+  const char *zTolerance = getenv("TG_INSTRUCTIONS_TOLERANCE");
+  double tolerance = zTolerance ? atof(zTolerance) : 2.0;
+  const char *zCounter = getenv("TG_INSTRUCTIONS_COUNTER");
+  if (zCounter && strcmp(zCounter, COUNTER_NAMES[COUNTER_PERF]) != 0 &&
+      strcmp(zCounter, COUNTER_NAMES[COUNTER_SINGLESTEP]) != 0) {
+    fprintf(stderr, "❌ TG_INSTRUCTIONS_COUNTER must be perf or singlestep\n");
+    return 1;
+  }
+
+  char zToolchain[TOOLCHAIN_SIZE];
+  snprintf(zToolchain, sizeof(zToolchain), "SQLite %s, %s",
+           sqlite3_libversion(),
+#if defined(__clang__)
+           "clang " __clang_version__
+#elif defined(__GNUC__)
+           "gcc " __VERSION__
+#else
+           "unknown compiler"
+#endif
+  );
+
+  struct baseline aBaseline[MAX_BASELINES];
+  char aToolchain[N_COUNTERS][TOOLCHAIN_SIZE];
+  int nBaseline = read_baselines(path, aBaseline, aToolchain);
+  int hasPerf = 0;
+  for (int i = 0; i < nBaseline; i++) {
+    hasPerf |= strcmp(aBaseline[i].counter, COUNTER_NAMES[COUNTER_PERF]) == 0;
+  }
+
+  struct counter counter = {COUNTER_SINGLESTEP, -1};
+  if (!zCounter || strcmp(zCounter, COUNTER_NAMES[COUNTER_PERF]) == 0) {
+    const char *reason = NULL;
+    int fd = perf_open(&reason);
+    if (fd >= 0 && (zCounter || update || hasPerf)) {
+      counter.kind = COUNTER_PERF;
+      counter.fd = fd;
+    } else if (fd >= 0) {
+#ifdef __linux__
+      close(fd);
+#endif
+    } else if (zCounter) {
+      fprintf(stderr, "❌ no perf instruction counter: %s\n", reason);
+      return 1;
+    } else {
+      printf("   no perf instruction counter (%s), single-stepping\n",
+             reason);
+    }
+  }
+  const char *zName = COUNTER_NAMES[counter.kind];
+  const char *zRecorded = aToolchain[counter.kind];
+  // the toolchain starts with "SQLite <version>, "
+  size_t nSqlite = strcspn(zToolchain, ",");
+  if (!update && zRecorded[0] &&
+      (strncmp(zRecorded, zToolchain, nSqlite) != 0 ||
+       zRecorded[nSqlite] != ',')) {
+    fprintf(stderr,
+            "❌ test-instructions: %s counts in %s were recorded with %s, this "
+            "is %s. Re-record them with `make test-instructions-update`\n",
+            zName, path, zRecorded, zToolchain);
+#ifdef __linux__
+    if (counter.fd >= 0) {
+      close(counter.fd);
+    }
+#endif
+    return 1;
+  }
+
+  sqlite3_int64 aCount[N_WORKLOADS];
+  int failures = counter.kind == COUNTER_PERF
+                     ? run_workloads(&counter, aCount)
+                     : singlestep_workloads(aCount);
+#ifdef __linux__
+  if (counter.fd >= 0) {
+    close(counter.fd);
+  }
+#endif
+  if (failures < 0) {
+    return 1;
+  }
+  if (!update && zRecorded[0] && strcmp(zRecorded, zToolchain) != 0) {
+    printf("⚠️ %s counts in %s were recorded with %s, this is %s\n", zName,
+           path, zRecorded, zToolchain);
+  }
+
+  int missing = 0;
+  for (int i = 0; i < N_WORKLOADS; i++) {
+    if (aCount[i] < 0) {
+      printf("❌ %-40s failed\n", WORKLOADS[i].name);
+      continue;
+    }
+    const struct baseline *baseline = NULL;
+    for (int j = 0; j < nBaseline; j++) {
+      if (strcmp(aBaseline[j].counter, zName) == 0 &&
+          strcmp(aBaseline[j].name, WORKLOADS[i].name) == 0 &&
+          aBaseline[j].count > 0) {
+        baseline = &aBaseline[j];
+      }
+    }
+    if (update) {
+      printf("   %-40s %14lld\n", WORKLOADS[i].name, aCount[i]);
+      continue;
+    }
+    if (!baseline) {
+      printf("❌ %-40s %14lld  (no %s baseline)\n", WORKLOADS[i].name,
+             aCount[i], zName);
+      missing++;
+      continue;
+    }
+    double delta = 100.0 * (double)(aCount[i] - baseline->count) /
+                   (double)baseline->count;
+    int regressed = delta > tolerance;
+    printf("%s %-40s %14lld %+7.2f%%%s\n", regressed ? "❌" : "  ",
+           WORKLOADS[i].name, aCount[i], delta,
+           delta < -tolerance ? "  (faster, update the baseline)" : "");
+    failures += regressed;
+  }
+
+  if (update && !failures) {
+    snprintf(aToolchain[counter.kind], TOOLCHAIN_SIZE, "%s", zToolchain);
+    return write_baselines(path, counter.kind, aToolchain, aCount, aBaseline,
+                           nBaseline);
+  }
+  if (failures) {
+    fprintf(stderr,
+            "❌ test-instructions: %d workloads regressed more than %.1f%% "
+            "or failed\n",
+            failures, tolerance);
+  }
+  if (missing) {
+    fprintf(stderr,
+            "❌ test-instructions: %d workloads have no %s count in %s, "
+            "record them with `make test-instructions-update`\n",
+            missing, zName, path);
+  }
+  if (failures || missing) {
+    return 1;
+  }
+  printf("✅ test-instructions: all workloads within %.1f%% of the %s counts "
+         "in %s\n",
+         tolerance, zName, path);
+  return 0;
+}
@@ -11,6 +11,7 @@
 import re
 import sqlite3
 import json
+import struct
 import unittest
 from pathlib import Path
 import inspect
@@ -62,6 +63,7 @@ def spread_args(args):
 
 
 FUNCTIONS = [
+    "tg0_last_query_stats",
     "tg_contains",
     "tg_coveredby",
     "tg_covers",
@@ -77,12 +79,18 @@ FUNCTIONS = [
     "tg_group_multilinestring",
     "tg_group_multipoint",
     "tg_group_multipolygon",
+    "tg_hilbert",
+    "tg_hilbert",
+    "tg_hilbert_xy",
+    "tg_hilbert_xy",
     "tg_intersects",
     "tg_line",
     "tg_multipoint",
     "tg_point",
     "tg_poly_exterior",
     "tg_to_geojson",
+    "tg_to_twkb",
+    "tg_to_twkb",
     "tg_to_wkb",
     "tg_to_wkt",
     "tg_touches",
@@ -90,20 +98,38 @@ FUNCTIONS = [
     "tg_valid_geojson",
     "tg_valid_wkb",
     "tg_valid_wkt",
+    "tg_validate",
     "tg_version",
     "tg_within",
+    "tg_write_geojson",
+    "tg_write_geojson",
+    "tg_write_geojsonseq",
+    "tg_write_geojsonseq",
+    "tg_zorder",
+    "tg_zorder",
+    "tg_zorder_xy",
+    "tg_zorder_xy",
 ]
 
 
 MODULES = [
     "tg0",
+    "tg0_parallel_query",
     "tg_bbox",
+    "tg_coords",
     "tg_each",
     "tg_geometries_each",
     "tg_holes_each",
     "tg_lines_each",
     "tg_points_each",
     "tg_polygons_each",
+    "tg_random_lines",
+    "tg_random_points",
+    "tg_random_polygons",
+    "tg_read_geojson",
+    "tg_read_geojsonseq",
+    "tg_read_wkb_stream",
+    "tg_stats",
 ]
 
 SUPPORTS_SUBTYPE = sqlite3.version_info[1] > 38
@@ -208,6 +234,54 @@ def test_tg_to_wkb(snapshot):
     # TODO more tests
 
 
+def test_tg_to_twkb():
+    tg_to_twkb = lambda *args: db.execute(
+        f"select tg_to_twkb({', '.join('?' * len(args))})", args
+    ).fetchone()[0]
+    tg_to_wkt = lambda *args: db.execute("select tg_to_wkt(?)", args).fetchone()[0]
+
+    # the examples of the TWKB specification
+    assert tg_to_twkb("POINT(1 1)", 0) == bytes.fromhex("01000202")
+    assert tg_to_twkb("LINESTRING(1 1, 5 5)", 0) == bytes.fromhex("02000202020808")
+
+    for wkt in [
+        "POINT(1.5 -2.25)",
+        "POINT(1 2 3 4)",
+        "POINT M(1 2 4)",
+        "POINT EMPTY",
+        "LINESTRING(0 0,1.1234567 2,-3 4)",
+        "LINESTRING(0 0 1,1 1 2)",
+        "POLYGON((0 0,10 0,10 10,0 10,0 0),(1 1,2 1,2 2,1 1))",
+        "MULTIPOINT(1 2,3 4)",
+        "MULTILINESTRING((0 0,1 1),(2 2,3 3,4 4))",
+        "MULTIPOLYGON(((0 0 1,1 0 2,1 1 3,0 0 1)),((5 5 1,6 5 1,6 6 1,5 5 1)))",
+        "GEOMETRYCOLLECTION(POINT(1 2),LINESTRING(0 0 1,1 1 1),MULTIPOINT EMPTY)",
+        "GEOMETRYCOLLECTION EMPTY",
+    ]:
+        twkb = tg_to_twkb(wkt)
+        assert tg_to_wkt(twkb) == wkt
+        assert len(twkb) < len(db.execute("select tg_to_wkb(?)", [wkt]).fetchone()[0])
+
+    # coordinates are rounded to the precision, negative ones to tens
+    assert tg_to_wkt(tg_to_twkb("POINT(-122.4075 37.787994)", 4)) == "POINT(-122.4075 37.788)"
+    assert tg_to_wkt(tg_to_twkb("POINT(123.456 -7.891)", -1)) == "POINT(120 -10)"
+    # TWKB with a bounding box, size, and id list, as written by other tools
+    assert (
+        tg_to_wkt(bytes.fromhex("04070b0204040402010202040404"))
+        == "MULTIPOINT(1 2,3 4)"
+    )
+
+    with pytest.raises(sqlite3.OperationalError, match="precision must be an integer between -8 and 7"):
+        tg_to_twkb("POINT(1 1)", 8)
+    with pytest.raises(sqlite3.OperationalError, match="precision must be an integer between -8 and 7"):
+        tg_to_twkb("POINT(1 1)", "x")
+    with pytest.raises(sqlite3.OperationalError, match="coordinate out of range"):
+        tg_to_twkb("POINT(1e300 1)")
+    # truncated TWKB reports the error of the blob read as WKB
+    with pytest.raises(sqlite3.OperationalError, match="ParseError"):
+        tg_to_wkt(bytes.fromhex("020002020208"))
+
+
 def test_tg_extra_json():
     tg_extra_json = lambda *args: db.execute(
         "select tg_extra_json(?)", args
@@ -250,6 +324,12 @@ def test_tg_valid_wkb():
     assert tg_valid_wkb(shapely.to_wkb(LINE_A)) == 1
     assert tg_valid_wkb(shapely.to_wkt(LINE_A)) == 0
 
+    # a count whose byte size wraps around 32 bits, which tg once read past
+    overflow = struct.pack("<BII", 1, 2, 0x10000002) + bytes(32)
+    assert tg_valid_wkb(overflow) == 0
+    with pytest.raises(sqlite3.OperationalError, match="invalid binary"):
+        db.execute("select tg_to_wkt(?)", [overflow]).fetchone()
+
 
 def test_tg_valid_wkt():
     tg_valid_wkt = lambda *args: db.execute("select tg_valid_wkt(?)", args).fetchone()[
@@ -259,6 +339,86 @@ def test_tg_valid_wkt():
     assert tg_valid_wkt(shapely.to_wkb(LINE_A)) == 0
 
 
+def test_tg_validate():
+    tg_validate = lambda *args: db.execute("select tg_validate(?)", args).fetchone()[0]
+    reason = lambda *args: tuple(
+        db.execute(
+            "select tg_validate(?) ->> 'reason', tg_validate(?) ->> 'offset'",
+            args + args,
+        ).fetchone()
+    )
+
+    assert tg_validate("POINT(1 2)") is None
+    assert tg_validate('{"type":"Point","coordinates":[1,2]}') is None
+    assert tg_validate(bytes.fromhex("0101000000000000000000f03f0000000000000040")) is None
+
+    assert reason("POLYGON((0 0,1 0,1 1,0 1))") == (
+        "rings must have matching first and last positions",
+        21,
+    )
+    assert reason("LINESTRING(1 2)") == ("lines must have two or more positions", 11)
+    assert reason("POINT(1 x)") == ("invalid number", 8)
+    assert reason('{"type":"Point","coordinates":[1,"2"]}') == (
+        "'coordinates' must only contain numbers",
+        33,
+    )
+    assert reason('{"type":"Point",') == ("invalid json", 16)
+    assert reason(
+        '{"type":"Feature","geometry":{"type":"Feature","geometry":null}}'
+    ) == (
+        "'geometry' must only contain an object with the 'type' of Point, "
+        "LineString, Polygon, MultiPoint, MultiLineString, MultiPolygon, or "
+        "GeometryCollection",
+        29,
+    )
+    # truncated after the point count of a linestring
+    assert reason(bytes.fromhex("010200000002000000")) == ("invalid binary", 9)
+    # (without the trailing byte this is also a valid TWKB point)
+    assert reason(bytes.fromhex("0108000000ff")) == ("invalid type", 0)
+    # a MultiPoint holding a LineString
+    assert reason(
+        bytes.fromhex(
+            "010400000001000000010200000002000000"
+            "0000000000000000000000000000000000000000000000000000f03f000000000000f03f"
+        )
+    ) == ("invalid child type", 9)
+    # TWKB, as parseBlob() tells it apart from WKB
+    assert db.execute("select tg_validate(tg_to_twkb('POINT(1 2)'))").fetchone()[0] is None
+    assert db.execute(
+        "select tg_validate(tg_to_twkb('GEOMETRYCOLLECTION(POINT Z(1 2 3),POLYGON((0 0,1 0,1 1,0 0)))', 2))"
+    ).fetchone()[0] is None
+    assert reason(bytes.fromhex("02000502")) == ("count exceeds the input", 2)
+    assert reason(bytes.fromhex("020001020400")) == ("trailing bytes", 5)
+    assert reason(bytes.fromhex("0f00")) == ("invalid geometry type", 0)
+    assert reason(bytes.fromhex("030000")) == ("polygon has no rings", 2)
+    assert reason(bytes.fromhex("010002ff")) == ("invalid binary", 1)
+    assert reason(1) == (
+        "invalid geometry input. Must be WKT (as text), WKB (as blob), or "
+        "GeoJSON (as text).",
+        None,
+    )
+
+    # the scanners agree with tg's parsers
+    for wkt in [
+        "POINT EMPTY",
+        "POINT Z (1 2 3)",
+        "MULTIPOINT ((1 2),(3 4))",
+        "MULTIPOINT (1 2, (3 4))",
+        "GEOMETRYCOLLECTION ()",
+        "GEOMETRYCOLLECTION (POINT (1 2),)",
+        "POLYGON ((0 0, 1 0, 1 1, 0 0), (0 0))",
+        "MULTILINESTRING ()",
+    ]:
+        valid = db.execute("select tg_valid_wkt(?)", [wkt]).fetchone()[0]
+        parses = True
+        try:
+            db.execute("select tg_geom(?)", [wkt]).fetchone()
+        except sqlite3.OperationalError:
+            parses = False
+        assert valid == parses, wkt
+        assert (tg_validate(wkt) is None) == parses, wkt
+
+
 def test_tg_geometries_each(snapshot):
     tg_geometries_each = lambda *args: execute_all(
         db, "select rowid, * from tg_geometries_each(?)", args
@@ -321,6 +481,472 @@ def test_tg_bbox():
         tg_tg_bbox()
 
 
+def test_each_bbox():
+    # 100 unit squares along the diagonal, enough for tg to index the children
+    squares = ", ".join(
+        f"(({i} {i}, {i + 1} {i}, {i + 1} {i + 1}, {i} {i + 1}, {i} {i}))"
+        for i in range(100)
+    )
+    multipolygon = f"MULTIPOLYGON ({squares})"
+    each = lambda sql, *args: list(map(tuple, db.execute(sql, args).fetchall()))
+    assert each(
+        "select rowid, tg_to_wkt(polygon) from tg_polygons_each(?, ?)",
+        multipolygon,
+        "POLYGON ((40.5 40.5, 42.5 40.5, 42.5 42.5, 40.5 42.5, 40.5 40.5))",
+    ) == [
+        (40, "POLYGON((40 40,41 40,41 41,40 41,40 40))"),
+        (41, "POLYGON((41 41,42 41,42 42,41 42,41 41))"),
+        (42, "POLYGON((42 42,43 42,43 43,42 43,42 42))"),
+    ]
+    assert each(
+        "select rowid from tg_polygons_each(?, ?)", multipolygon, "POINT (-5 -5)"
+    ) == []
+    # NULL bbox means no filtering
+    assert each(
+        "select count(*) from tg_polygons_each(?, ?)", multipolygon, None
+    ) == [(100,)]
+    assert each(
+        "select rowid from tg_points_each(?, ?)",
+        "MULTIPOINT (0 0, 5 5, 10 10, 6 6)",
+        "POLYGON ((4 4, 7 4, 7 7, 4 7, 4 4))",
+    ) == [(1,), (3,)]
+    assert each(
+        "select rowid from tg_geometries_each(?, ?)",
+        "GEOMETRYCOLLECTION (POINT (0 0), LINESTRING (5 5, 6 6), POINT (9 9))",
+        "POINT (5.5 5.5)",
+    ) == [(1,)]
+    assert each(
+        "select rowid from tg_holes_each(?, ?)",
+        "POLYGON ((0 0, 10 0, 10 10, 0 10, 0 0), (1 1, 2 1, 2 2, 1 1), (7 7, 8 7, 8 8, 7 7))",
+        "POINT (7.5 7.5)",
+    ) == [(1,)]
+    with pytest.raises(sqlite3.OperationalError):
+        each("select * from tg_polygons_each(?, ?)", multipolygon, "nope")
+
+
+def test_tg_each_arrow():
+    features = """{"type":"FeatureCollection","features":[
+      {"type":"Feature","id":7,"geometry":{"type":"Point","coordinates":[1,2]},"properties":{"name":"a","pop":3}},
+      {"type":"Feature","geometry":{"type":"Point","coordinates":[3,4]},"properties":{"name":"b","pop":5}},
+      {"type":"Feature","geometry":{"type":"Point","coordinates":[5,6]}}
+    ]}"""
+    assert list(
+        map(
+            tuple,
+            db.execute(
+                """
+                  select
+                    rowid,
+                    geometry ->> '$.properties.name',
+                    geometry ->> '$.properties.pop',
+                    geometry ->> '$.id'
+                  from tg_each(?)
+                """,
+                [features],
+            ).fetchall(),
+        )
+    ) == [(0, "a", 3, 7), (1, "b", 5, None), (2, None, None, None)]
+    # features whose extra JSON has the same length aren't mixed up by the
+    # memo
+    same = """{"type":"FeatureCollection","features":[
+      {"type":"Feature","geometry":{"type":"Point","coordinates":[1,2]},"properties":{"k":"x","v":1}},
+      {"type":"Feature","geometry":{"type":"Point","coordinates":[1,2]},"properties":{"k":"y","v":2}}
+    ]}"""
+    assert list(
+        map(
+            tuple,
+            db.execute(
+                "select geometry ->> '$.properties.k', geometry ->> '$.properties.v' from tg_each(?)",
+                [same],
+            ).fetchall(),
+        )
+    ) == [("x", 1), ("y", 2)]
+
+
+def test_tg_read_geojson(tmp_path):
+    read = lambda path: list(
+        map(
+            tuple,
+            db.execute(
+                "select rowid, tg_to_wkt(geometry), properties from tg_read_geojson(?)",
+                [str(path)],
+            ).fetchall(),
+        )
+    )
+    path = tmp_path / "features.geojson"
+    path.write_text(
+        """{
+          "type": "FeatureCollection",
+          "name": "has \\"features\\" in a string",
+          "features": [
+            {"type": "Feature", "properties": {"name": "a]}"}, "geometry": {"type": "Point", "coordinates": [1, 2]}},
+            {"type": "Feature", "geometry": {"type": "LineString", "coordinates": [[0, 0], [1, 1]]}, "properties": null}
+          ]
+        }"""
+    )
+    assert read(path) == [
+        (0, "POINT(1 2)", '{"name": "a]}"}'),
+        (1, "LINESTRING(0 0,1 1)", None),
+    ]
+
+    path = tmp_path / "empty.geojson"
+    path.write_text('{"type": "FeatureCollection", "features": []}')
+    assert read(path) == []
+
+    path = tmp_path / "point.geojson"
+    path.write_text('{"type": "Point", "coordinates": [3, 4]}')
+    assert read(path) == [(0, "POINT(3 4)", None)]
+
+    path = tmp_path / "bad.geojson"
+    path.write_text('{"type": "FeatureCollection", "features": [{"type": "Feature"}]}')
+    with pytest.raises(sqlite3.OperationalError, match="feature 0"):
+        read(path)
+    point = '{"type": "Point", "coordinates": [1, 2]}'
+    for features, match in [
+        (f"[{point} {point}]", "after feature 0: expected ',' or ']'"),
+        (f"[{point}, {point} x]", "after feature 1: expected ',' or ']'"),
+        (f"[{point}, {point}", "after feature 1: expected ',' or ']'"),
+        (f"[{point},]", "malformed GeoJSON in feature 1"),
+        (f"[, {point}]", "malformed GeoJSON in feature 0"),
+    ]:
+        path.write_text('{"type": "FeatureCollection", "features": %s}' % features)
+        with pytest.raises(sqlite3.OperationalError, match=match):
+            read(path)
+    # features are scanned as they're read, not all up front, so rows before
+    # a truncation are still returned
+    path.write_text('{"type": "FeatureCollection", "features": [%s, {"type": "Po' % point)
+    assert db.execute(
+        "select tg_to_wkt(geometry) from tg_read_geojson(?) limit 1", [str(path)]
+    ).fetchone()[0] == "POINT(1 2)"
+    with pytest.raises(sqlite3.OperationalError, match="malformed GeoJSON in feature 1"):
+        read(path)
+    with pytest.raises(sqlite3.OperationalError, match="could not open"):
+        read(tmp_path / "missing.geojson")
+    with pytest.raises(sqlite3.OperationalError, match="path argument is required"):
+        db.execute("select * from tg_read_geojson").fetchall()
+
+
+def test_tg_random():
+    points = db.execute(
+        "select rowid, geometry from tg_random_points(1000, 'POLYGON((0 0, 10 0, 10 5, 0 5, 0 0))', 7)"
+    ).fetchall()
+    assert len(points) == 1000
+    assert points[0][0] == 1 and points[-1][0] == 1000
+    assert all(
+        db.execute(
+            "select minX >= 0 and maxX <= 10 and minY >= 0 and maxY <= 5 from tg_bbox(?)",
+            [geometry],
+        ).fetchone()[0]
+        == 1
+        for _, geometry in points
+    )
+    # reproducible, independently of which rows are read
+    assert (
+        db.execute(
+            "select geometry from tg_random_points(1000, 'POLYGON((0 0, 10 0, 10 5, 0 5, 0 0))', 7) where rowid = 500"
+        ).fetchone()[0]
+        == points[499][1]
+    )
+    assert (
+        db.execute(
+            "select geometry from tg_random_points(1000, 'POLYGON((0 0, 10 0, 10 5, 0 5, 0 0))', 8) where rowid = 500"
+        ).fetchone()[0]
+        != points[499][1]
+    )
+
+    # clusters stay in the bbox, and NULL skips an argument
+    assert db.execute(
+        "select count(*), sum(tg_intersects(geometry, 'POLYGON((-180 -90, 180 -90, 180 90, -180 90, -180 -90))')) from tg_random_points(1000, null, 1, 3)"
+    ).fetchone()[:] == (1000, 1000)
+
+    lines = db.execute(
+        "select tg_type(geometry), count(*) from tg_random_lines(10, 6) join tg_coords(geometry) group by 1"
+    ).fetchall()
+    assert list(map(tuple, lines)) == [("LineString", 60)]
+
+    polygons = db.execute(
+        "select tg_type(geometry), count(*), count(distinct ring_index) from tg_random_polygons(10, 5, null, 3, 2, 3) join tg_coords(geometry) group by 1"
+    ).fetchall()
+    assert list(map(tuple, polygons)) == [("Polygon", 10 * 4 * 6, 4)]
+    # every hole lies inside its polygon's exterior
+    assert db.execute(
+        "select count(*) from tg_random_polygons(100, 8, null, 1, 0, 2) join tg_holes_each(geometry) where not tg_contains(tg_poly_exterior(geometry), hole)"
+    ).fetchone()[0] == 0
+
+    assert db.execute("select count(*) from tg_random_points(0)").fetchone()[0] == 0
+    with pytest.raises(sqlite3.OperationalError, match="n argument is required"):
+        db.execute("select * from tg_random_points").fetchall()
+    with pytest.raises(sqlite3.OperationalError, match="n must be"):
+        db.execute("select * from tg_random_points(-1)").fetchall()
+    with pytest.raises(sqlite3.OperationalError, match="vertices must be"):
+        db.execute("select * from tg_random_polygons(1, 2)").fetchall()
+    with pytest.raises(sqlite3.OperationalError, match="non-zero area"):
+        db.execute("select * from tg_random_lines(1, 2, 'POINT(1 1)')").fetchall()
+    with pytest.raises(sqlite3.OperationalError, match="holes must be"):
+        db.execute("select * from tg_random_polygons(1, 8, null, 0, 0, -1)").fetchall()
+
+
+def test_tg_read_geojsonseq(tmp_path):
+    path = tmp_path / "features.geojsonl"
+    lines = [
+        f'{{"type": "Feature", "properties": {{"i": {i}}}, "geometry": {{"type": "Point", "coordinates": [{i}, {i}]}}}}'
+        for i in range(1000)
+    ]
+    # RFC 8142 record separators and blank lines are both accepted
+    path.write_text("\x1e" + "\n\n".join(lines[:2]) + "\r\n" + "\n".join(lines[2:]) + "\n")
+    for threads in [1, 4]:
+        rows = db.execute(
+            "select ordinal, tg_to_wkt(geometry), properties ->> 'i' from tg_read_geojsonseq(?, ?)",
+            [str(path), threads],
+        ).fetchall()
+        assert len(rows) == 1000
+        assert all(
+            tuple(row) == (i, f"POINT({i} {i})", i) for i, row in enumerate(rows)
+        )
+    assert db.execute(
+        "select count(*) from tg_read_geojsonseq(?)", [str(path)]
+    ).fetchone()[0] == 1000
+    # a correlated scan re-filters the same cursor, reusing its threads
+    assert db.execute(
+        """
+        select sum(
+          (select count(*) from tg_read_geojsonseq(?1, 4) where ordinal < value)
+        )
+        from json_each('[1, 10, 100]')
+        """,
+        [str(path)],
+    ).fetchone()[0] == 111
+
+    path.write_text(lines[0] + "\nnope\n")
+    with pytest.raises(sqlite3.OperationalError, match="record 1"):
+        db.execute("select * from tg_read_geojsonseq(?)", [str(path)]).fetchall()
+    with pytest.raises(sqlite3.OperationalError, match="threads must be"):
+        db.execute("select * from tg_read_geojsonseq(?, -1)", [str(path)]).fetchall()
+
+
+def test_tg_read_wkb_stream(tmp_path):
+    wkbs = [
+        db.execute("select tg_to_wkb(?)", [wkt]).fetchone()[0]
+        for wkt in ["POINT(1 2)", "LINESTRING(0 0,1 1)", "POINT(3 4)"]
+    ]
+    path = tmp_path / "geoms.wkb"
+    path.write_bytes(b"".join(len(w).to_bytes(4, "little") + w for w in wkbs))
+    assert list(
+        map(
+            tuple,
+            db.execute(
+                "select ordinal, tg_to_wkt(geometry), properties from tg_read_wkb_stream(?, 2)",
+                [str(path)],
+            ).fetchall(),
+        )
+    ) == [
+        (0, "POINT(1 2)", None),
+        (1, "LINESTRING(0 0,1 1)", None),
+        (2, "POINT(3 4)", None),
+    ]
+    path.write_bytes(len(wkbs[0]).to_bytes(4, "little") + wkbs[0][:-1])
+    with pytest.raises(sqlite3.OperationalError, match="record 0: truncated"):
+        db.execute("select * from tg_read_wkb_stream(?)", [str(path)]).fetchall()
+
+
+def test_tg_write_geojson(tmp_path):
+    path = tmp_path / "out.geojson"
+    rows = [
+        ("POINT(1 2)", '{"name":"a"}'),
+        ("LINESTRING(0 0,1 1)", None),
+        ('{"type":"Feature","id":3,"geometry":{"type":"Point","coordinates":[5,6]},"properties":{"name":"c"}}', None),
+    ]
+    sql = """
+      select tg_write_geojson(?, column1, column2)
+      from (values (?, ?), (?, ?), (?, ?))
+    """
+    args = [str(path)] + [v for row in rows for v in row]
+    assert db.execute(sql, args).fetchone()[0] == 3
+    assert json.loads(path.read_text()) == {
+        "type": "FeatureCollection",
+        "features": [
+            {
+                "type": "Feature",
+                "geometry": {"type": "Point", "coordinates": [1, 2]},
+                "properties": {"name": "a"},
+            },
+            {
+                "type": "Feature",
+                "geometry": {"type": "LineString", "coordinates": [[0, 0], [1, 1]]},
+                "properties": {},
+            },
+            {
+                "type": "Feature",
+                "id": 3,
+                "geometry": {"type": "Point", "coordinates": [5, 6]},
+                "properties": {"name": "c"},
+            },
+        ],
+    }
+    # round trips through the readers
+    assert db.execute(
+        "select count(*) from tg_read_geojson(?)", [str(path)]
+    ).fetchone()[0] == 3
+
+    seq = tmp_path / "out.geojsonl"
+    assert (
+        db.execute(
+            "select tg_write_geojsonseq(?, tg_point(value, value), json_object('i', value)) from json_each('[1,2,3]')",
+            [str(seq)],
+        ).fetchone()[0]
+        == 3
+    )
+    assert seq.read_text().splitlines() == [
+        '{"type":"Feature","geometry":{"type":"Point","coordinates":[1,1]},"properties":{"i":1}}',
+        '{"type":"Feature","geometry":{"type":"Point","coordinates":[2,2]},"properties":{"i":2}}',
+        '{"type":"Feature","geometry":{"type":"Point","coordinates":[3,3]},"properties":{"i":3}}',
+    ]
+
+    # a feature larger than the write buffer
+    big = tmp_path / "big.geojson"
+    coords = ",".join(f"{i} {i}" for i in range(20000))
+    assert db.execute(
+        "select tg_write_geojson(?, ?)", [str(big), f"LINESTRING({coords})"]
+    ).fetchone()[0] == 1
+    assert len(json.loads(big.read_text())["features"][0]["geometry"]["coordinates"]) == 20000
+
+    assert db.execute(
+        "select tg_write_geojson(?, 'POINT(1 1)') where 0", [str(path)]
+    ).fetchone()[0] == 0
+    # NULL geometries are skipped but create the file, so a left join onto
+    # one row always writes a (possibly empty) collection
+    empty = tmp_path / "empty.geojson"
+    assert db.execute(
+        "select tg_write_geojson(?, t.value) from (select 1) left join json_each('[]') as t",
+        [str(empty)],
+    ).fetchone()[0] == 0
+    assert json.loads(empty.read_text()) == {"type": "FeatureCollection", "features": []}
+    emptyseq = tmp_path / "empty.geojsonl"
+    assert db.execute(
+        "select tg_write_geojsonseq(?, null)", [str(emptyseq)]
+    ).fetchone()[0] == 0
+    assert emptyseq.read_text() == ""
+    assert db.execute(
+        "select tg_write_geojson(?, value) from json_each('[null, \"POINT(1 1)\", null, \"POINT(2 2)\"]')",
+        [str(empty)],
+    ).fetchone()[0] == 2
+    assert len(json.loads(empty.read_text())["features"]) == 2
+    # the properties argument replaces a Feature's own
+    feature = tmp_path / "feature.geojson"
+    assert db.execute(
+        "select tg_write_geojson(?, ?, json_object('name', 'd'))",
+        [str(feature), rows[2][0]],
+    ).fetchone()[0] == 1
+    assert json.loads(feature.read_text())["features"] == [
+        {
+            "type": "Feature",
+            "id": 3,
+            "geometry": {"type": "Point", "coordinates": [5, 6]},
+            "properties": {"name": "d"},
+        }
+    ]
+
+    with pytest.raises(sqlite3.OperationalError, match="properties must be a JSON object"):
+        db.execute("select tg_write_geojson(?, 'POINT(1 1)', 'nope')", [str(path)]).fetchone()
+    with pytest.raises(sqlite3.OperationalError, match="properties must be a JSON object"):
+        db.execute("select tg_write_geojson(?, 'POINT(1 1)', '{not json')", [str(path)]).fetchone()
+    # properties are written re-serialized
+    spaced = tmp_path / "spaced.geojsonl"
+    db.execute(
+        "select tg_write_geojsonseq(?, 'POINT(1 1)', ' { \"a\" : [1, 2] } ')", [str(spaced)]
+    ).fetchone()
+    assert spaced.read_text() == (
+        '{"type":"Feature","geometry":{"type":"Point","coordinates":[1,1]},"properties":{"a":[1,2]}}\n'
+    )
+    with pytest.raises(sqlite3.OperationalError, match="properties must be a JSON object"):
+        db.execute(
+            "select tg_write_geojson(?, 'POINT(1 1)', json_array(1, 2))", [str(path)]
+        ).fetchone()
+    with pytest.raises(sqlite3.OperationalError, match="cannot write a FeatureCollection"):
+        db.execute(
+            "select tg_write_geojson(?, ?)",
+            [str(path), '{"type":"FeatureCollection","features":[]}'],
+        ).fetchone()
+    with pytest.raises(sqlite3.OperationalError, match="could not open"):
+        db.execute(
+            "select tg_write_geojson(?, 'POINT(1 1)')", [str(tmp_path / "missing" / "x")]
+        ).fetchone()
+
+
+def test_tg_coords():
+    tg_coords = lambda sql, *args: list(map(tuple, db.execute(sql, args).fetchall()))
+    assert tg_coords(
+        "select rowid, x, y, z, m, part_index, ring_index, vertex_index from tg_coords(?)",
+        "LINESTRING (30 10, 10 30, 40 40)",
+    ) == [
+        (0, 30.0, 10.0, None, None, 0, None, 0),
+        (1, 10.0, 30.0, None, None, 0, None, 1),
+        (2, 40.0, 40.0, None, None, 0, None, 2),
+    ]
+    assert tg_coords(
+        "select rowid, x, y, part_index, ring_index, vertex_index from tg_coords(?)",
+        "MULTIPOLYGON (((0 0, 10 0, 10 10, 0 0), (1 1, 2 1, 2 2, 1 1)), ((20 20, 30 20, 30 30, 20 20)))",
+    ) == [
+        (0, 0.0, 0.0, 0, 0, 0),
+        (1, 10.0, 0.0, 0, 0, 1),
+        (2, 10.0, 10.0, 0, 0, 2),
+        (3, 0.0, 0.0, 0, 0, 3),
+        (4, 1.0, 1.0, 0, 1, 0),
+        (5, 2.0, 1.0, 0, 1, 1),
+        (6, 2.0, 2.0, 0, 1, 2),
+        (7, 1.0, 1.0, 0, 1, 3),
+        (8, 20.0, 20.0, 1, 0, 0),
+        (9, 30.0, 20.0, 1, 0, 1),
+        (10, 30.0, 30.0, 1, 0, 2),
+        (11, 20.0, 20.0, 1, 0, 3),
+    ]
+    assert tg_coords(
+        "select x, y, z, m, part_index, vertex_index from tg_coords(?)",
+        "MULTIPOINT ZM (1 2 3 4, 5 6 7 8)",
+    ) == [(1.0, 2.0, 3.0, 4.0, 0, 0), (5.0, 6.0, 7.0, 8.0, 1, 0)]
+    assert tg_coords("select z, m from tg_coords(?)", "POINT M (1 2 3)") == [
+        (None, 3.0)
+    ]
+    assert tg_coords(
+        "select part_index, vertex_index, x from tg_coords(?)",
+        "GEOMETRYCOLLECTION (POINT (1 1), MULTIPOINT (2 2, 3 3))",
+    ) == [(0, 0, 1.0), (1, 0, 2.0), (1, 1, 3.0)]
+    assert tg_coords("select * from tg_coords(?)", "POLYGON EMPTY") == []
+
+    # rowid and vertex_index constraints seek instead of scanning
+    line = "LINESTRING (0 0, 1 1, 2 2, 3 3, 4 4, 5 5)"
+    assert tg_coords(
+        "select rowid, x from tg_coords(?) where rowid between 2 and 3", line
+    ) == [(2, 2.0), (3, 3.0)]
+    assert tg_coords("select x from tg_coords(?) where rowid = 4", line) == [(4.0,)]
+    assert tg_coords("select x from tg_coords(?) where rowid > 4.5", line) == [
+        (5.0,)
+    ]
+    assert tg_coords("select x from tg_coords(?) where rowid = 99", line) == []
+    assert tg_coords(
+        "select rowid from tg_coords(?) where vertex_index < 2",
+        "MULTILINESTRING ((0 0, 1 1, 2 2), (3 3, 4 4, 5 5))",
+    ) == [(0,), (1,), (3,), (4,)]
+    # every point of a MultiPoint has vertex_index 0
+    multipoint = "MULTIPOINT (1 1, 2 2, 3 3)"
+    assert tg_coords(
+        "select rowid, vertex_index from tg_coords(?) where vertex_index = 0",
+        multipoint,
+    ) == [(0, 0), (1, 0), (2, 0)]
+    assert tg_coords(
+        "select rowid from tg_coords(?) where vertex_index = 1", multipoint
+    ) == []
+    assert tg_coords(
+        "select rowid from tg_coords(?) where vertex_index < 1 and rowid >= 1",
+        multipoint,
+    ) == [(1,), (2,)]
+
+    with pytest.raises(sqlite3.OperationalError, match="source argument is required"):
+        tg_coords("select * from tg_coords")
+    with pytest.raises(sqlite3.OperationalError):
+        tg_coords("select * from tg_coords(?)", "nope")
+
+
 def test_tg_to_geojson():
     tg_to_geojson = lambda *args: db.execute(
         "select tg_to_geojson(?)", args
@@ -332,6 +958,38 @@ def test_tg_to_geojson():
     # TODO more tests
 
 
+def test_conversion_passthrough():
+    one = lambda sql, *args: db.execute(sql, args).fetchone()[0]
+    # little-endian ISO WKB comes back byte-for-byte
+    wkb = bytes.fromhex("01010000000000000000000000000000000000f03f")
+    assert one("select tg_to_wkb(?)", wkb) == wkb
+    wkb_z = one("select tg_to_wkb('MULTIPOINT Z (1 2 3, 4 5 6)')")
+    assert one("select tg_to_wkb(?)", wkb_z) == wkb_z
+    # big-endian WKB is re-encoded
+    assert (
+        one("select tg_to_wkb(?)", bytes.fromhex("00000000013ff00000000000004000000000000000"))
+        == bytes.fromhex("0101000000000000000000f03f0000000000000040")
+    )
+    # invalid inputs still error
+    with pytest.raises(sqlite3.OperationalError):
+        one("select tg_to_wkb(?)", wkb[:-1])
+
+    # compact GeoJSON is returned unchanged, anything else is re-serialized
+    compact = '{"type":"Point","coordinates":[1.0,2],"id":"a b"}'
+    assert one("select tg_to_geojson(?)", compact) == compact
+    assert (
+        one("select tg_to_geojson(?)", '{"type": "Point", "coordinates": [1, 2]}')
+        == '{"type":"Point","coordinates":[1,2]}'
+    )
+
+    # outputs larger than the first size guess
+    coords = ",".join(f"{i} {i}.125" for i in range(5000))
+    line = one("select tg_to_wkt(tg_geom(?))", f"LINESTRING({coords})")
+    assert line == f"LINESTRING({coords})"
+    assert one("select tg_to_wkt(tg_to_wkb(?))", line) == line
+    assert one("select tg_to_wkt(tg_to_geojson(tg_to_wkb(?)))", line) == line
+
+
 @pytest.mark.skip(reason="TODO")
 def test_tg_point():
     pass
@@ -493,6 +1151,100 @@ def test_tg_within():
     pass
 
 
+GRID = "POLYGON((0 0, 8 0, 8 8, 0 8, 0 0))"
+
+
+def curve_cells(func, order=3):
+    # every cell of the grid over GRID, keyed by its center
+    n = 1 << order
+    return {
+        db.execute(
+            f"select {func}(?, ?, ?, ?)", [x + 0.5, y + 0.5, GRID, order]
+        ).fetchone()[0]: (x, y)
+        for x in range(n)
+        for y in range(n)
+    }
+
+
+def test_tg_hilbert():
+    tg_hilbert = lambda *args: db.execute(
+        f"select tg_hilbert({spread_args(args)})", args
+    ).fetchone()[0]
+    assert tg_hilbert("POINT(1 1)", "POLYGON((0 0, 4 0, 4 4, 0 4, 0 0))", 2) == 2
+    # keyed by the center of the bounding box
+    assert tg_hilbert("LINESTRING(0 0, 2 2)", "POLYGON((0 0, 4 0, 4 4, 0 4, 0 0))", 2) == 2
+    assert tg_hilbert("POINT(0 0)", None) == 1 << 31
+    assert tg_hilbert("POINT(-180 -90)", None, 31) == 0
+    # clamped to bbox
+    assert tg_hilbert("POINT(100 -100)", GRID, 3) == tg_hilbert("POINT(7.5 0.5)", GRID, 3)
+    # WKT, WKB and pointer values agree
+    assert tuple(
+        db.execute(
+            "select tg_hilbert(tg_geom('POINT(3 5)'), ?, 3), tg_hilbert(tg_to_wkb('POINT(3 5)'), ?, 3)",
+            [GRID, GRID],
+        ).fetchone()
+    ) == (tg_hilbert("POINT(3 5)", GRID, 3),) * 2
+    assert tg_hilbert(None, None) is None
+    assert tg_hilbert("POINT EMPTY", None) is None
+    # WKB POINT EMPTY, with NaN coordinates
+    assert tg_hilbert(bytes.fromhex("0101000000000000000000F87F000000000000F87F"), None) is None
+
+    with pytest.raises(sqlite3.OperationalError, match="order must be an integer between 1 and 31"):
+        tg_hilbert("POINT(1 1)", None, 32)
+    with pytest.raises(sqlite3.OperationalError, match="order must be an integer between 1 and 31"):
+        tg_hilbert("POINT(1 1)", None, 0)
+    with pytest.raises(sqlite3.OperationalError, match="bbox must not be empty"):
+        tg_hilbert("POINT(1 1)", "POINT EMPTY")
+    # many times over, since the geometry of a failed parse was once freed
+    # from an uninitialized pointer
+    for _ in range(100):
+        with pytest.raises(sqlite3.OperationalError, match="ParseError"):
+            tg_hilbert("nope", None)
+
+
+def test_tg_hilbert_xy():
+    # every key is used once, and consecutive keys are neighboring cells
+    cells = curve_cells("tg_hilbert_xy")
+    assert sorted(cells) == list(range(64))
+    for key in range(63):
+        (x1, y1), (x2, y2) = cells[key], cells[key + 1]
+        assert abs(x1 - x2) + abs(y1 - y2) == 1
+    assert db.execute(
+        "select tg_hilbert_xy(3.5, 0.5, 'POLYGON((0 0, 4 0, 4 4, 0 4, 0 0))', 2)"
+    ).fetchone()[0] == 15
+    assert db.execute(
+        "select tg_hilbert_xy(-122.4, 37.8, null) = tg_hilbert('POINT(-122.4 37.8)', null)"
+    ).fetchone()[0] == 1
+    assert db.execute("select tg_hilbert_xy(null, 1, null)").fetchone()[0] is None
+
+
+def test_tg_zorder():
+    tg_zorder = lambda *args: db.execute(
+        f"select tg_zorder({spread_args(args)})", args
+    ).fetchone()[0]
+    assert tg_zorder("POINT(1 1)", "POLYGON((0 0, 4 0, 4 4, 0 4, 0 0))", 2) == 3
+    assert tg_zorder("POINT(180 90)", None, 31) == (1 << 62) - 1
+    assert tg_zorder("POLYGON EMPTY", None) is None
+    with pytest.raises(sqlite3.OperationalError, match="order must be an integer between 1 and 31"):
+        tg_zorder("POINT(1 1)", None, 1.5)
+    for _ in range(100):
+        with pytest.raises(sqlite3.OperationalError, match="ParseError"):
+            tg_zorder("POLYGON((0 0, 1", None)
+
+
+def test_tg_zorder_xy():
+    # the bits of the column and row, interleaved
+    cells = curve_cells("tg_zorder_xy")
+    for key, (x, y) in cells.items():
+        assert key == sum(
+            ((x >> bit) & 1) << (2 * bit) | ((y >> bit) & 1) << (2 * bit + 1)
+            for bit in range(3)
+        )
+    assert db.execute(
+        "select tg_zorder_xy(3.5, 0.5, 'POLYGON((0 0, 4 0, 4 4, 0 4, 0 0))', 2)"
+    ).fetchone()[0] == 5
+
+
 # fmt: off
 tg_demo1 = [
     {"type":"Feature","geometry":{"type":"Polygon","coordinates":[[[-117.23818620800527,32.881627962039275],[-117.23803891594858,32.881627962039275],[-117.23803891594858,32.88150426716983],[-117.23818620800527,32.88150426716983],[-117.23818620800527,32.881627962039275]]]},"properties":{}},
@@ -638,6 +1390,777 @@ def test_tg0_with_aux():
     ]
 
 
+@pytest.mark.skipif(not SUPPORTS_RTREE, reason="tg0 require R-Tree extension")
+def test_tg0_update():
+    db.execute("create virtual table tg_demo3 using tg0(a, b);")
+    db.execute(
+        """
+        insert into tg_demo3(rowid, _shape, a, b) values
+          (1, 'POINT (1 1)', 'one', 1),
+          (2, 'POINT (5 5)', 'two', 2)
+        """
+    )
+    rtree = lambda: execute_all(
+        db, "select id, minX, maxX, minY, maxY from tg_demo3_rtree order by id"
+    )
+    rows = lambda: execute_all(
+        db, "select rowid, tg_to_wkt(_shape) as wkt, a, b from tg_demo3 order by rowid"
+    )
+    window = lambda wkt: [
+        row[0]
+        for row in db.execute(
+            "select rowid from tg_demo3 where tg_intersects(_shape, ?)", [wkt]
+        ).fetchall()
+    ]
+
+    # aux-only changes leave the rtree box alone
+    before = rtree()
+    db.execute("update tg_demo3 set a = 'uno', b = b + 10 where rowid = 1")
+    assert rtree() == before
+    assert rows()[0] == {"rowid": 1, "wkt": "POINT(1 1)", "a": "uno", "b": 11}
+
+    # shape changes move the box
+    db.execute("update tg_demo3 set _shape = 'POINT (3 3)' where rowid = 2")
+    assert rows()[1] == {"rowid": 2, "wkt": "POINT(3 3)", "a": "two", "b": 2}
+    assert window("POLYGON ((2 2, 4 2, 4 4, 2 4, 2 2))") == [2]
+    assert window("POLYGON ((4 4, 6 4, 6 6, 4 6, 4 4))") == []
+
+    # rowid changes, with and without a new shape
+    db.execute("update tg_demo3 set rowid = 10 where rowid = 1")
+    db.execute("update tg_demo3 set rowid = 20, _shape = 'POINT (0 0)' where rowid = 2")
+    assert rows() == [
+        {"rowid": 10, "wkt": "POINT(1 1)", "a": "uno", "b": 11},
+        {"rowid": 20, "wkt": "POINT(0 0)", "a": "two", "b": 2},
+    ]
+    assert window("POINT (0 0)") == [20]
+
+    with pytest.raises(sqlite3.OperationalError, match="UNIQUE constraint failed"):
+        db.execute("update tg_demo3 set rowid = 20 where rowid = 10")
+
+    cursor = db.execute("insert into tg_demo3(_shape, a) values ('POINT (9 9)', 'x')")
+    assert cursor.lastrowid == 21
+
+    db.execute("drop table tg_demo3;")
+
+
+@pytest.mark.skipif(not SUPPORTS_RTREE, reason="tg0 require R-Tree extension")
+def test_tg0_join():
+    db.execute("create virtual table tg_demo4 using tg0(name);")
+    db.execute(
+        """
+        insert into tg_demo4(rowid, _shape, name) values
+          (1, 'POLYGON ((0 0, 2 0, 2 2, 0 2, 0 0))', 'a'),
+          (2, 'POLYGON ((1 1, 3 1, 3 3, 1 3, 1 1))', 'b'),
+          (3, 'POLYGON ((5 5, 6 5, 6 6, 5 6, 5 5))', 'c')
+        """
+    )
+    # the tg0 cursor is re-filtered once per outer row, including repeats of
+    # the same query geometry
+    assert execute_all(
+        db,
+        """
+        select json_each.key, tg_demo4.name
+        from json_each(?)
+        join tg_demo4 on tg_intersects(tg_demo4._shape, json_each.value)
+        order by 1, 2
+        """,
+        [
+            json.dumps(
+                ["POINT (0.5 0.5)", "POINT (1.5 1.5)", "POINT (1.5 1.5)", "POINT (9 9)"]
+            )
+        ],
+    ) == [
+        {"key": 0, "name": "a"},
+        {"key": 1, "name": "a"},
+        {"key": 1, "name": "b"},
+        {"key": 2, "name": "a"},
+        {"key": 2, "name": "b"},
+    ]
+
+    # two cursors on the same table and plan at the same time
+    assert execute_all(
+        db,
+        """
+        select a.name as a, b.name as b
+        from tg_demo4 as a
+        join tg_demo4 as b on tg_intersects(b._shape, 'POINT (1.5 1.5)')
+        where tg_intersects(a._shape, 'POINT (5.5 5.5)')
+        order by 1, 2
+        """,
+    ) == [{"a": "c", "b": "a"}, {"a": "c", "b": "b"}]
+    db.execute("drop table tg_demo4;")
+
+
+@pytest.mark.skipif(not SUPPORTS_RTREE, reason="tg0 require R-Tree extension")
+def test_tg0_threads():
+    # more rows than one batch, with aux columns, so that batches refill
+    for name, options in [("tg_demo6", ""), ("tg_demo7", ", threads = 4")]:
+        db.execute(f"create virtual table {name} using tg0(label, n{options})")
+        db.execute(
+            f"""
+            insert into {name}(rowid, _shape, label, n)
+            select rowid, geometry, 'row ' || rowid, rowid * 2
+            from tg_random_polygons(3000, 8, 'POLYGON((0 0, 10 0, 10 10, 0 10, 0 0))', 1)
+            """
+        )
+    window = "POLYGON((1 1, 9 2, 8 8, 5 4, 2 9, 1 1))"
+    expected = db.execute(
+        "select rowid, _shape, label, n from tg_demo6 where tg_intersects(_shape, ?)",
+        [window],
+    ).fetchall()
+    assert 100 < len(expected) < 3000
+    assert (
+        db.execute(
+            "select rowid, _shape, label, n from tg_demo7 where tg_intersects(_shape, ?)",
+            [window],
+        ).fetchall()
+        == expected
+    )
+    stats = json.loads(
+        db.execute("select tg0_last_query_stats('tg_demo7')").fetchone()[0]
+    )
+    assert stats["accepted"] == len(expected)
+    assert stats["predicate_calls"] == stats["rtree_rows"]
+
+    # re-filtered once per outer row in a join, and stopped early by LIMIT
+    assert db.execute(
+        """
+        select count(*) from tg_random_points(20, 'POLYGON((0 0, 10 0, 10 10, 0 10, 0 0))', 2) as p
+        join tg_demo7 on tg_intersects(tg_demo7._shape, p.geometry)
+        """
+    ).fetchone()[0] == db.execute(
+        """
+        select count(*) from tg_random_points(20, 'POLYGON((0 0, 10 0, 10 10, 0 10, 0 0))', 2) as p
+        join tg_demo6 on tg_intersects(tg_demo6._shape, p.geometry)
+        """
+    ).fetchone()[0]
+    assert [
+        row[0]
+        for row in db.execute(
+            "select rowid from tg_demo7 where tg_intersects(_shape, ?) limit 2",
+            [window],
+        ).fetchall()
+    ] == [row[0] for row in expected[:2]]
+    db.execute("drop table tg_demo6")
+    db.execute("drop table tg_demo7")
+
+    with pytest.raises(sqlite3.OperationalError, match="threads must be"):
+        db.execute("create virtual table tg_demo8 using tg0(threads=100)")
+    with pytest.raises(sqlite3.OperationalError, match="unknown tg0 option 'color'"):
+        db.execute("create virtual table tg_demo8 using tg0(color=red)")
+
+
+@pytest.mark.skipif(not SUPPORTS_RTREE, reason="tg0 require R-Tree extension")
+def test_tg0_points():
+    # point candidates are checked from their WKB coordinates, other shapes
+    # (3D points, polygons) are parsed, in the same batches
+    db.execute("create virtual table tg_demo8 using tg0(label)")
+    db.execute(
+        """
+        insert into tg_demo8(rowid, _shape, label)
+        select rowid, geometry, 'point ' || rowid
+        from tg_random_points(3000, 'POLYGON((0 0, 10 0, 10 10, 0 10, 0 0))', 1)
+        """
+    )
+    db.execute(
+        """
+        insert into tg_demo8(rowid, _shape, label) values
+          (4001, 'POINT(1 1)', 'vertex'),
+          (4002, 'POINT(5 1.5)', 'edge'),
+          (4003, 'POINT(5 4)', 'notch vertex'),
+          (4004, 'POINT(5 5)', 'notch'),
+          (4005, 'POINT Z (5 3 5)', '3d'),
+          (4006, 'POLYGON((4.5 3.5, 5.5 3.5, 5.5 3.6, 4.5 3.5))', 'polygon')
+        """
+    )
+    window = "POLYGON((1 1, 9 2, 8 8, 5 4, 2 9, 1 1))"
+    rows = db.execute(
+        "select rowid, label from tg_demo8 where tg_intersects(_shape, ?)",
+        [window],
+    ).fetchall()
+    expected = db.execute(
+        """
+        select rowid, label from tg_demo8
+        where tg_intersects(+_shape, ?) order by rowid
+        """,
+        [window],
+    ).fetchall()
+    assert 100 < len(rows) < 3000
+    assert sorted(tuple(row) for row in rows) == [tuple(row) for row in expected]
+    labels = {row[1] for row in rows}
+    assert {"vertex", "edge", "notch vertex", "3d", "polygon"} <= labels
+    assert "notch" not in labels
+    db.execute("drop table tg_demo8")
+
+
+def test_tg0_twkb():
+    db.execute("create virtual table tg_demo9 using tg0(label, twkb=5)")
+    db.execute("create virtual table tg_demo10 using tg0(label)")
+    for table in ["tg_demo9", "tg_demo10"]:
+        db.execute(
+            f"""
+            insert into {table}(rowid, _shape, label)
+            select rowid, geometry, 'polygon ' || rowid
+            from tg_random_polygons(500, 16, 'POLYGON((0 0, 10 0, 10 10, 0 10, 0 0))', 1)
+            union all
+            select 1000 + rowid, geometry, 'point ' || rowid
+            from tg_random_points(500, 'POLYGON((0 0, 10 0, 10 10, 0 10, 0 0))', 2)
+            """
+        )
+    size = lambda table: db.execute(
+        f"select sum(length(_shape)) from {table}"
+    ).fetchone()[0]
+    assert size("tg_demo9") * 2 < size("tg_demo10")
+
+    # shapes are stored as TWKB, rounded to 5 digits
+    shape = db.execute("select _shape from tg_demo9 where rowid = 1001").fetchone()[0]
+    assert shape[0] == 0xA1
+    assert db.execute(
+        "select tg_to_wkt(a._shape) = tg_to_wkt(tg_to_twkb(b._shape, 5)) "
+        "from tg_demo9 as a join tg_demo10 as b on b.rowid = a.rowid "
+        "where a.rowid = 1"
+    ).fetchone()[0] == 1
+
+    window = "POLYGON((1 1, 9 2, 8 8, 5 4, 2 9, 1 1))"
+    query = "select rowid from {} where tg_intersects(_shape, ?) order by rowid"
+    rows = [tuple(row) for row in db.execute(query.format("tg_demo9"), [window])]
+    assert 100 < len(rows) < 1000
+    assert rows == [tuple(row) for row in db.execute(query.format("tg_demo10"), [window])]
+    db.execute("delete from tg_stats")
+    db.execute(query.format("tg_demo9"), [window]).fetchall()
+    stats = {row[0]: row[1] for row in db.execute("select name, value from tg_stats")}
+    assert stats["parse_twkb"] > 100 and stats["parse_wkb"] == 0
+
+    db.execute("update tg_demo9 set _shape = 'POINT(1.234567 2)' where rowid = 1")
+    assert db.execute(
+        "select tg_to_wkt(_shape) from tg_demo9 where rowid = 1"
+    ).fetchone()[0] == "POINT(1.23457 2)"
+
+    with pytest.raises(sqlite3.OperationalError, match="twkb precision must be between -8 and 7, not '8'"):
+        db.execute("create virtual table tg_demo_bad using tg0(twkb=8)")
+    db.execute("drop table tg_demo9")
+    db.execute("drop table tg_demo10")
+
+
+@pytest.mark.skipif(not SUPPORTS_RTREE, reason="tg0 require R-Tree extension")
+def test_tg0_type_point(tmp_path):
+    file_db = sqlite3.connect(str(tmp_path / "points.db"), isolation_level=None)
+    file_db.enable_load_extension(True)
+    file_db.load_extension(EXT_PATH)
+    file_db.execute("create virtual table fixes using tg0(label, type=point)")
+    file_db.execute("create virtual table shapes using tg0(label)")
+    for table in ["fixes", "shapes"]:
+        file_db.execute(
+            f"""
+            insert into {table}(rowid, _shape, label)
+            select rowid, geometry, 'point ' || rowid
+            from tg_random_points(3000, 'POLYGON((0 0, 10 0, 10 10, 0 10, 0 0))', 1)
+            """
+        )
+    # no _shape blob, just the coordinates
+    columns = [row[1] for row in file_db.execute("pragma table_info(fixes_rtree)")]
+    assert columns[5:] == ["_x", "_y", "c1"]
+
+    file_db.execute(
+        """
+        insert into fixes(rowid, _shape, label) values
+          (4001, 'POINT(1 1)', 'vertex'),
+          (4002, tg_point(5, 1.5), 'edge'),
+          (4003, tg_to_twkb('POINT(5 4)', 3), 'notch vertex'),
+          (4004, '{"type":"Point","coordinates":[5,5]}', 'notch'),
+          (4005, 'POINT Z (5 3 5)', '3d')
+        """
+    )
+    window = "POLYGON((1 1, 9 2, 8 8, 5 4, 2 9, 1 1))"
+    query = "select rowid, label from {} where tg_intersects(_shape, ?) order by rowid"
+    rows = [tuple(row) for row in file_db.execute(query.format("fixes"), [window])]
+    labels = {row[1] for row in rows}
+    assert {"vertex", "edge", "notch vertex", "3d"} <= labels
+    assert "notch" not in labels
+    assert [row for row in rows if row[0] <= 3000] == [
+        tuple(row) for row in file_db.execute(query.format("shapes"), [window])
+    ]
+
+    # _shape reads back as WKB, z dropped
+    assert file_db.execute(
+        "select _shape, tg_to_wkt(_shape) from fixes where rowid = 4005"
+    ).fetchone() == (bytes.fromhex("0101000000" "0000000000001440" "0000000000000840"), "POINT(5 3)")
+    file_db.execute("update fixes set _shape = 'POINT(7 7)', label = 'moved' where rowid = 4004")
+    file_db.execute("update fixes set label = 'renamed' where rowid = 4001")
+    file_db.execute("update fixes set rowid = 5001 where rowid = 4002")
+    assert [tuple(row) for row in file_db.execute(
+        "select rowid, tg_to_wkt(_shape), label from fixes where rowid > 4000 order by rowid"
+    )] == [
+        (4001, "POINT(1 1)", "renamed"),
+        (4003, "POINT(5 4)", "notch vertex"),
+        (4004, "POINT(7 7)", "moved"),
+        (4005, "POINT(5 3)", "3d"),
+        (5001, "POINT(5 1.5)", "edge"),
+    ]
+
+    for predicate in ["intersects", "within"]:
+        expected = file_db.execute(
+            f"select rowid, _shape from fixes where tg_{predicate}(+_shape, ?) order by rowid",
+            [window],
+        ).fetchall()
+        rows = file_db.execute(
+            "select id, _shape from tg0_parallel_query('fixes', ?, ?, 2)",
+            [window, predicate],
+        ).fetchall()
+        assert sorted(tuple(row) for row in rows) == [tuple(row) for row in expected]
+
+    for shape in ["LINESTRING(0 0, 1 1)", "POINT EMPTY"]:
+        with pytest.raises(sqlite3.OperationalError, match="type=point only store points"):
+            file_db.execute("insert into fixes(_shape) values (?)", [shape])
+    with pytest.raises(sqlite3.OperationalError, match="type must be 'geometry' or 'point', not 'line'"):
+        file_db.execute("create virtual table bad using tg0(type=line)")
+    with pytest.raises(sqlite3.OperationalError, match="twkb can't be used with type=point"):
+        file_db.execute("create virtual table bad using tg0(type=point, twkb=5)")
+    file_db.close()
+
+
+@pytest.mark.skipif(not SUPPORTS_RTREE, reason="tg0 require R-Tree extension")
+def test_tg0_content():
+    content_db = connect(EXT_PATH)
+    content_db.execute("create table parcels(id integer primary key, owner, geom)")
+    content_db.execute(
+        """
+        insert into parcels
+        select rowid, 'owner ' || rowid, geometry
+        from tg_random_polygons(2000, 8, 'POLYGON((0 0, 10 0, 10 10, 0 10, 0 0))', 1)
+        """
+    )
+    content_db.execute(
+        """
+        insert into parcels values
+          (3001, 'wkt', 'POLYGON((1 1, 2 1, 2 2, 1 2, 1 1))'),
+          (3002, 'geojson', '{"type":"Point","coordinates":[1.5,1.5]}'),
+          (3003, 'none', null)
+        """
+    )
+    content_db.execute(
+        """
+        create virtual table parcels_index using tg0(
+          owner, content='parcels', content_rowid=id, shape_column="geom", triggers=1
+        )
+        """
+    )
+    # the rtree only holds bounding boxes
+    columns = [row[1] for row in content_db.execute("pragma table_info(parcels_index_rtree)")]
+    assert columns == ["id", "minX", "maxX", "minY", "maxY"]
+    assert content_db.execute("select count(*) from parcels_index").fetchone()[0] == 0
+    content_db.execute("insert into parcels_index(parcels_index) values ('rebuild')")
+    assert content_db.execute("select count(*) from parcels_index").fetchone()[0] == 2002
+
+    window = "POLYGON((1 1, 9 2, 8 8, 5 4, 2 9, 1 1))"
+
+    def check():
+        expected = [
+            tuple(row)
+            for row in content_db.execute(
+                "select id, owner, geom from parcels "
+                "where tg_intersects(coalesce(geom, 'POINT EMPTY'), ?) order by id",
+                [window],
+            )
+        ]
+        assert [
+            tuple(row)
+            for row in content_db.execute(
+                "select rowid, owner, _shape from parcels_index "
+                "where tg_intersects(_shape, ?) order by rowid",
+                [window],
+            )
+        ] == expected
+        return expected
+
+    rows = check()
+    assert rows[-2:] == [
+        (3001, "wkt", "POLYGON((1 1, 2 1, 2 2, 1 2, 1 1))"),
+        (3002, "geojson", '{"type":"Point","coordinates":[1.5,1.5]}'),
+    ]
+
+    # the triggers keep the index in sync
+    content_db.execute("delete from parcels where id % 3 = 0")
+    content_db.execute("update parcels set geom = 'POINT(100 100)' where id = 3001")
+    content_db.execute("update parcels set id = 4002 where id = 3002")
+    content_db.execute("update parcels set geom = 'POINT(5 5)' where id = 3003")
+    content_db.execute("update parcels set owner = 'renamed' where id = 1")
+    content_db.execute("insert into parcels values (5000, 'new', 'POINT(2 2)')")
+    rows = check()
+    assert (4002, "geojson", '{"type":"Point","coordinates":[1.5,1.5]}') in rows
+    assert (5000, "new", "POINT(2 2)") in rows
+    assert [
+        row[0]
+        for row in content_db.execute(
+            "select rowid from parcels_index where tg_intersects(_shape, 'POINT(100 100)')"
+        )
+    ] == [3001]
+    assert content_db.execute("select count(*) from parcels_index").fetchone()[0] == content_db.execute(
+        "select count(*) from parcels where geom is not null"
+    ).fetchone()[0]
+
+    # only removes the row from the index
+    content_db.execute("insert into parcels_index(parcels_index, rowid) values ('delete', 5000)")
+    assert content_db.execute("select count(*) from parcels_index where rowid = 5000").fetchone()[0] == 0
+    assert content_db.execute("select count(*) from parcels where id = 5000").fetchone()[0] == 1
+
+    with pytest.raises(sqlite3.OperationalError, match="unknown tg0 command 'optimize'"):
+        content_db.execute("insert into parcels_index(parcels_index) values ('optimize')")
+    with pytest.raises(sqlite3.OperationalError, match="need a rowid"):
+        content_db.execute("insert into parcels_index(_shape) values ('POINT(1 1)')")
+    with pytest.raises(sqlite3.OperationalError, match="can't be used with content"):
+        content_db.execute("create virtual table bad using tg0(content=parcels, twkb=6)")
+    with pytest.raises(sqlite3.OperationalError, match="need a content table"):
+        content_db.execute("create virtual table bad using tg0(shape_column=geom)")
+
+    content_db.execute("create table gone(id integer primary key, geom)")
+    content_db.execute("insert into gone values (1, 'POINT(1 1)')")
+    content_db.execute("create virtual table gone_index using tg0(content=gone, content_rowid=id, shape_column=geom)")
+    content_db.execute("insert into gone_index(gone_index) values ('rebuild')")
+    assert [row[0] for row in content_db.execute("select rowid from gone_index")] == [1]
+    content_db.execute("drop table gone")
+    missing = 'content table "main"."gone" of tg0 table gone_index is missing: no such table: main.gone'
+    with pytest.raises(sqlite3.OperationalError, match=missing):
+        content_db.execute("select rowid from gone_index").fetchall()
+    with pytest.raises(sqlite3.OperationalError, match=missing):
+        content_db.execute("select rowid from gone_index where tg_intersects(_shape, 'POINT(1 1)')").fetchall()
+    content_db.execute("drop table gone_index")
+
+    content_db.execute("drop table parcels_index")
+    assert content_db.execute(
+        "select count(*) from sqlite_master where type = 'trigger'"
+    ).fetchone()[0] == 0
+    content_db.close()
+
+
+@pytest.mark.skipif(not SUPPORTS_RTREE, reason="tg0 require R-Tree extension")
+def test_tg0_resident(tmp_path):
+    path = str(tmp_path / "resident.db")
+
+    def open_db():
+        file_db = sqlite3.connect(path, isolation_level=None)
+        file_db.enable_load_extension(True)
+        file_db.load_extension(EXT_PATH)
+        return file_db
+
+    file_db = open_db()
+    for options in ["", ", type=point", ", twkb=4"]:
+        file_db.execute(f"create virtual table disk using tg0(label{options})")
+        file_db.execute(
+            f"create virtual table memory using tg0(label{options}, resident=1)"
+        )
+        source = (
+            "tg_random_points(1000, 'POLYGON((0 0, 10 0, 10 10, 0 10, 0 0))', 1)"
+            if "point" in options
+            else "tg_random_polygons(1000, 8, 'POLYGON((0 0, 10 0, 10 10, 0 10, 0 0))', 1)"
+        )
+        writes = [
+            f"insert into {{t}}(rowid, _shape, label) select rowid, geometry, 'row ' || rowid from {source}",
+            "delete from {t} where rowid % 7 = 0",
+            "update {t} set label = 'updated' where rowid % 5 = 0",
+            "update {t} set rowid = rowid + 5000 where rowid % 11 = 0",
+            "update {t} set _shape = 'POINT(5 5)' where rowid % 13 = 0",
+            "insert into {t}(rowid, _shape, label) values (9000, 'POINT(2 2)', 'new')",
+        ]
+
+        def check():
+            for window in [
+                "POLYGON((1 1, 9 2, 8 8, 5 4, 2 9, 1 1))",
+                "POINT(5 5)",
+                "POLYGON((20 20, 21 20, 21 21, 20 20))",
+            ]:
+                rows = [
+                    file_db.execute(
+                        f"select rowid, _shape, label from {table} "
+                        "where tg_intersects(_shape, ?) order by rowid",
+                        [window],
+                    ).fetchall()
+                    for table in ["disk", "memory"]
+                ]
+                assert rows[0] == rows[1]
+                stats = json.loads(
+                    file_db.execute("select tg0_last_query_stats('memory')").fetchone()[0]
+                )
+                assert stats["resident"]
+            assert file_db.execute(
+                "select rowid, _shape, label from disk order by rowid"
+            ).fetchall() == file_db.execute(
+                "select rowid, _shape, label from memory order by rowid"
+            ).fetchall()
+
+        # the first query loads the copy, later writes update it in place
+        check()
+        for write in writes:
+            for table in ["disk", "memory"]:
+                file_db.execute(write.format(t=table))
+            check()
+
+        file_db.execute("begin")
+        file_db.execute("delete from memory where rowid < 500")
+        file_db.execute("rollback")
+        check()
+
+        other_db = open_db()
+        for table in ["disk", "memory"]:
+            other_db.execute(f"delete from {table} where rowid > 800")
+        other_db.close()
+        check()
+
+        file_db.execute("drop table disk")
+        file_db.execute("drop table memory")
+
+    # a copy over resident_mb falls back to the rtree
+    file_db.execute("create virtual table big using tg0(resident=1, resident_mb=1)")
+    file_db.execute(
+        "insert into big(rowid, _shape) select rowid, geometry "
+        "from tg_random_polygons(20000, 16, null, 1)"
+    )
+    assert file_db.execute("select count(*) from big").fetchone()[0] == 20000
+    stats = json.loads(file_db.execute("select tg0_last_query_stats('big')").fetchone()[0])
+    assert not stats["resident"]
+
+    with pytest.raises(sqlite3.OperationalError, match="resident must be 0 or 1, not 'yes'"):
+        file_db.execute("create virtual table bad using tg0(resident=yes)")
+    with pytest.raises(sqlite3.OperationalError, match="resident_mb must be between 1 and 1048576, not '0'"):
+        file_db.execute("create virtual table bad using tg0(resident=1, resident_mb=0)")
+    with pytest.raises(sqlite3.OperationalError, match="resident_mb needs resident=1"):
+        file_db.execute("create virtual table bad using tg0(resident_mb=8)")
+    with pytest.raises(sqlite3.OperationalError, match="resident can't be used with content"):
+        file_db.execute("create virtual table bad using tg0(content=big, resident=1)")
+    file_db.close()
+
+
+@pytest.mark.skipif(not SUPPORTS_RTREE, reason="tg0 require R-Tree extension")
+def test_tg0_parallel_query(tmp_path):
+    path = tmp_path / "tg0.db"
+    for journal_mode in ["wal", "delete"]:
+        file_db = sqlite3.connect(str(path) + journal_mode, isolation_level=None)
+        file_db.enable_load_extension(True)
+        file_db.load_extension(EXT_PATH)
+        file_db.execute(f"pragma journal_mode = {journal_mode}")
+        file_db.execute("create virtual table shapes using tg0(label)")
+        file_db.execute(
+            """
+            insert into shapes(rowid, _shape, label)
+            select rowid, geometry, 'row ' || rowid
+            from tg_random_polygons(3000, 8, 'POLYGON((0 0, 10 0, 10 10, 0 10, 0 0))', 1, 20)
+            """
+        )
+        window = "POLYGON((1 1, 9 2, 8 8, 5 4, 2 9, 1 1))"
+        for predicate in ["intersects", "within", "coveredby", "contains"]:
+            expected = file_db.execute(
+                f"select rowid, _shape from shapes where tg_{predicate}(+_shape, ?) order by rowid",
+                [window],
+            ).fetchall()
+            for threads in [1, 3]:
+                rows = file_db.execute(
+                    "select id, _shape, threads from tg0_parallel_query('shapes', ?, ?, ?)",
+                    [window, predicate, threads],
+                ).fetchall()
+                assert sorted(row[:2] for row in rows) == expected
+                assert all(row[2] == threads for row in rows)
+        assert file_db.execute(
+            "select count(*) from tg0_parallel_query('shapes', ?)", [window]
+        ).fetchone()[0] == len(
+            file_db.execute(
+                "select 1 from shapes where tg_intersects(_shape, ?)", [window]
+            ).fetchall()
+        )
+
+        # joins back to the table, with the query geometry from the outer row
+        assert file_db.execute(
+            """
+            select count(*) from shapes as s
+            join tg0_parallel_query('shapes', s._shape, 'intersects', 2) as q
+            where s.rowid <= 10 and q.id = s.rowid
+            """
+        ).fetchone()[0] == 10
+
+        file_db.execute("begin")
+        file_db.execute("delete from shapes where rowid = 1")
+        with pytest.raises(sqlite3.OperationalError, match="write transaction"):
+            file_db.execute(
+                "select * from tg0_parallel_query('shapes', ?)", [window]
+            ).fetchall()
+        file_db.execute("rollback")
+        with pytest.raises(sqlite3.OperationalError, match="no such tg0 table: nope"):
+            file_db.execute(
+                "select * from tg0_parallel_query('nope', ?)", [window]
+            ).fetchall()
+        with pytest.raises(sqlite3.OperationalError, match="predicate must be one of"):
+            file_db.execute(
+                "select * from tg0_parallel_query('shapes', ?, 'disjoint')", [window]
+            ).fetchall()
+
+        # tables of attached databases are named schema.table
+        attached = str(path) + journal_mode + "-attached"
+        file_db.execute("attach database ? as other", [attached])
+        file_db.execute("create virtual table other.far using tg0()")
+        file_db.execute(
+            "insert into other.far(rowid, _shape) select rowid, _shape from main.shapes"
+        )
+        assert sorted(
+            row[0]
+            for row in file_db.execute(
+                "select id from tg0_parallel_query('other.far', ?, 'intersects', 2)",
+                [window],
+            )
+        ) == sorted(
+            row[0]
+            for row in file_db.execute(
+                "select id from tg0_parallel_query('shapes', ?)", [window]
+            )
+        )
+        file_db.execute(
+            "create virtual table other.far_index using tg0(content=far)"
+        )
+        with pytest.raises(sqlite3.OperationalError, match="not supported for content= tables"):
+            file_db.execute(
+                "select * from tg0_parallel_query('other.far_index', ?)", [window]
+            ).fetchall()
+        file_db.execute("detach database other")
+        file_db.close()
+
+    with pytest.raises(sqlite3.OperationalError, match="needs an on-disk database"):
+        db.execute("select * from tg0_parallel_query('shapes', 'POINT(1 1)')").fetchall()
+    with pytest.raises(sqlite3.OperationalError, match="geom argument is required"):
+        db.execute("select * from tg0_parallel_query('shapes')").fetchall()
+
+
+@pytest.mark.skipif(not SUPPORTS_RTREE, reason="tg0 require R-Tree extension")
+def test_tg0_last_query_stats():
+    def last(table="tg_demo5"):
+        value = db.execute("select tg0_last_query_stats(?)", [table]).fetchone()[0]
+        return json.loads(value) if value is not None else None
+
+    db.execute("create virtual table tg_demo5 using tg0()")
+    db.execute(
+        """
+        insert into tg_demo5(rowid, _shape) values
+          (1, 'POINT(1 1)'), (2, 'LINESTRING(0 3, 3 0)'), (3, 'POINT(9 9)')
+        """
+    )
+    assert last() is None
+
+    db.execute(
+        """
+        select rowid from tg_demo5
+        where tg_intersects(_shape, 'POLYGON((0 0, 1 0, 1 1, 0 1, 0 0))')
+        """
+    ).fetchall()
+    stats = last()
+    assert stats == {
+        "plan": "intersect",
+        "rtree_rows": 2,
+        "shape_bytes": 21 + 41,
+        "predicate_calls": 2,
+        "accepted": 1,
+        "rtree_ns": 0,
+        "decode_ns": 0,
+        "predicate_ns": 0,
+        "resident": False,
+    }
+
+    db.execute("update tg_stats set value = 1 where name = 'timing'")
+    db.execute("select rowid from tg_demo5").fetchall()
+    stats = last("TG_DEMO5")
+    assert stats["plan"] == "fullscan"
+    assert stats["rtree_rows"] == 3
+    assert stats["accepted"] == 3
+    assert stats["predicate_calls"] == 0
+    assert stats["rtree_ns"] > 0
+    db.execute("update tg_stats set value = 0 where name = 'timing'")
+
+    with pytest.raises(
+        sqlite3.OperationalError,
+        match="no tg0 table named 'nope' has been used on this connection",
+    ):
+        last("nope")
+    db.execute("drop table tg_demo5")
+
+
+def test_tg_stats():
+    def stats():
+        return {
+            row[0]: row[1]
+            for row in db.execute("select name, value from tg_stats").fetchall()
+        }
+
+    db.execute("delete from tg_stats")
+    assert set(stats().values()) == {0}
+
+    db.execute(
+        "select tg_intersects('POINT(1 1)', X'01010000000000000000000000000000000000f03f')"
+    )
+    db.execute("select tg_within(tg_point(1, 1), '{\"type\":\"Point\",\"coordinates\":[1,1]}')")
+    counts = stats()
+    assert counts["parse_wkt"] == 1
+    assert counts["parse_wkb"] == 1
+    assert counts["parse_geojson"] == 1
+    assert counts["parse_bytes"] == len("POINT(1 1)") + 21 + len(
+        '{"type":"Point","coordinates":[1,1]}'
+    )
+    assert counts["pointer_values"] == 1
+    assert counts["predicate_intersects"] == 1
+    assert counts["predicate_within"] == 1
+    assert counts["allocations"] > 0
+    assert counts["parse_ns"] == 0
+
+    # a single counter can be reset, and timing toggled
+    db.execute("delete from tg_stats where name = 'parse_wkt'")
+    assert stats()["parse_wkt"] == 0
+    assert stats()["parse_wkb"] == 1
+    db.execute("update tg_stats set value = 1 where name = 'timing'")
+    db.execute("select tg_intersects('POINT(1 1)', 'POINT(1 1)')")
+    assert stats()["parse_ns"] > 0
+    assert stats()["predicate_ns"] > 0
+    db.execute("delete from tg_stats")
+    assert stats()["timing"] == 1
+    db.execute("update tg_stats set value = 0 where name = 'timing'")
+
+    with pytest.raises(
+        sqlite3.OperationalError,
+        match="tg_stats only supports DELETE, and UPDATE of the 'timing' row",
+    ):
+        db.execute("update tg_stats set value = 1 where name = 'parse_wkt'")
+    with pytest.raises(sqlite3.OperationalError):
+        db.execute("insert into tg_stats values ('parse_wkt', 1)")
+
+    # counters are per connection
+    other = connect(EXT_PATH)
+    other.execute("select tg_to_wkt('POINT(1 1)')")
+    assert stats()["parse_wkt"] == 0
+    assert other.execute(
+        "select value from tg_stats where name = 'parse_wkt'"
+    ).fetchone()[0] == 1
+    other.close()
+
+    if SUPPORTS_RTREE:
+        db.execute("create virtual table tg_stats_demo using tg0()")
+        db.execute(
+            """
+            insert into tg_stats_demo(rowid, _shape) values
+              (1, 'POINT(1 1)'), (2, 'LINESTRING(0 3, 3 0)'), (3, 'POINT(9 9)')
+            """
+        )
+        db.execute("delete from tg_stats")
+        assert db.execute(
+            """
+            select rowid from tg_stats_demo
+            where tg_intersects(_shape, 'POLYGON((0 0, 1 0, 1 1, 0 1, 0 0))')
+            """
+        ).fetchone()[0] == 1
+        counts = stats()
+        assert counts["tg0_candidates"] == 2
+        assert counts["tg0_accepted"] == 1
+        # the tg0 overload of tg_intersects() counts like the regular one
+        db.execute(
+            "select tg_intersects(_shape, 'POINT(9 9)') from tg_stats_demo"
+        ).fetchall()
+        assert stats()["predicate_intersects"] == 3
+        db.execute("drop table tg_stats_demo")
+
+
 @pytest.mark.skip(reason="TODO not needeD?")
 def test_coverage():
     current_module = inspect.getmodule(inspect.currentframe())
@@ -31,6 +31,37 @@ static int exec_expect_error(sqlite3 *db, const char *sql) {
   return 0;
 }
 
+// tg allocates through sqlite3_malloc(), so a geometry held by a statement
+// must show up in sqlite3_memory_used().
+static int check_geometry_memory(sqlite3 *db) {
+  sqlite3_str *wkt = sqlite3_str_new(NULL);
+  sqlite3_str_appendall(wkt, "LINESTRING(");
+  for (int i = 0; i < 5000; i++) {
+    sqlite3_str_appendf(wkt, "%s%d %d", i ? "," : "", i, i);
+  }
+  sqlite3_str_appendall(wkt, ")");
+  char *zWkt = sqlite3_str_finish(wkt);
+
+  sqlite3_stmt *stmt = NULL;
+  int failed = 1;
+  if (zWkt &&
+      sqlite3_prepare_v2(db, "select tg_geom(?)", -1, &stmt, NULL) ==
+          SQLITE_OK) {
+    sqlite3_bind_text(stmt, 1, zWkt, -1, SQLITE_STATIC);
+    sqlite3_int64 before = sqlite3_memory_used();
+    if (sqlite3_step(stmt) == SQLITE_ROW) {
+      sqlite3_int64 used = sqlite3_memory_used() - before;
+      failed = used < 5000 * 2 * (sqlite3_int64)sizeof(double);
+      if (failed) {
+        fprintf(stderr, "❌ tg geometry not counted: %lld bytes\n", used);
+      }
+    }
+  }
+  sqlite3_finalize(stmt);
+  sqlite3_free(zWkt);
+  return failed;
+}
+
 int main(int argc, char *argv[]) {
   sqlite3 *db = NULL;
   int failures = 0;
@@ -53,6 +84,8 @@ int main(int argc, char *argv[]) {
       "select tg_to_wkt(tg_point(1, 2))",
       "select tg_to_wkb(tg_point(1, 2))",
       "select tg_to_geojson(tg_point(1, 2))",
+      "select tg_to_wkb(X'01010000000000000000000000000000000000f03f')",
+      "select tg_to_geojson('{\"type\":\"Point\",\"coordinates\":[1,2]}')",
       "select tg_point(1, 2)",
       "select tg_type('POLYGON ((30 10, 40 40, 20 40, 10 20, 30 10))')",
       "select tg_extra_json('{\"id\": 1, \"type\": \"Point\", \"coordinates\": [1, 2]}')",
@@ -62,13 +95,81 @@ int main(int argc, char *argv[]) {
       "'POLYGON ((30 10, 40 40, 20 40, 10 20, 30 10), (20 30, 35 35, 30 20, 20 30))'))",
       "select tg_intersects('LINESTRING (0 0, 2 2)', 'LINESTRING (1 0, 1 2)')",
       "select tg_valid_wkt('POINT(1 1)'), tg_valid_wkt('nope')",
+      "select tg_validate('POLYGON((0 0, 1 0, 1 1, 0 1))'), "
+      "tg_validate(X'0102000000'), "
+      "tg_validate('{\"type\":\"Feature\",\"geometry\":{\"typ\\\\u0065\":1}}')",
       "select tg_to_wkt(point) from tg_points_each('MULTIPOINT (10 40, 40 30)')",
       "select tg_to_wkt(geometry) from tg_geometries_each("
       "'GEOMETRYCOLLECTION (POINT (40 10), LINESTRING (10 10, 20 20, 10 40))')",
       "select tg_to_wkt(hole) from tg_holes_each("
       "'POLYGON ((0 0, 10 0, 10 10, 0 0), (1 1, 2 1, 2 2, 1 1))')",
       "select count(*) from tg_holes_each('POINT(1 1)')",
+      "select rowid from tg_points_each('MULTIPOINT (0 0, 5 5, 6 6)', "
+      "'POLYGON ((4 4, 7 4, 7 7, 4 7, 4 4))')",
+      "select rowid from tg_holes_each("
+      "'POLYGON ((0 0, 10 0, 10 10, 0 0), (1 1, 2 1, 2 2, 1 1))', 'POINT (1.5 1.2)')",
       "select * from tg_bbox('LINESTRING (30 10, 10 30, 40 40)')",
+      "select geometry ->> '$.properties.name', geometry ->> '$.id' "
+      "from tg_each('{\"type\":\"FeatureCollection\",\"features\":["
+      "{\"type\":\"Feature\",\"id\":1,\"properties\":{\"name\":\"a\"},"
+      "\"geometry\":{\"type\":\"Point\",\"coordinates\":[1,2]}}]}')",
+      "select tg_to_wkt(geometry), properties "
+      "from tg_read_geojson('tests/data/collection.geojson')",
+      "select * from tg_coords("
+      "'MULTIPOLYGON (((0 0, 10 0, 10 10, 0 0), (1 1, 2 1, 2 2, 1 1)))')",
+      "select x, z, m from tg_coords('MULTIPOINT ZM (1 2 3 4, 5 6 7 8)') "
+      "where rowid >= 1",
+      "select tg_to_wkt(geometry) from tg_random_points(3, null, 1, 2)",
+      "select tg_hilbert(geometry, 'POLYGON((0 0, 4 0, 4 4, 0 4, 0 0))', 8), "
+      "tg_zorder(geometry, null) from tg_random_polygons(3, 6, null, 1)",
+      "select tg_hilbert_xy(1, 2, null), tg_zorder_xy(1, 2, null, 31)",
+      "select tg_to_wkt(tg_to_twkb(geometry, 5)) "
+      "from tg_random_polygons(3, 6, null, 1, 0, 2)",
+      "select tg_to_wkt(tg_to_twkb("
+      "'GEOMETRYCOLLECTION(POINT ZM(1 2 3 4), MULTILINESTRING((0 0, 1 1)))'))",
+      "create virtual table temp.demo_twkb using tg0(twkb=6)",
+      "insert into temp.demo_twkb(rowid, _shape) "
+      "select rowid, geometry from tg_random_polygons(50, 8, null, 1)",
+      "select count(*) from temp.demo_twkb "
+      "where tg_intersects(_shape, 'POLYGON((0 0, 90 0, 90 45, 0 45, 0 0))')",
+      "create virtual table temp.demo_points using tg0(label, type=point)",
+      "insert into temp.demo_points(rowid, _shape, label) "
+      "select rowid, geometry, rowid from tg_random_points(50, null, 1)",
+      "insert into temp.demo_points(rowid, _shape, label) "
+      "values (100, tg_point(1, 2), 'a'), (101, 'POINT Z(3 4 5)', 'b')",
+      "update temp.demo_points set _shape = 'POINT(5 6)', label = 'c' "
+      "where rowid = 100",
+      "select rowid, tg_to_wkt(_shape), label from temp.demo_points "
+      "where tg_intersects(_shape, 'POLYGON((0 0, 90 0, 90 45, 0 45, 0 0))')",
+      "create table temp.demo_parcels(id integer primary key, owner, geom)",
+      "insert into temp.demo_parcels select rowid, rowid, geometry "
+      "from tg_random_polygons(50, 8, null, 1)",
+      "create virtual table temp.demo_content using tg0(owner, "
+      "content=demo_parcels, content_rowid=id, shape_column=geom, triggers=1)",
+      "insert into temp.demo_content(demo_content) values ('rebuild')",
+      "insert into temp.demo_parcels values (100, 'a', 'POINT(1 2)'), "
+      "(101, 'b', null)",
+      "update temp.demo_parcels set geom = 'POINT(3 4)' where id = 101",
+      "delete from temp.demo_parcels where id = 1",
+      "select rowid, owner, tg_to_wkt(_shape) from temp.demo_content "
+      "where tg_intersects(_shape, 'POLYGON((0 0, 90 0, 90 45, 0 45, 0 0))')",
+      "drop table temp.demo_content",
+      "create virtual table temp.demo_resident using tg0(label, resident=1)",
+      "insert into temp.demo_resident(rowid, _shape, label) "
+      "select rowid, geometry, rowid from tg_random_polygons(50, 8, null, 1)",
+      "select count(*) from temp.demo_resident "
+      "where tg_intersects(_shape, 'POLYGON((0 0, 90 0, 90 45, 0 45, 0 0))')",
+      "insert into temp.demo_resident(rowid, _shape, label) "
+      "values (100, 'POINT(1 2)', 'a')",
+      "update temp.demo_resident set label = 'b' where rowid = 100",
+      "update temp.demo_resident set _shape = 'POINT(3 4)' where rowid = 2",
+      "delete from temp.demo_resident where rowid % 3 = 0",
+      "select rowid, tg_to_wkt(_shape), label from temp.demo_resident "
+      "where tg_intersects(_shape, 'POLYGON((0 0, 90 0, 90 45, 0 45, 0 0))')",
+      "drop table temp.demo_resident",
+      "select tg_to_wkt(geometry) from tg_random_lines(3, 5)",
+      "select tg_to_wkt(geometry) from tg_random_polygons("
+      "3, 6, 'POLYGON((0 0, 1 0, 1 1, 0 1, 0 0))', 1, 0, 2)",
       "select tg_to_wkt(tg_group_multipoint(tg_point(value, value))) "
       "from json_each('[1, 2, 3]')",
       "select tg_to_wkt(tg_group_geometry_collection(value)) "
@@ -80,10 +181,33 @@ int main(int argc, char *argv[]) {
       "create virtual table temp.demo using tg0(label)",
       "insert into temp.demo(rowid, _shape, label) "
       "values (1, tg_geom('POINT(1 1)'), 'a'), (2, tg_geom('POINT(9 9)'), 'b')",
+      // shapes bigger than the arenas' buffers and chunks
+      "insert into temp.demo(rowid, _shape, label) "
+      "with recursive n(i) as (select 0 union all select i + 1 from n where i < 3000) "
+      "select 10, 'LINESTRING(' || group_concat(i || ' ' || i, ',') || ')', 'c' from n",
+      "select rowid from temp.demo "
+      "where tg_intersects(_shape, 'POLYGON((0 0, 2 0, 2 2, 0 2, 0 0))')",
+      "select tg_intersects(_shape, 'POINT(9 9)') from temp.demo",
+      "delete from temp.demo where rowid = 10",
       "select rowid, label from temp.demo "
       "where tg_intersects(_shape, 'POLYGON((0 0, 2 0, 2 2, 0 2, 0 0))')",
+      "select tg0_last_query_stats('demo')",
+      "update temp.demo set label = 'aa' where rowid = 1",
+      "update temp.demo set _shape = 'POINT(3 3)' where rowid = 2",
+      "update temp.demo set rowid = 3 where rowid = 2",
       "delete from temp.demo where rowid = 1",
       "drop table temp.demo",
+      "update tg_stats set value = 1 where name = 'timing'",
+      "select name, value from tg_stats",
+      "delete from tg_stats",
+      "create virtual table temp.demo_threads using tg0(label, threads=2)",
+      "insert into temp.demo_threads(rowid, _shape, label) "
+      "select rowid, geometry, rowid from tg_random_polygons(1500, 8)",
+      "select rowid, _shape, label from temp.demo_threads "
+      "where tg_intersects(_shape, 'POLYGON((0 0, 90 0, 90 45, 0 45, 0 0))')",
+      "drop table temp.demo_threads",
+      "create virtual table temp.demo_err using tg0()",
+      "insert into temp.demo_err(rowid, _shape) values (1, 'POINT(1 1)')",
   };
   static const char *ERROR_STATEMENTS[] = {
       "select tg_to_wkt('not a geometry')",
@@ -94,6 +218,36 @@ int main(int argc, char *argv[]) {
       "select tg_intersects('POINT(1 1)', 'nope')",
       "select tg_to_wkt(tg_group_multipoint(value)) "
       "from json_each('[\"LINESTRING(0 0, 1 1)\"]')",
+      "select * from tg_coords('nope')",
+      "select * from tg_read_geojson('tests/data/does-not-exist.geojson')",
+      "select * from tg_read_geojsonseq('tests/data/does-not-exist.geojsonl')",
+      "select tg_write_geojson('tests/data/does-not-exist/out.geojson', "
+      "'POINT(1 1)')",
+      "select * from tg_read_wkb_stream('tests/data/collection.geojson')",
+      "select * from tg_points_each('MULTIPOINT (0 0)', 'nope')",
+      "select * from tg_random_points(-1)",
+      "select * from tg_random_polygons(3, 8, 'nope')",
+      "select * from tg_random_lines(3, 4, 'POINT(1 1)')",
+      "insert into tg_stats(name, value) values ('timing', 1)",
+      "create virtual table temp.demo_bad using tg0(threads=-1)",
+      "select tg0_last_query_stats('demo')",
+      "select * from tg0_parallel_query('demo', 'POINT(1 1)')",
+      "select tg_hilbert('POINT(1 1)', 'POINT EMPTY')",
+      "select tg_hilbert('nope', null)",
+      "select tg_zorder('POLYGON((0 0, 1', null)",
+      "select tg_zorder_xy(1, 1, null, 32)",
+      "select tg_to_twkb('POINT(1e300 1)')",
+      "select tg_to_wkt(X'020002020208')",
+      "create virtual table temp.demo_bad_twkb using tg0(twkb=9)",
+      "create virtual table temp.demo_bad_type using tg0(type=line)",
+      "insert into temp.demo_points(_shape) values ('LINESTRING(0 0, 1 1)')",
+      "create virtual table temp.demo_bad_content using tg0("
+      "content=demo_parcels, type=point)",
+      "create virtual table temp.demo_bad_content using tg0(content_rowid=id)",
+      "create virtual table temp.demo_bad_resident using tg0(resident=2)",
+      "create virtual table temp.demo_bad_resident using tg0(resident_mb=8)",
+      "update temp.demo_err set _shape = 'nope'",
+      "insert into temp.demo_err(rowid, _shape) values (2, 'nope')",
   };
 
   for (int i = 0; i < sizeof(OK_STATEMENTS) / sizeof(OK_STATEMENTS[0]); i++) {
@@ -104,7 +258,15 @@ int main(int argc, char *argv[]) {
     failures += exec_expect_error(db, ERROR_STATEMENTS[i]);
   }
 
+  failures += check_geometry_memory(db);
+
   sqlite3_close(db);
+  sqlite3_reset_auto_extension();
+  if (sqlite3_memory_used() != 0) {
+    fprintf(stderr, "❌ %lld bytes still allocated after close\n",
+            sqlite3_memory_used());
+    failures++;
+  }
   if (failures) {
     fprintf(stderr, "❌ %d statement(s) failed\n", failures);
     return 1;
@@ -0,0 +1,278 @@
+#include "sqlite-tg.c"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+// Checks that tg_valid_wkt(), tg_valid_wkb(), tg_valid_geojson() and
+// tg_validate()'s blob check agree with the parsers. The validators scan their
+// input in place instead of building a geometry, so they re-implement the
+// rules of tg_parse_wktn(), tg_parse_wkb(), tg_parse_geojsonn() and
+// parseBlob()'s TWKB reader; this is the proof that they still match. Seed geometries are mutated with a fixed PRNG (deleting, inserting,
+// replacing and splicing bytes, flipping bits, overwriting WKB counts and
+// type codes, truncating) and every input must be accepted by a validator
+// exactly when tg parses it without an error.
+//
+//   dist/test-validate [iterations per seed] [prng seed]
+//
+// Build with CFLAGS="-fsanitize=address,undefined -fno-sanitize=alignment" to
+// also check the scanners' bounds (tg reads WKB coordinates in place, so
+// misaligned loads are expected).
+
+#define DEFAULT_ITERATIONS 20000
+#define MAX_INPUT 4096
+
+static const char *WKT_SEEDS[] = {
+    "POINT(1 2)",
+    "POINT Z(1 2 3)",
+    "POINT M (1 2 3)",
+    "POINT ZM (1 2 3 4)",
+    "POINT EMPTY",
+    "LINESTRING(0 0,1 1)",
+    "LINESTRING M (0 0 1, 1 1 2)",
+    "POLYGON((0 0,1 0,1 1,0 0))",
+    "POLYGON((0 0,1 0,1 1,0 0),(0.1 0.1,0.2 0.1,0.2 0.2,0.1 0.1))",
+    "POLYGON Z((0 0 1,10 0 1,10 10 1,0 10 1,0 0 1))",
+    "MULTIPOINT(1 2,3 4)",
+    "MULTIPOINT((1 2),(3 4))",
+    "MULTIPOINT Z(1 2 3,4 5 6)",
+    "MULTILINESTRING((0 0,1 1),(2 2,3 3,4 4))",
+    "MULTIPOLYGON(((0 0,1 0,1 1,0 0)))",
+    "MULTIPOLYGON Z(((0 0 1,1 0 2,1 1 3,0 0 1)),((5 5 1,6 5 1,6 6 1,5 5 1)))",
+    "GEOMETRYCOLLECTION(POINT(1 2),LINESTRING(0 0,1 1))",
+    "GEOMETRYCOLLECTION(POINT(1 2),LINESTRING Z(0 0 1,1 1 1),"
+    "MULTIPOINT M(1 1 1,2 2 2))",
+    "GEOMETRYCOLLECTION(GEOMETRYCOLLECTION(POINT(1 2)),POLYGON EMPTY)",
+    "GEOMETRYCOLLECTION EMPTY",
+    "POINT(-1.5e3 2.25E-2)",
+};
+
+static const char *GEOJSON_SEEDS[] = {
+    "{\"type\":\"Point\",\"coordinates\":[1,2]}",
+    "{\"type\":\"Point\",\"coordinates\":[1,2,3,4]}",
+    "{\"type\":\"Point\",\"coordinates\":[]}",
+    "{\"type\":\"LineString\",\"coordinates\":[[0,0],[1,1]]}",
+    "{\"type\":\"Polygon\",\"coordinates\":[[[0,0],[1,0],[1,1],[0,0]]]}",
+    "{\"type\":\"Polygon\",\"coordinates\":[[[0,0],[9,0],[9,9],[0,0]],"
+    "[[1,1],[2,1],[2,2],[1,1]]]}",
+    "{\"type\":\"MultiPoint\",\"coordinates\":[[1,2],[3,4]]}",
+    "{\"type\":\"MultiLineString\",\"coordinates\":[[[0,0],[1,1]],"
+    "[[2,2],[3,3]]]}",
+    "{\"type\":\"MultiPolygon\",\"coordinates\":"
+    "[[[[0,0],[1,0],[1,1],[0,0]]]]}",
+    "{\"type\":\"GeometryCollection\",\"geometries\":"
+    "[{\"type\":\"Point\",\"coordinates\":[1,2,3]}]}",
+    "{\"type\":\"Feature\",\"geometry\":{\"type\":\"Point\","
+    "\"coordinates\":[1,2]},\"properties\":{\"a\":1},\"id\":\"x\"}",
+    "{\"type\":\"Feature\",\"geometry\":null,\"properties\":null}",
+    "{\"type\":\"FeatureCollection\",\"features\":[{\"type\":\"Feature\","
+    "\"geometry\":{\"type\":\"Point\",\"coordinates\":[1,2]},"
+    "\"properties\":{}}]}",
+    "{\"type\":\"Point\",\"coordinates\":[1.5e2,-2],\"bbox\":[1,2,3,4],"
+    "\"extra\":{\"nested\":[true,false,null,\"s\\\"\\u00e9\"]}}",
+};
+
+static const char TEXT_BYTES[] =
+    "()[]{},.:\" 0123456789+-eEZMabcdEMPTYPOINTLINESTRINGtypecoordinates"
+    "\t\n\\u";
+
+static sqlite3_uint64 prngState;
+
+static sqlite3_uint64 prng(void) {
+  prngState ^= prngState << 13;
+  prngState ^= prngState >> 7;
+  prngState ^= prngState << 17;
+  return prngState;
+}
+
+static size_t prng_below(size_t n) { return n ? (size_t)(prng() % n) : 0; }
+
+// Applies one to three random edits to b[0..*pn). other is another seed of the
+// same format, a source of well-formed pieces to splice in.
+static void mutate(unsigned char *b, size_t *pn, const unsigned char *other,
+                   size_t nOther, int binary) {
+  size_t n = *pn;
+  int edits = 1 + (int)prng_below(3);
+  for (int e = 0; e < edits; e++) {
+    size_t i = prng_below(n + 1);
+    unsigned char c = binary ? (unsigned char)prng()
+                             : (unsigned char)TEXT_BYTES[prng_below(
+                                   sizeof(TEXT_BYTES) - 1)];
+    switch (prng_below(binary ? 7 : 5)) {
+    case 0: // delete a byte
+      if (i < n) {
+        memmove(b + i, b + i + 1, n - i - 1);
+        n--;
+      }
+      break;
+    case 1: // insert a byte
+      if (n < MAX_INPUT) {
+        memmove(b + i + 1, b + i, n - i);
+        b[i] = c;
+        n++;
+      }
+      break;
+    case 2: // replace a byte
+      if (i < n)
+        b[i] = c;
+      break;
+    case 3: // truncate
+      n = i;
+      break;
+    case 4: { // splice in a piece of another seed
+      size_t from = prng_below(nOther);
+      size_t len = prng_below(nOther - from + 1);
+      if (n + len <= MAX_INPUT) {
+        memmove(b + i + len, b + i, n - i);
+        memcpy(b + i, other + from, len);
+        n += len;
+      }
+      break;
+    }
+    case 5: // flip a bit
+      if (i < n)
+        b[i] ^= (unsigned char)(1 << prng_below(8));
+      break;
+    case 6: { // overwrite a 32-bit count or type code
+      static const sqlite3_uint64 values[] = {
+          0, 1, 2, 3, 4, 5, 6, 7, 1001, 2003, 3002, 4007, 0x20000001,
+          0x80000003, 0x7fffffff, 0xffffffff};
+      sqlite3_uint64 v = values[prng_below(sizeof(values) / sizeof(*values))];
+      if (i + 4 <= n) {
+        int little = prng() & 1;
+        for (int k = 0; k < 4; k++)
+          b[i + k] = (unsigned char)(v >> (8 * (little ? k : 3 - k)));
+      }
+      break;
+    }
+    }
+  }
+  *pn = n;
+}
+
+static void print_input(const unsigned char *b, size_t n, int binary) {
+  for (size_t i = 0; i < n; i++) {
+    if (binary)
+      fprintf(stderr, "%02x", b[i]);
+    else if (b[i] >= 0x20 && b[i] < 0x7f)
+      fputc(b[i], stderr);
+    else
+      fprintf(stderr, "\\x%02x", b[i]);
+  }
+  fputc('\n', stderr);
+}
+
+enum format { WKT, WKB, TWKB, GEOJSON };
+static const char *FORMAT_NAMES[] = {"wkt", "wkb", "twkb", "geojson"};
+
+// Returns 1 when the validator and tg disagree about b.
+static int check(enum format format, const unsigned char *b, size_t n) {
+  struct validation v;
+  int valid;
+  struct tg_geom *geom;
+  switch (format) {
+  case WKT:
+    valid = wktValidate((const char *)b, n, &v);
+    geom = tg_parse_wktn_ix((const char *)b, n, TG_NONE);
+    break;
+  case WKB:
+    valid = wkbValidate(b, n, &v);
+    geom = tg_parse_wkb_ix(b, n, TG_NONE);
+    break;
+  case TWKB: {
+    int isTwkb;
+    valid = blobValidate(b, n, &v);
+    geom = parseBlob(b, n, TG_NONE, &isTwkb);
+    break;
+  }
+  default:
+    valid = geojsonValidate((const char *)b, n, &v);
+    geom = tg_parse_geojsonn_ix((const char *)b, n, TG_NONE);
+    break;
+  }
+  if (!geom) {
+    fprintf(stderr, "❌ out of memory\n");
+    exit(1);
+  }
+  const char *zError = tg_geom_error(geom);
+  int mismatch = valid != (zError == NULL);
+  if (mismatch) {
+    fprintf(stderr, "❌ %s: validator says %s (%s), tg says %s: ",
+            FORMAT_NAMES[format], valid ? "valid" : "invalid",
+            valid ? "-" : v.reason, zError ? zError : "valid");
+    print_input(b, n, format == WKB || format == TWKB);
+  }
+  tg_geom_free(geom);
+  return mismatch;
+}
+
+int main(int argc, char *argv[]) {
+  long iterations = argc > 1 ? atol(argv[1]) : DEFAULT_ITERATIONS;
+  prngState = argc > 2 ? strtoull(argv[2], NULL, 10) : 88172645463325252ull;
+  if (!prngState)
+    prngState = 1;
+
+  // the WKB and TWKB seeds are the WKT seeds written out by tg and twkbEncode()
+  size_t nWkt = sizeof(WKT_SEEDS) / sizeof(*WKT_SEEDS);
+  unsigned char *wkb[sizeof(WKT_SEEDS) / sizeof(*WKT_SEEDS)];
+  size_t nWkb[sizeof(WKT_SEEDS) / sizeof(*WKT_SEEDS)];
+  unsigned char *twkb[sizeof(WKT_SEEDS) / sizeof(*WKT_SEEDS)];
+  size_t nTwkb[sizeof(WKT_SEEDS) / sizeof(*WKT_SEEDS)];
+  for (size_t i = 0; i < nWkt; i++) {
+    struct tg_geom *geom = tg_parse_wkt(WKT_SEEDS[i]);
+    const char *zErr = NULL;
+    if (!geom || tg_geom_error(geom) ||
+        !(twkb[i] = twkbEncode(geom, (int)(i % 4), &nTwkb[i], &zErr))) {
+      fprintf(stderr, "❌ bad seed %s\n", WKT_SEEDS[i]);
+      return 1;
+    }
+    nWkb[i] = tg_geom_wkb(geom, NULL, 0);
+    wkb[i] = malloc(nWkb[i]);
+    tg_geom_wkb(geom, wkb[i], nWkb[i]);
+    tg_geom_free(geom);
+  }
+
+  long checked = 0, failures = 0;
+  unsigned char *b = malloc(MAX_INPUT);
+  for (int format = WKT; format <= GEOJSON; format++) {
+    size_t nSeeds = format == GEOJSON
+                        ? sizeof(GEOJSON_SEEDS) / sizeof(*GEOJSON_SEEDS)
+                        : nWkt;
+    for (size_t s = 0; s < nSeeds; s++) {
+      const char **seeds = format == GEOJSON ? GEOJSON_SEEDS : WKT_SEEDS;
+      const unsigned char *seed = format == WKB    ? wkb[s]
+                                  : format == TWKB ? twkb[s]
+                                                   : (const unsigned char *)seeds[s];
+      size_t nSeed = format == WKB    ? nWkb[s]
+                     : format == TWKB ? nTwkb[s]
+                                      : strlen(seeds[s]);
+      failures += check(format, seed, nSeed);
+      for (long it = 0; it < iterations && failures < 10; it++) {
+        size_t o = prng_below(nSeeds);
+        const unsigned char *other = format == WKB    ? wkb[o]
+                                     : format == TWKB ? twkb[o]
+                                                      : (const unsigned char *)seeds[o];
+        size_t nOther = format == WKB    ? nWkb[o]
+                        : format == TWKB ? nTwkb[o]
+                                         : strlen(seeds[o]);
+        size_t n = nSeed;
+        memcpy(b, seed, n);
+        mutate(b, &n, other, nOther, format == WKB || format == TWKB);
+        failures += check(format, b, n);
+        checked++;
+      }
+    }
+  }
+  free(b);
+  for (size_t i = 0; i < nWkt; i++) {
+    free(wkb[i]);
+    sqlite3_free(twkb[i]);
+  }
+
+  if (failures) {
+    fprintf(stderr, "❌ test-validate: %ld disagreements\n", failures);
+    return 1;
+  }
+  printf("✅ test-validate: %ld mutated inputs, validators agree with tg\n",
+         checked);
+  return 0;
+}